@@ -0,0 +1,1740 @@
+//-----------------------------------------------------------------------------
+// libopencluster-event
+// event based library interface to communicate with the opencluster service.
+
+#include "opencluster-event.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#if (LIBOPENCLUSTER_EVENT_VERSION != 0x00000100)
+#error "Incorrect opencluster-event.h header version."
+#endif
+
+
+#define OPENCLUSTER_DEFAULT_PORT   13600
+
+// the socket buffers start out this big, and double whenever they are full.
+#define DEFAULT_BUFFER_SIZE   (16*1024)
+
+// the amount we try to read from the socket at a time.
+#define READ_CHUNK_SIZE       (16*1024)
+
+// the request table starts with this many slots (it must be a power of 2), and doubles when needed.
+#define REQUEST_TABLE_START   1024
+
+// a request is sent on to the server named in a TRYELSEWHERE reply at most this many times.
+#define REQUEST_MAX_TRIES     3
+
+// requests for a bucket that no server has told us about are held for this long (in seconds), 
+// waiting for one to.  After that they fail.
+#define QUEUE_TIMEOUT         5
+
+// the number of hot keys we keep track of (see process_hotkey), and the most copies of each that the 
+// reads are spread over.
+#define HOTKEY_MAX            64
+#define HOTKEY_SERVERS        4
+
+
+#define REPLY_UNKNOWN                       0x0002
+#define REPLY_FAIL                          0x0003
+#define REPLY_TRYELSEWHERE                  0x0007
+#define REPLY_OK                            0x0010
+#define REPLY_DATA_INT                      0x0110
+#define REPLY_DATA_STRING                   0x0120
+
+#define PROTOCOL_V1                         1
+
+// the optional features we ask for in the HELLO.  We want the server to send us all its hashmasks 
+// when we connect, so that we can send requests straight to the server that has the data, and to 
+// tell us which servers have copies of the hot keys, so that we can spread the reads for them.
+#define FEATURE_HASHMASKS                   0x0002
+#define FEATURE_HOTKEYS                     0x0004
+
+#define COMMAND_HELLO                       0x0010
+#define COMMAND_SHUTTINGDOWN                0x0030
+#define COMMAND_GOODBYE                     0x0040
+#define COMMAND_HASHMASK                    0x0080
+#define COMMAND_HOTKEY                      0x0090
+#define COMMAND_GET_INT                     0x2010
+#define COMMAND_GET_STRING                  0x2020
+#define COMMAND_SET_INT                     0x2200
+#define COMMAND_SET_STRING                  0x2210
+
+// this structure is not packed on word boundaries, so it should represent the
+// data received over the network.
+#pragma pack(push,1)
+typedef struct {
+	uint16_t command;
+	uint16_t reply;
+	uint32_t userid;
+	uint32_t length;
+} raw_header_t;
+#pragma pack(pop)
+
+
+#define SERVER_IDLE          0
+#define SERVER_CONNECTING    1
+#define SERVER_CONNECTED     2
+
+
+struct __cluster_t;
+
+// information about a server we know about.
+typedef struct {
+	struct __cluster_t *cluster;
+	conninfo_t *conninfo;
+
+	int handle;
+	int state;
+
+	// the server has replied to our HELLO, and has told us which buckets it has.
+	int ready;
+
+	// a GOODBYE has been sent, so no more requests are sent to this server.
+	int closing;
+
+	struct event *read_event;
+	struct event *write_event;
+
+	// data received from the server that has not been processed yet.
+	char *in_buffer;
+	int in_length;
+	int in_max;
+
+	// data waiting to be written to the socket.
+	char *out_buffer;
+	int out_length;
+	int out_max;
+
+	// the number of requests sent to this server that have not had a reply yet.
+	int waiting;
+} server_t;
+
+
+// a request that is waiting for a reply.
+typedef struct {
+	uint32_t id;
+	int command;
+	server_t *server;
+
+	evcluster_reply_cb fn;
+	void *arg;
+
+	// the payload of a request for a key is kept, so that it can be sent again to a different 
+	// server.  'tries' is the number of times it has been sent on after a TRYELSEWHERE.
+	hash_t map_hash;
+	hash_t key_hash;
+	char *message;
+	int message_length;
+	int message_max;
+	int tries;
+
+	// when the request started waiting for us to know which server has its bucket.
+	time_t queued;
+} request_t;
+
+
+// a key that a server has told us is hot, and the other servers that have a copy of it.
+typedef struct {
+	hash_t map_hash;
+	hash_t key_hash;
+	server_t *servers[HOTKEY_SERVERS];
+	int server_count;
+
+	// the reads go to each of the copies in turn, and then to the usual server for the bucket.
+	int next;
+} hotkey_t;
+
+
+typedef struct __cluster_t {
+	struct event_base *evbase;
+
+	server_t **servers;
+	int server_count;
+
+	int max_stale;
+
+	// which server has the primary and backup copy of each bucket (indexed by key_hash & mask), built
+	// from the HASHMASK messages the servers send.  Entries are NULL when we dont know.
+	hash_t mask;
+	server_t **primaries;
+	server_t **backups;
+
+	evcluster_hashmask_cb hashmask_fn;
+	void *hashmask_arg;
+
+	// requests waiting for a reply, indexed by (id & (request_max-1)).  Ids are handed out in order,
+	// so as long as the table is bigger than the number of outstanding requests, they dont collide.
+	uint32_t next_id;
+	request_t **requests;
+	int request_max;
+	int request_count;
+
+	// requests for buckets that we dont know the server for yet (see request_submit).  The timer 
+	// is running while there are any, so that they fail if no server tells us.
+	request_t **queue;
+	int queue_count;
+	int queue_max;
+	struct event *queue_event;
+
+	// the hot keys that the reads (if they can be stale) are spread for.  When the table is full, 
+	// the entries are replaced in turn.
+	hotkey_t hotkeys[HOTKEY_MAX];
+	int hotkey_count;
+	int hotkey_replace;
+} cluster_t;
+
+
+
+EVCLUSTER evcluster_new(struct event_base *evbase)
+{
+	cluster_t *cluster;
+
+	assert(evbase);
+
+	cluster = calloc(1, sizeof(cluster_t));
+	assert(cluster);
+
+	cluster->evbase = evbase;
+	cluster->max_stale = -1;
+	cluster->next_id = 1;
+
+	return(cluster);
+}
+
+
+// add a server to the list.  The conninfo is controlled by the cluster object now.
+void evcluster_addserver(EVCLUSTER cluster_ptr, conninfo_t *conninfo)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+
+	assert(cluster);
+	assert(conninfo);
+
+	server = calloc(1, sizeof(server_t));
+	assert(server);
+
+	server->cluster = cluster;
+	server->conninfo = conninfo;
+	server->handle = -1;
+	server->state = SERVER_IDLE;
+
+	cluster->servers = realloc(cluster->servers, sizeof(server_t *) * (cluster->server_count + 1));
+	assert(cluster->servers);
+	cluster->servers[cluster->server_count] = server;
+	cluster->server_count ++;
+}
+
+
+int evcluster_servercount(EVCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	return(cluster->server_count);
+}
+
+
+void evcluster_setstale(EVCLUSTER cluster_ptr, int seconds)
+{
+	cluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	cluster->max_stale = seconds;
+}
+
+
+void evcluster_onhashmask(EVCLUSTER cluster_ptr, evcluster_hashmask_cb fn, void *arg)
+{
+	cluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	cluster->hashmask_fn = fn;
+	cluster->hashmask_arg = arg;
+}
+
+
+int evcluster_pending(EVCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	return(cluster->request_count + cluster->queue_count);
+}
+
+
+
+static void requests_grow(cluster_t *cluster)
+{
+	request_t **old;
+	int old_max;
+	int i;
+
+	assert(cluster);
+
+	old = cluster->requests;
+	old_max = cluster->request_max;
+
+	cluster->request_max = (old_max == 0) ? REQUEST_TABLE_START : (old_max * 2);
+	cluster->requests = calloc(cluster->request_max, sizeof(request_t *));
+	assert(cluster->requests);
+
+	for (i=0; i<old_max; i++) {
+		if (old[i]) {
+			assert(cluster->requests[old[i]->id & (cluster->request_max - 1)] == NULL);
+			cluster->requests[old[i]->id & (cluster->request_max - 1)] = old[i];
+		}
+	}
+
+	if (old) { free(old); }
+}
+
+
+// give the request an id, and put it in the table of requests that are waiting for a reply from 
+// 'server'.
+static void request_register(cluster_t *cluster, request_t *request, server_t *server)
+{
+	assert(cluster);
+	assert(request);
+	assert(server);
+	assert(request->server == NULL);
+
+	// make sure the slot for the new id is free.  Since the ids are handed out in order, this only
+	// happens when a very old request is still waiting.
+	while (cluster->request_max == 0 || cluster->request_count >= (cluster->request_max / 2) || cluster->requests[cluster->next_id & (cluster->request_max - 1)] != NULL) {
+		requests_grow(cluster);
+	}
+
+	request->id = cluster->next_id ++;
+	if (cluster->next_id == 0) { cluster->next_id = 1; }
+	request->server = server;
+
+	cluster->requests[request->id & (cluster->request_max - 1)] = request;
+	cluster->request_count ++;
+	server->waiting ++;
+}
+
+
+static request_t * request_create(int command, evcluster_reply_cb fn, void *arg)
+{
+	request_t *request;
+
+	assert(command > 0);
+
+	request = calloc(1, sizeof(request_t));
+	assert(request);
+	request->command = command;
+	request->fn = fn;
+	request->arg = arg;
+
+	return(request);
+}
+
+
+static request_t * request_new(cluster_t *cluster, server_t *server, int command, evcluster_reply_cb fn, void *arg)
+{
+	request_t *request;
+
+	request = request_create(command, fn, arg);
+	request_register(cluster, request, server);
+	return(request);
+}
+
+
+static void request_free(request_t *request)
+{
+	assert(request);
+	if (request->message) { free(request->message); }
+	free(request);
+}
+
+
+// the request could not be done, so the callback is told.
+static void request_fail(cluster_t *cluster, request_t *request, int code)
+{
+	evcluster_reply_t reply;
+
+	assert(cluster);
+	assert(request);
+
+	if (request->fn) {
+		memset(&reply, 0, sizeof(reply));
+		reply.code = code;
+		request->fn(cluster, &reply, request->arg);
+	}
+	request_free(request);
+}
+
+
+// remove the request from the table.  The caller must free it.
+static request_t * request_take(cluster_t *cluster, uint32_t id)
+{
+	request_t *request;
+	int slot;
+
+	assert(cluster);
+
+	if (cluster->request_max == 0) {
+		return(NULL);
+	}
+
+	slot = id & (cluster->request_max - 1);
+	request = cluster->requests[slot];
+	if (request == NULL || request->id != id) {
+		return(NULL);
+	}
+
+	cluster->requests[slot] = NULL;
+	assert(cluster->request_count > 0);
+	cluster->request_count --;
+	assert(request->server);
+	assert(request->server->waiting > 0);
+	request->server->waiting --;
+	request->server = NULL;
+
+	return(request);
+}
+
+
+
+static void out_reserve(server_t *server, int length)
+{
+	assert(server);
+	assert(length > 0);
+
+	while (server->out_length + length > server->out_max) {
+		server->out_max = (server->out_max == 0) ? DEFAULT_BUFFER_SIZE : (server->out_max * 2);
+		server->out_buffer = realloc(server->out_buffer, server->out_max);
+		assert(server->out_buffer);
+	}
+}
+
+
+// start a new message at the end of the out buffer.  Returns the offset of the header, which is
+// needed to set the length when the message is complete.
+static int out_header(server_t *server, int command, int reply, uint32_t userid)
+{
+	raw_header_t *raw;
+	int offset;
+
+	assert(server);
+	assert(command > 0);
+
+	out_reserve(server, sizeof(raw_header_t));
+	offset = server->out_length;
+
+	raw = (raw_header_t *) (server->out_buffer + offset);
+	raw->command = htobe16(command);
+	raw->reply = htobe16(reply);
+	raw->userid = htobe32(userid);
+	raw->length = 0;
+
+	server->out_length += sizeof(raw_header_t);
+	return(offset);
+}
+
+
+static void out_int(server_t *server, int value)
+{
+	int32_t nvalue = htobe32(value);
+	out_reserve(server, sizeof(nvalue));
+	memcpy(server->out_buffer + server->out_length, &nvalue, sizeof(nvalue));
+	server->out_length += sizeof(nvalue);
+}
+
+
+static void out_long(server_t *server, long long value)
+{
+	int64_t nvalue = htobe64(value);
+	out_reserve(server, sizeof(nvalue));
+	memcpy(server->out_buffer + server->out_length, &nvalue, sizeof(nvalue));
+	server->out_length += sizeof(nvalue);
+}
+
+
+static void out_bin(server_t *server, const char *data, int length)
+{
+	assert(length >= 0);
+	assert(length == 0 || data);
+
+	out_int(server, length);
+	if (length > 0) {
+		out_reserve(server, length);
+		memcpy(server->out_buffer + server->out_length, data, length);
+		server->out_length += length;
+	}
+}
+
+
+// the payload of a request is built in the request, so that it can be sent again if needed.
+static void msg_reserve(request_t *request, int length)
+{
+	assert(request);
+	assert(length > 0);
+
+	while (request->message_length + length > request->message_max) {
+		request->message_max = (request->message_max == 0) ? 64 : (request->message_max * 2);
+		request->message = realloc(request->message, request->message_max);
+		assert(request->message);
+	}
+}
+
+
+static void msg_int(request_t *request, int value)
+{
+	int32_t nvalue = htobe32(value);
+	msg_reserve(request, sizeof(nvalue));
+	memcpy(request->message + request->message_length, &nvalue, sizeof(nvalue));
+	request->message_length += sizeof(nvalue);
+}
+
+
+static void msg_long(request_t *request, long long value)
+{
+	int64_t nvalue = htobe64(value);
+	msg_reserve(request, sizeof(nvalue));
+	memcpy(request->message + request->message_length, &nvalue, sizeof(nvalue));
+	request->message_length += sizeof(nvalue);
+}
+
+
+static void msg_bin(request_t *request, const char *data, int length)
+{
+	assert(length >= 0);
+	assert(length == 0 || data);
+
+	msg_int(request, length);
+	if (length > 0) {
+		msg_reserve(request, length);
+		memcpy(request->message + request->message_length, data, length);
+		request->message_length += length;
+	}
+}
+
+
+static void write_handler(evutil_socket_t fd, short flags, void *arg);
+
+
+// the message that starts at 'offset' is complete, so fill in its length, and make sure it will be
+// written out.
+static void out_finish(server_t *server, int offset)
+{
+	raw_header_t *raw;
+
+	assert(server);
+	assert(offset >= 0);
+	assert(server->out_length >= offset + sizeof(raw_header_t));
+
+	raw = (raw_header_t *) (server->out_buffer + offset);
+	raw->length = htobe32(server->out_length - offset - sizeof(raw_header_t));
+
+	// while connecting, the write event is already waiting for the connect to finish.
+	if (server->state == SERVER_CONNECTED) {
+		assert(server->write_event);
+		if (event_pending(server->write_event, EV_WRITE, NULL) == 0) {
+			event_add(server->write_event, NULL);
+		}
+	}
+}
+
+
+// send a request (with the payload that was built in it) to the server.
+static void request_send(cluster_t *cluster, request_t *request, server_t *server)
+{
+	int offset;
+
+	assert(cluster);
+	assert(request);
+	assert(server);
+
+	request_register(cluster, request, server);
+	offset = out_header(server, request->command, 0, request->id);
+	if (request->message_length > 0) {
+		out_reserve(server, request->message_length);
+		memcpy(server->out_buffer + server->out_length, request->message, request->message_length);
+		server->out_length += request->message_length;
+	}
+	out_finish(server, offset);
+}
+
+
+
+static server_t * choose_server(cluster_t *cluster, hash_t key_hash, int spread);
+static int server_connect(server_t *server);
+
+
+// the requests for a key can be spread over the servers that have a copy, if stale data is ok.
+static int request_spread(cluster_t *cluster, request_t *request)
+{
+	assert(cluster);
+	assert(request);
+	return((request->command == COMMAND_GET_INT || request->command == COMMAND_GET_STRING) && cluster->max_stale >= 0);
+}
+
+
+static void queue_handler(evutil_socket_t fd, short flags, void *arg);
+
+
+// hold the request until we know which server has its bucket.
+static void queue_add(cluster_t *cluster, request_t *request)
+{
+	struct timeval tv = {1, 0};
+
+	assert(cluster);
+	assert(request);
+	assert(request->server == NULL);
+
+	if (cluster->queue_count >= cluster->queue_max) {
+		cluster->queue_max = (cluster->queue_max == 0) ? 64 : (cluster->queue_max * 2);
+		cluster->queue = realloc(cluster->queue, sizeof(request_t *) * cluster->queue_max);
+		assert(cluster->queue);
+	}
+	if (request->queued == 0) {
+		request->queued = time(NULL);
+	}
+	cluster->queue[cluster->queue_count++] = request;
+
+	if (cluster->queue_event == NULL) {
+		cluster->queue_event = evtimer_new(cluster->evbase, queue_handler, cluster);
+		assert(cluster->queue_event);
+	}
+	if (evtimer_pending(cluster->queue_event, NULL) == 0) {
+		evtimer_add(cluster->queue_event, &tv);
+	}
+}
+
+
+static hotkey_t * hotkey_find(cluster_t *cluster, hash_t map_hash, hash_t key_hash)
+{
+	int i;
+
+	assert(cluster);
+
+	for (i=0; i<cluster->hotkey_count; i++) {
+		if (cluster->hotkeys[i].map_hash == map_hash && cluster->hotkeys[i].key_hash == key_hash) {
+			return(&cluster->hotkeys[i]);
+		}
+	}
+
+	return(NULL);
+}
+
+
+static void hotkey_remove(cluster_t *cluster, hotkey_t *hotkey)
+{
+	assert(cluster);
+	assert(hotkey);
+	assert(cluster->hotkey_count > 0);
+
+	cluster->hotkey_count --;
+	*hotkey = cluster->hotkeys[cluster->hotkey_count];
+}
+
+
+// the server no longer has a copy of the hot key (it told us to try elsewhere), so the reads for it 
+// stop going there.
+static void hotkey_forget(cluster_t *cluster, hash_t map_hash, hash_t key_hash, server_t *server)
+{
+	hotkey_t *hotkey;
+	int i;
+
+	assert(cluster);
+	assert(server);
+
+	hotkey = hotkey_find(cluster, map_hash, key_hash);
+	if (hotkey) {
+		for (i=0; i<hotkey->server_count; i++) {
+			if (hotkey->servers[i] == server) {
+				hotkey->server_count --;
+				hotkey->servers[i] = hotkey->servers[hotkey->server_count];
+				break;
+			}
+		}
+		if (hotkey->server_count == 0) {
+			hotkey_remove(cluster, hotkey);
+		}
+	}
+}
+
+
+// pick the server for a request.  The reads for a hot key (that can be stale) take turns between the 
+// servers that have copies of it and the usual server for the bucket.
+static server_t * request_route(cluster_t *cluster, request_t *request)
+{
+	hotkey_t *hotkey;
+	server_t *server;
+	int spread;
+	int slot;
+
+	assert(cluster);
+	assert(request);
+
+	spread = request_spread(cluster, request);
+	if (spread && cluster->hotkey_count > 0) {
+		hotkey = hotkey_find(cluster, request->map_hash, request->key_hash);
+		if (hotkey) {
+			slot = hotkey->next % (hotkey->server_count + 1);
+			hotkey->next ++;
+			if (slot < hotkey->server_count) {
+				server = hotkey->servers[slot];
+				if (server->state != SERVER_IDLE && server->closing == 0) {
+					return(server);
+				}
+			}
+		}
+	}
+
+	return(choose_server(cluster, request->key_hash, spread));
+}
+
+
+// send the request to the server that has its bucket, or hold it until we know which one that is.
+static void request_submit(cluster_t *cluster, request_t *request)
+{
+	server_t *server;
+
+	assert(cluster);
+	assert(request);
+
+	server = request_route(cluster, request);
+	if (server) {
+		request_send(cluster, request, server);
+	}
+	else {
+		queue_add(cluster, request);
+	}
+}
+
+
+// something has changed (a server told us about its buckets, or a connection finished or closed), 
+// so the requests that are being held might be able to go now.  The ones that have waited too long, 
+// or that no server is left to answer, fail.
+static void queue_flush(cluster_t *cluster)
+{
+	request_t **queue;
+	request_t *request;
+	server_t *server;
+	time_t now;
+	int count;
+	int active = 0;
+	int i;
+
+	assert(cluster);
+
+	if (cluster->queue_count == 0) {
+		return;
+	}
+
+	for (i=0; i<cluster->server_count; i++) {
+		if (cluster->servers[i]->state != SERVER_IDLE && cluster->servers[i]->closing == 0) {
+			active ++;
+		}
+	}
+
+	// the callbacks can make new requests, so we work on our own copy of the queue.
+	queue = cluster->queue;
+	count = cluster->queue_count;
+	cluster->queue = NULL;
+	cluster->queue_count = 0;
+	cluster->queue_max = 0;
+
+	now = time(NULL);
+	for (i=0; i<count; i++) {
+		request = queue[i];
+		server = request_route(cluster, request);
+		if (server) {
+			request_send(cluster, request, server);
+		}
+		else if (active == 0 || now - request->queued >= QUEUE_TIMEOUT) {
+			request_fail(cluster, request, 0);
+		}
+		else {
+			queue_add(cluster, request);
+		}
+	}
+
+	free(queue);
+}
+
+
+static void queue_handler(evutil_socket_t fd, short flags, void *arg)
+{
+	cluster_t *cluster = arg;
+	struct timeval tv = {1, 0};
+
+	assert(cluster);
+
+	queue_flush(cluster);
+	if (cluster->queue_count > 0 && evtimer_pending(cluster->queue_event, NULL) == 0) {
+		evtimer_add(cluster->queue_event, &tv);
+	}
+}
+
+
+// find the server named by a conninfo string (of 'str_len' chars) that a server sent us.  If we didn't 
+// know about it, it is added, and we start connecting to it.
+static server_t * server_lookup(cluster_t *cluster, const char *payload, int str_len)
+{
+	conninfo_t *conninfo;
+	server_t *server = NULL;
+	char *str;
+	int i;
+
+	assert(cluster);
+	assert(str_len > 0);
+	assert(payload);
+
+	str = malloc(str_len + 1);
+	assert(str);
+	memcpy(str, payload, str_len);
+	str[str_len] = '\0';
+
+	for (i=0; i<cluster->server_count && server == NULL; i++) {
+		if (conninfo_compare_str(cluster->servers[i]->conninfo, str) == 0) {
+			server = cluster->servers[i];
+		}
+	}
+
+	if (server == NULL) {
+		conninfo = conninfo_parse(str);
+		if (conninfo) {
+			evcluster_addserver(cluster, conninfo);
+			server = cluster->servers[cluster->server_count - 1];
+		}
+	}
+	free(str);
+
+	if (server && server->state == SERVER_IDLE && server_connect(server) != 0) {
+		server = NULL;
+	}
+	if (server && server->closing) {
+		server = NULL;
+	}
+
+	return(server);
+}
+
+
+
+// a server has told us that it has (or no longer has) a bucket.  If the mask has grown, each of the
+// existing entries is split into the buckets that it became.
+static void routing_update(cluster_t *cluster, server_t *server, hash_t mask, hash_t hashmask, int level)
+{
+	server_t **primaries;
+	server_t **backups;
+	hash_t i;
+
+	assert(cluster);
+	assert(server);
+
+	if (mask == 0 || hashmask > mask) {
+		return;
+	}
+
+	if (mask != cluster->mask) {
+		primaries = calloc(mask + 1, sizeof(server_t *));
+		backups = calloc(mask + 1, sizeof(server_t *));
+		assert(primaries && backups);
+
+		// if the mask got smaller, we start again, the servers will tell us what they have.
+		if (cluster->mask > 0 && mask > cluster->mask) {
+			for (i=0; i<=mask; i++) {
+				primaries[i] = cluster->primaries[i & cluster->mask];
+				backups[i] = cluster->backups[i & cluster->mask];
+			}
+		}
+
+		if (cluster->primaries) { free(cluster->primaries); }
+		if (cluster->backups) { free(cluster->backups); }
+		cluster->primaries = primaries;
+		cluster->backups = backups;
+		cluster->mask = mask;
+	}
+
+	if (level == 0) {
+		cluster->primaries[hashmask] = server;
+		if (cluster->backups[hashmask] == server) { cluster->backups[hashmask] = NULL; }
+	}
+	else if (level == 1) {
+		cluster->backups[hashmask] = server;
+		if (cluster->primaries[hashmask] == server) { cluster->primaries[hashmask] = NULL; }
+	}
+	else {
+		if (cluster->primaries[hashmask] == server) { cluster->primaries[hashmask] = NULL; }
+		if (cluster->backups[hashmask] == server) { cluster->backups[hashmask] = NULL; }
+	}
+}
+
+
+// the server has gone, so we no longer know where its buckets are.  Until the other servers tell
+// us, requests for them will go to any server.
+static void routing_forget(cluster_t *cluster, server_t *server)
+{
+	hash_t i;
+
+	assert(cluster);
+	assert(server);
+
+	for (i=0; cluster->mask > 0 && i<=cluster->mask; i++) {
+		if (cluster->primaries[i] == server) { cluster->primaries[i] = NULL; }
+		if (cluster->backups[i] == server) { cluster->backups[i] = NULL; }
+	}
+}
+
+
+// the connection to the server has gone.  Any requests that were waiting for a reply from it have
+// failed, so their callbacks are called.
+static void server_closed(server_t *server)
+{
+	cluster_t *cluster;
+	request_t **failed = NULL;
+	int count = 0;
+	int i;
+
+	assert(server);
+	cluster = server->cluster;
+	assert(cluster);
+
+	if (server->read_event) {
+		event_free(server->read_event);
+		server->read_event = NULL;
+	}
+	if (server->write_event) {
+		event_free(server->write_event);
+		server->write_event = NULL;
+	}
+	if (server->handle >= 0) {
+		close(server->handle);
+		server->handle = -1;
+	}
+	server->state = SERVER_IDLE;
+	server->ready = 0;
+	server->closing = 0;
+	server->in_length = 0;
+	server->out_length = 0;
+	routing_forget(cluster, server);
+
+	// take the requests out of the table before calling any callbacks, because the callbacks can
+	// send new requests (which can change the table).
+	if (server->waiting > 0) {
+		failed = malloc(sizeof(request_t *) * server->waiting);
+		assert(failed);
+		for (i=0; i<cluster->request_max && server->waiting > 0; i++) {
+			if (cluster->requests[i] && cluster->requests[i]->server == server) {
+				failed[count++] = request_take(cluster, cluster->requests[i]->id);
+			}
+		}
+		assert(server->waiting == 0);
+	}
+
+	for (i=0; i<count; i++) {
+		assert(failed[i]);
+		request_fail(cluster, failed[i], 0);
+	}
+
+	if (failed) { free(failed); }
+
+	// if that was the last server, the requests being held wont be answered either.
+	queue_flush(cluster);
+}
+
+
+
+static void process_reply(server_t *server, int reply_code, uint32_t userid, const char *payload, int length)
+{
+	cluster_t *cluster;
+	request_t *request;
+	server_t *target;
+	evcluster_reply_t reply;
+	int command;
+	int str_len;
+
+	assert(server);
+	assert(length == 0 || payload);
+	cluster = server->cluster;
+	assert(cluster);
+
+	request = request_take(cluster, userid);
+	if (request == NULL) {
+		// not something we are waiting for.
+		return;
+	}
+
+	// the server doesn't have the bucket, but knows who does.  We remember that, and send the 
+	// request on to it (a few times at most, in case the bucket is moving around).  If the server 
+	// was one with a copy of a hot key, the copy has gone, so the reads stop going there.
+	if (reply_code == REPLY_TRYELSEWHERE && request->message && request->tries < REQUEST_MAX_TRIES) {
+		hotkey_forget(cluster, request->map_hash, request->key_hash, server);
+		target = NULL;
+		if (length > sizeof(int32_t)) {
+			str_len = be32toh(*(uint32_t *)(payload));
+			if (str_len > 0 && str_len <= length - sizeof(int32_t)) {
+				target = server_lookup(cluster, payload + sizeof(int32_t), str_len);
+			}
+		}
+		if (target && target != server) {
+			request->tries ++;
+			if (cluster->mask > 0 && request_spread(cluster, request) == 0) {
+				cluster->primaries[request->key_hash & cluster->mask] = target;
+			}
+			request_send(cluster, request, target);
+			return;
+		}
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	reply.code = reply_code;
+	reply.payload = payload;
+	reply.payload_length = length;
+
+	// GET replies contain the map, key, and value hashes, followed by the value.
+	if (reply_code == REPLY_DATA_INT && length >= 32) {
+		reply.map_hash = be64toh(*(uint64_t *)(payload));
+		reply.key_hash = be64toh(*(uint64_t *)(payload + 8));
+		reply.value = (long long) be64toh(*(uint64_t *)(payload + 24));
+		reply.ok = (request->command == COMMAND_GET_INT);
+	}
+	else if (reply_code == REPLY_DATA_STRING && length >= 28) {
+		reply.map_hash = be64toh(*(uint64_t *)(payload));
+		reply.key_hash = be64toh(*(uint64_t *)(payload + 8));
+		str_len = be32toh(*(uint32_t *)(payload + 24));
+		if (str_len >= 0 && str_len <= length - 28) {
+			reply.data = payload + 28;
+			reply.length = str_len;
+			reply.ok = (request->command == COMMAND_GET_STRING);
+		}
+	}
+	else if (reply_code == REPLY_OK) {
+		reply.ok = 1;
+	}
+
+	command = request->command;
+	if (command == COMMAND_HELLO && reply.ok) {
+		server->ready = 1;
+	}
+	if (request->fn) {
+		request->fn(cluster, &reply, request->arg);
+	}
+	request_free(request);
+
+	// the server will close the connection after replying to a GOODBYE, so we do it now.  If it
+	// didn't accept our HELLO, there is no point keeping the connection either.
+	if ((command == COMMAND_GOODBYE || (command == COMMAND_HELLO && server->ready == 0)) && server->handle >= 0) {
+		server_closed(server);
+	}
+	else if (command == COMMAND_HELLO) {
+		// the server has told us all its buckets (they come before the reply).
+		queue_flush(cluster);
+	}
+}
+
+
+// a server has told us which other servers have copies of one of its hot keys (none means that it 
+// isn't hot anymore).  The payload is the map and key hashes, the number of servers, and the conninfo 
+// string of each.
+static void process_hotkey(cluster_t *cluster, const char *payload, int length)
+{
+	hotkey_t *hotkey;
+	server_t *server;
+	hash_t map_hash, key_hash;
+	int count;
+	int str_len;
+	int offset;
+	int i;
+
+	assert(cluster);
+
+	if (length < 20) {
+		return;
+	}
+	map_hash = be64toh(*(uint64_t *)(payload));
+	key_hash = be64toh(*(uint64_t *)(payload + 8));
+	count = (int) be32toh(*(uint32_t *)(payload + 16));
+	offset = 20;
+
+	hotkey = hotkey_find(cluster, map_hash, key_hash);
+	if (hotkey == NULL && count > 0) {
+		if (cluster->hotkey_count < HOTKEY_MAX) {
+			hotkey = &cluster->hotkeys[cluster->hotkey_count];
+			cluster->hotkey_count ++;
+		}
+		else {
+			hotkey = &cluster->hotkeys[cluster->hotkey_replace];
+			cluster->hotkey_replace = (cluster->hotkey_replace + 1) % HOTKEY_MAX;
+		}
+		memset(hotkey, 0, sizeof(hotkey_t));
+		hotkey->map_hash = map_hash;
+		hotkey->key_hash = key_hash;
+	}
+	if (hotkey == NULL) {
+		return;
+	}
+
+	hotkey->server_count = 0;
+	for (i=0; i<count && length - offset > sizeof(int32_t); i++) {
+		str_len = be32toh(*(uint32_t *)(payload + offset));
+		offset += sizeof(int32_t);
+		if (str_len <= 0 || str_len > length - offset) {
+			break;
+		}
+		server = server_lookup(cluster, payload + offset, str_len);
+		offset += str_len;
+		if (server && hotkey->server_count < HOTKEY_SERVERS) {
+			hotkey->servers[hotkey->server_count] = server;
+			hotkey->server_count ++;
+		}
+	}
+
+	if (hotkey->server_count == 0) {
+		hotkey_remove(cluster, hotkey);
+	}
+}
+
+
+// the servers send us some commands without being asked.  They all need a reply.
+static void process_command(server_t *server, int command, uint32_t userid, const char *payload, int length)
+{
+	cluster_t *cluster;
+	hash_t mask, hashmask;
+	int level;
+	int offset;
+	int reply = REPLY_OK;
+
+	assert(server);
+	assert(length == 0 || payload);
+	cluster = server->cluster;
+	assert(cluster);
+
+	switch (command) {
+		case COMMAND_HASHMASK:
+			// an empty HASHMASK is a ping, but they are only sent to other nodes.
+			if (length >= 20) {
+				mask = be64toh(*(uint64_t *)(payload));
+				hashmask = be64toh(*(uint64_t *)(payload + 8));
+				level = (int) be32toh(*(uint32_t *)(payload + 16));
+				routing_update(cluster, server, mask, hashmask, level);
+				if (cluster->hashmask_fn) {
+					cluster->hashmask_fn(cluster, conninfo_remoteaddr(server->conninfo), mask, hashmask, level, cluster->hashmask_arg);
+				}
+				queue_flush(cluster);
+			}
+			break;
+
+		case COMMAND_SHUTTINGDOWN:
+			// the server will close the connection when it has finished, which is when the
+			// waiting requests will fail if they haven't been answered.
+			break;
+
+		case COMMAND_HOTKEY:
+			process_hotkey(cluster, payload, length);
+			break;
+
+		default:
+			reply = REPLY_UNKNOWN;
+			break;
+	}
+
+	if (server->handle >= 0) {
+		offset = out_header(server, command, reply, userid);
+		out_finish(server, offset);
+	}
+}
+
+
+// process all the complete messages in the in buffer.  The payloads are passed to the callbacks
+// where they are, and the buffer is only compacted when all of them are done.
+static void process_buffer(server_t *server)
+{
+	raw_header_t *raw;
+	int offset = 0;
+	int command, reply, length;
+	uint32_t userid;
+
+	assert(server);
+
+	while (server->handle >= 0 && (server->in_length - offset) >= sizeof(raw_header_t)) {
+		raw = (raw_header_t *) (server->in_buffer + offset);
+		length = be32toh(raw->length);
+		if ((server->in_length - offset) < sizeof(raw_header_t) + length) {
+			break;
+		}
+
+		command = be16toh(raw->command);
+		reply = be16toh(raw->reply);
+		userid = be32toh(raw->userid);
+		offset += sizeof(raw_header_t);
+
+		if (reply != 0) {
+			process_reply(server, reply, userid, server->in_buffer + offset, length);
+		}
+		else {
+			process_command(server, command, userid, server->in_buffer + offset, length);
+		}
+
+		offset += length;
+	}
+
+	// if the connection was closed by one of the callbacks, the buffer has already been emptied.
+	if (server->handle >= 0 && offset > 0) {
+		assert(offset <= server->in_length);
+		server->in_length -= offset;
+		if (server->in_length > 0) {
+			memmove(server->in_buffer, server->in_buffer + offset, server->in_length);
+		}
+	}
+}
+
+
+static void read_handler(evutil_socket_t fd, short flags, void *arg)
+{
+	server_t *server = arg;
+	ssize_t got;
+	int avail;
+
+	assert(fd >= 0);
+	assert(server);
+	assert(server->handle == fd);
+
+	for (;;) {
+		if (server->in_max - server->in_length < READ_CHUNK_SIZE) {
+			server->in_max = (server->in_max == 0) ? DEFAULT_BUFFER_SIZE : (server->in_max * 2);
+			server->in_buffer = realloc(server->in_buffer, server->in_max);
+			assert(server->in_buffer);
+		}
+
+		avail = server->in_max - server->in_length;
+		got = recv(fd, server->in_buffer + server->in_length, avail, 0);
+		if (got > 0) {
+			server->in_length += got;
+			if (got < avail) {
+				// we have read all there is for now.
+				break;
+			}
+		}
+		else if (got == 0) {
+			server_closed(server);
+			return;
+		}
+		else if (errno == EINTR) {
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		}
+		else {
+			server_closed(server);
+			return;
+		}
+	}
+
+	process_buffer(server);
+}
+
+
+static void write_handler(evutil_socket_t fd, short flags, void *arg)
+{
+	server_t *server = arg;
+	ssize_t sent;
+	int error = 0;
+	socklen_t error_len = sizeof(error);
+
+	assert(fd >= 0);
+	assert(server);
+	assert(server->handle == fd);
+
+	if (server->state == SERVER_CONNECTING) {
+		// the non-blocking connect has finished, one way or another.
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0) {
+			server_closed(server);
+			return;
+		}
+
+		server->state = SERVER_CONNECTED;
+		event_add(server->read_event, NULL);
+	}
+
+	while (server->out_length > 0) {
+		sent = send(fd, server->out_buffer, server->out_length, MSG_NOSIGNAL);
+		if (sent > 0) {
+			server->out_length -= sent;
+			if (server->out_length > 0) {
+				memmove(server->out_buffer, server->out_buffer + sent, server->out_length);
+			}
+		}
+		else if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			event_add(server->write_event, NULL);
+			return;
+		}
+		else {
+			server_closed(server);
+			return;
+		}
+	}
+}
+
+
+
+static int sock_resolve(const char *remote_addr, struct sockaddr_in *pSin)
+{
+	unsigned long ulAddress;
+	struct hostent *hp;
+	char *copy;
+	char *first;
+	char *next;
+	char *host = NULL;
+	int port = OPENCLUSTER_DEFAULT_PORT;
+	int result = -1;
+
+	assert(remote_addr);
+	assert(pSin);
+
+	copy = strdup(remote_addr);
+	assert(copy);
+	next = copy;
+	first = strsep(&next, ":");
+	assert(first == copy);
+
+	if (next == NULL) {
+		// no port was supplied.
+		host = strdup(remote_addr);
+	}
+	else {
+		port = atoi(next);
+		assert(port > 0);
+		host = strdup(first);
+	}
+	free (copy); copy = NULL;
+
+	assert(host != NULL && host[0] != '\0' && port > 0);
+
+	pSin->sin_family = AF_INET;
+	pSin->sin_port = htons(port);
+
+	// Look up by standard notation (xxx.xxx.xxx.xxx) first, and then try DNS.
+	ulAddress = inet_addr(host);
+	if ( ulAddress != (unsigned long)(-1) )  {
+		pSin->sin_addr.s_addr = ulAddress;
+		result = 0;
+	}
+	else {
+		hp = gethostbyname(host);
+		if (hp != NULL) {
+			memcpy( &(pSin->sin_addr.s_addr), &(hp->h_addr[0]), hp->h_length);
+			result = 0;
+		}
+	}
+
+	free(host);
+	return(result);
+}
+
+
+// put a HELLO at the front of the out buffer.  Requests could already be waiting in it, and the
+// HELLO needs to go first.
+static void queue_hello(server_t *server)
+{
+	request_t *request;
+	char *queued = NULL;
+	int queued_length;
+	int offset;
+
+	assert(server);
+
+	queued_length = server->out_length;
+	if (queued_length > 0) {
+		queued = malloc(queued_length);
+		assert(queued);
+		memcpy(queued, server->out_buffer, queued_length);
+		server->out_length = 0;
+	}
+
+	request = request_new(server->cluster, server, COMMAND_HELLO, NULL, NULL);
+	offset = out_header(server, COMMAND_HELLO, 0, request->id);
+	out_bin(server, NULL, 0);
+	out_int(server, PROTOCOL_V1);
+	out_int(server, FEATURE_HASHMASKS | FEATURE_HOTKEYS);
+	out_finish(server, offset);
+
+	if (queued) {
+		out_reserve(server, queued_length);
+		memcpy(server->out_buffer + server->out_length, queued, queued_length);
+		server->out_length += queued_length;
+		free(queued);
+	}
+}
+
+
+// start connecting to the server.  The connect will complete when the socket becomes writable.
+static int server_connect(server_t *server)
+{
+	struct sockaddr_in sin;
+	const char *remote_addr;
+	int handle;
+
+	assert(server);
+	assert(server->cluster);
+
+	if (server->state != SERVER_IDLE) {
+		return(0);
+	}
+	assert(server->handle < 0);
+
+	remote_addr = conninfo_remoteaddr(server->conninfo);
+	assert(remote_addr);
+	if (sock_resolve(remote_addr, &sin) < 0) {
+		return(-1);
+	}
+
+	handle = socket(AF_INET, SOCK_STREAM, 0);
+	if (handle < 0) {
+		return(-1);
+	}
+	evutil_make_socket_nonblocking(handle);
+
+	if (connect(handle, (struct sockaddr*)&sin, sizeof(sin)) < 0 && errno != EINPROGRESS) {
+		close(handle);
+		return(-1);
+	}
+
+	server->handle = handle;
+	server->state = SERVER_CONNECTING;
+	server->in_length = 0;
+	queue_hello(server);
+
+	assert(server->read_event == NULL);
+	assert(server->write_event == NULL);
+	server->read_event = event_new(server->cluster->evbase, handle, EV_READ | EV_PERSIST, read_handler, server);
+	server->write_event = event_new(server->cluster->evbase, handle, EV_WRITE, write_handler, server);
+	assert(server->read_event);
+	assert(server->write_event);
+	event_add(server->write_event, NULL);
+
+	return(0);
+}
+
+
+// the number of servers that we have started connecting to, but which are not ready yet.
+int evcluster_connecting(EVCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	int count = 0;
+	int i;
+
+	assert(cluster);
+
+	for (i=0; i<cluster->server_count; i++) {
+		if (cluster->servers[i]->state != SERVER_IDLE && cluster->servers[i]->ready == 0) {
+			count ++;
+		}
+	}
+
+	return(count);
+}
+
+
+// the number of servers that are ready for requests.
+int evcluster_connected(EVCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	int count = 0;
+	int i;
+
+	assert(cluster);
+
+	for (i=0; i<cluster->server_count; i++) {
+		if (cluster->servers[i]->ready) {
+			count ++;
+		}
+	}
+
+	return(count);
+}
+
+
+int evcluster_connect(EVCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	int started = 0;
+	int i;
+
+	assert(cluster);
+
+	for (i=0; i<cluster->server_count; i++) {
+		if (server_connect(cluster->servers[i]) == 0) {
+			started ++;
+		}
+	}
+
+	return(started);
+}
+
+
+// send a GOODBYE to each server.  The connection is closed when the reply comes back, which will be
+// after the replies to everything that was sent before it.
+void evcluster_disconnect(EVCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+	request_t *request;
+	int offset;
+	int i;
+
+	assert(cluster);
+
+	for (i=0; i<cluster->server_count; i++) {
+		server = cluster->servers[i];
+		assert(server);
+
+		if (server->state != SERVER_IDLE && server->closing == 0) {
+			request = request_new(cluster, server, COMMAND_GOODBYE, NULL, NULL);
+			offset = out_header(server, COMMAND_GOODBYE, 0, request->id);
+			out_finish(server, offset);
+			server->closing = 1;
+		}
+	}
+}
+
+
+void evcluster_free(EVCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+	int i;
+
+	assert(cluster);
+
+	for (i=0; i<cluster->server_count; i++) {
+		server = cluster->servers[i];
+		assert(server);
+
+		server_closed(server);
+		if (server->in_buffer) { free(server->in_buffer); }
+		if (server->out_buffer) { free(server->out_buffer); }
+		conninfo_free(server->conninfo);
+		free(server);
+	}
+
+	// like the requests that are waiting for a reply, the ones being held must have finished.
+	assert(cluster->queue_count == 0);
+	if (cluster->queue) { free(cluster->queue); }
+	if (cluster->queue_event) { event_free(cluster->queue_event); }
+
+	assert(cluster->request_count == 0);
+	if (cluster->primaries) { free(cluster->primaries); }
+	if (cluster->backups) { free(cluster->backups); }
+	if (cluster->servers) { free(cluster->servers); }
+	if (cluster->requests) { free(cluster->requests); }
+	free(cluster);
+}
+
+
+
+// Pick the server to send a request to.  If we know which server has the bucket for the key, it goes
+// straight there (or to the backup copy for reads that allow stale data, when the primary is not
+// available).  Otherwise there isn't one yet (a server that doesn't have the bucket can't always 
+// answer for it), and the request waits until one of them tells us (see request_submit).
+static server_t * choose_server(cluster_t *cluster, hash_t key_hash, int spread)
+{
+	server_t *server;
+
+	assert(cluster);
+
+	if (cluster->mask > 0) {
+		server = cluster->primaries[key_hash & cluster->mask];
+		if (server && server->state != SERVER_IDLE && server->closing == 0) {
+			return(server);
+		}
+
+		if (spread) {
+			server = cluster->backups[key_hash & cluster->mask];
+			if (server && server->state != SERVER_IDLE && server->closing == 0) {
+				return(server);
+			}
+		}
+	}
+
+	return(NULL);
+}
+
+
+// start a request for a key.  Returns NULL if there are no servers that could answer it.
+static request_t * request_start(cluster_t *cluster, int command, hash_t map_hash, hash_t key_hash, evcluster_reply_cb fn, void *arg)
+{
+	request_t *request;
+	int i;
+
+	assert(cluster);
+
+	for (i=0; i<cluster->server_count; i++) {
+		if (cluster->servers[i]->state != SERVER_IDLE && cluster->servers[i]->closing == 0) {
+			request = request_create(command, fn, arg);
+			request->map_hash = map_hash;
+			request->key_hash = key_hash;
+			return(request);
+		}
+	}
+
+	return(NULL);
+}
+
+
+int evcluster_getint(EVCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, evcluster_reply_cb fn, void *arg)
+{
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
+
+	assert(cluster);
+
+	request = request_start(cluster, COMMAND_GET_INT, map_hash, key_hash, fn, arg);
+	if (request == NULL) {
+		return(-1);
+	}
+
+	msg_long(request, map_hash);
+	msg_long(request, key_hash);
+	if (cluster->max_stale >= 0) {
+		msg_int(request, cluster->max_stale);
+	}
+	request_submit(cluster, request);
+
+	return(0);
+}
+
+
+int evcluster_getstr(EVCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, evcluster_reply_cb fn, void *arg)
+{
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
+
+	assert(cluster);
+
+	request = request_start(cluster, COMMAND_GET_STRING, map_hash, key_hash, fn, arg);
+	if (request == NULL) {
+		return(-1);
+	}
+
+	msg_long(request, map_hash);
+	msg_long(request, key_hash);
+	msg_int(request, 0);			// unlimited string size.
+	if (cluster->max_stale >= 0) {
+		msg_int(request, cluster->max_stale);
+	}
+	request_submit(cluster, request);
+
+	return(0);
+}
+
+
+int evcluster_setlong(EVCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, long long value, int expires, evcluster_reply_cb fn, void *arg)
+{
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
+
+	assert(cluster);
+	assert(expires >= 0);
+
+	request = request_start(cluster, COMMAND_SET_INT, map_hash, key_hash, fn, arg);
+	if (request == NULL) {
+		return(-1);
+	}
+
+	msg_long(request, map_hash);
+	msg_long(request, key_hash);
+	msg_int(request, expires);
+	msg_long(request, value);
+	request_submit(cluster, request);
+
+	return(0);
+}
+
+
+int evcluster_setbin(EVCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, int length, int expires, evcluster_reply_cb fn, void *arg)
+{
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
+
+	assert(cluster);
+	assert(expires >= 0);
+	assert(length >= 0);
+
+	request = request_start(cluster, COMMAND_SET_STRING, map_hash, key_hash, fn, arg);
+	if (request == NULL) {
+		return(-1);
+	}
+
+	msg_long(request, map_hash);
+	msg_long(request, key_hash);
+	msg_int(request, expires);
+	msg_bin(request, value, length);
+	request_submit(cluster, request);
+
+	return(0);
+}
+
+
+int evcluster_setstr(EVCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, int expires, evcluster_reply_cb fn, void *arg)
+{
+	return(evcluster_setbin(cluster_ptr, map_hash, key_hash, value, value ? strlen(value) : 0, expires, fn, arg));
+}
+
+
+
+// The FNV hashes are the same as the ones used by libopencluster, so both libraries can be used
+// against the same data.
+#define FNV_BASE_LONG   14695981039346656037llu
+#define FNV_PRIME_LONG  1099511628211llu
+
+
+hash_t evcluster_hash_bin(const char *str, const int length)
+{
+	register int i;
+	register hash_t hash = FNV_BASE_LONG;
+
+	for (i=0; i<length; i++)  {
+		hash ^= (unsigned int)str[i];
+		hash *= FNV_PRIME_LONG;
+	}
+
+	return(hash);
+}
+
+
+hash_t evcluster_hash_str(const char *str)
+{
+	return(evcluster_hash_bin(str, strlen(str)));
+}
+
+
+hash_t evcluster_hash_long(const long long key)
+{
+	register int i;
+	register hash_t hash = FNV_BASE_LONG;
+	union {
+		long long nkey;
+		char str[sizeof(long long)];
+	} match;
+
+	assert(sizeof(match) == sizeof(key));
+
+	match.nkey = htobe64(key);
+
+	for (i=0; i<sizeof(key); i++)  {
+		hash ^= (unsigned int)match.str[i];
+		hash *= FNV_PRIME_LONG;
+	}
+
+	return(hash);
+}
+
@@ -0,0 +1,101 @@
+/*
+ * Event based Opencluster client library
+ *
+ * This library is intended for services that are built on libevent.  It attaches to the
+ * event_base supplied by the caller, and never blocks.  Each request is given a callback function
+ * which is called when the reply arrives.  Any number of requests can be waiting for replies.
+ *
+ * The data in the reply is not copied.  The pointers in the reply point into the library's receive
+ * buffer, so they are only valid until the callback returns.  If the data is needed after that,
+ * the callback must copy it.
+ *
+ * The servers also send messages that were not asked for (for example, when the buckets they hold
+ * change).  These are handled by the library, and the hashmask changes are passed on to the
+ * callback set with evcluster_onhashmask().
+ *
+ */
+
+
+#ifndef __OPENCLUSTER_EVENT_H
+#define __OPENCLUSTER_EVENT_H
+
+
+#include <conninfo.h>
+#include <event2/event.h>
+#include <stdint.h>
+
+#define LIBOPENCLUSTER_EVENT_VERSION 0x00000100
+#define LIBOPENCLUSTER_EVENT_VERSION_NAME "v0.01.00"
+
+
+typedef uint64_t hash_t;
+typedef void * EVCLUSTER;
+
+
+// The reply to a request.  'ok' is non-zero if the request was successful (for GETs, that the value
+// was found).  'code' is the reply code from the server, or 0 if the connection was lost before the
+// reply arrived.  'payload' is the whole of the reply, and 'data' is the string value for string
+// GETs.  Neither is null terminated.
+typedef struct {
+	int ok;
+	int code;
+
+	hash_t map_hash;
+	hash_t key_hash;
+	long long value;
+
+	const char *data;
+	int length;
+
+	const char *payload;
+	int payload_length;
+} evcluster_reply_t;
+
+typedef void (*evcluster_reply_cb)(EVCLUSTER cluster, const evcluster_reply_t *reply, void *arg);
+
+// called when a server tells us which buckets it has (level 0 is the primary copy, 1 is the backup,
+// -1 means it no longer has it).  'server' is the connection string for the server.
+typedef void (*evcluster_hashmask_cb)(EVCLUSTER cluster, const char *server, hash_t mask, hash_t hashmask, int level, void *arg);
+
+
+EVCLUSTER evcluster_new(struct event_base *evbase);
+void evcluster_free(EVCLUSTER cluster);
+
+// 'conninfo' is controlled by the cluster after this function.
+void evcluster_addserver(EVCLUSTER cluster, conninfo_t *conninfo);
+
+// start connecting to all the servers.  Requests can be made straight away, they will be sent when
+// the connection is ready.  Returns the number of connections that were started.
+//
+// Each server tells us which buckets it has, and the requests for those buckets are sent straight to
+// it.  evcluster_connecting() returns the number of servers that haven't done that yet.
+int evcluster_connect(EVCLUSTER cluster);
+int evcluster_connecting(EVCLUSTER cluster);
+int evcluster_connected(EVCLUSTER cluster);
+void evcluster_disconnect(EVCLUSTER cluster);
+int evcluster_servercount(EVCLUSTER cluster);
+
+// allow reads to be answered with data up to 'seconds' old.  Those reads can also go to the backup 
+// copy of the bucket, and the reads for keys that the servers say are hot are spread over the 
+// servers that have copies of them.
+void evcluster_setstale(EVCLUSTER cluster, int seconds);
+void evcluster_onhashmask(EVCLUSTER cluster, evcluster_hashmask_cb fn, void *arg);
+
+// the request functions return 0 if the request was queued, or -1 if there are no servers to send
+// it to.  The callback can be NULL if the result is not needed.  If we dont know yet which server has
+// the bucket, the request is held until one tells us, and fails if none has after a few seconds.  A
+// request that gets a TRYELSEWHERE is sent on to the server it names (a few times at most).
+int evcluster_getint(EVCLUSTER cluster, hash_t map_hash, hash_t key_hash, evcluster_reply_cb fn, void *arg);
+int evcluster_getstr(EVCLUSTER cluster, hash_t map_hash, hash_t key_hash, evcluster_reply_cb fn, void *arg);
+int evcluster_setlong(EVCLUSTER cluster, hash_t map_hash, hash_t key_hash, long long value, int expires, evcluster_reply_cb fn, void *arg);
+int evcluster_setbin(EVCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, int length, int expires, evcluster_reply_cb fn, void *arg);
+int evcluster_setstr(EVCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, int expires, evcluster_reply_cb fn, void *arg);
+
+int evcluster_pending(EVCLUSTER cluster);
+
+hash_t evcluster_hash_str(const char *str);
+hash_t evcluster_hash_bin(const char *str, const int length);
+hash_t evcluster_hash_long(const long long key);
+
+
+#endif
@@ -0,0 +1,230 @@
+//-----------------------------------------------------------------------------
+// libopencluster-ll
+// low-latency library interface to communicate with the opencluster service.  The connections
+// and the routing of requests to the node that has the data are handled by libopencluster-event,
+// this library just waits for the replies.
+
+#include "opencluster-ll.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#if (LIBOPENCLUSTER_LL_VERSION != 0x00000100)
+#error "Incorrect opencluster-ll.h header version."
+#endif
+
+
+typedef struct {
+	struct event_base *evbase;
+	EVCLUSTER events;
+} llcluster_t;
+
+
+// the result of a request, filled in by the callback.
+typedef struct {
+	int done;
+	int ok;
+	long long value;
+	char *data;
+	int length;
+} result_t;
+
+
+
+LLCLUSTER llcluster_new(void)
+{
+	llcluster_t *cluster;
+
+	cluster = calloc(1, sizeof(llcluster_t));
+	assert(cluster);
+
+	cluster->evbase = event_base_new();
+	assert(cluster->evbase);
+	cluster->events = evcluster_new(cluster->evbase);
+	assert(cluster->events);
+
+	return(cluster);
+}
+
+
+void llcluster_free(LLCLUSTER cluster_ptr)
+{
+	llcluster_t *cluster = cluster_ptr;
+
+	assert(cluster);
+
+	evcluster_free(cluster->events);
+	event_base_free(cluster->evbase);
+	free(cluster);
+}
+
+
+void llcluster_addserver(LLCLUSTER cluster_ptr, conninfo_t *conninfo)
+{
+	llcluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	evcluster_addserver(cluster->events, conninfo);
+}
+
+
+int llcluster_servercount(LLCLUSTER cluster_ptr)
+{
+	llcluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	return(evcluster_servercount(cluster->events));
+}
+
+
+void llcluster_setstale(LLCLUSTER cluster_ptr, int seconds)
+{
+	llcluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	evcluster_setstale(cluster->events, seconds);
+}
+
+
+int llcluster_connect(LLCLUSTER cluster_ptr)
+{
+	llcluster_t *cluster = cluster_ptr;
+
+	assert(cluster);
+
+	evcluster_connect(cluster->events);
+	while (evcluster_connecting(cluster->events) > 0) {
+		event_base_loop(cluster->evbase, EVLOOP_ONCE);
+	}
+
+	return(evcluster_connected(cluster->events));
+}
+
+
+void llcluster_disconnect(LLCLUSTER cluster_ptr)
+{
+	llcluster_t *cluster = cluster_ptr;
+
+	assert(cluster);
+
+	evcluster_disconnect(cluster->events);
+	while (evcluster_pending(cluster->events) > 0) {
+		event_base_loop(cluster->evbase, EVLOOP_ONCE);
+	}
+}
+
+
+
+static void reply_handler(EVCLUSTER events, const evcluster_reply_t *reply, void *arg)
+{
+	result_t *result = arg;
+
+	assert(events);
+	assert(reply);
+	assert(result);
+	assert(result->done == 0);
+
+	result->done = 1;
+	result->ok = reply->ok;
+	result->value = reply->value;
+
+	// the data is only valid during the callback, so it needs to be copied.
+	if (reply->ok && reply->data) {
+		result->data = malloc(reply->length + 1);
+		assert(result->data);
+		memcpy(result->data, reply->data, reply->length);
+		result->data[reply->length] = '\0';
+		result->length = reply->length;
+	}
+}
+
+
+// wait for the reply to the request that was just sent.  Returns 0 if it was successful.
+static int wait_result(llcluster_t *cluster, int sent, result_t *result)
+{
+	assert(cluster);
+	assert(result);
+
+	if (sent != 0) {
+		return(-1);
+	}
+
+	while (result->done == 0) {
+		event_base_loop(cluster->evbase, EVLOOP_ONCE);
+	}
+
+	return(result->ok ? 0 : -1);
+}
+
+
+
+int llcluster_getint(LLCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, long long *value)
+{
+	llcluster_t *cluster = cluster_ptr;
+	result_t result;
+	int res;
+
+	assert(cluster);
+	assert(value);
+
+	memset(&result, 0, sizeof(result));
+	res = wait_result(cluster, evcluster_getint(cluster->events, map_hash, key_hash, reply_handler, &result), &result);
+	if (res == 0) {
+		*value = result.value;
+	}
+
+	return(res);
+}
+
+
+int llcluster_getstr(LLCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, char **value, int *length)
+{
+	llcluster_t *cluster = cluster_ptr;
+	result_t result;
+	int res;
+
+	assert(cluster);
+	assert(value);
+
+	memset(&result, 0, sizeof(result));
+	res = wait_result(cluster, evcluster_getstr(cluster->events, map_hash, key_hash, reply_handler, &result), &result);
+	if (res == 0) {
+		*value = result.data;
+		if (length) { *length = result.length; }
+	}
+	else {
+		assert(result.data == NULL);
+	}
+
+	return(res);
+}
+
+
+int llcluster_setlong(LLCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, long long value, int expires)
+{
+	llcluster_t *cluster = cluster_ptr;
+	result_t result;
+
+	assert(cluster);
+
+	memset(&result, 0, sizeof(result));
+	return(wait_result(cluster, evcluster_setlong(cluster->events, map_hash, key_hash, value, expires, reply_handler, &result), &result));
+}
+
+
+int llcluster_setbin(LLCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, int length, int expires)
+{
+	llcluster_t *cluster = cluster_ptr;
+	result_t result;
+
+	assert(cluster);
+
+	memset(&result, 0, sizeof(result));
+	return(wait_result(cluster, evcluster_setbin(cluster->events, map_hash, key_hash, value, length, expires, reply_handler, &result), &result));
+}
+
+
+int llcluster_setstr(LLCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, int expires)
+{
+	return(llcluster_setbin(cluster_ptr, map_hash, key_hash, value, value ? strlen(value) : 0, expires));
+}
+
@@ -0,0 +1,56 @@
+/*
+ * Low-latency Opencluster client library
+ *
+ * This library connects to every node in the cluster, and keeps track of which node has each bucket
+ * (the nodes tell it when that changes).  Each request is sent straight to the node that has the
+ * data, so every operation is a single round trip, and when a node fails, only the requests for
+ * the buckets it had are affected.
+ *
+ * The functions block until the reply arrives.  It is built on libopencluster-event (with its own
+ * event_base), so the hash functions from that library are used.
+ *
+ * All the nodes in the cluster should be added with llcluster_addserver() before connecting.  A
+ * request for a bucket that no node has told us about waits (for a few seconds at most) until one
+ * does, and if a node says the bucket is somewhere else, the request follows it there.
+ *
+ */
+
+
+#ifndef __OPENCLUSTER_LL_H
+#define __OPENCLUSTER_LL_H
+
+
+#include <conninfo.h>
+#include <opencluster-event.h>
+
+#define LIBOPENCLUSTER_LL_VERSION 0x00000100
+#define LIBOPENCLUSTER_LL_VERSION_NAME "v0.01.00"
+
+
+typedef void * LLCLUSTER;
+
+
+LLCLUSTER llcluster_new(void);
+void llcluster_free(LLCLUSTER cluster);
+
+// 'conninfo' is controlled by the cluster after this function.
+void llcluster_addserver(LLCLUSTER cluster, conninfo_t *conninfo);
+int llcluster_servercount(LLCLUSTER cluster);
+
+// connect to all the servers, and wait until each one has told us which buckets it has (or failed).
+// Returns the number of servers that we are connected to.
+int llcluster_connect(LLCLUSTER cluster);
+void llcluster_disconnect(LLCLUSTER cluster);
+
+void llcluster_setstale(LLCLUSTER cluster, int seconds);
+
+// the GET functions return 0 if the value was found.  The string returned by llcluster_getstr must
+// be freed by the caller.  The SET functions return 0 if the value was stored.
+int llcluster_getint(LLCLUSTER cluster, hash_t map_hash, hash_t key_hash, long long *value);
+int llcluster_getstr(LLCLUSTER cluster, hash_t map_hash, hash_t key_hash, char **value, int *length);
+int llcluster_setlong(LLCLUSTER cluster, hash_t map_hash, hash_t key_hash, long long value, int expires);
+int llcluster_setbin(LLCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, int length, int expires);
+int llcluster_setstr(LLCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, int expires);
+
+
+#endif
@@ -3,18 +3,24 @@
 // library interface to communicate with the opencluster service.
 
 #include "opencluster.h"
+#include "codec.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
 #include <endian.h>
 #include <netdb.h>
+#include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 
 #if (LIBOPENCLUSTER_VERSION != 0x00000100)
@@ -28,24 +34,92 @@
 
 #define DEFAULT_BUFFER_SIZE   OPENCLUSTER_DEFAULT_BUFFSIZE
 
+// requests sent with the _async functions are collected in a per-server buffer, and sent when there 
+// is this much, or when we need to wait for a reply.
+#define ASYNC_FLUSH_SIZE      (64*1024)
+
+// the request table starts with this many slots (it must be a power of 2), and doubles when needed.
+#define ASYNC_TABLE_START     1024
+
+// if this many requests are waiting for replies, sending another one will wait for some of them to 
+// arrive first.  Replies that have arrived still hold on to their request id until they are 
+// collected, so if ASYNC_MAX_REQUESTS have not been collected, another async request will fail 
+// (return 0) instead.  The request ids are only 16 bits (REQUEST_ID_MAX), so these need to be well 
+// under that, otherwise there might not be an id that is free to use.
+#define ASYNC_MAX_WAITING     (32*1024)
+#define ASYNC_MAX_REQUESTS    (60*1024)
+#define REQUEST_ID_MAX        0xFFFF
+
+// the near cache hash table has about this many slots for each entry.
+#define CACHE_TABLE_RATIO     2
+
+// the number of times the entries in a batch request will be sent, if the server we sent them to 
+// says they are on a different server.
+#define BATCH_TRIES           2
+
+// large values are sent and received in chunks of this size (see cluster_setbin_chunked), with up 
+// to CHUNK_WINDOW chunks waiting for replies at a time.
+#define CHUNK_SIZE            (64*1024)
+#define CHUNK_WINDOW          8
+
 // #define WAIT_FOR_REPLY 1
 
 
 #define REPLY_FAIL                          0x0003
+#define REPLY_TRYELSEWHERE                  0x0007
 #define REPLY_OK                            0x0010
+#define REPLY_NOT_MODIFIED                  0x0011
 #define REPLY_KEYVALUE_HASH                 0x001F
 #define REPLY_KEYVALUE                      0x0020
 #define REPLY_DATA_INT                      0x0110
 #define REPLY_DATA_STRING                   0x0120
+#define REPLY_MULTI                         0x0130
+#define REPLY_DATA_KEY                      0x0140
+#define REPLY_SCAN                          0x0150
+#define REPLY_DATA_CHUNK                    0x0160
+
+// the framing used on the connection (see the server's header.h).  We ask for v2 in the HELLO, and 
+// the server says in the reply if it agrees.
+#define PROTOCOL_V1                         1
+#define PROTOCOL_V2                         2
+
+// the optional features we tell the server we understand in the HELLO.  Servers that keep values 
+// compressed will send them to us that way, and we expand them.
+#define FEATURE_COMPRESSED_VALUES           0x0001
+
+#define FRAME_REPLY                         0x01
+#define FRAME_BATCH                         0x02
+#define FRAME_LONGID                        0x10
+#define FRAME_HEADER_MIN                    6
 
 #define COMMAND_HELLO                       0x0010
+#define COMMAND_HASHMASK                    0x0080
+#define COMMAND_HOTKEY                      0x0090
+#define COMMAND_INVALIDATIONS               0x00A0
+#define COMMAND_INVALIDATE                  0x00B0
 #define COMMAND_GOODBYE                     0x0040
 #define COMMAND_GET_INT                     0x2010
 #define COMMAND_GET_STRING                  0x2020
+#define COMMAND_MGET                        0x2030
+#define COMMAND_GET_IF_CHANGED              0x2040
+#define COMMAND_GET_KEY_ALL                 0x2050
+#define COMMAND_SCAN_MAP                    0x2060
+#define COMMAND_GET_CHUNK                   0x2070
 #define COMMAND_SET_INT                     0x2200
 #define COMMAND_SET_STRING                  0x2210
+#define COMMAND_MSET                        0x2220
+#define COMMAND_SET_STREAM                  0x2230
+#define COMMAND_SET_CHUNK                   0x2240
+#define COMMAND_SET_INT_IF                  0x2300
+#define COMMAND_SET_STRING_IF               0x2310
+#define COMMAND_SET_KEY_MULTI               0x2320
+#define COMMAND_INCR                        0x2400
+#define COMMAND_MINCR                       0x2410
 #define COMMAND_SET_KEYVALUE                0x2500
 #define COMMAND_GET_KEYVALUE                0x2520
+#define COMMAND_DROP_MAP                    0x2600
+#define COMMAND_DELETE                      0x2610
+#define COMMAND_MDELETE                     0x2620
 
 // this structure is not packed on word boundaries, so it should represent the 
 // data received over the network.
@@ -72,6 +146,10 @@ typedef struct {
 		int length;
 		int max;
 		int command;
+		
+		// non-zero if the request is a read that can be sent to any server (because the backup 
+		// copies are allowed to answer it).
+		int spread;
 	} out;
 	
 	// data coming in.
@@ -108,9 +186,53 @@ typedef struct {
 
 	int ready;
 	
+	// PROTOCOL_V1 or PROTOCOL_V2.
+	int protocol;
+	
+	// requests that have been sent with the _async functions, but not written to the socket yet.  
+	// With v2 framing, they are marked as part of a batch (so the server can send the replies 
+	// together), except for the last one, which is at 'out_last' until the buffer is sent.
+	char *out_buffer;
+	int out_length;
+	int out_max;
+	int out_last;
+	
 } server_t;
 
 
+// an item kept in the near cache.
+typedef struct __cache_item_t {
+	hash_t map_hash;
+	hash_t key_hash;
+	
+	// the command that read it (COMMAND_GET_INT or COMMAND_GET_STRING).
+	int type;
+	long long value;
+	char *data;
+	int length;
+	
+	time_t stored;
+	
+	// the chain of items in the same hash table slot.
+	struct __cache_item_t *chain;
+	
+	// the LRU list.  The most recently used item is at the head.
+	struct __cache_item_t *prev;
+	struct __cache_item_t *next;
+} cache_item_t;
+
+
+// a request that has been sent with one of the _async functions.  The reply is kept in 'message' 
+// until the caller collects it.
+typedef struct {
+	message_t message;
+	server_t *server;
+	
+	// the caller doesn't want the result, so the request is discarded when the reply arrives.
+	int released;
+} request_t;
+
+
 
 
 typedef struct {
@@ -120,6 +242,11 @@ typedef struct {
 
 	unsigned long long mask;
 	
+	// the servers tell us which buckets they are the primary for (indexed by the hashmask, so there 
+	// are mask+1 entries).  The blocking functions don't use this, but the batch requests are split up 
+	// so that each part goes to the server that has the data.
+	server_t **routes;
+	
 	void *payload;
 	int payload_max;
 	int payload_length;
@@ -127,14 +254,45 @@ typedef struct {
 	int disconnecting;
 	short debug;
 
+	// how stale (in seconds) the data returned by a GET can be.  When this is set, the backup copy 
+	// of the data is allowed to answer, and the reads are spread over the servers.  -1 means that 
+	// only the primary can answer.
+	int max_stale;
+	int read_next;
+
 	message_t message;
 	
+	// every request gets its own id (which the server returns in the reply), so that several can be 
+	// waiting for replies at the same time.  The async requests are kept in a table, indexed by the 
+	// id (modulo the size of the table).
+	int next_id;
+	request_t **requests;
+	int request_max;
+	int request_count;
+	int request_waiting;
+	
+	struct pollfd *pollfds;
+	
+	// the near cache (see cluster_cache).  'cache_max' is 0 when it is turned off.
+	int cache_max;
+	int cache_max_age;
+	int cache_count;
+	int cache_slots;
+	cache_item_t **cache_table;
+	cache_item_t *cache_head;
+	cache_item_t *cache_tail;
+	cluster_cache_stats_t cache_stats;
+	
 } cluster_t;
 
 
 //-----------------------------------------------------------------------------
 // function pre-declaration.
 static int server_connect(cluster_t *cluster, server_t *server);
+static int send_request_server(cluster_t *cluster, server_t *server);
+static void message_done(cluster_t *cluster);
+static void cache_clear(cluster_t *cluster);
+static void msg_setint(cluster_t *cluster, const int value);
 
 
 
@@ -162,6 +320,16 @@ OPENCLUSTER cluster_init(void)
 	cluster->mask = 0;			
 	
 	cluster->disconnecting = 0;
+	
+	cluster->max_stale = -1;
+	cluster->read_next = 0;
+	
+	cluster->next_id = 0;
+	cluster->requests = NULL;
+	cluster->request_max = 0;
+	cluster->request_count = 0;
+	cluster->request_waiting = 0;
+	cluster->pollfds = NULL;
 
 	assert(cluster->message.out.command == 0);
 	assert(cluster->message.id == 0);
@@ -187,6 +355,18 @@ void cluster_debug_off(OPENCLUSTER cluster_ptr)
 }
 
 
+// Indicate how old (in seconds) the data returned from a GET can be.  If the backup copy of the 
+// data has been kept up to date within that time, then it can answer the request, which means the 
+// reads can be spread over the servers.  A negative value means only the primary can answer (which 
+// is the default).
+void cluster_setstale(OPENCLUSTER cluster_ptr, int seconds)
+{
+	cluster_t *cluster = cluster_ptr;
+	assert(cluster);
+	cluster->max_stale = seconds < 0 ? -1 : seconds;
+}
+
+
 
 
 
@@ -203,6 +383,11 @@ static void server_free(server_t *server)
 	assert(server->in_max > 0);
 	free(server->in_buffer);
 	
+	assert(server->out_length == 0);
+	if (server->out_buffer) {
+		free(server->out_buffer);
+	}
+	
 	free(server);
 }
 
@@ -211,9 +396,52 @@ static void server_free(server_t *server)
 void cluster_free(OPENCLUSTER cluster_ptr)
 {
 	cluster_t *cluster = cluster_ptr;
+	int i;
 	
 	assert(cluster);
 
+	// any requests that were never collected.
+	for (i=0; i<cluster->request_max; i++) {
+		if (cluster->requests[i]) {
+			if (cluster->requests[i]->message.in.payload) {
+				free(cluster->requests[i]->message.in.payload);
+			}
+			free(cluster->requests[i]);
+			cluster->request_count --;
+		}
+	}
+	assert(cluster->request_count == 0);
+	if (cluster->requests) {
+		free(cluster->requests);
+		cluster->requests = NULL;
+		cluster->request_max = 0;
+	}
+	
+	if (cluster->pollfds) {
+		free(cluster->pollfds);
+		cluster->pollfds = NULL;
+	}
+	
+	cache_clear(cluster);
+	if (cluster->cache_table) {
+		free(cluster->cache_table);
+		cluster->cache_table = NULL;
+	}
+	
+	if (cluster->routes) {
+		free(cluster->routes);
+		cluster->routes = NULL;
+	}
+	
+	if (cluster->message.out.data) {
+		free(cluster->message.out.data);
+		cluster->message.out.data = NULL;
+	}
+	if (cluster->message.in.payload) {
+		free(cluster->message.in.payload);
+		cluster->message.in.payload = NULL;
+	}
+
 	while (cluster->server_count > 0) {
 		cluster->server_count --;
 		
@@ -277,6 +505,13 @@ void cluster_addserver(OPENCLUSTER cluster_ptr, conninfo_t *conninfo)
 		server->in_length = 0;
 		server->in_max = DEFAULT_BUFFER_SIZE;
 		
+		server->out_buffer = NULL;
+		server->out_length = 0;
+		server->out_max = 0;
+		server->out_last = -1;
+		
+		server->protocol = PROTOCOL_V1;
+		
 		server->conninfo = conninfo;
 		
 		// add the conn to the list.
@@ -391,23 +626,300 @@ static int sock_connect(const char *remote_addr)
 }
 
 
-// the connection to the server was closed. 
+static request_t * request_find(cluster_t *cluster, int id)
+{
+	request_t *request;
+	
+	assert(cluster);
+	
+	if (cluster->request_max == 0) {
+		return(NULL);
+	}
+	
+	request = cluster->requests[id & (cluster->request_max - 1)];
+	if (request && request->message.id == id) {
+		return(request);
+	}
+	else {
+		return(NULL);
+	}
+}
+
+
+// double the size of the request table.  Two ids that are in different slots will still be in 
+// different slots after the table is doubled, so they can just be moved across.
+static void requests_grow(cluster_t *cluster)
+{
+	request_t **requests;
+	int max;
+	int i;
+	
+	assert(cluster);
+	
+	max = cluster->request_max == 0 ? ASYNC_TABLE_START : cluster->request_max * 2;
+	requests = calloc(max, sizeof(request_t *));
+	assert(requests);
+	
+	for (i=0; i<cluster->request_max; i++) {
+		if (cluster->requests[i]) {
+			assert(requests[cluster->requests[i]->message.id & (max - 1)] == NULL);
+			requests[cluster->requests[i]->message.id & (max - 1)] = cluster->requests[i];
+		}
+	}
+	
+	if (cluster->requests) {
+		free(cluster->requests);
+	}
+	cluster->requests = requests;
+	cluster->request_max = max;
+}
+
+
+static void request_add(cluster_t *cluster, request_t *request)
+{
+	assert(cluster);
+	assert(request);
+	assert(request->message.id > 0);
+	
+	// the ids are handed out in order, so the slot will only be in use if a request from a long time 
+	// ago still hasn't been collected.
+	while (cluster->request_max == 0 || cluster->requests[request->message.id & (cluster->request_max - 1)] != NULL) {
+		requests_grow(cluster);
+	}
+	
+	cluster->requests[request->message.id & (cluster->request_max - 1)] = request;
+	cluster->request_count ++;
+}
+
+
+static void request_remove(cluster_t *cluster, request_t *request)
+{
+	assert(cluster);
+	assert(request);
+	assert(cluster->request_max > 0);
+	assert(cluster->requests[request->message.id & (cluster->request_max - 1)] == request);
+	
+	cluster->requests[request->message.id & (cluster->request_max - 1)] = NULL;
+	cluster->request_count --;
+	assert(cluster->request_count >= 0);
+	
+	if (request->message.in.payload) {
+		free(request->message.in.payload);
+	}
+	free(request);
+}
+
+
+// a reply has arrived for this message.
+static void message_reply(message_t *msg, int reply, int length, void *data)
+{
+	assert(msg);
+	assert(reply > 0);
+	assert(length >= 0);
+	
+	if (length > 0) {
+		assert(msg->in.max >= 0);
+		assert((msg->in.max == 0) || (msg->in.max > 0 && msg->in.payload));
+		if (msg->in.max < length) {
+			msg->in.payload = realloc(msg->in.payload, length);
+			msg->in.max = length;
+		}
+		
+		assert(msg->in.max > 0);
+		assert(msg->in.payload);
+		memcpy(msg->in.payload, data, length);
+		msg->in.length = length;
+		assert(msg->in.length <= msg->in.max);
+	}
+	msg->in.offset = 0;
+	msg->in.result = reply;
+}
+
+
+// the request has finished (either the reply arrived, or it failed).
+static void request_finished(cluster_t *cluster, request_t *request)
+{
+	assert(cluster);
+	assert(request);
+	assert(request->message.in.result > 0);
+	
+	cluster->request_waiting --;
+	assert(cluster->request_waiting >= 0);
+	
+	if (request->released) {
+		request_remove(cluster, request);
+	}
+}
+
+
+// the connection to the server was closed.  Any async requests that were sent to it will not get a 
+// reply, so they are failed.
 static void server_closed(cluster_t *cluster, server_t *server)
 {
+	request_t *request;
+	int i;
+	
 	assert(cluster);
 	assert(server);
 	
 	close(server->handle);
 	server->handle = -1;
-	server->active = 0;;
+	server->active = 0;
+	server->in_length = 0;
+	server->out_length = 0;
+	server->out_last = -1;
+	server->protocol = PROTOCOL_V1;
+	
+	// we wont hear about the items that change while we are not connected, so the copies we have 
+	// cant be trusted any more.
+	cache_clear(cluster);
+	
+	if (cluster->routes) {
+		for (i=0; i<=cluster->mask; i++) {
+			if (cluster->routes[i] == server) {
+				cluster->routes[i] = NULL;
+			}
+		}
+	}
+	
+	for (i=0; i<cluster->request_max; i++) {
+		request = cluster->requests[i];
+		if (request && request->server == server && request->message.in.result == 0) {
+			request->message.in.result = REPLY_FAIL;
+			request_finished(cluster, request);
+		}
+	}
 }
 
 
 
-/*
 // When creating the header, we dont actually know the 'length' of the payload, so we will adjust 
 // that as we add data to it.   This payload will be used mostly just for returning ACK and NACK 
 // replies to the server.
+// messages are always built with a v1 header.  If the server is using v2 framing, the header is 
+// replaced with a v2 one that ends where the v1 header did, so the payload doesn't need to move.  
+// Returns the offset that the message starts at now.
+static int frame_header(server_t *server, void *data, int flags)
+{
+	raw_header_t *raw;
+	unsigned char header[sizeof(raw_header_t)];
+	unsigned int userid;
+	unsigned int length;
+	int command;
+	int reply;
+	int pos;
+	
+	assert(server);
+	assert(data);
+	
+	if (server->protocol != PROTOCOL_V2) {
+		return(0);
+	}
+	
+	raw = data;
+	command = ntohs(raw->command);
+	reply = ntohs(raw->reply);
+	userid = ntohl(raw->userid);
+	length = ntohl(raw->length);
+	
+	// our requests ids are never more than 16 bits, but the ones the server sends can be.
+	if (reply > 0)        { flags |= FRAME_REPLY; }
+	if (userid > 0xFFFF)  { flags |= FRAME_LONGID; }
+	
+	header[0] = flags;
+	header[1] = command >> 8;
+	header[2] = command & 0xFF;
+	pos = 3;
+	if (flags & FRAME_REPLY) {
+		header[pos++] = reply >> 8;
+		header[pos++] = reply & 0xFF;
+	}
+	if (flags & FRAME_LONGID) {
+		header[pos++] = userid >> 24;
+		header[pos++] = (userid >> 16) & 0xFF;
+	}
+	header[pos++] = (userid >> 8) & 0xFF;
+	header[pos++] = userid & 0xFF;
+	while (length >= 0x80 && pos < sizeof(header)) {
+		header[pos++] = (length & 0x7F) | 0x80;
+		length >>= 7;
+	}
+	assert(length < 0x80 && pos < sizeof(header));
+	header[pos++] = length;
+	
+	memcpy(data + sizeof(raw_header_t) - pos, header, pos);
+	return(sizeof(raw_header_t) - pos);
+}
+
+
+// decode the header of a message from the server.  Returns the size of the header, 0 if it isn't 
+// all there yet, or -1 if it isn't valid.
+static int frame_decode(server_t *server, const unsigned char *data, int avail, int *command, int *reply, int *userid, int *length)
+{
+	const raw_header_t *raw;
+	unsigned int value;
+	int flags;
+	int pos;
+	int shift;
+	
+	assert(server);
+	assert(data);
+	
+	if (server->protocol != PROTOCOL_V2) {
+		if (avail < sizeof(raw_header_t)) {
+			return(0);
+		}
+		raw = (const void *) data;
+		*command = ntohs(raw->command);
+		*reply = ntohs(raw->reply);
+		*userid = ntohl(raw->userid);
+		*length = ntohl(raw->length);
+		return(sizeof(raw_header_t));
+	}
+	
+	if (avail < FRAME_HEADER_MIN) {
+		return(0);
+	}
+	
+	flags = data[0];
+	pos = FRAME_HEADER_MIN - 1;
+	if (flags & FRAME_REPLY)  { pos += 2; }
+	if (flags & FRAME_LONGID) { pos += 2; }
+	if (pos >= avail) {
+		return(0);
+	}
+	
+	*command = (data[1] << 8) | data[2];
+	pos = 3;
+	*reply = 0;
+	if (flags & FRAME_REPLY) {
+		*reply = (data[pos] << 8) | data[pos+1];
+		pos += 2;
+	}
+	value = 0;
+	if (flags & FRAME_LONGID) {
+		value = (data[pos] << 24) | (data[pos+1] << 16);
+		pos += 2;
+	}
+	*userid = value | (data[pos] << 8) | data[pos+1];
+	pos += 2;
+	
+	value = 0;
+	for (shift = 0; pos < avail; shift += 7) {
+		if (shift > 28 || (shift == 28 && data[pos] > 0x07)) {
+			return(-1);
+		}
+		value |= (data[pos] & 0x7F) << shift;
+		if ((data[pos++] & 0x80) == 0) {
+			*length = value;
+			return(pos);
+		}
+	}
+	
+	return(0);
+}
+
+
 static void payload_header(cluster_t *cluster, uint16_t command, uint16_t reply, uint32_t userid)
 {
 	raw_header_t *raw;
@@ -428,7 +940,6 @@ static void payload_header(cluster_t *cluster, uint16_t command, uint16_t reply,
 	
 	cluster->payload_length = sizeof(raw_header_t);
 }
-*/
 
 
 /*
@@ -513,7 +1024,6 @@ static void payload_string(cluster_t *cluster, const char *str)
 }
 */
 
-/*
 // assumes that the reply is already in the cluster->payload,
 static void send_reply(cluster_t *cluster, server_t *server)
 {
@@ -528,7 +1038,7 @@ static void send_reply(cluster_t *cluster, server_t *server)
 	assert(cluster->payload_length >= sizeof(raw_header_t));
 	
 	// send the data
-	datasent = 0;
+	datasent = frame_header(server, cluster->payload, 0);
 	assert(server->handle > 0);
 	while (datasent < cluster->payload_length && server->handle > 0) {
 		avail = cluster->payload_length - datasent;
@@ -549,9 +1059,8 @@ static void send_reply(cluster_t *cluster, server_t *server)
 	
 	assert(cluster->payload_length == 0);
 }
-*/
 
-/*
+
 static void reply_ok(cluster_t *cluster, server_t *server, short repcmd, int userid)
 {
 	assert(cluster);
@@ -564,7 +1073,6 @@ static void reply_ok(cluster_t *cluster, server_t *server, short repcmd, int use
 	payload_header(cluster, repcmd, REPLY_OK, userid);
 	send_reply(cluster, server);
 }
-*/
 
 
 
@@ -646,198 +1154,448 @@ static void * data_string(void *data, int *length, char **ptr)
 
 
 
-// this function will ensure that there is not any pending data on the incoming socket for the 
-// server.  Since the server details are not exposed outside of the library, this is an internal 
-// function.   Developers will need to call cluster_pending which will process pending data on all 
-// the connected servers.
-static void pending_server(cluster_t *cluster, server_t *server)
+//-----------------------------------------------------------------------------
+// The near cache.  Items are found through a hash table of (map_hash, key_hash), and are also kept 
+// in a list in the order they were used, so that the least recently used can be dropped when the 
+// cache is full.
+
+static int cache_slot(cluster_t *cluster, hash_t map_hash, hash_t key_hash)
 {
-	int offset = 0;
-	int avail;
-	int sent;
-	raw_header_t *header;
-	int length;
-	short reply;
-	int userid;
-	int inner = 0;
-	short command;
-	
 	assert(cluster);
-	assert(server);
-	assert(server->active);
+	assert(cluster->cache_slots > 0);
+	return((key_hash ^ (map_hash * 0x9E3779B97F4A7C15llu)) & (cluster->cache_slots - 1));
+}
+
+
+static void cache_unlink(cluster_t *cluster, cache_item_t *item)
+{
+	assert(cluster);
+	assert(item);
+	
+	if (item->prev) { item->prev->next = item->next; }
+	else { cluster->cache_head = item->next; }
+	if (item->next) { item->next->prev = item->prev; }
+	else { cluster->cache_tail = item->prev; }
+	item->prev = NULL;
+	item->next = NULL;
+}
+
+
+static void cache_push_head(cluster_t *cluster, cache_item_t *item)
+{
+	assert(cluster);
+	assert(item);
+	assert(item->prev == NULL && item->next == NULL);
 	
-	assert(server->in_length == 0);
+	item->next = cluster->cache_head;
+	if (cluster->cache_head) { cluster->cache_head->prev = item; }
+	cluster->cache_head = item;
+	if (cluster->cache_tail == NULL) { cluster->cache_tail = item; }
+}
 
-	// Outer loop that keeps looping until there are no messages that we are waiting to receive.
-	int done = 0;
-	while (done == 0) {
+
+// remove the item from the cache and free it.
+static void cache_remove(cluster_t *cluster, cache_item_t *item)
+{
+	cache_item_t **ptr;
 	
-		assert(server->in_buffer);
-		assert(server->in_max > 0);
-		assert(server->in_length >= 0);
+	assert(cluster);
+	assert(item);
+	
+	ptr = &cluster->cache_table[cache_slot(cluster, item->map_hash, item->key_hash)];
+	while (*ptr != item) {
+		assert(*ptr);
+		ptr = &(*ptr)->chain;
+	}
+	*ptr = item->chain;
+	
+	cache_unlink(cluster, item);
+	if (item->data) { free(item->data); }
+	free(item);
+	
+	cluster->cache_count --;
+	assert(cluster->cache_count >= 0);
+}
 
-		avail = server->in_max - server->in_length;
-		
-		// if we have less than a buffer size available, then we need to expand the size of the buffer.
-		if (avail < DEFAULT_BUFFER_SIZE) {
-			assert(DEFAULT_BUFFER_SIZE > 0);
-			server->in_max += DEFAULT_BUFFER_SIZE;
-			assert(server->in_max >= (server->in_length + DEFAULT_BUFFER_SIZE));  // will catch if we roll over.
-			server->in_buffer = realloc(server->in_buffer, server->in_max);
-			assert(server->in_buffer);
-			avail = server->in_max - server->in_length;
-		}
-		
-		assert(avail >= DEFAULT_BUFFER_SIZE);
-		assert(offset >= 0);
-		assert(offset == 0 || offset < server->in_length);
-		
-// 		printf("recv: max=%d\n", avail);
-		
-		sent = recv(server->handle, server->in_buffer + server->in_length, avail, 0);
-		if (sent <= 0) {
-			// socket has shutdown
-			assert(0);
-		}
-		else {
-			assert(sent > 0);
-			assert(sent <= avail);
-			server->in_length += sent;
 
-// 			printf("recv: got=%d\n", sent);
-			
-			inner = 0;
-			while (inner == 0) {
-			
-				// now that we've got data, we need to make sure we have enough for the header.
-				if ((server->in_length - offset) < sizeof(raw_header_t)) {
-					// we dont have enough data yet, so we need to break out of the inner loop.
-					inner ++;
-				}
-				else {
-					
-					// Offset is used, because this function will process all the pending messages, 
-					// loading them into a single buffer that increases in size as needed.  The 
-					// messages are not moved around the buffer unnecessarily.   We might need to 
-					// have care that the buffer does not get too large.   
-					void *ptr = server->in_buffer + offset;
-					
-					header = ptr;
-					length = ntohl(header->length);
-					
-					ptr += sizeof(raw_header_t);
-					
-					if (length < 0) {
-						// if we get some obviously wrong data, we need to close the socket.
-						assert(0);
-					}
-					
-					if ((server->in_length - offset) >= sizeof(raw_header_t) + length) {
-						// we have enough data to parse this entire message.
-						
-						command = ntohs(header->command);
-						reply = ntohs(header->reply);
-						userid = ntohl(header->userid);
-						assert(userid >= 0);
-						
-						// if message is a reply, add it to the reply data.
-						if (reply > 0) {
-							
-							assert(cluster->message.id == userid);
-							assert(cluster->message.out.command == command);
-
-							if (length > 0) {
-								assert(cluster->message.in.max >= 0);
-								assert((cluster->message.in.max == 0) || (cluster->message.in.max > 0 && cluster->message.in.payload));
-								if (cluster->message.in.max < length) {
-									cluster->message.in.payload = realloc(cluster->message.in.payload, length);
-									cluster->message.in.max = length;
-								}
-								
-								assert(cluster->message.in.max > 0);
-								assert(cluster->message.in.payload);
-								memcpy(cluster->message.in.payload, ptr, length);
-								cluster->message.in.length = length;
-								assert(cluster->message.in.length <= cluster->message.in.max);
-							}
-							cluster->message.in.result = reply;
-							
-// 							printf("Received reply (%d) from command (%d), length=%d\n", msg->in.result, repcmd, length);
-
-						}
-						else {
-							// it is not a reply, it is a command.  We need to process that as well.
-					
-// 							printf("Command Received: %d\n", command); 
-							switch (command) {
-		
-// 								case COMMAND_HASHMASK:    process_hashmask(cluster, server, userid, length, ptr);  break;
-			
-								default:
-									printf("Unexpected command: cmd=%d\n", command);
-									assert(0);
-									break;
-								
-							}
-						}
-
-						// if we've processed all the data, and we dont have any partial messages at the end of 
-						// it, then we exit the loop.  If we do have a partial message, then we need to continue 
-						// waiting for more data.
-						
-						offset += (sizeof(raw_header_t) + length);
-						assert(offset <= server->in_max);
-						
-						if (offset == server->in_length) {
-							// we've processed all the messages in the buffer, and there are no more partial ones... so we are done.
-							offset = 0;
-							server->in_length = 0;
-							inner ++;
-							done = 1;
-						}
-					}
-				}
-			}
-		}
+static cache_item_t * cache_find(cluster_t *cluster, hash_t map_hash, hash_t key_hash)
+{
+	cache_item_t *item;
+	
+	assert(cluster);
+	
+	if (cluster->cache_max == 0) {
+		return(NULL);
 	}
 	
-	assert(server->in_length == 0);
+	item = cluster->cache_table[cache_slot(cluster, map_hash, key_hash)];
+	while (item && (item->map_hash != map_hash || item->key_hash != key_hash)) {
+		item = item->chain;
+	}
+	
+	return(item);
 }
 
 
-static int check_server_active(cluster_t *cluster, server_t *server)
+// the item has changed (or we are changing it), so any copy we have is no longer valid.
+static void cache_drop(cluster_t *cluster, hash_t map_hash, hash_t key_hash)
 {
+	cache_item_t *item;
+	
 	assert(cluster);
-	assert(server);
-	return(server->active);
+	
+	item = cache_find(cluster, map_hash, key_hash);
+	if (item) {
+		cache_remove(cluster, item);
+	}
 }
 
-static void log_data(int handle, char *tag, unsigned char *data, int length)
+
+static void cache_clear(cluster_t *cluster)
 {
-	int i;
-	int col;
-	char buffer[512];	// line buffer.
-	int len;  			// buffer length;
-	int start;
+	assert(cluster);
 	
-	assert(tag);
-	assert(data);
-	assert(length > 0);
+	while (cluster->cache_head) {
+		cache_remove(cluster, cluster->cache_head);
+	}
+	assert(cluster->cache_count == 0);
+	assert(cluster->cache_tail == NULL);
+}
 
-	i = 0;
-	while (i < length) {
 
-		start = i;
-		
-		// first put the tag in the buffer.
-		strncpy(buffer, tag, sizeof(buffer));
-		len = strlen(tag);
-		
-		// now put the line count.
-		len += sprintf(buffer+len, "[%d] %04X: ", handle, i);
-		
-		// now display the columns of text.
-		for (col=0; col<16; col++) {
+// return the cached copy of the item (if it is there, is the right type, and isn't too old).
+static cache_item_t * cache_lookup(cluster_t *cluster, hash_t map_hash, hash_t key_hash, int type)
+{
+	cache_item_t *item;
+	
+	assert(cluster);
+	assert(cluster->cache_max > 0);
+	
+	item = cache_find(cluster, map_hash, key_hash);
+	if (item && (item->type != type || (cluster->cache_max_age > 0 && time(NULL) - item->stored > cluster->cache_max_age))) {
+		cache_remove(cluster, item);
+		item = NULL;
+	}
+	
+	if (item) {
+		cluster->cache_stats.hits ++;
+		cache_unlink(cluster, item);
+		cache_push_head(cluster, item);
+	}
+	else {
+		cluster->cache_stats.misses ++;
+	}
+	
+	return(item);
+}
+
+
+// keep a copy of the item that was just read.  'data' is copied.
+static void cache_store(cluster_t *cluster, hash_t map_hash, hash_t key_hash, int type, long long value, const char *data, int length)
+{
+	cache_item_t *item;
+	int slot;
+	
+	assert(cluster);
+	assert(length >= 0);
+	assert(length == 0 || data);
+	
+	if (cluster->cache_max == 0) {
+		return;
+	}
+	
+	cache_drop(cluster, map_hash, key_hash);
+	
+	if (cluster->cache_count >= cluster->cache_max) {
+		assert(cluster->cache_tail);
+		cache_remove(cluster, cluster->cache_tail);
+		cluster->cache_stats.evictions ++;
+	}
+	
+	item = calloc(1, sizeof(cache_item_t));
+	assert(item);
+	item->map_hash = map_hash;
+	item->key_hash = key_hash;
+	item->type = type;
+	item->value = value;
+	if (data) {
+		item->data = malloc(length + 1);
+		assert(item->data);
+		memcpy(item->data, data, length);
+		item->data[length] = 0;
+		item->length = length;
+	}
+	item->stored = time(NULL);
+	
+	slot = cache_slot(cluster, map_hash, key_hash);
+	item->chain = cluster->cache_table[slot];
+	cluster->cache_table[slot] = item;
+	cache_push_head(cluster, item);
+	cluster->cache_count ++;
+}
+
+
+// the server has told us that an item has changed.
+static void process_invalidate(cluster_t *cluster, server_t *server, int userid, int length, void *data)
+{
+	hash_t map_hash;
+	hash_t key_hash;
+	
+	assert(cluster);
+	assert(server);
+	
+	if (length >= (sizeof(hash_t) * 2)) {
+		map_hash = be64toh(*(uint64_t *) data);
+		key_hash = be64toh(*(uint64_t *) (data + sizeof(hash_t)));
+		if (cache_find(cluster, map_hash, key_hash)) {
+			cache_drop(cluster, map_hash, key_hash);
+			cluster->cache_stats.invalidations ++;
+		}
+	}
+	
+	reply_ok(cluster, server, COMMAND_INVALIDATE, userid);
+}
+
+
+
+
+// the server has told us about a bucket it has (or no longer has).  An empty HASHMASK is just a ping.
+static void process_hashmask(cluster_t *cluster, server_t *server, int userid, int length, void *data)
+{
+	hash_t mask;
+	hash_t hashmask;
+	int level;
+	
+	assert(cluster);
+	assert(server);
+	
+	if (length >= (sizeof(hash_t) * 2) + sizeof(int32_t)) {
+		mask = be64toh(*(uint64_t *) data);
+		hashmask = be64toh(*(uint64_t *) (data + sizeof(hash_t)));
+		level = (int32_t) be32toh(*(uint32_t *) (data + (sizeof(hash_t) * 2)));
+		
+		// when the cluster splits its buckets, everything we knew is out of date.  The servers will 
+		// tell us about the new buckets.
+		if (mask != cluster->mask || cluster->routes == NULL) {
+			if (cluster->routes) {
+				free(cluster->routes);
+			}
+			cluster->mask = mask;
+			cluster->routes = calloc(mask + 1, sizeof(server_t *));
+			assert(cluster->routes);
+		}
+		
+		hashmask &= mask;
+		if (level == 0) {
+			cluster->routes[hashmask] = server;
+		}
+		else if (cluster->routes[hashmask] == server) {
+			cluster->routes[hashmask] = NULL;
+		}
+	}
+	
+	reply_ok(cluster, server, COMMAND_HASHMASK, userid);
+}
+
+
+// the server that is the primary for the key, if we know it (and are connected to it).
+static server_t * route_server(cluster_t *cluster, hash_t key_hash)
+{
+	server_t *server;
+	
+	assert(cluster);
+	
+	if (cluster->routes == NULL) {
+		return(NULL);
+	}
+	
+	server = cluster->routes[key_hash & cluster->mask];
+	if (server && server->active && server->handle > 0) {
+		return(server);
+	}
+	
+	return(NULL);
+}
+
+
+
+
+// a complete message has been received from the server.
+static void process_message(cluster_t *cluster, server_t *server, short command, short reply, int userid, int length, void *data)
+{
+	request_t *request;
+	
+	assert(cluster);
+	assert(server);
+	assert(length >= 0);
+	
+	// if message is a reply, it is either for the request we are waiting for, or one of the async 
+	// requests.
+	if (reply > 0) {
+		
+		// the server says which framing it agreed to in the HELLO reply.  Everything after it (even 
+		// the rest of what we have already read) uses that.
+		if (command == COMMAND_HELLO && reply == REPLY_OK && length >= sizeof(int)) {
+			server->protocol = ntohl(*(int *) data);
+		}
+		
+		if (cluster->message.out.command > 0 && cluster->message.id == userid) {
+			assert(cluster->message.out.command == command);
+			message_reply(&cluster->message, reply, length, data);
+		}
+		else {
+			request = request_find(cluster, userid);
+			if (request == NULL || request->message.in.result != 0) {
+				if (cluster->debug) {
+					printf("Unexpected reply: cmd=%d, reply=%d, userid=%d\n", command, reply, userid);
+				}
+			}
+			else {
+				assert(request->message.out.command == command);
+				message_reply(&request->message, reply, length, data);
+				request_finished(cluster, request);
+			}
+		}
+	}
+	else {
+		// it is not a reply, it is a command.  We need to process that as well.
+		switch (command) {
+
+			// this library does not send single requests to copies of the hot keys.
+			case COMMAND_HASHMASK:    process_hashmask(cluster, server, userid, length, data);  break;
+			case COMMAND_HOTKEY:      reply_ok(cluster, server, command, userid);  break;
+			
+			case COMMAND_INVALIDATE:  process_invalidate(cluster, server, userid, length, data);  break;
+
+			default:
+				printf("Unexpected command: cmd=%d\n", command);
+				assert(0);
+				break;
+		}
+	}
+}
+
+
+// Read whatever data has arrived from the server, and process all the complete messages.  If 
+// 'wait' is non-zero, this will block until some data arrives.  Since the server details are not 
+// exposed outside of the library, this is an internal function.   Developers will need to call 
+// cluster_pending or cluster_poll which will process pending data on all the connected servers.  
+// Returns -1 if the connection was closed.
+static int server_read(cluster_t *cluster, server_t *server, int wait)
+{
+	int offset = 0;
+	int avail;
+	ssize_t got;
+	int header_size;
+	int command;
+	int reply;
+	int userid;
+	int length;
+	void *ptr;
+	
+	assert(cluster);
+	assert(server);
+	assert(server->handle > 0);
+	assert(server->in_buffer);
+	assert(server->in_max > 0);
+	assert(server->in_length >= 0);
+
+	avail = server->in_max - server->in_length;
+	
+	// if we have less than a buffer size available, then we need to expand the size of the buffer.
+	if (avail < DEFAULT_BUFFER_SIZE) {
+		assert(DEFAULT_BUFFER_SIZE > 0);
+		server->in_max += (server->in_max > DEFAULT_BUFFER_SIZE * 64) ? server->in_max : DEFAULT_BUFFER_SIZE;
+		assert(server->in_max >= (server->in_length + DEFAULT_BUFFER_SIZE));  // will catch if we roll over.
+		server->in_buffer = realloc(server->in_buffer, server->in_max);
+		assert(server->in_buffer);
+		avail = server->in_max - server->in_length;
+	}
+	assert(avail >= DEFAULT_BUFFER_SIZE);
+	
+	got = recv(server->handle, server->in_buffer + server->in_length, avail, wait ? 0 : MSG_DONTWAIT);
+	if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return(0);
+	}
+	else if (got <= 0) {
+		// socket has shutdown
+		server_closed(cluster, server);
+		return(-1);
+	}
+	
+	assert(got <= avail);
+	server->in_length += got;
+
+	// The messages are processed where they are in the buffer.  If there is a partial message at 
+	// the end, it is moved to the start of the buffer when we are done.
+	while (server->handle > 0) {
+		ptr = server->in_buffer + offset;
+		header_size = frame_decode(server, ptr, server->in_length - offset, &command, &reply, &userid, &length);
+		if (header_size == 0) {
+			// we dont have the whole header yet.
+			break;
+		}
+		
+		if (header_size < 0 || length < 0) {
+			// if we get some obviously wrong data, we need to close the socket.
+			assert(0);
+		}
+		
+		if ((server->in_length - offset) < header_size + length) {
+			// we dont have the whole message yet.
+			break;
+		}
+		
+		process_message(cluster, server, command, reply, userid, length, ptr + header_size);
+		
+		offset += (header_size + length);
+		assert(offset <= server->in_length);
+	}
+	
+	if (server->handle > 0 && offset > 0) {
+		if (offset < server->in_length) {
+			memmove(server->in_buffer, server->in_buffer + offset, server->in_length - offset);
+		}
+		server->in_length -= offset;
+	}
+	
+	return(0);
+}
+
+
+static int check_server_active(cluster_t *cluster, server_t *server)
+{
+	assert(cluster);
+	assert(server);
+	return(server->active);
+}
+
+static void log_data(int handle, char *tag, unsigned char *data, int length)
+{
+	int i;
+	int col;
+	char buffer[512];	// line buffer.
+	int len;  			// buffer length;
+	int start;
+	
+	assert(tag);
+	assert(data);
+	assert(length > 0);
+
+	i = 0;
+	while (i < length) {
+
+		start = i;
+		
+		// first put the tag in the buffer.
+		strncpy(buffer, tag, sizeof(buffer));
+		len = strlen(tag);
+		
+		// now put the line count.
+		len += sprintf(buffer+len, "[%d] %04X: ", handle, i);
+		
+		// now display the columns of text.
+		for (col=0; col<16; col++) {
 			if (i < length && col==7) {
 				len += sprintf(buffer+len, "%02x-", data[i]);
 			}
@@ -878,801 +1636,2788 @@ static void log_data(int handle, char *tag, unsigned char *data, int length)
 }
 
 
-
-//--------------------------------------------------------------------------------------------------
-// the included message has the details for the reply, so we need to just send the data, and then 
-// wait for the replies to come in (if we are waiting for them).
-static int send_request(cluster_t *cluster)
+
+//--------------------------------------------------------------------------------------------------
+// Choose the server to send the message to.  Reads that can be answered by a backup are spread over 
+// the servers by starting at a different one each time.  Everything else starts with the first 
+// server.
+static server_t * choose_server(cluster_t *cluster)
+{
+	server_t *server;
+	int start = 0;
+	int tries;
+	
+	assert(cluster);
+	
+	if (cluster->message.out.spread && cluster->server_count > 0) {
+		start = cluster->read_next % cluster->server_count;
+		cluster->read_next = start + 1;
+	}
+	
+	for (tries = 0; tries < cluster->server_count; tries ++) {
+		server = cluster->servers[(start + tries) % cluster->server_count];
+		if (server && check_server_active(cluster, server)) {
+			assert(server->handle > 0);
+			return(server);
+		}
+	}
+	
+	return(NULL);
+}
+
+
+// send the data to the server.  Returns 0 if it was all sent.
+static int server_send(cluster_t *cluster, server_t *server, const void *data, int length)
+{
+	ssize_t sent;
+	int datasent = 0;
+	
+	assert(cluster);
+	assert(server);
+	assert(data);
+	assert(length > 0);
+	
+	if (cluster->debug) {
+		log_data(0, "SEND ", (unsigned char *) data, length);
+	}
+	
+	while (datasent < length && server->handle > 0) {
+		sent = send(server->handle, data + datasent, length - datasent, 0);
+		assert(sent != 0);
+		if (sent < 0) {
+			if (errno != EINTR) {
+				server_closed(cluster, server);
+				assert(server->active == 0);
+			}
+		}
+		else {
+			assert(sent <= length - datasent);
+			datasent += sent;
+		}
+	}
+	
+	return(datasent == length ? 0 : -1);
+}
+
+
+// send any async requests that are waiting in the buffer.
+static int server_flush(cluster_t *cluster, server_t *server)
+{
+	int result = 0;
+	int length;
+	
+	assert(cluster);
+	assert(server);
+	
+	if (server->out_length > 0 && server->handle > 0) {
+		// the last request that is being sent is the end of the batch.
+		if (server->out_last >= 0) {
+			server->out_buffer[server->out_last] &= ~FRAME_BATCH;
+			server->out_last = -1;
+		}
+		
+		length = server->out_length;
+		server->out_length = 0;
+		result = server_send(cluster, server, server->out_buffer, length);
+	}
+	
+	return(result);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// the included message has the details for the request, so we need to just send the data, and then 
+// wait for the reply to come in.  Any replies to async requests that arrive in the meantime are 
+// stored with the request.  Returns 0 if the reply was received.
+static int send_request(cluster_t *cluster)
+{
+	server_t *server;
+
+	assert(cluster);
+
+	assert(cluster->message.out.length >= sizeof(raw_header_t));
+	assert(cluster->message.out.max >= cluster->message.out.length);
+	assert(cluster->message.out.data);
+	assert(cluster->message.in.result == 0);
+
+	// since we are sending a request, then the currently known incoming data, should be empty.
+	assert(cluster->message.in.length == 0);
+	assert(cluster->message.in.max >= 0);
+	cluster->message.in.offset = 0;
+	
+	server = choose_server(cluster);
+	if (server == NULL) {
+		return(-1);
+	}
+	
+	return(send_request_server(cluster, server));
+}
+
+
+// send the message that has been built to a particular server, and wait for the reply.
+static int send_request_server(cluster_t *cluster, server_t *server)
+{
+	int start;
+
+	assert(cluster);
+	assert(server);
+	assert(cluster->message.out.length >= sizeof(raw_header_t));
+	assert(cluster->message.in.result == 0);
+	
+	// async requests that are waiting to be sent need to go first, so that things happen in the 
+	// order they were asked for.
+	if (server_flush(cluster, server) != 0) {
+		return(-1);
+	}
+	
+	start = frame_header(server, cluster->message.out.data, 0);
+	if (server_send(cluster, server, cluster->message.out.data + start, cluster->message.out.length - start) != 0) {
+		return(-1);
+	}
+	
+	while (cluster->message.in.result == 0 && server->handle > 0) {
+		server_read(cluster, server, 1);
+	}
+	
+	return(cluster->message.in.result == 0 ? -1 : 0);
+}
+
+
+// send the message that has been built to a particular server, without waiting for the reply.  The 
+// request is added to the table, and its id is returned (or 0 if it could not be sent).
+static OC_REQUEST send_async_server(cluster_t *cluster, server_t *server)
+{
+	request_t *request;
+	OC_REQUEST id;
+	int start;
+	int length;
+	
+	assert(cluster);
+	assert(cluster->message.out.length >= sizeof(raw_header_t));
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.id > 0);
+	
+	// dont let the number of requests waiting for replies grow without limit.
+	while (cluster->request_waiting >= ASYNC_MAX_WAITING) {
+		cluster_poll(cluster, -1);
+	}
+	
+	// waiting wont help if the caller isn't collecting the results.
+	if (cluster->request_count >= ASYNC_MAX_REQUESTS) {
+		message_done(cluster);
+		return(0);
+	}
+	
+	if (server == NULL || server->handle <= 0) {
+		message_done(cluster);
+		return(0);
+	}
+	
+	// add it to the buffer for the server.  It is marked as part of a batch, until we know it is the 
+	// last one.
+	start = frame_header(server, cluster->message.out.data, FRAME_BATCH);
+	length = cluster->message.out.length - start;
+	if (server->out_length + length > server->out_max) {
+		server->out_max = server->out_length + length + ASYNC_FLUSH_SIZE;
+		server->out_buffer = realloc(server->out_buffer, server->out_max);
+		assert(server->out_buffer);
+	}
+	memcpy(server->out_buffer + server->out_length, cluster->message.out.data + start, length);
+	if (server->protocol == PROTOCOL_V2) {
+		server->out_last = server->out_length;
+	}
+	server->out_length += length;
+	
+	request = calloc(1, sizeof(request_t));
+	assert(request);
+	request->message.id = cluster->message.id;
+	request->message.out.command = cluster->message.out.command;
+	request->server = server;
+	request->released = 0;
+	request_add(cluster, request);
+	cluster->request_waiting ++;
+	
+	id = cluster->message.id;
+	message_done(cluster);
+	
+	// if the send fails, the request is failed along with the others on that connection.
+	if (server->out_length >= ASYNC_FLUSH_SIZE) {
+		server_flush(cluster, server);
+	}
+	
+	return(id);
+}
+
+
+// send the message that has been built, without waiting for the reply.
+static OC_REQUEST send_async(cluster_t *cluster)
+{
+	assert(cluster);
+	return(send_async_server(cluster, choose_server(cluster)));
+}
+
+
+static void message_new(cluster_t *cluster, short int command)
+{
+	raw_header_t *header;
+	
+	assert(cluster);
+	assert(cluster->message.out.command == 0);
+	cluster->message.out.command = command;
+	
+	// every request gets a new id, so that its reply can be matched up with it.
+	// the ids are 16 bits (to fit in the v2 header), so they wrap around.  One that is still in use 
+	// by a request that hasn't been collected is skipped.  There will always be one free, because 
+	// send_async_server() wont let more than ASYNC_MAX_REQUESTS be held at a time.
+	assert(cluster->request_count < REQUEST_ID_MAX);
+	do {
+		cluster->next_id ++;
+		if (cluster->next_id > REQUEST_ID_MAX) {
+			cluster->next_id = 1;
+		}
+	} while (request_find(cluster, cluster->next_id));
+	cluster->message.id = cluster->next_id;
+
+	
+	if (cluster->message.out.data == NULL) {
+		assert(OPENCLUSTER_DEFAULT_BUFFSIZE >= sizeof(raw_header_t));
+		cluster->message.out.data = malloc(OPENCLUSTER_DEFAULT_BUFFSIZE);
+		cluster->message.out.max = OPENCLUSTER_DEFAULT_BUFFSIZE;
+		assert(cluster->message.out.data);
+	}
+	
+	cluster->message.out.length = sizeof(raw_header_t);
+	
+	assert(cluster->message.out.data);
+	header = cluster->message.out.data;
+
+	header->command = htobe16(command);
+	header->reply   = 0;
+	header->userid  = htobe32(cluster->message.id);
+	header->length  = htobe32(0);
+
+	assert(cluster->message.in.result == 0);
+}
+
+static void message_done(cluster_t *cluster)
+{
+	assert(cluster);
+	assert(cluster->message.out.command > 0);
+	cluster->message.out.command = 0;
+	cluster->message.out.spread = 0;
+	cluster->message.in.result = 0;
+	cluster->message.in.length = 0;
+}
+
+
+
+// add a block of binary data (which is sent the same as a string) to the outgoing message.
+static void msg_setbin(cluster_t *cluster, const char *data, int length) 
+{
+	raw_header_t *header;
+	int *ptr;
+	char * sptr;
+	
+	assert(cluster);
+	assert(length >= 0);
+	assert(length == 0 || data);
+
+	// make sure there is enough space in the buffer.
+	while ((cluster->message.out.length + sizeof(int) + length) > cluster->message.out.max) {
+		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
+		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	}
+
+	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
+	ptr[0] = htonl(length);
+
+	if (length > 0) {
+		sptr = ((void*)cluster->message.out.data + cluster->message.out.length + sizeof(int));
+		memcpy(sptr, data, length);
+	}
+	
+	cluster->message.out.length += (sizeof(int) + length);
+	
+	// add the msg details to the outgoing payload buffer.
+	assert(cluster->message.out.max >= sizeof(raw_header_t));
+	assert(cluster->message.out.data);
+	
+	header = cluster->message.out.data;
+	header->length = htonl(cluster->message.out.length - sizeof(raw_header_t));
+}
+
+
+static void msg_setstr(cluster_t *cluster, const char *str) 
+{
+	assert(cluster);
+
+	if (str) { msg_setbin(cluster, str, strlen(str)); }
+	else { msg_setbin(cluster, NULL, 0); }
+}
+
+
+// make room for 'length' more bytes at the end of the outgoing message, and return a pointer to 
+// them.  This is for the generated encoders (codec.h), which write a whole message at once.
+static char * msg_reserve(cluster_t *cluster, int length)
+{
+	raw_header_t *header;
+	char *ptr;
+	
+	assert(cluster);
+	assert(length >= 0);
+	
+	if ((cluster->message.out.length + length) > cluster->message.out.max) {
+		cluster->message.out.max = cluster->message.out.length + length + DEFAULT_BUFFER_SIZE;
+		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max);
+		assert(cluster->message.out.data);
+	}
+	
+	ptr = cluster->message.out.data + cluster->message.out.length;
+	cluster->message.out.length += length;
+	
+	header = cluster->message.out.data;
+	header->length = htobe32(cluster->message.out.length - sizeof(raw_header_t));
+	
+	return(ptr);
+}
+
+
+// the payloads of the most common requests are built with the generated encoders.
+static void msg_encode_setint(cluster_t *cluster, hash_t map_hash, hash_t key_hash, int expires, long long value)
+{
+	msg_set_int_t msg = {
+		.map_hash = map_hash,
+		.key_hash = key_hash,
+		.expires = expires,
+		.value = value,
+	};
+	int size = msg_set_int_size(&msg);
+	msg_set_int_encode(msg_reserve(cluster, size), size, &msg);
+}
+
+
+static void msg_encode_setbin(cluster_t *cluster, hash_t map_hash, hash_t key_hash, int expires, const char *value, int length)
+{
+	msg_set_str_t msg = {
+		.map_hash = map_hash,
+		.key_hash = key_hash,
+		.expires = expires,
+		.value = value,
+		.value_len = length,
+	};
+	int size = msg_set_str_size(&msg);
+	msg_set_str_encode(msg_reserve(cluster, size), size, &msg);
+}
+
+
+// if stale values are allowed, the GETs can go to any server that has a copy.
+static void msg_encode_getint(cluster_t *cluster, hash_t map_hash, hash_t key_hash)
+{
+	msg_get_int_t msg = {
+		.map_hash = map_hash,
+		.key_hash = key_hash,
+		.max_stale = cluster->max_stale >= 0 ? cluster->max_stale : -1,
+	};
+	int size = msg_get_int_size(&msg);
+	msg_get_int_encode(msg_reserve(cluster, size), size, &msg);
+	if (cluster->max_stale >= 0) {
+		cluster->message.out.spread = 1;
+	}
+}
+
+
+static void msg_encode_getstr(cluster_t *cluster, hash_t map_hash, hash_t key_hash)
+{
+	msg_get_str_t msg = {
+		.map_hash = map_hash,
+		.key_hash = key_hash,
+		.max_length = 0,		// unlimited string size.
+		.max_stale = cluster->max_stale >= 0 ? cluster->max_stale : -1,
+	};
+	int size = msg_get_str_size(&msg);
+	msg_get_str_encode(msg_reserve(cluster, size), size, &msg);
+	if (cluster->max_stale >= 0) {
+		cluster->message.out.spread = 1;
+	}
+}
+
+
+static void msg_encode_getchunk(cluster_t *cluster, hash_t map_hash, hash_t key_hash, int offset)
+{
+	msg_get_chunk_t msg = {
+		.map_hash = map_hash,
+		.key_hash = key_hash,
+		.offset = offset,
+		.max_length = CHUNK_SIZE,
+		.max_stale = cluster->max_stale >= 0 ? cluster->max_stale : -1,
+	};
+	int size = msg_get_chunk_size(&msg);
+	msg_get_chunk_encode(msg_reserve(cluster, size), size, &msg);
+}
+
+
+// a copy of a string (or binary value) from a reply, with a null on the end.
+static char * msg_copydata(const char *data, int length)
+{
+	char *str;
+	
+	assert(length >= 0);
+	str = malloc(length + 1);
+	assert(str);
+	if (length > 0) {
+		memcpy(str, data, length);
+	}
+	str[length] = 0;
+	return(str);
+}
+
+
+// a copy of the string value from a DATA_STRING reply, with a null on the end.  If the server sent 
+// it compressed, it is expanded.  Returns NULL if it couldn't be expanded.
+static char * msg_copyvalue(const msg_data_str_t *reply, int *length)
+{
+	uLongf size;
+	char *str;
+	
+	assert(reply);
+	assert(length);
+	
+	if (reply->raw_length <= 0) {
+		*length = reply->value_len;
+		return(msg_copydata(reply->value, reply->value_len));
+	}
+	
+	str = malloc(reply->raw_length + 1);
+	assert(str);
+	size = reply->raw_length;
+	if (uncompress((Bytef *) str, &size, (const Bytef *) reply->value, reply->value_len) != Z_OK || size != reply->raw_length) {
+		free(str);
+		*length = 0;
+		return(NULL);
+	}
+	str[size] = 0;
+	*length = size;
+	return(str);
+}
+
+
+
+// tell the server whether we want to know when items change.  The reply isn't waited for (it will 
+// be ignored when it arrives).
+static void server_invalidations(cluster_t *cluster, server_t *server, int enabled)
+{
+	char buffer[sizeof(raw_header_t) + sizeof(int32_t)];
+	raw_header_t *raw;
+	int32_t *ptr;
+	
+	assert(cluster);
+	assert(server);
+	assert(server->handle > 0);
+	
+	raw = (raw_header_t *) buffer;
+	raw->command = htobe16(COMMAND_INVALIDATIONS);
+	raw->reply = 0;
+	raw->userid = 0;
+	raw->length = htobe32(sizeof(int32_t));
+	ptr = (int32_t *) (buffer + sizeof(raw_header_t));
+	*ptr = htobe32(enabled ? 1 : 0);
+	
+	server_send(cluster, server, buffer, sizeof(buffer));
+}
+
+
+void cluster_cache(OPENCLUSTER cluster_ptr, int entries, int max_age)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+	int enabled;
+	int i;
+	
+	assert(cluster);
+	assert(entries >= 0);
+	assert(max_age >= 0);
+	
+	enabled = cluster->cache_max > 0;
+	
+	cache_clear(cluster);
+	if (cluster->cache_table) {
+		free(cluster->cache_table);
+		cluster->cache_table = NULL;
+		cluster->cache_slots = 0;
+	}
+	
+	cluster->cache_max = entries;
+	cluster->cache_max_age = max_age;
+	if (entries > 0) {
+		cluster->cache_slots = 1;
+		while (cluster->cache_slots < entries * CACHE_TABLE_RATIO) {
+			cluster->cache_slots <<= 1;
+		}
+		cluster->cache_table = calloc(cluster->cache_slots, sizeof(cache_item_t *));
+		assert(cluster->cache_table);
+	}
+	
+	// the servers we are already connected to need to be told.  New connections are told when 
+	// they are made.
+	if (enabled != (entries > 0)) {
+		for (i=0; i<cluster->server_count; i++) {
+			server = cluster->servers[i];
+			if (server && server->handle > 0) {
+				server_invalidations(cluster, server, entries > 0);
+			}
+		}
+	}
+}
+
+
+void cluster_cache_stats(OPENCLUSTER cluster_ptr, cluster_cache_stats_t *stats)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(stats);
+	
+	*stats = cluster->cache_stats;
+	stats->entries = cluster->cache_count;
+}
+
+
+
+static int server_connect(cluster_t *cluster, server_t *server)
+{
+	int res=-1;
+	
+	assert(cluster);
+	assert(server);
+	
+	// if server has a handle, then we exit, because we are already connected to it.
+	if (server->handle < 0) {
+		
+		assert(server->active == 0);
+		assert(server->closing == 0);
+		assert(server->shutdown == 0);
+		
+		assert(server->conninfo);
+		const char *remote_addr = conninfo_remoteaddr(server->conninfo);
+		assert(remote_addr);
+		
+		server->handle = sock_connect(remote_addr);
+		assert(res < 0);
+		
+		if (server->handle < 0) {
+			res = -1;
+			assert(server->active == 0);
+		}
+		else {
+			assert(res < 0);
+
+			// the HELLO always goes out in v1 framing, and asks to use v2 after it.
+			server->protocol = PROTOCOL_V1;
+			server->out_last = -1;
+			message_new(cluster, COMMAND_HELLO);
+			msg_setstr(cluster, NULL);
+			msg_setint(cluster, PROTOCOL_V2);
+			msg_setint(cluster, FEATURE_COMPRESSED_VALUES);
+			
+			if (cluster->debug) {
+				log_data(0, "output ", cluster->message.out.data, cluster->message.out.length);
+			}
+
+			// temporarily set the server as active.
+			server->active = 1;
+
+			
+			// send the request and receive the reply.  It has to go to this server, not whichever one 
+			// would be chosen for a normal request.
+			assert(cluster->message.out.length > 0);
+			if (send_request_server(cluster, server) != 0) {
+				// some error occured.  SHould handle this some how.
+				server->active = 0;
+
+				assert(0);
+			}
+			else {
+				// check the result.
+				
+				// need to mark the server as active.
+				assert(server->active == 1);
+				
+				res = 0;
+			}
+			
+			message_done(cluster);
+			
+			// if we are keeping copies of items, the server needs to tell us when they change.
+			if (res == 0 && cluster->cache_max > 0 && server->handle > 0) {
+				server_invalidations(cluster, server, 1);
+			}
+		}
+	}
+
+	return(res);
+}
+
+
+// This function is used to make sure there is no pending commands in any of the server connections.  
+// Any buffered async requests are sent, and the replies that have already arrived are processed.
+void cluster_pending(OPENCLUSTER cluster_ptr) 
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+	int i;
+	
+	assert(cluster);
+	assert(cluster->server_count > 0);
+	assert(cluster->servers);
+	
+	for (i=0; i < cluster->server_count; i++) {
+		server = cluster->servers[i];
+		if (server != NULL && server->handle > 0) {
+			if (server_flush(cluster, server) == 0) {
+				server_read(cluster, server, 0);
+			}
+		}
+	}
+}
+
+
+// do nothing if we are already connected.  If we are not connected, then 
+// connect to the first server in the list.  Since we are setup for blocking 
+// activity, we will wait until the connect succeeds or fails.
+int cluster_connect(OPENCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+	int try = 0;
+	int connected = 0;
+	int res;
+
+	assert(cluster->servers);
+	assert(cluster->server_count > 0);
+
+	for (try=0; try < cluster->server_count && connected == 0; try++) {
+		server = cluster->servers[try];
+		assert(server);
+
+		res = server_connect(cluster, server);
+		if (res == 0) {
+			connected ++;
+		}
+	}
+	
+	return(connected);
+}
+
+
+static void server_disconnect(cluster_t *cluster, server_t *server)
+{
+	assert(cluster);
+	assert(server);
+	
+	// if we are connected to the server, send the GOODBYE request and receive the reply.
+	if (server->handle >= 0) {
+		// send a GOODBYE command  first.
+		message_new(cluster, COMMAND_GOODBYE);
+		
+		assert(cluster->message.in.result == 0);
+		assert(cluster->message.out.length > 0);
+		if (send_request(cluster) != 0) {
+			assert(0);
+			
+			// what?
+		}
+		
+		message_done(cluster);
+		
+		// close the connection.  Any async requests that are still waiting will fail.
+		if (server->handle > 0) {
+			server_closed(cluster, server);
+		}
+	}
+}
+
+void cluster_disconnect(OPENCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+	int try = 0;
+
+	assert(cluster);
+	assert(cluster->servers);
+	assert(cluster->server_count > 0);
+	
+	assert(cluster->disconnecting == 0);
+	cluster->disconnecting = 1;
+	
+	for (try=0; try < cluster->server_count; try++) {
+	
+		server = cluster->servers[try];
+		if (server) {
+			server_disconnect(cluster, server);
+		}
+	}
+}
+
+#define FNV_BASE_LONG   14695981039346656037llu
+#define FNV_PRIME_LONG  1099511628211llu                      
+
+
+
+// FNV hash.  Public domain function converted from public domain Java version.
+// TODO: modify this to a macro to improve performance a little.
+hash_t cluster_hash_bin(const char *str, const int length)
+{
+	register int i;
+	register hash_t hash = FNV_BASE_LONG;
+
+	for (i=0; i<length; i++)  {
+		hash ^= (unsigned int)str[i];
+		hash *= FNV_PRIME_LONG;
+	}
+
+	return(hash);
+}
+
+
+hash_t cluster_hash_str(const char *str)
+{
+	return(cluster_hash_bin(str, strlen(str)));
+}
+
+
+hash_t cluster_hash_int(const int key)
+{
+	register int i;
+	register hash_t hash = FNV_BASE_LONG;
+	union {
+		int nkey;
+		char str[sizeof(int)];
+	} match;
+
+	
+	assert(sizeof(key) == 4);
+	assert(sizeof(match) == sizeof(key));
+	
+	match.nkey = htobe32(key);
+
+	for (i=0; i<sizeof(key); i++)  {
+		hash ^= (unsigned int)match.str[i];
+		hash *= FNV_PRIME_LONG;
+	}
+
+	return(hash);
+}
+
+
+hash_t cluster_hash_long(const long long key)
+{
+	register int i;
+	register hash_t hash = FNV_BASE_LONG;
+	union {
+		long long nkey;
+		char str[sizeof(long long)];
+	} match;
+
+	assert(sizeof(key) == 8);
+	assert(sizeof(match) == sizeof(key));
+	
+	match.nkey = htobe64(key);
+
+	for (i=0; i<sizeof(key); i++)  {
+		hash ^= (unsigned int)match.str[i];
+		hash *= FNV_PRIME_LONG;
+	}
+
+	return(hash);
+}
+
+
+
+static void msg_setint(cluster_t *cluster, const int value) 
+{
+	raw_header_t *header;
+	int *ptr;
+	
+	assert(cluster);
+	
+	// make sure there is enough space in the buffer.
+	if ((cluster->message.out.length + sizeof(int)) > cluster->message.out.max) {
+		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
+		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	}
+
+	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
+	ptr[0] = htonl(value);
+	cluster->message.out.length += sizeof(int);
+	
+	// add the msg details to the outgoing payload buffer.
+	assert(cluster->message.out.max >= sizeof(raw_header_t));
+	assert(cluster->message.out.data);
+	
+	header = cluster->message.out.data;
+	header->length = htonl(cluster->message.out.length - sizeof(raw_header_t));
+}
+
+
+static void msg_sethash(cluster_t *cluster, hash_t value) 
+{
+	raw_header_t *header;
+	uint64_t *ptr;
+	
+	assert(cluster);
+	assert(sizeof(hash_t) == sizeof(uint64_t));
+	
+	// make sure there is enough space in the buffer.
+	if ((cluster->message.out.length + sizeof(value)) > cluster->message.out.max) {
+		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
+		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	}
+
+	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
+	ptr[0] = htobe64(value);
+	cluster->message.out.length += sizeof(value);
+	
+	// add the msg details to the outgoing payload buffer.
+	assert(cluster->message.out.max >= sizeof(raw_header_t));
+	assert(cluster->message.out.data);
+	
+	header = cluster->message.out.data;
+	header->length = htobe32(cluster->message.out.length - sizeof(raw_header_t));
+}
+
+
+static void msg_setlong(cluster_t *cluster, long long value) 
+{
+	raw_header_t *header;
+	long long *ptr;
+	
+	assert(cluster);
+	assert(sizeof(long long) == sizeof(uint64_t));
+	
+	// make sure there is enough space in the buffer.
+	if ((cluster->message.out.length + sizeof(value)) > cluster->message.out.max) {
+		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
+		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	}
+
+	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
+	ptr[0] = htobe64(value);
+	cluster->message.out.length += sizeof(value);
+	
+	// add the msg details to the outgoing payload buffer.
+	assert(cluster->message.out.max >= sizeof(raw_header_t));
+	assert(cluster->message.out.data);
+	
+	header = cluster->message.out.data;
+	header->length = htobe32(cluster->message.out.length - sizeof(raw_header_t));
+}
+
+
+
+
+
+
+
+
+int cluster_setint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const int value, const int expires)
+{
+	cluster_t *cluster = cluster_ptr;
+	int res = 0;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SET_INT);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_encode_setint(cluster, map_hash, key_hash, expires, value);
+
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);		// this will wait for the reply, so we should have the result.
+
+	// now we've got a reply, we free the message, because there is no 
+	assert(cluster->message.in.result == REPLY_OK);
+	message_done(cluster);
+	
+	return(res);
+}
+
+
+
+// same as cluster_setint, but for the full 64-bit value.
+int cluster_setlong(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const long long value, const int expires)
+{
+	cluster_t *cluster = cluster_ptr;
+	int res = 0;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SET_INT);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_encode_setint(cluster, map_hash, key_hash, expires, value);
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+
+	assert(cluster->message.in.result == REPLY_OK);
+	message_done(cluster);
+	
+	return(res);
+}
+
+
+
+int cluster_setstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int expires)
+{
+	cluster_t *cluster = cluster_ptr;
+	int res = 0;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SET_STRING);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_encode_setbin(cluster, map_hash, key_hash, expires, value, strlen(value));
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	// now we've got a reply, we free the message, because there is no 
+	assert(cluster->message.in.result == REPLY_OK);
+	
+	message_done(cluster);
+	
+	return(res);
+}
+
+
+
+// set a binary value.  It is stored the same as a string, but can contain nulls.
+int cluster_setbin(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires)
+{
+	cluster_t *cluster = cluster_ptr;
+	int res = 0;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	assert(length >= 0);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SET_STRING);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_encode_setbin(cluster, map_hash, key_hash, expires, value, length);
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	assert(cluster->message.in.result == REPLY_OK);
+	message_done(cluster);
+	
+	return(res);
+}
+
+
+// the number of bytes in the reply that haven't been read yet.  Replies that have a variable 
+// number of items in them (such as the batch replies) are checked with this before reading each one, 
+// so that a bad reply can't make us read past the end.
+static int msg_avail(message_t *msg)
+{
+	assert(msg);
+	assert(msg->in.offset >= 0);
+	return(msg->in.length - msg->in.offset);
+}
+
+
+// check that the next thing in the reply is a complete string (the length, and that many bytes).
+static int msg_avail_str(message_t *msg)
+{
+	int len;
+	
+	assert(msg);
+	
+	if (msg_avail(msg) < sizeof(uint32_t)) {
+		return(0);
+	}
+	len = ntohl(*(int *) ((void*)(msg->in.payload) + msg->in.offset));
+	return(len >= 0 && len <= msg_avail(msg) - (int) sizeof(uint32_t));
+}
+
+
+static void msg_getint(message_t *msg, int *value)
+{
+	int *ptr;
+	
+	assert(msg);
+	assert(value);
+	assert(msg->in.offset >= 0);
+	
+	ptr = ((void*)(msg->in.payload) + msg->in.offset);
+	*value = ntohl(*ptr);
+
+	msg->in.offset += sizeof(uint32_t);
+}
+
+static void msg_gethash(message_t *msg, hash_t *value)
+{
+	uint64_t *ptr;
+	
+	assert(msg);
+	assert(value);
+	assert(msg->in.offset >= 0);
+	assert(sizeof(hash_t) == sizeof(uint64_t));
+	
+	ptr = ((void*)(msg->in.payload) + msg->in.offset);
+	*value = be64toh(*ptr);
+
+	msg->in.offset += sizeof(uint64_t);
+}
+
+
+static void msg_getlong(message_t *msg, long long *value)
+{
+	uint64_t *ptr;
+	
+	assert(msg);
+	assert(value);
+	assert(msg->in.offset >= 0);
+	assert(sizeof(long long) == sizeof(uint64_t));
+	
+	ptr = ((void*)(msg->in.payload) + msg->in.offset);
+	*value = be64toh(*ptr);
+
+	msg->in.offset += sizeof(uint64_t);
+}
+
+
+
+
+static void msg_getstr(message_t *msg, char **value, int *length)
+{
+	int *ptr_len;
+	char *ptr_str;
+	int len;
+	char *str;
+
+	assert(msg);
+	assert(value);
+	assert(length);
+	assert(msg->in.offset >= 0);
+	
+	ptr_len = ((void*)(msg->in.payload) + msg->in.offset);
+	len = ntohl(*ptr_len);
+	msg->in.offset += sizeof(uint32_t);
+	
+	ptr_str = ((void*)(msg->in.payload) + msg->in.offset);
+	assert(len >= 0);
+	str = malloc(len + 1);
+	memcpy(str, ptr_str, len);
+	str[len] = 0;
+	msg->in.offset += len;
+	
+	*value = str;
+	*length = len;
+}
+
+
+
+int cluster_getint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
+{
+	cluster_t *cluster = cluster_ptr;
+	cache_item_t *item;
+	int value=0;
+	
+	assert(cluster);
+	
+	// use our own copy if we have one.  Any changes that the servers have told us about need to be 
+	// processed first.
+	if (cluster->cache_max > 0) {
+		cluster_pending(cluster);
+		item = cache_lookup(cluster, map_hash, key_hash, COMMAND_GET_INT);
+		if (item) {
+			return((int) item->value);
+		}
+	}
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_GET_INT);
+	msg_encode_getint(cluster, map_hash, key_hash);
+	
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	// now we've got a reply, we free the message, because there is no 
+	msg_data_int_t reply;
+	if (cluster->message.in.result == REPLY_DATA_INT 
+			&& msg_data_int_decode(cluster->message.in.payload, cluster->message.in.length, &reply) > 0) {
+		
+		assert(reply.map_hash == map_hash);
+		assert(reply.key_hash == key_hash);
+		
+		value = (int) reply.value;
+		cache_store(cluster, map_hash, key_hash, COMMAND_GET_INT, reply.value, NULL, 0);
+	}
+	else {
+		// need to do something else... since we didnt get the data.
+		assert(0);
+	}
+
+	message_done(cluster);
+
+	return(value);
+}
+
+
+char * cluster_getstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
+{
+	char *str = NULL;
+	int str_len;
+	cluster_t *cluster = cluster_ptr;
+	cache_item_t *item;
+	
+	assert(cluster);
+	
+	// use our own copy if we have one (the caller gets a copy of it to free).
+	if (cluster->cache_max > 0) {
+		cluster_pending(cluster);
+		item = cache_lookup(cluster, map_hash, key_hash, COMMAND_GET_STRING);
+		if (item) {
+			str = malloc(item->length + 1);
+			assert(str);
+			memcpy(str, item->data, item->length + 1);
+			return(str);
+		}
+	}
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_GET_STRING);
+	msg_encode_getstr(cluster, map_hash, key_hash);
+	
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+		
+	// now we've got a reply, we free the message, because there is no 
+	msg_data_str_t reply;
+	if (cluster->message.in.result == REPLY_DATA_STRING 
+			&& msg_data_str_decode(cluster->message.in.payload, cluster->message.in.length, &reply) > 0) {
+		
+		assert(reply.map_hash == map_hash);
+		assert(reply.key_hash == key_hash);
+		
+		str = msg_copyvalue(&reply, &str_len);
+		
+		assert(str);
+		assert(str_len > 0);
+		
+		cache_store(cluster, map_hash, key_hash, COMMAND_GET_STRING, 0, str, str_len);
+		
+		if (cluster->debug) {
+			printf("=== map_hash=%#llx, key_hash=%#llx\n", (long long unsigned) map_hash, (long long unsigned) key_hash);
+		}
+	}
+	else {
+		// the data was not available so we return a fail result.
+		assert(0);
+	}
+	
+	message_done(cluster);
+	
+	return(str);
+}
+
+
+// Add 'delta' to the counter on the server (creating it if it doesn't exist, with 'expires'), keeping 
+// it within 'min' and 'max'.  Returns 0 and the new value in 'result'.
+int cluster_incr_bounded(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const long long delta, const int expires, long long min, long long max, long long *result)
+{
+	cluster_t *cluster = cluster_ptr;
+	hash_t in_maphash;
+	hash_t in_keyhash;
+	hash_t in_valuehash;
+	long long value;
+	int res = -1;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	assert(min <= max);
+	
+	message_new(cluster, COMMAND_INCR);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_setlong(cluster, delta);
+	msg_setint(cluster, expires);
+	if (min != LLONG_MIN || max != LLONG_MAX) {
+		msg_setlong(cluster, min);
+		msg_setlong(cluster, max);
+	}
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	if (cluster->message.in.result == REPLY_DATA_INT) {
+		msg_gethash(&cluster->message, &in_maphash);
+		msg_gethash(&cluster->message, &in_keyhash);
+		msg_gethash(&cluster->message, &in_valuehash);
+		msg_getlong(&cluster->message, &value);
+		assert(in_maphash == map_hash);
+		assert(in_keyhash == key_hash);
+		if (result) { *result = value; }
+		res = 0;
+	}
+	
+	message_done(cluster);
+	return(res);
+}
+
+
+int cluster_incr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const long long delta, const int expires, long long *result)
+{
+	return(cluster_incr_bounded(cluster_ptr, map_hash, key_hash, delta, expires, LLONG_MIN, LLONG_MAX, result));
+}
+
+
+// process the reply to a SET_INT_IF or SET_STRING_IF that has been sent.
+static int setif_reply(cluster_t *cluster, hash_t *valuehash, long long *lcurrent, char **scurrent, int *slength)
+{
+	hash_t in_maphash;
+	hash_t in_keyhash;
+	long long value;
+	char *str;
+	int str_len;
+	int res = -1;
+	
+	assert(cluster);
+	assert(valuehash);
+	
+	if (cluster->message.in.result == REPLY_OK) {
+		msg_gethash(&cluster->message, valuehash);
+		res = 0;
+	}
+	else if (cluster->message.in.result == REPLY_DATA_INT) {
+		msg_gethash(&cluster->message, &in_maphash);
+		msg_gethash(&cluster->message, &in_keyhash);
+		msg_gethash(&cluster->message, valuehash);
+		msg_getlong(&cluster->message, &value);
+		if (lcurrent) { *lcurrent = value; }
+		res = 1;
+	}
+	else if (cluster->message.in.result == REPLY_DATA_STRING) {
+		msg_gethash(&cluster->message, &in_maphash);
+		msg_gethash(&cluster->message, &in_keyhash);
+		msg_gethash(&cluster->message, valuehash);
+		if (scurrent) {
+			msg_getstr(&cluster->message, &str, &str_len);
+			*scurrent = str;
+			if (slength) { *slength = str_len; }
+		}
+		res = 1;
+	}
+	
+	message_done(cluster);
+	return(res);
+}
+
+
+// Set the value if the stored value still has the hash in '*valuehash'.
+int cluster_setlong_if(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const long long value, const int expires, hash_t *valuehash, long long *current)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	assert(valuehash);
+	
+	message_new(cluster, COMMAND_SET_INT_IF);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_sethash(cluster, *valuehash);
+	msg_setint(cluster, expires);
+	msg_setlong(cluster, value);
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	return(setif_reply(cluster, valuehash, current, NULL, NULL));
+}
+
+
+int cluster_setbin_if(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires, hash_t *valuehash, char **current, int *current_length)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	assert(length >= 0);
+	assert(valuehash);
+	
+	if (current) { *current = NULL; }
+	
+	message_new(cluster, COMMAND_SET_STRING_IF);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_sethash(cluster, *valuehash);
+	msg_setint(cluster, expires);
+	msg_setbin(cluster, value, length);
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	return(setif_reply(cluster, valuehash, NULL, current, current_length));
+}
+
+
+// Get a string value, unless the server says it is the same as the copy we already have (in which 
+// case the reply is just the header).
+int cluster_getstr_ifchanged(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, hash_t *valuehash, char **value, int *length)
+{
+	cluster_t *cluster = cluster_ptr;
+	hash_t in_maphash;
+	hash_t in_keyhash;
+	int str_len = 0;
+	int res = -1;
+	
+	assert(cluster);
+	assert(valuehash);
+	assert(value);
+	
+	*value = NULL;
+	
+	message_new(cluster, COMMAND_GET_IF_CHANGED);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_sethash(cluster, *valuehash);
+	if (cluster->max_stale >= 0) {
+		msg_setint(cluster, cluster->max_stale);
+		cluster->message.out.spread = 1;
+	}
+	
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	if (cluster->message.in.result == REPLY_NOT_MODIFIED) {
+		res = 0;
+	}
+	else if (cluster->message.in.result == REPLY_DATA_STRING) {
+		msg_gethash(&cluster->message, &in_maphash);
+		msg_gethash(&cluster->message, &in_keyhash);
+		msg_gethash(&cluster->message, valuehash);
+		msg_getstr(&cluster->message, value, &str_len);
+		assert(in_maphash == map_hash);
+		assert(in_keyhash == key_hash);
+		res = 1;
+	}
+	
+	if (length) { *length = str_len; }
+	
+	message_done(cluster);
+	
+	return(res);
+}
+
+
+// Return the number of active servers in the cluster.
+int cluster_servercount(OPENCLUSTER cluster_ptr)
+{
+	int count = 0;
+	int i;
+	server_t *server;
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(cluster->server_count >= 0);
+	
+	for (i=0; i<cluster->server_count; i++) {
+		assert(cluster->servers);
+		if (cluster->servers[i]) {
+			server = cluster->servers[i];
+			if (server->active > 0) {
+				count ++;
+			}
+		}
+	}
+	
+	return(count);
+}
+
+
+
+hash_t cluster_setlabel(OPENCLUSTER cluster_ptr, char *label, int expires)
+{
+	cluster_t *cluster = cluster_ptr;
+	hash_t hash = 0;
+	
+	assert(cluster);
+	assert(label);
+	
+	// expiry should be 0 (never expires), or a positive number of seconds.
+	assert(expires >= 0);
+	if (expires < 0) { expires=0; }
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SET_KEYVALUE);
+	msg_setint(cluster, expires);
+	msg_setstr(cluster, label);
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	if (cluster->message.in.result == REPLY_KEYVALUE_HASH) {
+		
+		assert(cluster->message.in.length > 0);
+		assert(cluster->message.in.payload);
+
+		msg_gethash(&cluster->message, &hash);
+	}
+	else {
+		// how did we get a different result?
+		assert(0);
+	}
+	
+	message_done(cluster);
+	
+	return(hash);
+}
+
+
+const char * cluster_getlabel(OPENCLUSTER cluster_ptr, hash_t hash)
+{
+	char *str = NULL;
+	int str_len;
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_GET_KEYVALUE);
+	msg_sethash(cluster, hash);
+	
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+		
+	// now we've got a reply, we free the message, because there is no 
+	if(cluster->message.in.result == REPLY_KEYVALUE) {
+		msg_getstr(&cluster->message, &str, &str_len);
+
+		// we should not have an empty keyvalue.
+		assert(str);
+		assert(str_len > 0);
+		
+		if (cluster->debug) {
+			printf("=== hash=%#llx, keyvalue='%s'\n", (long long unsigned) hash, str);
+		}
+	}
+	else {
+		// the data was not available so we return a NULL result.
+		assert(str == NULL);
+	}
+	
+	message_done(cluster);
+	
+	return(str);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Async requests.  These build the same messages as the blocking functions, but return as soon as 
+// the request is buffered, with an id that is used to get the result later.  Requests are buffered 
+// and sent in batches, and any number of them can be waiting for replies, so the client isn't 
+// limited to one request per round trip.  Every request must be collected with one of the 
+// cluster_result functions, or given up with cluster_release().
+
+
+OC_REQUEST cluster_setlong_async(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const long long value, const int expires)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	
+	message_new(cluster, COMMAND_SET_INT);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_encode_setint(cluster, map_hash, key_hash, expires, value);
+	
+	return(send_async(cluster));
+}
+
+
+OC_REQUEST cluster_setint_async(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const int value, const int expires)
+{
+	return(cluster_setlong_async(cluster_ptr, map_hash, key_hash, value, expires));
+}
+
+
+OC_REQUEST cluster_setbin_async(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	assert(length >= 0);
+	
+	message_new(cluster, COMMAND_SET_STRING);
+	cache_drop(cluster, map_hash, key_hash);
+	msg_encode_setbin(cluster, map_hash, key_hash, expires, value, length);
+	
+	return(send_async(cluster));
+}
+
+
+OC_REQUEST cluster_setstr_async(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int expires)
 {
-	ssize_t sent, datasent;
-	int avail;
-	int status;
-	server_t *server;
-	int server_entry;
+	assert(value);
+	return(cluster_setbin_async(cluster_ptr, map_hash, key_hash, value, strlen(value), expires));
+}
 
+
+OC_REQUEST cluster_getint_async(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
+{
+	cluster_t *cluster = cluster_ptr;
+	
 	assert(cluster);
+	
+	message_new(cluster, COMMAND_GET_INT);
+	msg_encode_getint(cluster, map_hash, key_hash);
+	
+	return(send_async(cluster));
+}
 
-	assert(cluster->message.out.length >= sizeof(raw_header_t));
-	assert(cluster->message.out.max >= cluster->message.out.length);
-	assert(cluster->message.out.data);
-	assert(cluster->message.in.result == 0);
 
-	// since we are sending a request, then the currently known incoming data, should be empty.
-	assert(cluster->message.in.length == 0);
-	assert(cluster->message.in.max >= 0);
-	cluster->message.in.offset = 0;
+OC_REQUEST cluster_getstr_async(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
+{
+	cluster_t *cluster = cluster_ptr;
 	
-	status = 0;
-	for (server_entry = 0; status == 0 && server_entry < cluster->server_count; server_entry ++) {
-		server = cluster->servers[server_entry];
-		if (server) {
+	assert(cluster);
+	
+	message_new(cluster, COMMAND_GET_STRING);
+	msg_encode_getstr(cluster, map_hash, key_hash);
+	
+	return(send_async(cluster));
+}
 
-			if (check_server_active(cluster, server)) {
-				assert(server->handle > 0);
 
-				if (cluster->debug) {
-					log_data(0, "SEND ", cluster->message.out.data, cluster->message.out.length);
-				}
-				
-				// send the data
-				datasent = 0;
-				status = 0;
-				while (datasent < cluster->message.out.length && server->handle > 0) {
-					avail = cluster->message.out.length - datasent;
-					assert(avail > 0);
-					sent = send(server->handle, cluster->message.out.data + datasent, avail, 0);
-					assert(sent != 0);
-					assert(sent <= avail);
-					if (sent < 0) {
-						server_closed(cluster, server);
-						assert(server->active == 0);
-						assert(status == 0);
-					}
-					else {
-						datasent += sent;
-						status = 1;
-					}
-				}
-				
-				assert(datasent == cluster->message.out.length);
-				
-				// if we are going to be waiting for the data....
-				while (cluster->message.in.result == 0  && server->handle > 0) {
-					pending_server(cluster, server);
+// Send any async requests that are buffered, and process the replies that arrive within 'timeout' 
+// milliseconds (0 only processes what has already arrived, -1 waits until something arrives).  
+// Returns the number of async requests that are still waiting for replies.
+int cluster_poll(OPENCLUSTER cluster_ptr, int timeout)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server;
+	int count = 0;
+	int result;
+	int i;
+	
+	assert(cluster);
+	
+	for (i=0; i<cluster->server_count; i++) {
+		server = cluster->servers[i];
+		if (server && server->handle > 0) {
+			server_flush(cluster, server);
+		}
+	}
+	
+	if (cluster->request_waiting == 0) {
+		return(0);
+	}
+	
+	cluster->pollfds = realloc(cluster->pollfds, sizeof(struct pollfd) * cluster->server_count);
+	assert(cluster->pollfds);
+	
+	for (i=0; i<cluster->server_count; i++) {
+		server = cluster->servers[i];
+		if (server && server->handle > 0) {
+			cluster->pollfds[count].fd = server->handle;
+			cluster->pollfds[count].events = POLLIN;
+			cluster->pollfds[count].revents = 0;
+			count ++;
+		}
+	}
+	
+	if (count == 0) {
+		// the requests on servers that have closed will already have failed.
+		return(cluster->request_waiting);
+	}
+	
+	do {
+		result = poll(cluster->pollfds, count, timeout);
+	} while (result < 0 && errno == EINTR);
+	
+	if (result > 0) {
+		// the servers are in the same order as they were added to the poll list.
+		count = 0;
+		for (i=0; i<cluster->server_count; i++) {
+			server = cluster->servers[i];
+			if (server && server->handle > 0) {
+				assert(cluster->pollfds[count].fd == server->handle);
+				if (cluster->pollfds[count].revents != 0) {
+					server_read(cluster, server, 0);
 				}
+				count ++;
 			}
 		}
 	}
 	
-	return(0);
+	return(cluster->request_waiting);
 }
 
 
-
-static void message_new(cluster_t *cluster, short int command)
+// Wait for the reply to an async request.  Returns 0 if the request was successful, or -1 if it 
+// failed (or the id is not known).  The result stays with the request until it is collected.
+int cluster_wait(OPENCLUSTER cluster_ptr, OC_REQUEST id)
 {
-	raw_header_t *header;
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
 	
 	assert(cluster);
-	assert(cluster->message.out.command == 0);
-	cluster->message.out.command = command;
-
 	
-	if (cluster->message.out.data == NULL) {
-		assert(OPENCLUSTER_DEFAULT_BUFFSIZE >= sizeof(raw_header_t));
-		cluster->message.out.data = malloc(OPENCLUSTER_DEFAULT_BUFFSIZE);
-		cluster->message.out.max = OPENCLUSTER_DEFAULT_BUFFSIZE;
-		assert(cluster->message.out.data);
+	request = request_find(cluster, id);
+	if (request == NULL) {
+		return(-1);
 	}
+	assert(request->released == 0);
 	
-	cluster->message.out.length = sizeof(raw_header_t);
+	while (request->message.in.result == 0) {
+		assert(request->server);
+		if (server_flush(cluster, request->server) == 0) {
+			server_read(cluster, request->server, 1);
+		}
+	}
 	
-	assert(cluster->message.out.data);
-	header = cluster->message.out.data;
-
-	header->command = htobe16(command);
-	header->reply   = 0;
-	header->userid  = 0;
-	header->length  = htobe32(0);
-
-	assert(cluster->message.in.result == 0);
+	return(request->message.in.result == REPLY_FAIL ? -1 : 0);
 }
 
-static void message_done(cluster_t *cluster)
+
+// Collect the result of an async SET or DELETE.  Returns 0 if it was successful (a DELETE of an item 
+// that wasn't there counts, since it is gone either way).
+int cluster_result(OPENCLUSTER cluster_ptr, OC_REQUEST id)
 {
+	cluster_t *cluster = cluster_ptr;
+	int res;
+	int result;
+	
 	assert(cluster);
-	assert(cluster->message.out.command > 0);
-	cluster->message.out.command = 0;
-	cluster->message.in.result = 0;
-	cluster->message.in.length = 0;
+	
+	res = cluster_wait(cluster, id);
+	if (res == 0) {
+		result = cluster->requests[id & (cluster->request_max - 1)]->message.in.result;
+		if (result != REPLY_OK && result != REPLY_NOT_MODIFIED) {
+			res = -1;
+		}
+	}
+	
+	cluster_release(cluster, id);
+	return(res);
 }
 
 
-
-static void msg_setstr(cluster_t *cluster, const char *str) 
+// Collect the result of an async integer GET.  Returns 0 if the value was returned.
+int cluster_result_int(OPENCLUSTER cluster_ptr, OC_REQUEST id, long long *value)
 {
-	raw_header_t *header;
-	int *ptr;
-	char * sptr;
-	int slen;
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
+	msg_data_int_t reply;
+	int res;
 	
 	assert(cluster);
-
-	if (str) { slen = strlen(str); }
-	else { slen = 0; }
+	assert(value);
 	
-	// make sure there is enough space in the buffer.
-	while ((cluster->message.out.length + sizeof(int) + slen) > cluster->message.out.max) {
-		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
-		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	res = cluster_wait(cluster, id);
+	if (res == 0) {
+		request = request_find(cluster, id);
+		assert(request);
+		if (request->message.in.result == REPLY_DATA_INT 
+				&& msg_data_int_decode(request->message.in.payload, request->message.in.length, &reply) > 0) {
+			*value = reply.value;
+		}
+		else {
+			res = -1;
+		}
 	}
+	
+	cluster_release(cluster, id);
+	return(res);
+}
 
-	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
-	ptr[0] = htonl(slen);
 
-	if (slen > 0) {
-		sptr = ((void*)cluster->message.out.data + cluster->message.out.length + sizeof(int));
-		memcpy(sptr, str, slen);
-	}
+// Collect the result of an async string GET.  The string is allocated, and must be freed by the 
+// caller.  Returns NULL if the value was not returned.
+char * cluster_result_str(OPENCLUSTER cluster_ptr, OC_REQUEST id, int *length)
+{
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
+	msg_data_str_t reply;
+	char *str = NULL;
+	int str_len = 0;
 	
-	cluster->message.out.length += (sizeof(int) + slen);
+	assert(cluster);
 	
-	// add the msg details to the outgoing payload buffer.
-	assert(cluster->message.out.max >= sizeof(raw_header_t));
-	assert(cluster->message.out.data);
+	if (cluster_wait(cluster, id) == 0) {
+		request = request_find(cluster, id);
+		assert(request);
+		if (request->message.in.result == REPLY_DATA_STRING 
+				&& msg_data_str_decode(request->message.in.payload, request->message.in.length, &reply) > 0) {
+			str = msg_copyvalue(&reply, &str_len);
+		}
+	}
 	
-	header = cluster->message.out.data;
-	header->length = htonl(cluster->message.out.length - sizeof(raw_header_t));
+	if (length) { *length = str_len; }
+	
+	cluster_release(cluster, id);
+	return(str);
 }
 
 
-
-static int server_connect(cluster_t *cluster, server_t *server)
+// The result of the async request is not wanted.  If the reply has already arrived it is 
+// discarded, otherwise it will be discarded when it arrives.
+void cluster_release(OPENCLUSTER cluster_ptr, OC_REQUEST id)
 {
-	int res=-1;
+	cluster_t *cluster = cluster_ptr;
+	request_t *request;
 	
 	assert(cluster);
-	assert(server);
 	
-	// if server has a handle, then we exit, because we are already connected to it.
-	if (server->handle < 0) {
-		
-		assert(server->active == 0);
-		assert(server->closing == 0);
-		assert(server->shutdown == 0);
-		
-		assert(server->conninfo);
-		const char *remote_addr = conninfo_remoteaddr(server->conninfo);
-		assert(remote_addr);
-		
-		server->handle = sock_connect(remote_addr);
-		assert(res < 0);
-		
-		if (server->handle < 0) {
-			res = -1;
-			assert(server->active == 0);
+	request = request_find(cluster, id);
+	if (request) {
+		if (request->message.in.result != 0) {
+			request_remove(cluster, request);
 		}
 		else {
-			assert(res < 0);
+			request->released = 1;
+		}
+	}
+}
 
-			message_new(cluster, COMMAND_HELLO);
-			msg_setstr(cluster, NULL);
-			
-			if (cluster->debug) {
-				log_data(0, "output ", cluster->message.out.data, cluster->message.out.length);
-			}
 
-			// temporarily set the server as active.
-			server->active = 1;
+//--------------------------------------------------------------------------------------------------
+// Batch requests.  The entries are split up by the server that has the data (as far as we know), and 
+// one MGET or MSET is sent to each of those servers at the same time, so the whole batch only takes 
+// one round trip.  Entries that a server says are on a different node (because the bucket moved, or 
+// we didn't know where it was) are sent to that node, up to BATCH_TRIES times.
 
-			
-			// send the request and receive the reply.
-			assert(cluster->message.out.length > 0);
-			if (send_request(cluster) != 0) {
-				// some error occured.  SHould handle this some how.
-				server->active = 0;
 
-				assert(0);
-			}
-			else {
-				// check the result.
-				
-				// need to mark the server as active.
-				assert(server->active == 1);
-				
-				res = 0;
-			}
-			
-			message_done(cluster);
-		}
+// add the entry to the batch request that is being built.
+static void batch_setentry(cluster_t *cluster, int command, cluster_entry_t *entry)
+{
+	assert(cluster);
+	assert(entry);
+	assert(entry->expires >= 0);
+	
+	msg_sethash(cluster, entry->map_hash);
+	msg_sethash(cluster, entry->key_hash);
+	if (command == COMMAND_MGET || command == COMMAND_MDELETE) {
+		return;
+	}
+	else if (command == COMMAND_MINCR) {
+		msg_setlong(cluster, entry->value);
+		msg_setint(cluster, entry->expires);
+		return;
+	}
+	
+	assert(command == COMMAND_MSET);
+	msg_setint(cluster, entry->expires);
+	if (entry->data) {
+		msg_setint(cluster, COMMAND_SET_STRING);
+		msg_setbin(cluster, entry->data, entry->length);
+	}
+	else {
+		msg_setint(cluster, COMMAND_SET_INT);
+		msg_setlong(cluster, entry->value);
 	}
-
-	return(res);
 }
 
 
-// This function is used to make sure there is no pending commands in any of the server connections.
-void cluster_pending(OPENCLUSTER cluster_ptr) 
+// find the server with this conninfo (adding it to the list if we didn't know about it).
+static server_t * server_lookup(cluster_t *cluster, const char *conninfo_str)
 {
-	cluster_t *cluster = cluster_ptr;
+	conninfo_t *conninfo;
+	server_t *server;
 	int i;
 	
 	assert(cluster);
-	assert(cluster->server_count > 0);
-	assert(cluster->servers);
+	assert(conninfo_str);
 	
-	for (i=0; i < cluster->server_count; i++) {
-		if (cluster->servers[i] != NULL) {
-			pending_server(cluster, cluster->servers[i]);
+	conninfo = conninfo_parse(conninfo_str);
+	if (conninfo == NULL) {
+		return(NULL);
+	}
+	
+	for (i=0; i<cluster->server_count; i++) {
+		server = cluster->servers[i];
+		assert(server);
+		if (conninfo_compare(server->conninfo, conninfo) == 0) {
+			conninfo_free(conninfo);
+			return(server);
 		}
 	}
+	
+	// NOTE: conninfo is controlled by the cluster after this call.
+	cluster_addserver(cluster, conninfo);
+	assert(cluster->server_count > 0);
+	return(cluster->servers[cluster->server_count - 1]);
 }
 
 
-// do nothing if we are already connected.  If we are not connected, then 
-// connect to the first server in the list.  Since we are setup for blocking 
-// activity, we will wait until the connect succeeds or fails.
-int cluster_connect(OPENCLUSTER cluster_ptr)
+// read the results for the entries that were sent in a batch.  'order' has the index of the 
+// original entry for each one that was sent.  The entries that need to be sent to another server 
+// are left as 0 in 'results', with the server in 'targets'.
+static void batch_results(cluster_t *cluster, request_t *request, cluster_entry_t *entries, int *order, int sent, int *results, server_t **targets)
 {
-	cluster_t *cluster = cluster_ptr;
-	server_t *server;
-	int try = 0;
-	int connected = 0;
-	int res;
-
-	assert(cluster->servers);
-	assert(cluster->server_count > 0);
-
-	for (try=0; try < cluster->server_count && connected == 0; try++) {
-		server = cluster->servers[try];
-		assert(server);
-
-		res = server_connect(cluster, server);
-		if (res == 0) {
-			connected ++;
+	message_t *msg;
+	hash_t valuehash;
+	char *str;
+	int length;
+	int count;
+	int index;
+	int code;
+	int bad;
+	int i;
+	
+	assert(cluster);
+	assert(request);
+	assert(entries);
+	assert(order);
+	assert(sent > 0);
+	assert(results);
+	assert(targets);
+	
+	msg = &request->message;
+	if (msg->in.result != REPLY_MULTI || msg_avail(msg) < sizeof(uint32_t)) {
+		// the whole request failed.
+		for (i=0; i<sent; i++) {
+			results[order[i]] = REPLY_FAIL;
+		}
+		return;
+	}
+	
+	// the server should have sent a result for every entry, but we only trust what is actually in the 
+	// reply.  If it doesn't make sense, the entries that were sent to this server and dont have a 
+	// result yet are failed.
+	msg_getint(msg, &count);
+	bad = (count != sent);
+	
+	for (i=0; i<count && bad == 0; i++) {
+		bad = 1;
+		if (msg_avail(msg) < sizeof(uint32_t) * 2) { break; }
+		msg_getint(msg, &index);
+		msg_getint(msg, &code);
+		if (index < 0 || index >= sent) { break; }
+		index = order[index];
+		
+		if (code == REPLY_DATA_INT) {
+			if (msg_avail(msg) < sizeof(hash_t) + sizeof(long long)) { break; }
+			msg_gethash(msg, &valuehash);
+			msg_getlong(msg, &entries[index].value);
+			entries[index].ok = 1;
+		}
+		else if (code == REPLY_DATA_STRING) {
+			if (msg_avail(msg) < sizeof(hash_t)) { break; }
+			msg_gethash(msg, &valuehash);
+			if (msg_avail_str(msg) == 0) { break; }
+			if (entries[index].data) {
+				free(entries[index].data);
+			}
+			msg_getstr(msg, &entries[index].data, &entries[index].length);
+			entries[index].ok = 1;
+		}
+		else if (code == REPLY_OK) {
+			entries[index].ok = 1;
+		}
+		else if (code == REPLY_TRYELSEWHERE) {
+			if (msg_avail_str(msg) == 0) { break; }
+			msg_getstr(msg, &str, &length);
+			targets[index] = server_lookup(cluster, str);
+			free(str);
+		}
+		
+		if (code != REPLY_TRYELSEWHERE || targets[index] == NULL) {
+			results[index] = code;
+		}
+		bad = 0;
+	}
+	
+	if (bad) {
+		for (i=0; i<sent; i++) {
+			if (results[order[i]] == 0 && targets[order[i]] == request->server) {
+				results[order[i]] = REPLY_FAIL;
+			}
 		}
 	}
-	
-	return(connected);
 }
 
 
-static void server_disconnect(cluster_t *cluster, server_t *server)
+// 'min' and 'max' are only used for MINCR.
+static int batch_request(cluster_t *cluster, int command, cluster_entry_t *entries, int count, long long min, long long max)
 {
+	server_t **targets;
+	server_t *server;
+	server_t *fallback;
+	request_t *request;
+	OC_REQUEST *ids = NULL;
+	int *starts = NULL;
+	int *order;
+	int *results;
+	int servers;
+	int pending;
+	int tries;
+	int used;
+	int done = 0;
+	int i;
+	int s;
+	
 	assert(cluster);
-	assert(server);
+	assert(command == COMMAND_MGET || command == COMMAND_MSET || command == COMMAND_MINCR || command == COMMAND_MDELETE);
+	assert(entries);
+	assert(count > 0);
+	
+	targets = calloc(count, sizeof(server_t *));
+	order = calloc(count, sizeof(int));
+	results = calloc(count, sizeof(int));
+	assert(targets && order && results);
+	
+	// work out where each entry needs to go.  If we dont know, it goes to the server we would have 
+	// sent a single request to, and if that is wrong, it will tell us where to send it.
+	fallback = choose_server(cluster);
+	for (i=0; i<count; i++) {
+		entries[i].ok = 0;
+		if (command == COMMAND_MGET) {
+			entries[i].data = NULL;
+			entries[i].length = 0;
+		}
+		else {
+			cache_drop(cluster, entries[i].map_hash, entries[i].key_hash);
+		}
+		
+		targets[i] = route_server(cluster, entries[i].key_hash);
+		if (targets[i] == NULL) { targets[i] = fallback; }
+		if (targets[i] == NULL) { results[i] = REPLY_FAIL; }
+	}
 	
-	// if we are connected to the server, send the GOODBYE request and receive the reply.
-	if (server->handle >= 0) {
-		// send a GOODBYE command  first.
-		message_new(cluster, COMMAND_GOODBYE);
+	pending = count;
+	for (tries=0; tries < BATCH_TRIES && pending > 0; tries++) {
 		
-		assert(cluster->message.in.result == 0);
-		assert(cluster->message.out.length > 0);
-		if (send_request(cluster) != 0) {
-			assert(0);
+		// servers can be added while the replies are processed.
+		servers = cluster->server_count;
+		ids = realloc(ids, sizeof(OC_REQUEST) * servers);
+		starts = realloc(starts, sizeof(int) * (servers + 1));
+		assert(ids && starts);
+		
+		// send one request to each server that has some of the entries.
+		used = 0;
+		for (s=0; s<servers; s++) {
+			server = cluster->servers[s];
+			ids[s] = 0;
+			starts[s] = used;
 			
-			// what?
+			for (i=0; i<count; i++) {
+				if (results[i] == 0 && targets[i] == server) {
+					order[used++] = i;
+				}
+			}
+			
+			if (used > starts[s] && server->handle < 0) {
+				server_connect(cluster, server);
+			}
+			
+			if (used > starts[s]) {
+				message_new(cluster, command);
+				if (command == COMMAND_MGET) {
+					msg_setint(cluster, cluster->max_stale);
+				}
+				else if (command == COMMAND_MINCR) {
+					msg_setlong(cluster, min);
+					msg_setlong(cluster, max);
+				}
+				msg_setint(cluster, used - starts[s]);
+				for (i=starts[s]; i<used; i++) {
+					batch_setentry(cluster, command, &entries[order[i]]);
+				}
+				
+				ids[s] = send_async_server(cluster, server);
+				if (ids[s] == 0) {
+					for (i=starts[s]; i<used; i++) {
+						results[order[i]] = REPLY_FAIL;
+					}
+				}
+			}
 		}
+		starts[servers] = used;
 		
-		message_done(cluster);
+		// send them all, and then collect the replies.
+		cluster_poll(cluster, 0);
+		for (s=0; s<servers; s++) {
+			if (ids[s] != 0) {
+				cluster_wait(cluster, ids[s]);
+				request = request_find(cluster, ids[s]);
+				assert(request);
+				batch_results(cluster, request, entries, order + starts[s], starts[s+1] - starts[s], results, targets);
+				cluster_release(cluster, ids[s]);
+			}
+		}
 		
-		// close the connection.
-		assert(server->handle > 0);
-		close(server->handle);
-		server->handle = -1;
+		pending = 0;
+		for (i=0; i<count; i++) {
+			if (results[i] == 0) { pending ++; }
+		}
 	}
-}
-
-void cluster_disconnect(OPENCLUSTER cluster_ptr)
-{
-	cluster_t *cluster = cluster_ptr;
-	server_t *server;
-	int try = 0;
-
-	assert(cluster);
-	assert(cluster->servers);
-	assert(cluster->server_count > 0);
 	
-	assert(cluster->disconnecting == 0);
-	cluster->disconnecting = 1;
+	for (i=0; i<count; i++) {
+		if (entries[i].ok) { done ++; }
+	}
 	
-	for (try=0; try < cluster->server_count; try++) {
+	free(targets);
+	free(order);
+	free(results);
+	free(ids);
+	free(starts);
 	
-		server = cluster->servers[try];
-		if (server) {
-			server_disconnect(cluster, server);
-		}
-	}
+	return(done);
 }
 
-#define FNV_BASE_LONG   14695981039346656037llu
-#define FNV_PRIME_LONG  1099511628211llu                      
-
-
 
-// FNV hash.  Public domain function converted from public domain Java version.
-// TODO: modify this to a macro to improve performance a little.
-hash_t cluster_hash_bin(const char *str, const int length)
+// Get all the entries.  Returns the number that were found.
+int cluster_mget(OPENCLUSTER cluster_ptr, cluster_entry_t *entries, int count)
 {
-	register int i;
-	register hash_t hash = FNV_BASE_LONG;
-
-	for (i=0; i<length; i++)  {
-		hash ^= (unsigned int)str[i];
-		hash *= FNV_PRIME_LONG;
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(count >= 0);
+	assert(count == 0 || entries);
+	
+	if (count == 0) {
+		return(0);
 	}
-
-	return(hash);
-}
-
-
-hash_t cluster_hash_str(const char *str)
-{
-	return(cluster_hash_bin(str, strlen(str)));
+	
+	return(batch_request(cluster, COMMAND_MGET, entries, count, 0, 0));
 }
 
 
-hash_t cluster_hash_int(const int key)
+// Set all the entries.  Returns the number that were stored.
+int cluster_mset(OPENCLUSTER cluster_ptr, cluster_entry_t *entries, int count)
 {
-	register int i;
-	register hash_t hash = FNV_BASE_LONG;
-	union {
-		int nkey;
-		char str[sizeof(int)];
-	} match;
-
+	cluster_t *cluster = cluster_ptr;
 	
-	assert(sizeof(key) == 4);
-	assert(sizeof(match) == sizeof(key));
+	assert(cluster);
+	assert(count >= 0);
+	assert(count == 0 || entries);
 	
-	match.nkey = htobe32(key);
-
-	for (i=0; i<sizeof(key); i++)  {
-		hash ^= (unsigned int)match.str[i];
-		hash *= FNV_PRIME_LONG;
+	if (count == 0) {
+		return(0);
 	}
-
-	return(hash);
+	
+	return(batch_request(cluster, COMMAND_MSET, entries, count, 0, 0));
 }
 
 
-hash_t cluster_hash_long(const long long key)
+// Remove all the entries.  Returns the number that were removed ('ok' is set for them, and not for 
+// the ones that weren't there).
+int cluster_mdelete(OPENCLUSTER cluster_ptr, cluster_entry_t *entries, int count)
 {
-	register int i;
-	register hash_t hash = FNV_BASE_LONG;
-	union {
-		long long nkey;
-		char str[sizeof(long long)];
-	} match;
-
-	assert(sizeof(key) == 8);
-	assert(sizeof(match) == sizeof(key));
+	cluster_t *cluster = cluster_ptr;
 	
-	match.nkey = htobe64(key);
-
-	for (i=0; i<sizeof(key); i++)  {
-		hash ^= (unsigned int)match.str[i];
-		hash *= FNV_PRIME_LONG;
+	assert(cluster);
+	assert(count >= 0);
+	assert(count == 0 || entries);
+	
+	if (count == 0) {
+		return(0);
 	}
-
-	return(hash);
+	
+	return(batch_request(cluster, COMMAND_MDELETE, entries, count, 0, 0));
 }
 
 
-
-static void msg_setint(cluster_t *cluster, const int value) 
+// Add each entry's 'value' to the counter, keeping it within 'min' and 'max'.  The new values are 
+// returned in 'value'.  Returns the number of entries that were updated.
+int cluster_mincr(OPENCLUSTER cluster_ptr, cluster_entry_t *entries, int count, long long min, long long max)
 {
-	raw_header_t *header;
-	int *ptr;
+	cluster_t *cluster = cluster_ptr;
 	
 	assert(cluster);
+	assert(count >= 0);
+	assert(count == 0 || entries);
+	assert(min <= max);
 	
-	// make sure there is enough space in the buffer.
-	if ((cluster->message.out.length + sizeof(int)) > cluster->message.out.max) {
-		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
-		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	if (count == 0) {
+		return(0);
 	}
-
-	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
-	ptr[0] = htonl(value);
-	cluster->message.out.length += sizeof(int);
-	
-	// add the msg details to the outgoing payload buffer.
-	assert(cluster->message.out.max >= sizeof(raw_header_t));
-	assert(cluster->message.out.data);
 	
-	header = cluster->message.out.data;
-	header->length = htonl(cluster->message.out.length - sizeof(raw_header_t));
+	return(batch_request(cluster, COMMAND_MINCR, entries, count, min, max));
 }
 
 
-static void msg_sethash(cluster_t *cluster, hash_t value) 
+//--------------------------------------------------------------------------------------------------
+// Records.  All the values that have the same key hash (one for each map they are in) are stored in 
+// the same bucket, so they can all be read or written in one request to the server that has it.
+
+
+// the server to send a record request to.  'target' is the server that the last attempt was told to 
+// use, otherwise it goes to the server that has the key (as far as we know).  This needs to be done 
+// before the message is built, since connecting to the server sends a message of its own.
+static server_t * record_server(cluster_t *cluster, hash_t key_hash, server_t *target)
 {
-	raw_header_t *header;
-	uint64_t *ptr;
+	server_t *server = target;
 	
 	assert(cluster);
-	assert(sizeof(hash_t) == sizeof(uint64_t));
-	
-	// make sure there is enough space in the buffer.
-	if ((cluster->message.out.length + sizeof(value)) > cluster->message.out.max) {
-		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
-		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
-	}
-
-	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
-	ptr[0] = htobe64(value);
-	cluster->message.out.length += sizeof(value);
 	
-	// add the msg details to the outgoing payload buffer.
-	assert(cluster->message.out.max >= sizeof(raw_header_t));
-	assert(cluster->message.out.data);
+	if (server == NULL) { server = route_server(cluster, key_hash); }
+	if (server == NULL) { server = choose_server(cluster); }
+	if (server && server->handle < 0) { server_connect(cluster, server); }
 	
-	header = cluster->message.out.data;
-	header->length = htobe32(cluster->message.out.length - sizeof(raw_header_t));
+	return(server);
 }
 
 
-static void msg_setlong(cluster_t *cluster, long long value) 
+// send the record request that has been built, and wait for the reply.  Returns the request (which 
+// must be released by the caller) or 0.  If the server says the record is somewhere else, 'target' 
+// is set to that server.
+static OC_REQUEST record_send(cluster_t *cluster, server_t *server, server_t **target)
 {
-	raw_header_t *header;
-	long long *ptr;
+	request_t *request;
+	OC_REQUEST id;
+	char *str;
+	int length;
 	
 	assert(cluster);
-	assert(sizeof(long long) == sizeof(uint64_t));
+	assert(target);
 	
-	// make sure there is enough space in the buffer.
-	if ((cluster->message.out.length + sizeof(value)) > cluster->message.out.max) {
-		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
-		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	*target = NULL;
+	id = send_async_server(cluster, server);
+	if (id == 0) {
+		return(0);
 	}
-
-	ptr = ((void*)cluster->message.out.data + cluster->message.out.length);
-	ptr[0] = htobe64(value);
-	cluster->message.out.length += sizeof(value);
 	
-	// add the msg details to the outgoing payload buffer.
-	assert(cluster->message.out.max >= sizeof(raw_header_t));
-	assert(cluster->message.out.data);
+	cluster_wait(cluster, id);
+	request = request_find(cluster, id);
+	assert(request);
+	if (request->message.in.result == REPLY_TRYELSEWHERE) {
+		msg_getstr(&request->message, &str, &length);
+		*target = server_lookup(cluster, str);
+		free(str);
+	}
 	
-	header = cluster->message.out.data;
-	header->length = htobe32(cluster->message.out.length - sizeof(raw_header_t));
+	return(id);
 }
 
 
-
-
-
-
-
-
-int cluster_setint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const int value, const int expires)
+// read the type, valuehash and value of an entry in a reply.
+static void entry_read(message_t *msg, cluster_entry_t *entry)
 {
-	cluster_t *cluster = cluster_ptr;
-	int res = 0;
-	
-	assert(cluster);
-	assert(expires >= 0);
+	hash_t valuehash;
+	int code;
 	
-	// build the message and send it off.
-	message_new(cluster, COMMAND_SET_INT);
-	msg_sethash(cluster, map_hash);
-	msg_sethash(cluster, key_hash);
-	msg_setint(cluster,  expires);
-	msg_setlong(cluster, value);
-
-	assert(cluster->message.in.result == 0);
-	assert(cluster->message.out.length > 0);
-	send_request(cluster);		// this will wait for the reply, so we should have the result.
-
-	// now we've got a reply, we free the message, because there is no 
-	assert(cluster->message.in.result == REPLY_OK);
-	message_done(cluster);
+	assert(msg);
+	assert(entry);
 	
-	return(res);
+	msg_getint(msg, &code);
+	msg_gethash(msg, &valuehash);
+	if (code == REPLY_DATA_INT) {
+		msg_getlong(msg, &entry->value);
+	}
+	else {
+		assert(code == REPLY_DATA_STRING);
+		msg_getstr(msg, &entry->data, &entry->length);
+	}
+	entry->ok = 1;
 }
 
 
-
-int cluster_setstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int expires)
+// Get all the values that are stored with this key hash.  Returns the number of entries, which are 
+// in an array that is allocated, and must be freed with cluster_free_entries().  Returns -1 if it 
+// failed.
+int cluster_getkey_all(OPENCLUSTER cluster_ptr, hash_t key_hash, cluster_entry_t **entries)
 {
 	cluster_t *cluster = cluster_ptr;
-	int res = 0;
+	server_t *target = NULL;
+	server_t *server;
+	request_t *request;
+	message_t *msg;
+	hash_t in_keyhash;
+	OC_REQUEST id;
+	int count = -1;
+	int tries;
+	int i;
 	
 	assert(cluster);
-	assert(expires >= 0);
-	
-	// build the message and send it off.
-	message_new(cluster, COMMAND_SET_STRING);
-	msg_sethash(cluster, map_hash);
-	msg_sethash(cluster, key_hash);
-	msg_setint(cluster, expires);
-	msg_setstr(cluster, value);
-
-	assert(cluster->message.out.length > 0);
-	send_request(cluster);
+	assert(entries);
 	
-	// now we've got a reply, we free the message, because there is no 
-	assert(cluster->message.in.result == REPLY_OK);
+	*entries = NULL;
 	
-	message_done(cluster);
+	for (tries=0; tries < BATCH_TRIES && count < 0; tries++) {
+		server = record_server(cluster, key_hash, target);
+		message_new(cluster, COMMAND_GET_KEY_ALL);
+		msg_sethash(cluster, key_hash);
+		if (cluster->max_stale >= 0) {
+			msg_setint(cluster, cluster->max_stale);
+		}
+		
+		id = record_send(cluster, server, &target);
+		if (id == 0) {
+			break;
+		}
+		
+		request = request_find(cluster, id);
+		assert(request);
+		msg = &request->message;
+		if (msg->in.result == REPLY_DATA_KEY) {
+			msg_gethash(msg, &in_keyhash);
+			msg_getint(msg, &count);
+			assert(in_keyhash == key_hash);
+			assert(count >= 0);
+			
+			*entries = calloc(count > 0 ? count : 1, sizeof(cluster_entry_t));
+			assert(*entries);
+			for (i=0; i<count; i++) {
+				(*entries)[i].key_hash = key_hash;
+				msg_gethash(msg, &(*entries)[i].map_hash);
+				entry_read(msg, &(*entries)[i]);
+			}
+		}
+		
+		cluster_release(cluster, id);
+		if (target == NULL) {
+			break;
+		}
+	}
 	
-	return(res);
+	return(count);
 }
 
 
-/*
-static void msg_getint(cluster_t *cluster, int *value)
+// free the entries that were returned by cluster_getkey_all.
+void cluster_free_entries(cluster_entry_t *entries, int count)
 {
-	int *ptr;
+	int i;
 	
-	assert(cluster);
-	assert(value);
-	assert(cluster->message.in.offset >= 0);
+	assert(count >= 0);
 	
-	ptr = ((void*)(cluster->message.in.payload) + cluster->message.in.offset);
-	*value = ntohl(*ptr);
-
-	cluster->message.in.offset += sizeof(uint32_t);
+	if (entries) {
+		for (i=0; i<count; i++) {
+			if (entries[i].data) { free(entries[i].data); }
+		}
+		free(entries);
+	}
 }
-*/
 
-static void msg_gethash(cluster_t *cluster, hash_t *value)
+
+// Set all the entries as values with the same key hash (their 'key_hash' is ignored).  They are 
+// stored together, so either they are all set or none of them are.  Returns 0 if they were stored.
+int cluster_setkey_multi(OPENCLUSTER cluster_ptr, hash_t key_hash, cluster_entry_t *entries, int count)
 {
-	uint64_t *ptr;
+	cluster_t *cluster = cluster_ptr;
+	server_t *target = NULL;
+	server_t *server;
+	request_t *request;
+	OC_REQUEST id;
+	int res = -1;
+	int tries;
+	int i;
 	
 	assert(cluster);
-	assert(value);
-	assert(cluster->message.in.offset >= 0);
-	assert(sizeof(hash_t) == sizeof(uint64_t));
+	assert(count >= 0);
+	assert(count == 0 || entries);
 	
-	ptr = ((void*)(cluster->message.in.payload) + cluster->message.in.offset);
-	*value = be64toh(*ptr);
-
-	cluster->message.in.offset += sizeof(uint64_t);
+	if (count == 0) {
+		return(0);
+	}
+	
+	for (i=0; i<count; i++) {
+		cache_drop(cluster, entries[i].map_hash, key_hash);
+		entries[i].ok = 0;
+	}
+	
+	for (tries=0; tries < BATCH_TRIES && res != 0; tries++) {
+		server = record_server(cluster, key_hash, target);
+		message_new(cluster, COMMAND_SET_KEY_MULTI);
+		msg_sethash(cluster, key_hash);
+		msg_setint(cluster, count);
+		for (i=0; i<count; i++) {
+			assert(entries[i].expires >= 0);
+			msg_sethash(cluster, entries[i].map_hash);
+			msg_setint(cluster, entries[i].expires);
+			if (entries[i].data) {
+				msg_setint(cluster, COMMAND_SET_STRING);
+				msg_setbin(cluster, entries[i].data, entries[i].length);
+			}
+			else {
+				msg_setint(cluster, COMMAND_SET_INT);
+				msg_setlong(cluster, entries[i].value);
+			}
+		}
+		
+		id = record_send(cluster, server, &target);
+		if (id == 0) {
+			break;
+		}
+		
+		request = request_find(cluster, id);
+		assert(request);
+		if (request->message.in.result == REPLY_OK) {
+			res = 0;
+			for (i=0; i<count; i++) {
+				entries[i].ok = 1;
+			}
+		}
+		
+		cluster_release(cluster, id);
+		if (target == NULL) {
+			break;
+		}
+	}
+	
+	return(res);
 }
 
 
-static void msg_getlong(cluster_t *cluster, long long *value)
+// Get the next part of a scan through all the items in a map.  '*cursor' should be 0 to start, and is 
+// updated to where the next call should carry on from (it is 0 again when the scan is finished).  
+// Returns the number of entries, which are in an array that must be freed with 
+// cluster_free_entries().  Returns -1 if it failed.
+int cluster_scanmap(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t *cursor, int limit, cluster_entry_t **entries)
 {
-	uint64_t *ptr;
+	cluster_t *cluster = cluster_ptr;
+	server_t *target = NULL;
+	server_t *server;
+	request_t *request;
+	message_t *msg;
+	hash_t in_maphash;
+	OC_REQUEST id;
+	int count = -1;
+	int tries;
+	int i;
 	
 	assert(cluster);
-	assert(value);
-	assert(cluster->message.in.offset >= 0);
-	assert(sizeof(long long) == sizeof(uint64_t));
+	assert(cursor);
+	assert(limit > 0);
+	assert(entries);
+	
+	*entries = NULL;
+	
+	// the cursor is a key hash, so it goes to the server that has the bucket it is in.
+	for (tries=0; tries < BATCH_TRIES && count < 0; tries++) {
+		server = record_server(cluster, *cursor, target);
+		message_new(cluster, COMMAND_SCAN_MAP);
+		msg_sethash(cluster, map_hash);
+		msg_sethash(cluster, *cursor);
+		msg_setint(cluster, limit);
+		if (cluster->max_stale >= 0) {
+			msg_setint(cluster, cluster->max_stale);
+		}
+		
+		id = record_send(cluster, server, &target);
+		if (id == 0) {
+			break;
+		}
+		
+		request = request_find(cluster, id);
+		assert(request);
+		msg = &request->message;
+		if (msg->in.result == REPLY_SCAN) {
+			msg_gethash(msg, &in_maphash);
+			msg_gethash(msg, cursor);
+			msg_getint(msg, &count);
+			assert(in_maphash == map_hash);
+			assert(count >= 0);
+			
+			*entries = calloc(count > 0 ? count : 1, sizeof(cluster_entry_t));
+			assert(*entries);
+			for (i=0; i<count; i++) {
+				(*entries)[i].map_hash = map_hash;
+				msg_gethash(msg, &(*entries)[i].key_hash);
+				entry_read(msg, &(*entries)[i]);
+			}
+		}
+		
+		cluster_release(cluster, id);
+		if (target == NULL) {
+			break;
+		}
+	}
 	
-	ptr = ((void*)(cluster->message.in.payload) + cluster->message.in.offset);
-	*value = be64toh(*ptr);
-
-	cluster->message.in.offset += sizeof(uint64_t);
+	return(count);
 }
 
 
-
-
-static void msg_getstr(cluster_t *cluster, char **value, int *length)
+// Remove all the items in a map, from every node.  The node that gets the request passes it on to the 
+// others, so this returns before they have all finished.  Returns 0 if it worked.
+int cluster_dropmap(OPENCLUSTER cluster_ptr, hash_t map_hash)
 {
-	int *ptr_len;
-	char *ptr_str;
-	int len;
-	char *str;
-
+	cluster_t *cluster = cluster_ptr;
+	int res = -1;
+	
 	assert(cluster);
-	assert(value);
-	assert(length);
-	assert(cluster->message.in.offset >= 0);
 	
-	ptr_len = ((void*)(cluster->message.in.payload) + cluster->message.in.offset);
-	len = ntohl(*ptr_len);
-	cluster->message.in.offset += sizeof(uint32_t);
+	message_new(cluster, COMMAND_DROP_MAP);
+	msg_sethash(cluster, map_hash);
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
 	
-	ptr_str = ((void*)(cluster->message.in.payload) + cluster->message.in.offset);
-	assert(len > 0);
-	str = malloc(len + 1);
-	memcpy(str, ptr_str, len);
-	str[len] = 0;
+	if (cluster->message.in.result == REPLY_OK) {
+		res = 0;
+	}
 	
-	*value = str;
-	*length = len;
+	message_done(cluster);
+	return(res);
 }
 
 
-
-int cluster_getint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
+// Remove an item.  Returns 0 if it was removed, 1 if it wasn't there, or -1 if it failed.
+int cluster_delete(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
 {
 	cluster_t *cluster = cluster_ptr;
-	int value=0;
+	server_t *target = NULL;
+	server_t *server;
+	request_t *request;
+	OC_REQUEST id;
+	int res = -1;
+	int tries;
 	
 	assert(cluster);
 	
-	// build the message and send it off.
-	message_new(cluster, COMMAND_GET_INT);
-	msg_sethash(cluster, map_hash);
-	msg_sethash(cluster, key_hash);
-	
-	assert(cluster->message.in.result == 0);
-	assert(cluster->message.out.length > 0);
-	send_request(cluster);
+	cache_drop(cluster, map_hash, key_hash);
 	
-	// now we've got a reply, we free the message, because there is no 
-	if (cluster->message.in.result == REPLY_DATA_INT) {
+	for (tries=0; tries < BATCH_TRIES && res < 0; tries++) {
+		server = record_server(cluster, key_hash, target);
+		message_new(cluster, COMMAND_DELETE);
+		msg_sethash(cluster, map_hash);
+		msg_sethash(cluster, key_hash);
 		
-		hash_t in_maphash;
-		hash_t in_keyhash;
-		hash_t in_valuehash;
-		long long in_value;
+		id = record_send(cluster, server, &target);
+		if (id == 0) {
+			break;
+		}
 		
-		msg_gethash(cluster, &in_maphash);
-		msg_gethash(cluster, &in_keyhash);
-		msg_gethash(cluster, &in_valuehash);
-		msg_getlong(cluster, &in_value);
-		assert(in_maphash == map_hash);
-		assert(in_keyhash == key_hash);
+		request = request_find(cluster, id);
+		assert(request);
+		if (request->message.in.result == REPLY_OK) {
+			res = 0;
+		}
+		else if (request->message.in.result == REPLY_NOT_MODIFIED) {
+			res = 1;
+		}
 		
-		value = (int) in_value;
-	}
-	else {
-		// need to do something else... since we didnt get the data.
-		assert(0);
+		cluster_release(cluster, id);
+		if (target == NULL) {
+			break;
+		}
 	}
-
-	message_done(cluster);
-
-	return(value);
+	
+	return(res);
 }
 
 
-char * cluster_getstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
+// the delete is sent to the server that has the key (as far as we know).  If it was the wrong one, 
+// the result will be a failure.  See cluster_result().
+OC_REQUEST cluster_delete_async(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
 {
-	char *str = NULL;
-	int str_len;
 	cluster_t *cluster = cluster_ptr;
+	server_t *server;
 	
 	assert(cluster);
 	
-	// build the message and send it off.
-	message_new(cluster, COMMAND_GET_STRING);
+	server = record_server(cluster, key_hash, NULL);
+	message_new(cluster, COMMAND_DELETE);
+	cache_drop(cluster, map_hash, key_hash);
 	msg_sethash(cluster, map_hash);
 	msg_sethash(cluster, key_hash);
-	msg_setint(cluster, 0);			// unlimited string size.  //** This needs to be done differntly.
 	
-	assert(cluster->message.in.result == 0);
-	assert(cluster->message.out.length > 0);
-	send_request(cluster);
-		
-	// now we've got a reply, we free the message, because there is no 
-	if(cluster->message.in.result == REPLY_DATA_STRING) {
-		
-		hash_t in_maphash;
-		hash_t in_keyhash;
-		hash_t in_valuehash;
-		
-		msg_gethash(cluster, &in_maphash);
-		msg_gethash(cluster, &in_keyhash);
-		msg_gethash(cluster, &in_valuehash);
-		msg_getstr(cluster, &str, &str_len);
+	return(send_async_server(cluster, server));
+}
 
-		assert(in_maphash == map_hash);
-		assert(in_keyhash == key_hash);
-		
-		assert(str);
-		assert(str_len > 0);
-		
-		if (cluster->debug) {
-			printf("=== map_hash=%#llx, key_hash=%#llx\n", (long long unsigned) map_hash, (long long unsigned) key_hash);
-		}
+
+//--------------------------------------------------------------------------------------------------
+// Large values.  Rather than sending (or receiving) the whole value in one message, which means 
+// that both ends need to hold all of it in a buffer, and nothing else can happen on the connection 
+// until it is done, the value is sent in chunks of CHUNK_SIZE.  Up to CHUNK_WINDOW of them are sent 
+// before waiting for the replies, so it doesn't take a round trip for each one.
+
+
+// get the part of a value from a GET_CHUNK reply, copying it straight into the buffer for the whole 
+// value.  The first chunk allocates the buffer (with a null on the end), and sets the valuehash and 
+// total length that the rest of the chunks need to match.  Returns 0 if the chunk was the one 
+// expected, or -1 if it wasn't (because the value changed).
+static int msg_getchunk(message_t *msg, int offset, hash_t *valuehash, int *total, char **buffer)
+{
+	msg_data_chunk_t reply;
+	
+	assert(msg);
+	assert(valuehash);
+	assert(total);
+	assert(buffer);
+	
+	if (msg_data_chunk_decode(msg->in.payload, msg->in.length, &reply) < 0 || reply.total < 0) {
+		return(-1);
 	}
-	else {
-		// the data was not available so we return a fail result.
-		assert(0);
+	
+	if (*buffer == NULL) {
+		assert(offset == 0);
+		*valuehash = reply.valuehash;
+		*total = reply.total;
+		*buffer = malloc(reply.total + 1);
+		assert(*buffer);
+		(*buffer)[reply.total] = 0;
 	}
 	
-	message_done(cluster);
+	if (reply.valuehash != *valuehash || reply.total != *total || reply.offset != offset || offset + reply.chunk_len > *total) {
+		return(-1);
+	}
 	
-	return(str);
+	if (reply.chunk_len > 0) {
+		memcpy(*buffer + offset, reply.chunk, reply.chunk_len);
+	}
+	
+	return(0);
 }
 
 
-// Return the number of active servers in the cluster.
-int cluster_servercount(OPENCLUSTER cluster_ptr)
+// wait for the reply to a SET_CHUNK, and release it.  Returns the reply code, and if it was 
+// REPLY_TRYELSEWHERE (because the bucket moved before the value was finished), 'target' is set to 
+// the server that has it now.
+static int chunk_result(cluster_t *cluster, OC_REQUEST id, server_t **target)
 {
-	int count = 0;
-	int i;
-	server_t *server;
-	cluster_t *cluster = cluster_ptr;
+	request_t *request;
+	char *str;
+	int length;
+	int result = 0;
 	
 	assert(cluster);
-	assert(cluster->server_count >= 0);
-	
-	for (i=0; i<cluster->server_count; i++) {
-		assert(cluster->servers);
-		if (cluster->servers[i]) {
-			server = cluster->servers[i];
-			if (server->active > 0) {
-				count ++;
-			}
+	assert(id > 0);
+	
+	cluster_wait(cluster, id);
+	request = request_find(cluster, id);
+	if (request) {
+		result = request->message.in.result;
+		if (result == REPLY_TRYELSEWHERE && target) {
+			msg_getstr(&request->message, &str, &length);
+			*target = server_lookup(cluster, str);
+			free(str);
 		}
 	}
 	
-	return(count);
+	cluster_release(cluster, id);
+	return(result);
 }
 
 
-
-hash_t cluster_setlabel(OPENCLUSTER cluster_ptr, char *label, int expires)
+// Store a large value in chunks.  Returns 0 if it was stored, or -1 if it failed.  Small values can 
+// be stored this way too, it just takes one extra round trip compared to cluster_setbin().
+int cluster_setbin_chunked(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires)
 {
 	cluster_t *cluster = cluster_ptr;
-	hash_t hash = 0;
+	server_t *target = NULL;
+	server_t *server;
+	request_t *request;
+	OC_REQUEST id;
+	OC_REQUEST window[CHUNK_WINDOW];
+	int sent;
+	int collected;
+	int offset;
+	int chunk;
+	int size;
+	int result;
+	int res = -1;
+	int tries;
 	
 	assert(cluster);
-	assert(label);
-	
-	// expiry should be 0 (never expires), or a positive number of seconds.
 	assert(expires >= 0);
-	if (expires < 0) { expires=0; }
+	assert(length >= 0);
+	assert(length == 0 || value);
 	
-	// build the message and send it off.
-	message_new(cluster, COMMAND_SET_KEYVALUE);
-	msg_setint(cluster, expires);
-	msg_setstr(cluster, label);
-
-	assert(cluster->message.out.length > 0);
-	send_request(cluster);
+	// the servers wont start a stream for an empty value, and there is nothing to gain from it anyway.
+	if (length == 0) {
+		return(cluster_setbin(cluster, map_hash, key_hash, "", 0, expires));
+	}
 	
-	if (cluster->message.in.result == REPLY_KEYVALUE_HASH) {
+	cache_drop(cluster, map_hash, key_hash);
+	
+	for (tries=0; tries < BATCH_TRIES && res < 0; tries++) {
 		
-		assert(cluster->message.in.length > 0);
-		assert(cluster->message.in.payload);
-
-		msg_gethash(cluster, &hash);
-	}
-	else {
-		// how did we get a different result?
-		assert(0);
+		// the first chunk is sent on its own, so that if the server doesn't have the bucket, we find 
+		// out before sending all the rest.
+		chunk = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+		server = record_server(cluster, key_hash, target);
+		msg_set_stream_t stream = {
+			.map_hash = map_hash,
+			.key_hash = key_hash,
+			.expires = expires,
+			.total = length,
+			.chunk = value,
+			.chunk_len = chunk,
+		};
+		message_new(cluster, COMMAND_SET_STREAM);
+		size = msg_set_stream_size(&stream);
+		msg_set_stream_encode(msg_reserve(cluster, size), size, &stream);
+		
+		id = record_send(cluster, server, &target);
+		if (id == 0) {
+			break;
+		}
+		
+		request = request_find(cluster, id);
+		assert(request);
+		result = request->message.in.result;
+		cluster_release(cluster, id);
+		
+		if (result == REPLY_TRYELSEWHERE && target) {
+			continue;
+		}
+		else if (result != REPLY_OK) {
+			break;
+		}
+		
+		// then the rest of the chunks, keeping no more than CHUNK_WINDOW waiting at a time.
+		offset = chunk;
+		sent = 0;
+		collected = 0;
+		result = REPLY_OK;
+		while ((offset < length || collected < sent) && result == REPLY_OK) {
+			if (offset < length && sent - collected < CHUNK_WINDOW) {
+				chunk = (length - offset) < CHUNK_SIZE ? (length - offset) : CHUNK_SIZE;
+				msg_set_chunk_t part = {
+					.map_hash = map_hash,
+					.key_hash = key_hash,
+					.offset = offset,
+					.chunk = value + offset,
+					.chunk_len = chunk,
+				};
+				message_new(cluster, COMMAND_SET_CHUNK);
+				size = msg_set_chunk_size(&part);
+				msg_set_chunk_encode(msg_reserve(cluster, size), size, &part);
+				
+				id = send_async_server(cluster, server);
+				if (id == 0) {
+					result = REPLY_FAIL;
+				}
+				else {
+					window[sent % CHUNK_WINDOW] = id;
+					sent ++;
+					offset += chunk;
+				}
+			}
+			else {
+				result = chunk_result(cluster, window[collected % CHUNK_WINDOW], &target);
+				collected ++;
+			}
+		}
+		
+		// if one of them failed, the rest are not wanted.
+		while (collected < sent) {
+			cluster_release(cluster, window[collected % CHUNK_WINDOW]);
+			collected ++;
+		}
+		
+		if (result == REPLY_OK) {
+			res = 0;
+		}
+		else if (result != REPLY_TRYELSEWHERE || target == NULL) {
+			break;
+		}
 	}
 	
-	message_done(cluster);
-	
-	return(hash);
+	return(res);
 }
 
 
-const char * cluster_getlabel(OPENCLUSTER cluster_ptr, hash_t hash)
+// Get a large string value in chunks.  The value is allocated (with a null on the end), and must be 
+// freed by the caller.  Returns NULL if it could not be found.  If the value changes while it is 
+// being read, it is read again from the start.
+char * cluster_getbin_chunked(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, int *length)
 {
-	char *str = NULL;
-	int str_len;
 	cluster_t *cluster = cluster_ptr;
+	server_t *target = NULL;
+	server_t *server;
+	request_t *request;
+	OC_REQUEST id;
+	OC_REQUEST window[CHUNK_WINDOW];
+	hash_t valuehash = 0;
+	char *buffer = NULL;
+	int total = 0;
+	int sent;
+	int collected;
+	int offset;
+	int ok;
+	int tries;
 	
 	assert(cluster);
 	
-	// build the message and send it off.
-	message_new(cluster, COMMAND_GET_KEYVALUE);
-	msg_sethash(cluster, hash);
-	
-	assert(cluster->message.in.result == 0);
-	assert(cluster->message.out.length > 0);
-	send_request(cluster);
+	for (tries=0; tries < BATCH_TRIES && buffer == NULL; tries++) {
+		server = record_server(cluster, key_hash, target);
+		message_new(cluster, COMMAND_GET_CHUNK);
+		msg_encode_getchunk(cluster, map_hash, key_hash, 0);
 		
-	// now we've got a reply, we free the message, because there is no 
-	if(cluster->message.in.result == REPLY_KEYVALUE) {
-		msg_getstr(cluster, &str, &str_len);
-
-		// we should not have an empty keyvalue.
-		assert(str);
-		assert(str_len > 0);
+		id = record_send(cluster, server, &target);
+		if (id == 0) {
+			break;
+		}
 		
-		if (cluster->debug) {
-			printf("=== hash=%#llx, keyvalue='%s'\n", (long long unsigned) hash, str);
+		// the first chunk tells us how big the value is.
+		request = request_find(cluster, id);
+		assert(request);
+		ok = 0;
+		if (request->message.in.result == REPLY_DATA_CHUNK) {
+			ok = (msg_getchunk(&request->message, 0, &valuehash, &total, &buffer) == 0);
+		}
+		cluster_release(cluster, id);
+		
+		if (buffer == NULL) {
+			if (target) { continue; }
+			else { break; }
+		}
+		
+		offset = CHUNK_SIZE;
+		sent = 0;
+		collected = 0;
+		while (ok && (offset < total || collected < sent)) {
+			if (offset < total && sent - collected < CHUNK_WINDOW) {
+				message_new(cluster, COMMAND_GET_CHUNK);
+				msg_encode_getchunk(cluster, map_hash, key_hash, offset);
+				
+				id = send_async_server(cluster, server);
+				if (id == 0) {
+					ok = 0;
+				}
+				else {
+					window[sent % CHUNK_WINDOW] = id;
+					sent ++;
+					offset += CHUNK_SIZE;
+				}
+			}
+			else {
+				id = window[collected % CHUNK_WINDOW];
+				ok = 0;
+				if (cluster_wait(cluster, id) == 0) {
+					request = request_find(cluster, id);
+					assert(request);
+					if (request->message.in.result == REPLY_DATA_CHUNK) {
+						ok = (msg_getchunk(&request->message, (collected + 1) * CHUNK_SIZE, &valuehash, &total, &buffer) == 0);
+					}
+				}
+				cluster_release(cluster, id);
+				collected ++;
+			}
+		}
+		
+		while (collected < sent) {
+			cluster_release(cluster, window[collected % CHUNK_WINDOW]);
+			collected ++;
+		}
+		
+		// the value changed (or went away) while we were reading it, so start again.
+		if (ok == 0) {
+			free(buffer);
+			buffer = NULL;
+			target = NULL;
 		}
-	}
-	else {
-		// the data was not available so we return a NULL result.
-		assert(str == NULL);
 	}
 	
-	message_done(cluster);
-	
-	return(str);
-}
\ No newline at end of file
+	if (length) { *length = buffer ? total : 0; }
+	return(buffer);
+}
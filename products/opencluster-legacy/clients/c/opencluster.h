@@ -4,7 +4,8 @@
  * This library is intended to be used by regular clients that need access to the cluster.  It does 
  * not provide event-based activity, or low-latency connections.
  * 
- * It is simplified as much as possible for general use.
+ * It is simplified as much as possible for general use.  Most functions block until the reply 
+ * arrives, but the _async functions can be used to have many requests in flight at once.
  * 
  * If you need a client library that connects to all servers and sends requests directly to the 
  * server that has the data, then please use the libopencluster-ll library.
@@ -54,6 +55,32 @@
 typedef uint64_t hash_t;
 typedef void * OPENCLUSTER;
 
+// identifies a request sent with one of the _async functions.  0 means it could not be sent.
+typedef uint32_t OC_REQUEST;
+
+// the counters for the near cache (see cluster_cache).
+typedef struct {
+	long long hits;
+	long long misses;
+	long long invalidations;
+	long long evictions;
+	int entries;
+} cluster_cache_stats_t;
+
+// an entry for cluster_mget and cluster_mset.  For cluster_mset, if 'data' is set, it is stored as a 
+// string of 'length' bytes, otherwise 'value' is stored.  cluster_mget fills in the value, or 'data' 
+// and 'length' for strings ('data' is allocated and must be freed by the caller).  'ok' is set to 
+// non-zero if the entry was found (or stored).
+typedef struct {
+	hash_t map_hash;
+	hash_t key_hash;
+	long long value;
+	char *data;
+	int length;
+	int expires;
+	int ok;
+} cluster_entry_t;
+
 
 
 
@@ -73,15 +100,49 @@ void cluster_pending(OPENCLUSTER cluster);
 void cluster_debug_on(OPENCLUSTER cluster);
 void cluster_debug_off(OPENCLUSTER cluster);
 
+// allow GETs to be answered by a backup copy that is no more than 'seconds' behind.  -1 to disable.
+void cluster_setstale(OPENCLUSTER cluster, int seconds);
+
 void cluster_setkeyvalue(OPENCLUSTER cluster, hash_t key_hash, const char *name);
 
 int cluster_setint(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const int value, const int expires);
 int cluster_getint(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
+int cluster_setlong(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const long long value, const int expires);
 
 int cluster_setstr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int expires);
 int cluster_setbin(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires);
 char * cluster_getstr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
 
+// large values are sent and received in chunks, so that the value doesn't need to be buffered 
+// whole on either end, and other requests aren't held up behind it.  cluster_getbin_chunked returns 
+// the value (to be freed by the caller), or NULL if it wasn't found.
+int cluster_setbin_chunked(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires);
+char * cluster_getbin_chunked(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, int *length);
+
+// remove an item.  Returns 0 if it was removed, 1 if there was nothing to remove, or -1 if it failed.
+int cluster_delete(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
+
+// Counters.  'delta' is added to the value on the server (negative to decrement), which is created 
+// with 'expires' if it doesn't exist.  cluster_incr_bounded keeps the value within 'min' and 'max'.  
+// Returns 0 if it worked, with the new value in 'result'.
+int cluster_incr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const long long delta, const int expires, long long *result);
+int cluster_incr_bounded(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const long long delta, const int expires, long long min, long long max, long long *result);
+
+// Check-and-set.  The value is only set if the stored value still has the hash in '*valuehash' (0 
+// means only set it if there is no value).  Returns 0 if it was set, and '*valuehash' is updated to 
+// the hash of the new value.  If the stored value has changed, 1 is returned, with its hash in 
+// '*valuehash' and the value in '*current' (if it is the same type, strings must be freed by the 
+// caller), so the caller can work out the new value and try again.  Returns -1 if it failed, or a 
+// value was expected and there isn't one.  A read-modify-write loop can start with a valuehash of 0, 
+// since that returns the current value if there is one.
+int cluster_setlong_if(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const long long value, const int expires, hash_t *valuehash, long long *current);
+int cluster_setbin_if(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires, hash_t *valuehash, char **current, int *current_length);
+
+// only get the string if it has changed.  '*valuehash' is the hash of the copy the caller already has 
+// (0 if none), and is updated if a new value is returned.  Returns 1 if the value changed (and 
+// 'value' must be freed by the caller), 0 if it hasn't, or -1 if it wasn't found.
+int cluster_getstr_ifchanged(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, hash_t *valuehash, char **value, int *length);
+
 hash_t cluster_hash_str(const char *str);
 hash_t cluster_hash_bin(const char *str, const int length);
 hash_t cluster_hash_int(const int key);
@@ -90,5 +151,62 @@ hash_t cluster_hash_long(const long long key);
 hash_t cluster_setlabel(OPENCLUSTER cluster_ptr, char *label, int expires);
 const char * cluster_getlabel(OPENCLUSTER cluster_ptr, hash_t hash);
 
+// Async requests return straight away, so that many requests can be waiting for replies at the same 
+// time.  Every request must be collected with one of the cluster_result functions (which wait for 
+// the reply if it hasn't arrived yet), or given up with cluster_release().  If too many results are 
+// left uncollected, the _async functions will return 0 until some are.
+OC_REQUEST cluster_setint_async(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const int value, const int expires);
+OC_REQUEST cluster_setlong_async(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const long long value, const int expires);
+OC_REQUEST cluster_setstr_async(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int expires);
+OC_REQUEST cluster_setbin_async(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires);
+OC_REQUEST cluster_delete_async(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
+OC_REQUEST cluster_getint_async(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
+OC_REQUEST cluster_getstr_async(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
+
+int cluster_poll(OPENCLUSTER cluster, int timeout);
+int cluster_wait(OPENCLUSTER cluster, OC_REQUEST request);
+
+int cluster_result(OPENCLUSTER cluster, OC_REQUEST request);
+int cluster_result_int(OPENCLUSTER cluster, OC_REQUEST request, long long *value);
+char * cluster_result_str(OPENCLUSTER cluster, OC_REQUEST request, int *length);
+void cluster_release(OPENCLUSTER cluster, OC_REQUEST request);
+
+// Batch requests.  The entries are sent in one request to each server that has some of them (all at 
+// the same time), so the batch only takes one round trip.  They return the number of entries that 
+// were found (or stored).
+int cluster_mget(OPENCLUSTER cluster, cluster_entry_t *entries, int count);
+int cluster_mset(OPENCLUSTER cluster, cluster_entry_t *entries, int count);
+
+// add the 'value' of each entry to its counter (created with 'expires' if needed), and return the new 
+// value in 'value'.  All the counters are kept within 'min' and 'max'.
+int cluster_mincr(OPENCLUSTER cluster, cluster_entry_t *entries, int count, long long min, long long max);
+
+// remove the entries, and return the number that were there to be removed ('ok' is set for those).
+int cluster_mdelete(OPENCLUSTER cluster, cluster_entry_t *entries, int count);
+
+// Records.  All the values with the same key hash (the fields of a record, one for each map) are kept 
+// together, so they can be fetched or stored in one request.  cluster_getkey_all returns the number 
+// of values (or -1 if it failed), in an array that must be freed with cluster_free_entries().  
+// cluster_setkey_multi stores all the entries under 'key_hash', and returns 0 if it worked.
+int cluster_getkey_all(OPENCLUSTER cluster, hash_t key_hash, cluster_entry_t **entries);
+void cluster_free_entries(cluster_entry_t *entries, int count);
+int cluster_setkey_multi(OPENCLUSTER cluster, hash_t key_hash, cluster_entry_t *entries, int count);
+
+// Whole maps.  cluster_scanmap returns the next part of a scan through a map (up to 'limit' entries, 
+// to be freed with cluster_free_entries()).  '*cursor' starts at 0, and is 0 again when the scan is 
+// done.  Items that are there for the whole scan are returned once, but a scan can return fewer 
+// entries than 'limit' (even none) before it is finished.  cluster_dropmap removes all the items in 
+// a map.
+int cluster_scanmap(OPENCLUSTER cluster, hash_t map_hash, hash_t *cursor, int limit, cluster_entry_t **entries);
+int cluster_dropmap(OPENCLUSTER cluster, hash_t map_hash);
+
+// Keep a copy of up to 'entries' of the items that are read with cluster_getint and cluster_getstr, 
+// so that reading them again doesn't need to go to the server.  The servers tell us when an item 
+// changes, so the copies are dropped when they are no longer valid.  Since items that expire are 
+// only noticed by the server when they are looked up, 'max_age' (in seconds, 0 for no limit) sets 
+// how long a copy can be used for.  Setting 'entries' to 0 turns the cache off.
+void cluster_cache(OPENCLUSTER cluster, int entries, int max_age);
+void cluster_cache_stats(OPENCLUSTER cluster, cluster_cache_stats_t *stats);
+
 
 #endif
@@ -5,8 +5,11 @@
 #include "bucket.h"
 
 #include "constants.h"
+#include "hotkeys.h"
 #include "item.h"
 #include "push.h"
+#include "savefile.h"
+#include "seconds.h"
 #include "server.h"
 #include "stats.h"
 #include "timeout.h"
@@ -36,26 +39,38 @@ hash_t _mask = 0;
 int _primary_buckets = 0;
 int _secondary_buckets = 0;
 
-// 0 if no buckets are currently being transferred, 1 if there is.  There can only be one transfer 
-// at a time.
-bucket_t * _bucket_transfer = NULL;
+// the number of buckets that are currently being transferred (in either direction).  Each transfer 
+// is attached to the client it is going to (client->transfer_bucket), so there can only be one 
+// transfer per node connection, but several nodes can be receiving buckets at the same time.
+int _transfer_count = 0;
 
+// the maximum number of transfers we will allow at the same time.  
+int _transfer_max = DEFAULT_TRANSFER_MAX;
 
 
-// When a migration of a bucket needs to occur, and only one migration can occur at a time, we need 
-// to send ALL the data for this bucket to the other node, we need to have a way to tell if an item 
-// has already been transferred, and if it hasn't.   And we dont particularly want to go through the 
-// list first marking a flag.  So instead, each hash item will have an integer, and we will have a 
-// master integer (_migrate_sync).  When we increment the master integer, which will immediately 
-// make the integer in all the items obsolete.   Now the tree can be searched for items that have an 
-// outdated integer, transfer that item, and update the integer to match the master integer.   Since 
-// it will need to look at the chain of trees, this process will also work for them also.   Any 
-// items founds in the sub-chains will need to be moved to the current chain as it continues this 
-// process.
+
+// When a migration of a bucket needs to occur, we need to send ALL the data for this bucket to the 
+// other node, we need to have a way to tell if an item has already been transferred, and if it 
+// hasn't.   And we dont particularly want to go through the list first marking a flag.  So instead, 
+// each hash item will have an integer, and we will have a master integer (_migrate_sync).  When a 
+// transfer starts, we increment the master integer and the bucket keeps a copy of it, which will 
+// immediately make the integer in all the items of that bucket obsolete.   Now the tree can be 
+// searched for items that have an outdated integer, transfer that item, and update the integer to 
+// match the bucket's copy.   Since the master integer only ever goes up, concurrent transfers of 
+// different buckets do not interfere with each other.  Since it will need to look at the chain of 
+// trees, this process will also work for them also.   Any items founds in the sub-chains will need 
+// to be moved to the current chain as it continues this process.
 int _migrate_sync = 0;
 
 static struct event_base *_evbase = NULL;
 
+// the logger node (if there is one) that all primary buckets send a copy of their updates to.
+static node_t *_logging_node = NULL;
+
+// timer that regularly sends the sync counters of our primary buckets to the nodes that have the 
+// backups, so that they can tell how far behind they are.
+static struct event *_mark_event = NULL;
+
 
 // return the current migrate sync counter.  This is used when traversing the data trees to find 
 // items that have not been migrated.
@@ -65,11 +80,50 @@ int buckets_get_migrate_sync(void)
 	return(_migrate_sync);
 }
 
-// get a value from whichever bucket is resposible.
-value_t * buckets_get_value(hash_t map_hash, hash_t key_hash) 
+// return the number of seconds that the backup bucket could be behind the primary.  If the bucket 
+// has never been known to be up-to-date, then -1 is returned.
+static int bucket_sync_lag(bucket_t *bucket)
+{
+	assert(bucket);
+	assert(bucket->level == 1);
+	
+	if (bucket->sync_current <= 0) {
+		return(-1);
+	}
+	else {
+		int lag = seconds_get() - bucket->sync_current;
+		if (lag < 0) { lag = 0; }
+		return(lag);
+	}
+}
+
+
+// the data in the bucket can be read if we are the primary, or if we are the backup and are recent 
+// enough for what the client wants.
+static bucket_data_t * bucket_read_data(bucket_t *bucket, int max_stale)
+{
+	int lag;
+	
+	assert(bucket);
+	
+	if (bucket->level == 0 || (bucket->level == 1 && max_stale >= 0 && (lag = bucket_sync_lag(bucket)) >= 0 && lag <= max_stale)) {
+		assert(bucket->data);
+		return(bucket->data);
+	}
+	
+	return(NULL);
+}
+
+
+// get a value from whichever bucket is resposible.  Normally only the primary bucket will return 
+// the value.  If 'max_stale' is zero or more, then the client has indicated that it can accept data 
+// that is up to that many seconds old, and if we have the backup bucket and it is not lagging any 
+// more than that, it can return the value also.  A 'max_stale' of -1 means primary only.
+value_t * buckets_get_value(hash_t map_hash, hash_t key_hash, int max_stale) 
 {
 	int bucket_index;
 	bucket_t *bucket;
+	bucket_data_t *data;
 	value_t *value = NULL;
 
 	// calculate the bucket that this item belongs in.
@@ -83,19 +137,23 @@ value_t * buckets_get_value(hash_t map_hash, hash_t key_hash)
 	if (bucket) {
 		assert(bucket->hashmask == bucket_index);
 		
-		// make sure that this server is 'primary' for this bucket.
-		if (bucket->level != 0) {
-			// we need to reply with an indication of which server is actually responsible for this bucket.
-			assert(value == NULL);
+		// make sure that this server is 'primary' for this bucket (or a recent enough backup).
+		data = bucket_read_data(bucket, max_stale);
+		if (data) {
+			// search the btree in the bucket for this key.
+			value = data_get_value(map_hash, key_hash, data);
 		}
 		else {
-			// search the btree in the bucket for this key.
-			assert(bucket->data);
-			value = data_get_value(map_hash, key_hash, bucket->data);
+			// we are not responsible for this bucket, but another node might have sent us a copy 
+			// because it is a hot key.  Otherwise we need to reply with an indication of which 
+			// server is actually responsible for this bucket.
+			value = hotkeys_get_replica(map_hash, key_hash, max_stale);
 		}	
 	}
 	else {
-		assert(value == NULL);
+		// we dont have the bucket at all, but the hot key copies are sent to nodes that are not the 
+		// primary or backup, so we might still have one.
+		value = hotkeys_get_replica(map_hash, key_hash, max_stale);
 	}
 	
 	return(value);
@@ -103,15 +161,19 @@ value_t * buckets_get_value(hash_t map_hash, hash_t key_hash)
 
 
 
-// store the value in whatever bucket is resposible for the key_hash.
-// NOTE: value is controlled by the tree after this function call.
-// NOTE: name is controlled by the tree after this function call.
-int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *value) 
+// find the bucket that a change to the key should go to, and the clients that the change needs to be 
+// sent to (NULL if it doesn't need to go anywhere).
+static bucket_t * bucket_for_update(hash_t key_hash, client_t **backup_client, client_t **logging_client)
 {
 	int bucket_index;
 	bucket_t *bucket;
-	client_t *backup_client;
 
+	assert(backup_client);
+	assert(logging_client);
+	
+	*backup_client = NULL;
+	*logging_client = NULL;
+	
 	// calculate the bucket that this item belongs in.
 	bucket_index = _mask & key_hash;
 	assert(bucket_index >= 0);
@@ -124,16 +186,230 @@ int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *
 		assert(bucket->hashmask == bucket_index);
 		if (bucket->backup_node) {
 			// since we have a backup_node specified, then we must be the primary.
-			backup_client = bucket->backup_node->client;
-			assert(backup_client);
+			*backup_client = bucket->backup_node->client;
+			assert(*backup_client);
+			
+			// count the items we send to the backup, so that it can tell if it is keeping up.
+			bucket->sync_seq ++;
 		}
-		else {
-			// since we dont have a backup_node specified, then we are the backup and dont need to 
-			// send the data anywhere else.
-			backup_client = NULL;
+		// otherwise we are the backup, and dont need to send the data anywhere else.
+		
+		// if there is a logger node connected, it needs a copy of the updates to the primary buckets.
+		if (bucket->level == 0 && bucket->logging_node && bucket->logging_node->state == READY) {
+			*logging_client = bucket->logging_node->client;
+		}
+	}
+	
+	return(bucket);
+}
+
+
+// Call 'item_fn' for all the items with this key hash (in every map).  Returns -1 if this node can't 
+// answer for the bucket (the same as buckets_get_value returning NULL, without the hot key copies).
+int buckets_foreach_key(hash_t key_hash, int max_stale, data_item_fn item_fn, void *arg)
+{
+	bucket_t *bucket;
+	bucket_data_t *data;
+	
+	assert(_mask > 0);
+	assert(item_fn);
+	
+	bucket = _buckets[_mask & key_hash];
+	if (bucket) {
+		data = bucket_read_data(bucket, max_stale);
+		if (data) {
+			data_foreach_key(key_hash, data, item_fn, arg);
+			return(0);
+		}
+	}
+	
+	return(-1);
+}
+
+
+// Go through the items in a map, starting from 'cursor' (0 to start at the begining).  The lower 
+// bits of a key hash decide which bucket it is in, so the cursor is in bucket (cursor & mask), and 
+// the smallest key hash that a bucket can have is its own hashmask.  The scan carries on into the 
+// following buckets while this node has them.  Returns the number of items (or -1 if this node 
+// can't answer for the cursor's bucket), and 'cursor' is set to where the next scan should start 
+// from (or 0 if the whole map has been done).
+int buckets_scan_map(hash_t map_hash, hash_t *cursor, int limit, int max_stale, data_item_fn item_fn, void *arg)
+{
+	bucket_t *bucket;
+	bucket_data_t *data;
+	hash_t hashmask;
+	int count = 0;
+	int more;
+	
+	assert(_mask > 0);
+	assert(cursor);
+	assert(limit > 0);
+	assert(item_fn);
+	
+	hashmask = *cursor & _mask;
+	while (count < limit) {
+		bucket = _buckets[hashmask];
+		data = bucket ? bucket_read_data(bucket, max_stale) : NULL;
+		if (data == NULL) {
+			// the rest of the scan needs to be sent to the node that has this bucket.
+			if (count == 0) { return(-1); }
+			break;
+		}
+		
+		count += data_scan_map(map_hash, data, cursor, limit - count, &more, item_fn, arg);
+		if (more) {
+			break;
+		}
+		
+		if (hashmask == _mask) {
+			*cursor = 0;
+			break;
+		}
+		
+		hashmask ++;
+		*cursor = hashmask;
+	}
+	
+	return(count);
+}
+
+
+// Some items have been removed from the bucket, so the other nodes that have a copy of them need to 
+// be sent a tombstone (which is just the map and key hash).  If we are the primary, the backup gets 
+// them in order with the rest of the SYNC data, and the logger adds them to the log.  If the bucket 
+// is being migrated, some of the items might already have been sent to the node that is receiving 
+// it, so it needs them too, otherwise those items would come back to life when the migration 
+// finishes.  The tombstones go over the same bulk connection that the items went over, so they cant 
+// arrive before them.
+static void bucket_send_deletes(bucket_t *bucket, hash_t map_hash, int count, hash_t *key_hashes)
+{
+	int batch;
+	int i;
+	
+	assert(bucket);
+	assert(count > 0);
+	assert(key_hashes);
+	
+	for (i=0; i<count; i+=batch) {
+		batch = (count - i) < DROP_BATCH ? (count - i) : DROP_BATCH;
+		
+		if (bucket->level == 0 && bucket->backup_node && bucket->backup_node->client) {
+			bucket->sync_seq ++;
+			push_sync_delete(bucket->backup_node->client, map_hash, batch, key_hashes + i, bucket->sync_seq);
 		}
 		
-		data_set_value(map_hash, key_hash, bucket->data, value, expires, backup_client);
+		if (bucket->level == 0 && bucket->logging_node && bucket->logging_node->state == READY) {
+			push_sync_delete(bucket->logging_node->client, map_hash, batch, key_hashes + i, 0);
+		}
+		
+		// the node receiving a bucket has it marked as in-transit (level -1), and must not send them 
+		// back.
+		if (bucket->level >= 0 && bucket->transfer_client) {
+			push_sync_delete(bucket->transfer_client, map_hash, batch, key_hashes + i, 0);
+		}
+	}
+}
+
+
+// Remove all the items in a map from the primary buckets on this node.  The backups (and logger) are 
+// sent the keys that were removed, in batches.  Returns the number of items that were removed.
+int buckets_drop_map(hash_t map_hash)
+{
+	bucket_t *bucket;
+	hash_t *key_hashes;
+	hash_t i;
+	int count;
+	int total = 0;
+	
+	assert(_mask > 0);
+	assert(_buckets);
+	
+	for (i=0; i<=_mask; i++) {
+		bucket = _buckets[i];
+		if (bucket && bucket->level == 0) {
+			count = data_drop_map(map_hash, bucket->data, &key_hashes);
+			if (count > 0) {
+				assert(key_hashes);
+				bucket_send_deletes(bucket, map_hash, count, key_hashes);
+				free(key_hashes);
+				total += count;
+			}
+		}
+	}
+	
+	logger(LOG_INFO, "Map %#llx dropped.  %d items removed.", map_hash, total);
+	
+	return(total);
+}
+
+
+// Remove a single item, from the primary bucket it is in.  Returns 1 if it was removed, or 0 if it 
+// wasn't there.
+int buckets_delete_value(hash_t map_hash, hash_t key_hash)
+{
+	bucket_t *bucket;
+	
+	assert(_mask > 0);
+	
+	bucket = _buckets[_mask & key_hash];
+	assert(bucket);
+	assert(bucket->level == 0);
+	
+	if (data_delete_key(map_hash, key_hash, bucket->data) == 0) {
+		return(0);
+	}
+	
+	bucket_send_deletes(bucket, map_hash, 1, &key_hash);
+	return(1);
+}
+
+
+// The primary has removed some items (which were all in the same bucket) from a map, so they need to 
+// be removed from the backup too (or from the bucket we are receiving, if it is being migrated to 
+// us).  If this copy of the bucket is being migrated somewhere else, the keys that were removed are 
+// passed on.  'key_hashes' is re-used to hold those keys.  Returns the number that were removed.
+int buckets_delete_keys(hash_t map_hash, int count, hash_t *key_hashes)
+{
+	bucket_t *bucket;
+	int total = 0;
+	int i;
+	
+	assert(_mask > 0);
+	assert(count > 0);
+	assert(key_hashes);
+	
+	bucket = _buckets[_mask & key_hashes[0]];
+	if (bucket == NULL) {
+		return(0);
+	}
+	
+	for (i=0; i<count; i++) {
+		assert(_buckets[_mask & key_hashes[i]] == bucket);
+		if (data_delete_key(map_hash, key_hashes[i], bucket->data) > 0) {
+			key_hashes[total++] = key_hashes[i];
+		}
+	}
+	
+	if (total > 0 && bucket->level == 1) {
+		bucket_send_deletes(bucket, map_hash, total, key_hashes);
+	}
+	
+	return(total);
+}
+
+
+// store the value in whatever bucket is resposible for the key_hash.
+// NOTE: value is controlled by the tree after this function call.
+// NOTE: name is controlled by the tree after this function call.
+int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *value) 
+{
+	bucket_t *bucket;
+	client_t *backup_client;
+	client_t *logging_client;
+
+	bucket = bucket_for_update(key_hash, &backup_client, &logging_client);
+	if (bucket) {
+		data_set_value(map_hash, key_hash, bucket->data, value, expires, backup_client, bucket->sync_seq, logging_client);
 		return(0);
 	}
 	else {
@@ -143,6 +419,33 @@ int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *
 }
 
 
+// add 'delta' to an integer value (see data_incr_value).  Returns 0 and the new value in 'result', 
+// or -1 if the value is not an integer.
+int buckets_incr_value(hash_t map_hash, hash_t key_hash, long long delta, long long min, long long max, int expires, long long *result)
+{
+	bucket_t *bucket;
+	client_t *backup_client;
+	client_t *logging_client;
+	value_t *value;
+
+	assert(result);
+	assert(_mask > 0);
+	
+	// check the type before bucket_for_update() counts the change for the backup.  A change that 
+	// never gets sent would leave the backup waiting for it, and it would never be current.
+	bucket = _buckets[_mask & key_hash];
+	assert(bucket);
+	value = data_get_value(map_hash, key_hash, bucket->data);
+	if (value && value->type != VALUE_LONG) {
+		return(-1);
+	}
+	
+	bucket = bucket_for_update(key_hash, &backup_client, &logging_client);
+	assert(bucket);
+	return(data_incr_value(map_hash, key_hash, bucket->data, delta, min, max, expires, backup_client, bucket->sync_seq, logging_client, result));
+}
+
+
 
 bucket_t * bucket_new(hash_t hashmask)
 {
@@ -164,12 +467,20 @@ bucket_t * bucket_new(hash_t hashmask)
 	assert(bucket->source_node == NULL);
 	assert(bucket->logging_node == NULL);
 	assert(bucket->transfer_event == NULL);
+	
+	bucket->logging_node = _logging_node;
 	assert(bucket->shutdown_event == NULL);
 	assert(bucket->transfer_client == NULL);
-	assert(data_in_transit() == 0);
+	assert(bucket->migrate_sync == 0);
+	assert(bucket->in_transit == 0);
 	assert(bucket->oldbucket_event == NULL);
 	assert(bucket->transfer_mode_special == 0);
 	assert(bucket->promoting == NOT_PROMOTING);
+	assert(bucket->sync_seq == 0);
+	assert(bucket->sync_current == 0);
+	
+	// the backup hasn't been told what the primary is up to yet.
+	bucket->sync_target = -1;
 	
 	bucket->data = data_new(_mask, hashmask);
 	
@@ -270,7 +581,7 @@ void buckets_split_mask(hash_t current_mask, hash_t new_mask)
 			newbuckets[i]->primary_node = oldbuckets[index]->primary_node;
 			newbuckets[i]->secondary_node = oldbuckets[index]->secondary_node;
 			
-			assert(data_in_transit() == 0);
+			assert(oldbuckets[index]->in_transit == 0);
 		}
 	}
 
@@ -314,13 +625,15 @@ static void bucket_free(bucket_t *bucket)
 	assert(bucket->data == NULL);
 	assert(bucket->source_node == NULL);
 	assert(bucket->backup_node == NULL);
-	assert(bucket->logging_node == NULL);
 	assert(bucket->transfer_client == NULL);
 	assert(bucket->transfer_mode_special == 0);
 	assert(bucket->shutdown_event == NULL);
 	assert(bucket->transfer_event == NULL);
 	assert(bucket->oldbucket_event == NULL);
 	
+	// the logger node is shared by all the buckets, so it isn't cleared when the bucket is emptied.
+	bucket->logging_node = NULL;
+	
 	free(bucket);
 }
 
@@ -427,6 +740,17 @@ int buckets_shutdown(void)
 	hash_t i;
 	bucket_t *bucket;
 	
+	if (_mark_event) {
+		event_free(_mark_event);
+		_mark_event = NULL;
+	}
+	
+	// if we are the last node in the cluster, there is nowhere to send the buckets, so they are 
+	// written to the save file (if there is one) before they are destroyed.
+	if (_buckets && node_active_count() == 0 && savefile_enabled()) {
+		savefile_save();
+	}
+	
 	if (_buckets) {
 		assert(_mask > 0);
 		for (i=0; i<=_mask; i++) {
@@ -492,6 +816,74 @@ void buckets_init(hash_t mask, struct event_base *evbase)
 
 
 
+// used when taking over from a node that is being upgraded.  The bucket list is created with the 
+// same mask, but empty.  The buckets are then added one at a time with buckets_adopt_bucket().
+void buckets_adopt_init(hash_t mask, struct event_base *evbase)
+{
+	assert(_evbase == NULL);
+	assert(evbase);
+	_evbase = evbase;
+	
+	assert(_mask == 0);
+	assert(mask > 0);
+	_mask = mask;
+	
+	assert(_buckets == NULL);
+	_buckets = calloc(_mask+1, sizeof(bucket_t *));
+	assert(_buckets);
+	
+	assert(_primary_buckets == 0);
+	assert(_secondary_buckets == 0);
+	assert(_nobackup_buckets == 0);
+}
+
+
+// add a bucket that was handed over by the node we are replacing.  The items are loaded into it 
+// afterwards.
+bucket_t * buckets_adopt_bucket(hash_t hashmask, int level, int has_data, int sync_seq, node_t *primary_node, node_t *secondary_node, node_t *source_node, node_t *backup_node)
+{
+	bucket_t *bucket;
+	
+	assert(_buckets);
+	assert(hashmask <= _mask);
+	assert(level >= -1);
+	
+	bucket = bucket_new(hashmask);
+	assert(bucket);
+	
+	bucket->level = level;
+	bucket->sync_seq = sync_seq;
+	bucket->primary_node = primary_node;
+	bucket->secondary_node = secondary_node;
+	bucket->source_node = source_node;
+	bucket->backup_node = backup_node;
+	
+	if (has_data == 0) {
+		assert(bucket->data);
+		assert(bucket->data->ref == 1);
+		bucket->data->ref --;
+		data_free(bucket->data);
+		bucket->data = NULL;
+	}
+	
+	if (level == 0) {
+		_primary_buckets ++;
+		if (backup_node == NULL) {
+			_nobackup_buckets ++;
+		}
+	}
+	else if (level > 0) {
+		_secondary_buckets ++;
+	}
+	
+	assert(_buckets[hashmask] == NULL);
+	_buckets[hashmask] = bucket;
+	
+	return(bucket);
+}
+
+
+
 // we've been given a keyvalue for a hash-key item, and so we lookup the bucket that is responsible 
 // for that item.  the 'data' module will then find the data store within that handles that item.
 int buckets_store_keyvalue(hash_t key_hash, char *name, int expires)
@@ -632,6 +1024,13 @@ static void bucket_dump(bucket_t *bucket)
 	assert(altnode);
 	stat_dumpstr("    Bucket:%#llx, Mode:%s, %s Node:%s", bucket->hashmask, mode, altmode, altnode);
 	
+	if (bucket->level == 0 && bucket->backup_node) {
+		stat_dumpstr("      Sync Count: %d", bucket->sync_seq);
+	}
+	else if (bucket->level == 1) {
+		stat_dumpstr("      Sync Count: %d (primary at %d), Lag: %d", bucket->sync_seq, bucket->sync_target, bucket_sync_lag(bucket));
+	}
+	
 	assert(bucket->data);
 //	data_dump(bucket->data);
 
@@ -643,6 +1042,8 @@ static void bucket_dump(bucket_t *bucket)
 		assert(name);
 		stat_dumpstr("      Currently transferring to: %s", name);
 		stat_dumpstr("      Transfer Mode: %d", bucket->transfer_mode_special);
+		stat_dumpstr("      Transfer Sync: %d", bucket->migrate_sync);
+		stat_dumpstr("      Items in transit: %d", bucket->in_transit);
 	}
 }
 
@@ -656,7 +1057,7 @@ void buckets_dump(void)
 	stat_dumpstr("  Buckets without backups: %d", _nobackup_buckets);
 	stat_dumpstr("  Primary Buckets: %d", _primary_buckets);
 	stat_dumpstr("  Secondary Buckets: %d", _secondary_buckets);
-	stat_dumpstr("  Bucket currently transferring: %s", _bucket_transfer == NULL ? "no" : "yes");
+	stat_dumpstr("  Buckets currently transferring: %d (max %d)", _transfer_count, _transfer_max);
 	stat_dumpstr("  Migration Sync Counter: %d", _migrate_sync);
 
 	hashmasks_dump();
@@ -707,6 +1108,48 @@ node_t * buckets_get_primary_node(hash_t key_hash)
 }
 
 
+// A logger node has connected.  All the buckets will send it a copy of their updates (it is only 
+// actually used while the bucket is primary).
+void buckets_set_logging_node(node_t *node)
+{
+	hash_t i;
+	
+	assert(node);
+	assert(node->logger);
+	
+	_logging_node = node;
+	if (_buckets) {
+		assert(_mask > 0);
+		for (i=0; i<=_mask; i++) {
+			if (_buckets[i]) {
+				_buckets[i]->logging_node = node;
+			}
+		}
+	}
+	
+	logger(LOG_INFO, "Updates will be logged to '%s'", node_name(node));
+}
+
+
+// Get the node that has the backup copy of the bucket for this key.  Returns NULL if there isn't 
+// one, or if it is this node.
+node_t * buckets_get_backup_node(hash_t key_hash)
+{
+	bucket_t *bucket;
+
+	assert(_mask > 0);
+	bucket = _buckets[_mask & key_hash];
+	assert(bucket);
+	if (bucket->level == 0) {
+		return(bucket->backup_node);
+	}
+	else {
+		// secondary_node is NULL if we are the backup.
+		return(bucket->secondary_node);
+	}
+}
+
+
 int buckets_get_primary_count(void)
 {
 	assert(_primary_buckets >= 0);
@@ -720,11 +1163,31 @@ int buckets_get_secondary_count(void)
 }
 
 
-// return the number of buckets that are currently transferring.
+// return the number of buckets that are currently transferring.  This can be above the maximum 
+// for a while if the maximum was lowered by a config reload while transfers were active.
 int buckets_transferring(void)
 {
-	// return 0 if NULL.  non-zero if something is transferring.
-	return(_bucket_transfer != NULL);
+	assert(_transfer_count >= 0);
+	return(_transfer_count);
+}
+
+
+// return the maximum number of buckets that can be transferring at the same time.
+int buckets_transfer_max(void)
+{
+	assert(_transfer_max > 0);
+	return(_transfer_max);
+}
+
+
+// set the maximum number of concurrent bucket transfers.  Normally set from the config on startup.  
+// If it is lowered while more transfers are active, the existing ones will finish, but new ones 
+// will not start until the count drops below the new value.
+void buckets_set_transfer_max(int max)
+{
+	assert(max > 0);
+	_transfer_max = max;
+	logger(LOG_INFO, "Maximum concurrent bucket transfers: %d", _transfer_max);
 }
 
 
@@ -736,13 +1199,19 @@ int buckets_accept_bucket(client_t *client, hash_t mask, hash_t hashmask)
 	assert(client);
 	assert(mask > 0);
 	
-	if (_bucket_transfer) {
-		//  we are currently transferring another bucket, therefore we cannot accept another one.
-		logger(LOG_WARN, "cant accept bucket, already transferring one.");
+	if (client->transfer_bucket) {
+		//  we are currently transferring another bucket with this node, therefore we cannot accept 
+		//  another one from it.
+		logger(LOG_WARN, "cant accept bucket, already transferring one with this node.");
+		accepted = 0;
+	}
+	else if (_transfer_count >= _transfer_max) {
+		//  we are already handling as many transfers as we are allowed.
+		logger(LOG_WARN, "cant accept bucket, already transferring %d buckets.", _transfer_count);
 		accepted = 0;
 	}
 	else { 
-		assert(_bucket_transfer == NULL);
+		assert(client->transfer_bucket == NULL);
 		if (mask != _mask) {
 			// the masks are different, we cannot accept a bucket unless our masks match... which should 
 			// balance out once hashmasks have proceeded through all the nodes.
@@ -776,16 +1245,10 @@ int buckets_accept_bucket(client_t *client, hash_t mask, hash_t hashmask)
 				bucket_t *bucket = bucket_new(hashmask);
 				assert(bucket);
 				_buckets[hashmask] = bucket;
-				assert(data_in_transit() == 0);
-				assert(bucket->transfer_client == NULL);
-				assert(client->node);
-				logger(LOG_DEBUG, "Setting transfer client ('%s') to bucket %#llx.", node_name(client->node), bucket->hashmask);
-				bucket->transfer_client = client;
+				assert(bucket->in_transit == 0);
 				assert(bucket->level < 0);
+				buckets_set_transferring(bucket, client);
 				accepted = 1;
-				
-				assert(_bucket_transfer == NULL);
-				_bucket_transfer = bucket;
 			}
 		}
 	}
@@ -813,15 +1276,18 @@ int buckets_send_bucket(client_t *client, hash_t mask, hash_t hashmask)
 		if (bucket->level == 0 || bucket->level == 1) {
 			if (bucket->transfer_client == client) {
 
-				assert(data_in_transit() == 0);
+				assert(client->transfer_bucket == bucket);
+				assert(bucket->in_transit == 0);
 				
 				// increment the migrate_sync counter which will help indicate which items have already been 
-				// sent or not.
+				// sent or not.  The bucket keeps its own copy, because other buckets may start 
+				// transferring (and incrementing the master counter) while this one is still going.
 				assert(_migrate_sync >= 0);
 				_migrate_sync ++;
 				assert(_migrate_sync > 0);
+				bucket->migrate_sync = _migrate_sync;
 				
-				logger(LOG_DEBUG, "Setting Migration SYNC counter to: %d", _migrate_sync);
+				logger(LOG_DEBUG, "Setting Migration SYNC counter for bucket %#llx to: %d", bucket->hashmask, bucket->migrate_sync);
 				
 				ok = 1;
 			}
@@ -836,6 +1302,19 @@ int buckets_send_bucket(client_t *client, hash_t mask, hash_t hashmask)
 
 
 
+// the bucket has changed roles (or has just arrived), so the replication lag tracking needs to 
+// start again.  The backup will take whatever the primary tells it in the next mark as its starting 
+// point, since at this point it should have everything that the primary had.
+static void bucket_sync_reset(bucket_t *bucket)
+{
+	assert(bucket);
+	bucket->sync_seq = 0;
+	bucket->sync_target = -1;
+	bucket->sync_target_time = 0;
+	bucket->sync_current = 0;
+}
+
+
 void buckets_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int level)
 {
 	bucket_t *bucket = NULL;
@@ -854,7 +1333,7 @@ void buckets_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int
 	assert(bucket);
 	assert(bucket->hashmask == hashmask);
 	assert(bucket->transfer_client == NULL);
-	assert(data_in_transit() == 0);
+	assert(bucket->in_transit == 0);
 	assert(bucket->transfer_event == NULL);
 	
 	// mark the bucket as ready for action.
@@ -896,6 +1375,7 @@ void buckets_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int
 		assert(0);
 	}
 	bucket->level = level;
+	bucket_sync_reset(bucket);
 
 	assert(bucket->primary_node);
 	assert(bucket->secondary_node);
@@ -903,8 +1383,9 @@ void buckets_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int
 	bucket->primary_node = bucket->secondary_node;
 	bucket->secondary_node = node;
 		
-	// since this node is receiving the 'switch' command, we should not have any buckets transferring.
-	assert(_bucket_transfer == NULL);
+	// since this node is receiving the 'switch' command, we should not be transferring anything 
+	// with the node that sent it.
+	assert(client->transfer_bucket == NULL);
 }
 
 
@@ -939,6 +1420,29 @@ void buckets_hashmasks_update(node_t *node, hash_t hashmask, int level)
 }
 
 
+// tell a client that has just connected which buckets we have, so that clients which connect to 
+// every node can send their requests straight to the node that has the data.  After this, they will 
+// get the changes as they happen.
+void buckets_push_hashmasks(client_t *client)
+{
+	int i;
+	
+	assert(client);
+	
+	if (_buckets == NULL) {
+		return;
+	}
+	
+	assert(_mask > 0);
+	for (i=0; i<=_mask; i++) {
+		if (_buckets[i] && (_buckets[i]->level == 0 || _buckets[i]->level == 1)) {
+			assert(_buckets[i]->hashmask == i);
+			push_hashmask(client, _mask, _buckets[i]->hashmask, _buckets[i]->level);
+		}
+	}
+}
+
+
 // return the mask
 hash_t buckets_mask(void)
 {
@@ -947,6 +1451,17 @@ hash_t buckets_mask(void)
 }
 
 
+// return the bucket for the hashmask, or NULL if we dont have it.
+bucket_t * buckets_get(hash_t hashmask)
+{
+	assert(_mask > 0);
+	assert(hashmask <= _mask);
+	assert(_buckets);
+	
+	return(_buckets[hashmask]);
+}
+
+
 
 bucket_t * buckets_find_switchable(node_t *node)
 {
@@ -974,8 +1489,9 @@ bucket_t * buckets_find_switchable(node_t *node)
 				logger(LOG_DEBUG, "buckets_find_switchable(): We are primary of: %d, backup_node=%#llx, node=%#llx", 
 					   i, _buckets[i]->backup_node, node );
 
-				// is this client the backup node for this bucket?
-				if (_buckets[i]->backup_node == node) {
+				// is this client the backup node for this bucket?  (and it is not already busy being 
+				// transferred somewhere else)
+				if (_buckets[i]->backup_node == node && _buckets[i]->transfer_client == NULL) {
 					assert(0);
 					logger(LOG_DEBUG, "buckets_find_switchable(): not backup node for the client: %d", i);
 					
@@ -1013,19 +1529,19 @@ void buckets_finalize_migration(client_t *client, hash_t hashmask, int level, co
 	assert(bucket->level < 0);
 	assert(bucket->source_node == NULL);
 	assert(bucket->backup_node == NULL);
-	assert(data_in_transit() == 0);
+	assert(bucket->in_transit == 0);
 	assert(bucket->transfer_event == NULL);
-	assert(_bucket_transfer);
 
 	assert(bucket->transfer_client == client);
 	assert(client);
 	assert(client->node);
-	logger(LOG_DEBUG, "Removing transfer client ('%s') from bucket %#llx.", node_name(client->node), bucket->hashmask);
-
-	bucket->transfer_client = NULL;
+	assert(client->transfer_bucket == bucket);
+	
+	buckets_clear_transferring(bucket);
 		
 	// mark the bucket as ready for action.
 	bucket->level = level;
+	bucket_sync_reset(bucket);
 	if (level == 0) {
 		// we are receiving a primary bucket.  
 		if (conninfo) {
@@ -1082,25 +1598,35 @@ void buckets_set_transferring(bucket_t *bucket, client_t *client)
 	assert(client->node);
 	
 	assert(bucket->transfer_client == NULL);
+	assert(client->transfer_bucket == NULL);
 	logger(LOG_DEBUG, "Setting transfer client ('%s') to bucket %#llx.", node_name(client->node), bucket->hashmask);
 	bucket->transfer_client = client;
+	client->transfer_bucket = bucket;
 	
-	assert(_bucket_transfer == NULL);
-	_bucket_transfer = bucket;
+	assert(bucket->in_transit == 0);
+	
+	assert(_transfer_count >= 0);
+	assert(_transfer_count < _transfer_max);
+	_transfer_count ++;
 }
 
 void buckets_clear_transferring(bucket_t *bucket)
 {
 	assert(bucket);
 	
-	assert(_bucket_transfer == bucket);
-	_bucket_transfer = NULL;
-	
 	assert(bucket->transfer_client);
+	assert(bucket->transfer_client->transfer_bucket == bucket);
 	assert(bucket->transfer_client->node);
 	logger(LOG_DEBUG, "Finished transferring to client ('%s') of bucket %#llx.", 
 		   node_name(bucket->transfer_client->node), bucket->hashmask);
+	bucket->transfer_client->transfer_bucket = NULL;
 	bucket->transfer_client = NULL;
+	
+	// any items still in transit will not be acknowledged against this transfer anymore.
+	bucket->in_transit = 0;
+	
+	assert(_transfer_count > 0);
+	_transfer_count --;
 }
 
 
@@ -1118,13 +1644,13 @@ bucket_t * buckets_nobackup_bucket(void)
 	for (i=0; i<=_mask && bucket == NULL; i++) {
 		if (_buckets[i]) {
 			if (_buckets[i]->level == 0) {
-				if (_buckets[i]->backup_node == NULL) {
+				// skip the buckets that are already being transferred to some other node.
+				if (_buckets[i]->backup_node == NULL && _buckets[i]->transfer_client == NULL) {
 					bucket = _buckets[i];
 
 					logger(LOG_INFO, "Attempting to migrate bucket #%#llx that has no backup copy.", bucket->hashmask); 
 					
 					assert(bucket->hashmask == i);
-					assert(bucket->transfer_client == NULL);
 				}
 			}
 		}
@@ -1157,7 +1683,7 @@ static bucket_t * choose_bucket_for_migrate(client_t *client, int primary, int b
 		
 		// simply go through the bucket list until we find the appropriate bucket.
 		for (i=0; i<=_mask && bucket == NULL; i++) {
-			if (_buckets[i]) {
+			if (_buckets[i] && _buckets[i]->transfer_client == NULL) {
 				if (_buckets[i]->level == send_level) {
 					
 					if (send_level == 0) {
@@ -1195,13 +1721,14 @@ bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups)
 	assert(primary >= 0);
 	assert(backups >= 0);
 	
-	logger(LOG_DEBUG, "buckets_check_loadlevels(%d,%d): transferring=%s, mask=%#llx, no_backup_count=%d", 
+	logger(LOG_DEBUG, "buckets_check_loadlevels(%d,%d): transferring=%d/%d, mask=%#llx, no_backup_count=%d", 
 		   primary, backups, 
-		   _bucket_transfer == NULL ? "no" : "yes", 
+		   _transfer_count, _transfer_max, 
 		   _mask, buckets_nobackup_count()); 
 	
-	// if the target node is not currently transferring, and we are not currently transferring
-	if (_bucket_transfer == NULL && _mask > 0) {
+	// if we are not already transferring with this node, and we have not reached our limit of 
+	// concurrent transfers.
+	if (client->transfer_bucket == NULL && _transfer_count < _transfer_max && _mask > 0) {
 
 		// we havent sent anything yet, so now we need to check to see if we have any buckets 
 		// that do not have backup copies (we do not care about the ideal number of buckets, we 
@@ -1209,14 +1736,12 @@ bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups)
 		assert(bucket == NULL);
 		if (buckets_nobackup_count() > 0) {
 			bucket = buckets_nobackup_bucket();
-			assert(_bucket_transfer == NULL);
 		}
 
 		if (bucket == NULL) {
 			assert(client);
 			assert(client->node);
 			bucket = buckets_find_switchable(client->node);
-			assert(_bucket_transfer == NULL);
 		}
 		
 		if (bucket == NULL) {
@@ -1254,29 +1779,189 @@ bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups)
 
 int buckets_transfer_items(client_t *client)
 {
+	bucket_t *bucket;
+	
 	assert(client);
-	assert(_bucket_transfer);
-	assert(_bucket_transfer->transfer_client == client);
+	bucket = client->transfer_bucket;
+	assert(bucket);
+	assert(bucket->transfer_client == client);
+	assert(bucket->migrate_sync > 0);
 	
 	assert(TRANSIT_MAX >= TRANSIT_MIN && TRANSIT_MIN >= 0);
-	assert(data_in_transit() >= 0);
-	assert(data_in_transit() <= TRANSIT_MIN);
+	assert(bucket->in_transit >= 0);
+	assert(bucket->in_transit <= TRANSIT_MIN);
 
-	int avail = TRANSIT_MAX - data_in_transit();
+	int avail = TRANSIT_MAX - bucket->in_transit;
 	
-	logger(LOG_DEBUG, "Requesting %d items to migrate.", avail);
+	logger(LOG_DEBUG, "Requesting %d items to migrate for bucket %#llx.", avail, bucket->hashmask);
 	
 	// ask the data system for a certain number of migrate items.
-	assert(_bucket_transfer->data);
+	assert(bucket->data);
 	assert(avail > 0);
-	int items = data_migrate_items(_bucket_transfer->transfer_client, _bucket_transfer->data, _bucket_transfer->hashmask, avail);
+	int items = data_migrate_items(client, bucket->data, bucket->hashmask, bucket->migrate_sync, avail);
 	assert(items >= 0);
+	
+	bucket->in_transit += items;
+	assert(bucket->in_transit <= TRANSIT_MAX);
+	
 	return(items);
 }
 
 
 
-bucket_t *buckets_current_transfer(void)
+// return the bucket that is currently being transferred with this client (or NULL if there isn't one).
+bucket_t *buckets_current_transfer(client_t *client)
+{
+	assert(client);
+	return(client->transfer_bucket);
+}
+
+
+// a migrated item has been acknowledged by the node receiving it.  If it belongs to the bucket we 
+// are transferring to that client, then it is no longer in transit.  Returns 1 if more items can be 
+// sent, otherwise 0 (which includes acks for regular backup syncs).
+int buckets_transfer_ack(client_t *client, hash_t map_hash, hash_t key_hash)
+{
+	bucket_t *bucket;
+	
+	assert(client);
+	
+	bucket = client->transfer_bucket;
+	if (bucket == NULL || bucket->hashmask != (key_hash & _mask) || bucket->in_transit <= 0) {
+		return(0);
+	}
+	
+	assert(bucket->transfer_client == client);
+	data_migrated(bucket->data, map_hash, key_hash, bucket->migrate_sync);
+	bucket->in_transit --;
+	assert(bucket->in_transit >= 0);
+	
+	return(bucket->in_transit <= TRANSIT_MIN);
+}
+
+
+
+// if we are the primary for this bucket, and it has a backup, return the node it is on.
+static node_t * bucket_backup_node(bucket_t *bucket)
+{
+	assert(bucket);
+	if (bucket->level == 0 && bucket->backup_node && bucket->backup_node->client) {
+		return(bucket->backup_node);
+	}
+	else {
+		return(NULL);
+	}
+}
+
+
+// Every so often we tell each backup node what the sync counters are up to for the buckets that it 
+// is backing up for us.  All the buckets for that node are sent in the one message.
+static void mark_handler(evutil_socket_t fd, short what, void *arg)
+{
+	hash_t i, j;
+	node_t *node;
+	hash_t *hashmasks;
+	int *seqs;
+	int count;
+	int done;
+	
+	assert(fd == -1);
+	assert(arg == NULL);
+	assert(_mark_event);
+	
+	if (_buckets) {
+		assert(_mask > 0);
+		hashmasks = malloc(sizeof(hash_t) * (_mask + 1));
+		seqs = malloc(sizeof(int) * (_mask + 1));
+		assert(hashmasks && seqs);
+		
+		for (i=0; i<=_mask; i++) {
+			node = _buckets[i] ? bucket_backup_node(_buckets[i]) : NULL;
+			if (node) {
+				
+				// if an earlier bucket had the same backup node, then it has already been sent.
+				done = 0;
+				for (j=0; j<i && done == 0; j++) {
+					if (_buckets[j] && bucket_backup_node(_buckets[j]) == node) { done = 1; }
+				}
+				
+				if (done == 0) {
+					count = 0;
+					for (j=i; j<=_mask; j++) {
+						if (_buckets[j] && bucket_backup_node(_buckets[j]) == node) {
+							hashmasks[count] = j;
+							seqs[count] = _buckets[j]->sync_seq;
+							count ++;
+						}
+					}
+					assert(count > 0);
+					
+					push_sync_mark(node->client, _mask, count, hashmasks, seqs);
+				}
+			}
+		}
+		
+		free(hashmasks);
+		free(seqs);
+	}
+	
+	evtimer_add(_mark_event, &_timeout_sync_mark);
+}
+
+
+// start the timer that sends the sync marks to the backup nodes.
+void buckets_sync_start(struct event_base *evbase)
+{
+	assert(evbase);
+	assert(_mark_event == NULL);
+	_mark_event = evtimer_new(evbase, mark_handler, NULL);
+	assert(_mark_event);
+	evtimer_add(_mark_event, &_timeout_sync_mark);
+}
+
+
+// the backup has been told what the primary's sync counter is for one of its buckets.  If we have 
+// already received everything up to there, then we know the bucket is current as of now.  
+// Otherwise, it will become current (as of now) when the rest of the items arrive.
+void buckets_sync_mark(node_t *node, hash_t hashmask, int seq)
+{
+	bucket_t *bucket;
+	
+	assert(node);
+	assert(_mask > 0);
+	
+	if (_buckets && hashmask <= _mask) {
+		bucket = _buckets[hashmask];
+		if (bucket && bucket->level == 1 && bucket->source_node == node) {
+			
+			if (bucket->sync_target < 0) {
+				// this is the first mark since we got the bucket, so we have everything up to here.
+				bucket->sync_seq = seq;
+			}
+			
+			bucket->sync_target = seq;
+			bucket->sync_target_time = seconds_get();
+			if (bucket->sync_seq - bucket->sync_target >= 0) {
+				bucket->sync_current = bucket->sync_target_time;
+			}
+		}
+	}
+}
+
+
+// A SYNC item has arrived for a backup bucket, with the primary's sync counter.  The primary sends 
+// all the items for a bucket over the same bulk connection (see node_bulk_client()), so they arrive 
+// in order, and having this one means we have all the ones before it too.
+void buckets_sync_seen(hash_t key_hash, int seq)
 {
-	return(_bucket_transfer);
+	bucket_t *bucket;
+	
+	assert(_mask > 0);
+	bucket = _buckets[_mask & key_hash];
+	if (bucket && bucket->level == 1 && seq - bucket->sync_seq > 0) {
+		bucket->sync_seq = seq;
+		if (bucket->sync_target >= 0 && bucket->sync_seq - bucket->sync_target >= 0) {
+			bucket->sync_current = bucket->sync_target_time;
+		}
+	}
 }
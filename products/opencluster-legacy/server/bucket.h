@@ -42,6 +42,24 @@ typedef struct {
 	// client we are transferring this bucket to.  if this is not null, then a transfer is in progress.
 	client_t *transfer_client;
 	int transfer_mode_special;
+
+	// Several buckets can be migrating at the same time (to different nodes), so each transfer 
+	// keeps its own migrate sync value (taken from the master counter when the transfer starts), 
+	// and its own count of items that have been sent but not yet acknowledged.
+	int migrate_sync;
+	int in_transit;
+
+	// Replication lag tracking, so that a backup bucket can serve reads when the client says it 
+	// can cope with slightly stale data.  On the primary, sync_seq is a count of the items that have 
+	// been synced to the backup, and it is regularly sent to the backup node in a SYNC_MARK.  On the 
+	// backup, sync_seq is the highest count that has arrived (all the items for a bucket come over the 
+	// same connection, so everything before it has arrived too), sync_target is the count from the last 
+	// mark (and sync_target_time is when it arrived), and sync_current is the last time (in seconds) 
+	// that the backup was known to have everything the primary had sent it.
+	int sync_seq;
+	int sync_target;
+	int sync_target_time;
+	int sync_current;
 	
 	struct event *shutdown_event;
 	struct event *transfer_event;
@@ -62,10 +80,18 @@ typedef struct {
 } bucket_t;
 
 
-value_t * buckets_get_value(hash_t map_hash, hash_t key_hash);
+value_t * buckets_get_value(hash_t map_hash, hash_t key_hash, int max_stale);
+int buckets_foreach_key(hash_t key_hash, int max_stale, data_item_fn item_fn, void *arg);
+int buckets_scan_map(hash_t map_hash, hash_t *cursor, int limit, int max_stale, data_item_fn item_fn, void *arg);
+int buckets_drop_map(hash_t map_hash);
+int buckets_delete_value(hash_t map_hash, hash_t key_hash);
+int buckets_delete_keys(hash_t map_hash, int count, hash_t *key_hashes);
 int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *value);
+int buckets_incr_value(hash_t map_hash, hash_t key_hash, long long delta, long long min, long long max, int expires, long long *result);
 void buckets_split_mask(hash_t current_mask, hash_t new_mask);
 void buckets_init(hash_t mask, struct event_base *evbase);
+void buckets_adopt_init(hash_t mask, struct event_base *evbase);
+bucket_t * buckets_adopt_bucket(hash_t hashmask, int level, int has_data, int sync_seq, node_t *primary_node, node_t *secondary_node, node_t *source_node, node_t *backup_node);
 int buckets_store_keyvalue(hash_t key_hash, char *name, int expires);
 const char * buckets_get_keyvalue(hash_t hash_hash);
 
@@ -77,6 +103,8 @@ int buckets_nobackup_count(void);
 void bucket_destroy_contents(bucket_t *bucket);
 
 node_t * buckets_get_primary_node(hash_t key_hash);
+node_t * buckets_get_backup_node(hash_t key_hash);
+void buckets_set_logging_node(node_t *node);
 int buckets_get_migrate_sync(void);
 
 void buckets_dump(void);
@@ -85,13 +113,17 @@ int buckets_get_primary_count(void);
 int buckets_get_secondary_count(void);
 
 int buckets_transferring(void);
+int buckets_transfer_max(void);
+void buckets_set_transfer_max(int max);
 int buckets_send_bucket(client_t *client, hash_t mask, hash_t hashmask);
 int buckets_accept_bucket(client_t *client, hash_t mask, hash_t hashmask);
 void buckets_control_bucket(client_t *client, hash_t mask, hash_t key_hash, int level);
 
 void buckets_hashmasks_update(node_t *node, hash_t hashmask, int level);
+void buckets_push_hashmasks(client_t *client);
 
 hash_t buckets_mask(void);
+bucket_t * buckets_get(hash_t hashmask);
 bucket_t * buckets_find_switchable(node_t *node);
 bucket_t * buckets_nobackup_bucket(void);
 
@@ -101,7 +133,12 @@ bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups);
 void buckets_set_transferring(bucket_t *bucket, client_t *client);
 void buckets_clear_transferring(bucket_t *bucket);
 int buckets_transfer_items(client_t *client);
-bucket_t *buckets_current_transfer(void);
+bucket_t *buckets_current_transfer(client_t *client);
+int buckets_transfer_ack(client_t *client, hash_t map_hash, hash_t key_hash);
+
+void buckets_sync_start(struct event_base *evbase);
+void buckets_sync_seen(hash_t key_hash, int seq);
+void buckets_sync_mark(node_t *node, hash_t hashmask, int seq);
 
 
 
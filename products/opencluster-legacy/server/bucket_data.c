@@ -5,6 +5,7 @@
 #include "client.h"
 #include "constants.h"
 #include "hash.h"
+#include "hashfn.h"
 #include "item.h"
 #include "logging.h"
 #include "push.h"
@@ -12,6 +13,7 @@
 #include "stats.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -24,42 +26,128 @@ typedef struct {
 	item_t *item;
 	int items_count;
 	int limit;
+	int sync;
 	client_t *client;
 } trav_t;
 
 
-// the number of items that have been sent to the transfer client, but have not been ack'd yet.  
-// Since only one bucket can be migrating at a time, this should be only in use by one bucket at a 
-// time.  No need to keep seperate values per bucket.
-int _in_transit = 0;
+static gint key_compare_fn(gconstpointer a, gconstpointer b)
+{
+	const register hash_t *aa, *bb;
+	
+	aa = a;
+	bb = b;
+	
+	return((*aa) - (*bb));
+}
+
 
+// the items for one map, in the map index.
+typedef struct {
+	hash_t map_hash;
+	GTree *keys;
+} mapkeys_t;
 
+// the map index is only kept if it has been turned on in the config.
+static int _mapindex = 0;
 
 
-int data_in_transit(void)
+// the map index keeps the keys in numeric order, so that a scan can carry on from a cursor.
+static gint hash_compare_fn(gconstpointer a, gconstpointer b)
 {
-	assert(_in_transit >= 0);
-	return(_in_transit);
+	const hash_t *aa = a;
+	const hash_t *bb = b;
+	
+	if (*aa < *bb)      { return(-1); }
+	else if (*aa > *bb) { return(1); }
+	else                { return(0); }
 }
 
 
-void data_in_transit_dec(void)
+// turn the map index on (or off) for the buckets that are created after this.
+void data_set_mapindex(int enabled)
 {
-	assert(_in_transit > 0);
-	_in_transit --;
+	_mapindex = enabled;
 }
 
-static gint key_compare_fn(gconstpointer a, gconstpointer b)
+
+
+// add the item to the map index (if there is one).
+static void mapindex_add(bucket_data_t *data, item_t *item)
 {
-	const register hash_t *aa, *bb;
+	mapkeys_t *mapkeys;
 	
-	aa = a;
-	bb = b;
+	assert(data);
+	assert(item);
 	
-	return((*aa) - (*bb));
+	if (data->mapindex == NULL) {
+		return;
+	}
+	
+	mapkeys = g_tree_lookup(data->mapindex, &item->map_key);
+	if (mapkeys == NULL) {
+		mapkeys = malloc(sizeof(mapkeys_t));
+		assert(mapkeys);
+		mapkeys->map_hash = item->map_key;
+		mapkeys->keys = g_tree_new(hash_compare_fn);
+		assert(mapkeys->keys);
+		g_tree_insert(data->mapindex, &mapkeys->map_hash, mapkeys);
+	}
+	
+	assert(g_tree_lookup(mapkeys->keys, &item->item_key) == NULL);
+	g_tree_insert(mapkeys->keys, &item->item_key, item);
+}
+
+
+// remove the item from the map index (if there is one).  This needs to be done before the item is 
+// destroyed.
+static void mapindex_remove(bucket_data_t *data, item_t *item)
+{
+	mapkeys_t *mapkeys;
+	
+	assert(data);
+	assert(item);
+	
+	if (data->mapindex == NULL) {
+		return;
+	}
+	
+	mapkeys = g_tree_lookup(data->mapindex, &item->map_key);
+	assert(mapkeys);
+	
+	gboolean found = g_tree_remove(mapkeys->keys, &item->item_key);
+	assert(found == TRUE);
+	
+	// dont keep empty trees around for maps that are no longer used.
+	if (g_tree_nnodes(mapkeys->keys) == 0) {
+		g_tree_remove(data->mapindex, &mapkeys->map_hash);
+		g_tree_destroy(mapkeys->keys);
+		free(mapkeys);
+	}
 }
 
 
+// used to move the index entries for a maplist that is moved to a different tree.
+typedef struct {
+	bucket_data_t *from;
+	bucket_data_t *to;
+} mapmove_t;
+
+
+static gboolean mapindex_move_fn(gpointer p_key, gpointer p_value, void *p_data)
+{
+	mapmove_t *move = p_data;
+	item_t *item = p_value;
+	
+	assert(move);
+	assert(item);
+	
+	mapindex_remove(move->from, item);
+	mapindex_add(move->to, item);
+	
+	return(FALSE);
+}
+
 
 bucket_data_t * data_new(hash_t mask, hash_t hashmask)
 {
@@ -75,6 +163,7 @@ bucket_data_t * data_new(hash_t mask, hash_t hashmask)
 	data->tree = g_tree_new(key_compare_fn);
 	assert(data->tree);
 	data->next = NULL;
+	data->mapindex = _mapindex ? g_tree_new(hash_compare_fn) : NULL;
 	
 	data->item_count = 0;
 	data->data_size = 0;
@@ -186,6 +275,7 @@ void data_destroy(bucket_data_t *data, hash_t mask, hash_t hashmask)
 						// now remove the reference from the binary tree.
 						gboolean found = g_tree_remove(trav.map->mapstree, &trav.item->map_key);
 						assert(found == TRUE);
+						mapindex_remove(current, trav.item);
 						
 						item_destroy(trav.item);
 						trav.item = NULL;
@@ -224,6 +314,13 @@ void data_free(bucket_data_t *data)
 	g_tree_destroy(data->tree);
 	data->tree = NULL;
 	
+	if (data->mapindex) {
+		// the index entries are removed along with the items.
+		assert(g_tree_nnodes(data->mapindex) == 0);
+		g_tree_destroy(data->mapindex);
+		data->mapindex = NULL;
+	}
+	
 	free(data);
 }
 
@@ -261,9 +358,15 @@ static maplist_t * find_maplist(hash_t key_hash, bucket_data_t *data)
 			
 			assert(list->mapstree);
 			if (current != data) {
-				// we found the item in one of the sub-chains, so we need to move it to the top.
+				// we found the item in one of the sub-chains, so we need to move it to the top.  The 
+				// tree keeps a pointer to the key, so it needs to be the one in the list.
 				g_tree_remove(current->tree, &key_hash);
-				g_tree_insert(data->tree, &key_hash, list);
+				g_tree_insert(data->tree, &list->item_key, list);
+				
+				if (current->mapindex || data->mapindex) {
+					mapmove_t move = { .from = current, .to = data };
+					g_tree_foreach(list->mapstree, mapindex_move_fn, &move);
+				}
 			}
 			
 			// since the item was found, it shouldn't be anywhere else, so we can stop going 
@@ -306,9 +409,19 @@ value_t * data_get_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata)
 			logger(LOG_DEBUG, "data_get_value: key and map found. [%#llx/%#llx].", map_hash, key_hash);
 			
 			if (item->expires > 0 && item->expires < seconds_get()) {
-				// item has expired.   We need to remove it from the map list.
+				// item has expired.   We need to remove it from the map list, and let any clients 
+				// that kept a copy of it know that it is gone.
 				assert(value == NULL);
-				assert(0);
+				
+				logger(LOG_DEBUG, "data_get_value: item [%#llx/%#llx] has expired.", map_hash, key_hash);
+				
+				gboolean found = g_tree_remove(list->mapstree, &item->map_key);
+				assert(found == TRUE);
+				mapindex_remove(ddata, item);
+				item_destroy(item);
+				item = NULL;
+				
+				client_invalidate(map_hash, key_hash);
 			}
 			else {
 				value = item->value;
@@ -389,9 +502,28 @@ static maplist_t * list_new(hash_t key_hash)
 // the control of 'value' is given to this function.
 // NOTE: value is controlled by the tree after this function call.
 // NOTE: name is controlled by the tree after this function call.
+// the item has been set (or changed).  The backup and logger nodes need to be sent the new value, and 
+// any clients that have kept a copy of the old value need to drop it.
+static void item_changed(item_t *item, client_t *backup_client, int sync_seq, client_t *logging_client)
+{
+	assert(item);
+	
+	if (backup_client) {
+		assert(sync_seq > 0);
+		push_sync_item(backup_client, item, sync_seq);
+	}
+	
+	if (logging_client) {
+		push_sync_item(logging_client, item, 0);
+	}
+	
+	client_invalidate(item->map_key, item->item_key);
+}
+
+
 void data_set_value(
 	hash_t map_hash, hash_t key_hash, bucket_data_t *ddata,  
-	value_t *value, int expires, client_t *backup_client) 
+	value_t *value, int expires, client_t *backup_client, int sync_seq, client_t *logging_client) 
 {
 	maplist_t *list;
 	item_t *item = NULL;
@@ -458,15 +590,83 @@ void data_set_value(
 		item->migrate = 0;
 		
 		g_tree_insert(list->mapstree, &item->map_key, item);
+		mapindex_add(ddata, item);
 	}
 	
 	// by this point, we should have either found an existing item that matches, or created a new one.
 	assert(item);
+	item_changed(item, backup_client, sync_seq, logging_client);
+}
 
-	// if we have a backup node connected, we need to send the item details to it.
-	if (backup_client) {
-		push_sync_item(backup_client, item);
+
+// Add 'delta' to an integer item, without it going outside 'min' and 'max'.  If the item doesn't 
+// exist (or has expired) it is created with a value of 0 first, using 'expires' (an existing item 
+// keeps the expiry it has).  The value is changed in place, and then synced the same way as a SET.  
+// Returns 0 and the new value in 'result', or -1 if the item is not an integer.
+int data_incr_value(
+	hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, 
+	long long delta, long long min, long long max, int expires, 
+	client_t *backup_client, int sync_seq, client_t *logging_client, long long *result) 
+{
+	maplist_t *list;
+	item_t *item = NULL;
+	value_t *value;
+	long long current;
+	
+	assert(ddata);
+	assert(ddata->tree);
+	assert(min <= max);
+	assert(expires >= 0);
+	assert(result);
+	
+	list = find_maplist(key_hash, ddata);
+	if (list) {
+		assert(list->mapstree);
+		item = g_tree_lookup(list->mapstree, &map_hash);
+		if (item && item->expires > 0 && item->expires < seconds_get()) {
+			// it has expired, so it counts as missing.
+			item = NULL;
+		}
 	}
+	
+	if (item) {
+		assert(item->value);
+		if (item->value->type != VALUE_LONG) {
+			return(-1);
+		}
+		current = item->value->data.l;
+	}
+	else {
+		current = 0;
+	}
+	
+	// add the delta without overflowing, and then keep it within the limits.
+	if (delta > 0 && current > LLONG_MAX - delta)      { current = LLONG_MAX; }
+	else if (delta < 0 && current < LLONG_MIN - delta) { current = LLONG_MIN; }
+	else                                               { current += delta; }
+	
+	if (current < min)      { current = min; }
+	else if (current > max) { current = max; }
+	
+	*result = current;
+	
+	if (item) {
+		logger(LOG_DEBUG, "data_incr_value: item [%#llx/%#llx] is now %lld.", map_hash, key_hash, current);
+		item->value->data.l = current;
+		item->value->valuehash = generate_hash_long(current);
+		item_changed(item, backup_client, sync_seq, logging_client);
+	}
+	else {
+		// NOTE: value is controlled by the tree after this function call.
+		value = calloc(1, sizeof(value_t));
+		assert(value);
+		value->type = VALUE_LONG;
+		value->data.l = current;
+		value->valuehash = generate_hash_long(current);
+		data_set_value(map_hash, key_hash, ddata, value, expires, backup_client, sync_seq, logging_client);
+	}
+	
+	return(0);
 }
 
 
@@ -490,17 +690,15 @@ static gboolean migrate_map_fn(gpointer p_key, gpointer p_value, void *p_data)
 	assert(data->items_count < data->limit);
 	assert(data->items_count >= 0);
 	
-	// get the current sync value for all the buckets.  This is used so that we can find the items that have not yet been migrated.
-	sync = buckets_get_migrate_sync();
+	// get the sync value for the bucket being transferred.  This is used so that we can find the items that have not yet been migrated.
+	sync = data->sync;
 	assert(sync > 0);
 	
 	item = p_value;
 	assert(item->migrate <= sync);
 	if (item->migrate < sync) {
 		logger(LOG_DEBUG, "migrate: map %#llx ready to migrate.  Sending now.", *key);
-		push_sync_item(data->client, item);
-		_in_transit ++;
-		assert(_in_transit <= TRANSIT_MAX);
+		push_sync_item(data->client, item, 0);
 		data->items_count ++;
 		assert(data->items_count <= data->limit);
 		item->migrate = sync;
@@ -536,7 +734,7 @@ static gboolean migrate_hash_fn(gpointer p_key, gpointer p_value, void *p_data)
 	assert(data->limit > 0);
 	assert(data->items_count < data->limit);
 
-	int sync = buckets_get_migrate_sync();
+	int sync = data->sync;
 	assert(sync > 0);
 	
 	if ((*key & data->search_mask) == data->search_hash) {
@@ -584,9 +782,10 @@ static gboolean migrate_hash_fn(gpointer p_key, gpointer p_value, void *p_data)
 
 
 
-// go through the trees in the data to find items for this hashkey that need to be migrated.  Uses 
-// some global variables for extra information.
-int data_migrate_items(client_t *client, bucket_data_t *data, hash_t hashmask, int limit)
+// go through the trees in the data to find items for this hashkey that need to be migrated.  Any 
+// item with a migrate value lower than 'sync' has not been sent yet.  Returns the number of items 
+// sent, which the caller needs to count as being in transit.
+int data_migrate_items(client_t *client, bucket_data_t *data, hash_t hashmask, int sync, int limit)
 {
 	bucket_data_t *current;
 	trav_t trav = {
@@ -598,13 +797,16 @@ int data_migrate_items(client_t *client, bucket_data_t *data, hash_t hashmask, i
 	
 	assert(data);
 	assert(limit > 0);
+	assert(sync > 0);
 	
 	assert(client);
 	trav.client = client;
 
 	assert(trav.items_count == 0);
 	trav.limit = limit;
+	trav.sync = sync;
 	trav.search_hash = hashmask;
+	trav.search_mask = data->mask;
 	current = data;
 
 	logger(LOG_DEBUG, "About to search the data for hashmask:%#llx, limit:%d", 
@@ -675,7 +877,7 @@ void data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int
 
 // not really much we need to do about this, because we marked the data beforehand, but for debug 
 // purposes, we will check it out.
-void data_migrated(bucket_data_t *data, hash_t map_hash, hash_t key_hash)
+void data_migrated(bucket_data_t *data, hash_t map_hash, hash_t key_hash, int sync)
 {
 #ifndef NDEBUG
 	maplist_t *list;
@@ -693,7 +895,7 @@ void data_migrated(bucket_data_t *data, hash_t map_hash, hash_t key_hash)
 		if (item) {
 			// item is found, return with the data.
 			assert(item->value);
-			assert(item->migrate == buckets_get_migrate_sync() || item->migrate == 0);
+			assert(item->migrate == sync || item->migrate == 0);
 		}
 	}
 #endif
@@ -702,6 +904,540 @@ void data_migrated(bucket_data_t *data, hash_t map_hash, hash_t key_hash)
 
 
 
+// used when walking through all the items in a bucket (with data_foreach).
+typedef struct {
+	hash_t search_hash;
+	hash_t search_mask;
+	data_item_fn item_fn;
+	data_keyvalue_fn keyvalue_fn;
+	void *arg;
+} foreach_t;
+
+
+static gboolean foreach_map_fn(gpointer p_key, gpointer p_value, void *p_data)
+{
+	foreach_t *data = p_data;
+	item_t *item = p_value;
+	
+	assert(p_key);
+	assert(item);
+	assert(data);
+	assert(data->item_fn);
+	assert(item->value);
+	
+	// expired items are skipped, they will be cleaned up when someone tries to look them up.
+	if (item->expires == 0 || item->expires >= seconds_get()) {
+		data->item_fn(item, data->arg);
+	}
+	
+	return(FALSE);
+}
+
+
+static gboolean foreach_hash_fn(gpointer p_key, gpointer p_value, void *p_data)
+{
+	foreach_t *data = p_data;
+	hash_t *key = p_key;
+	maplist_t *map = p_value;
+	
+	assert(p_key);
+	assert(map);
+	assert(data);
+	assert(data->search_mask > 0);
+	
+	// the older trees in the chain can contain items for other buckets too.
+	if ((*key & data->search_mask) == data->search_hash) {
+		assert(map->mapstree);
+		g_tree_foreach(map->mapstree, foreach_map_fn, data);
+		
+		if (map->keyvalue && data->keyvalue_fn) {
+			if (map->keyvalue_expires == 0 || map->keyvalue_expires >= seconds_get()) {
+				data->keyvalue_fn(map->item_key, map->keyvalue, map->keyvalue_expires, data->arg);
+			}
+		}
+	}
+	
+	return(FALSE);
+}
+
+
+// call 'item_fn' for every item in the bucket (and 'keyvalue_fn' for every keyvalue, if it is 
+// supplied).  Within each tree, the items are visited in hash order.  The callbacks must not modify 
+// the trees.
+void data_foreach(bucket_data_t *data, hash_t mask, hash_t hashmask, data_item_fn item_fn, data_keyvalue_fn keyvalue_fn, void *arg)
+{
+	foreach_t trav;
+	bucket_data_t *current;
+	
+	assert(data);
+	assert(item_fn);
+	assert(mask > 0);
+	assert(hashmask <= mask);
+	
+	trav.search_hash = hashmask;
+	trav.search_mask = mask;
+	trav.item_fn = item_fn;
+	trav.keyvalue_fn = keyvalue_fn;
+	trav.arg = arg;
+	
+	current = data;
+	while (current) {
+		assert(current->tree);
+		g_tree_foreach(current->tree, foreach_hash_fn, &trav);
+		current = current->next;
+	}
+}
+
+
+// go through all the items for one key hash (the fields of one record, in all the maps).  Expired 
+// items are skipped.
+void data_foreach_key(hash_t key_hash, bucket_data_t *data, data_item_fn item_fn, void *arg)
+{
+	foreach_t trav;
+	maplist_t *list;
+	
+	assert(data);
+	assert(item_fn);
+	
+	list = find_maplist(key_hash, data);
+	if (list) {
+		assert(list->mapstree);
+		trav.item_fn = item_fn;
+		trav.keyvalue_fn = NULL;
+		trav.arg = arg;
+		g_tree_foreach(list->mapstree, foreach_map_fn, &trav);
+	}
+}
+
+
+
+// an item that was found for a map, and the tree it is in.
+typedef struct {
+	item_t *item;
+	maplist_t *list;
+	bucket_data_t *data;
+} mapitem_t;
+
+// used when looking through a bucket for the items in a map.
+typedef struct {
+	hash_t map_hash;
+	hash_t search_hash;
+	hash_t search_mask;
+	hash_t from;
+	bucket_data_t *current;
+	mapitem_t *items;
+	int count;
+	int max;
+} mapfind_t;
+
+
+static void mapfind_add(mapfind_t *find, item_t *item, maplist_t *list)
+{
+	assert(find);
+	assert(item);
+	assert(list);
+	
+	if (find->count >= find->max) {
+		find->max = find->max == 0 ? 64 : find->max * 2;
+		find->items = realloc(find->items, sizeof(mapitem_t) * find->max);
+		assert(find->items);
+	}
+	
+	find->items[find->count].item = item;
+	find->items[find->count].list = list;
+	find->items[find->count].data = find->current;
+	find->count ++;
+}
+
+
+// the map index has the items we want (although the older trees can have items for other buckets).
+static gboolean mapfind_index_fn(gpointer p_key, gpointer p_value, void *p_data)
+{
+	mapfind_t *find = p_data;
+	item_t *item = p_value;
+	maplist_t *list;
+	
+	assert(find);
+	assert(item);
+	
+	if ((item->item_key & find->search_mask) == find->search_hash && item->item_key >= find->from) {
+		list = g_tree_lookup(find->current->tree, &item->item_key);
+		assert(list);
+		mapfind_add(find, item, list);
+	}
+	
+	return(FALSE);
+}
+
+
+// without the map index, we need to look at every key in the bucket to see if it is in the map.
+static gboolean mapfind_hash_fn(gpointer p_key, gpointer p_value, void *p_data)
+{
+	mapfind_t *find = p_data;
+	hash_t *key = p_key;
+	maplist_t *list = p_value;
+	item_t *item;
+	
+	assert(find);
+	assert(key);
+	assert(list);
+	
+	if ((*key & find->search_mask) == find->search_hash && *key >= find->from) {
+		assert(list->mapstree);
+		item = g_tree_lookup(list->mapstree, &find->map_hash);
+		if (item) {
+			mapfind_add(find, item, list);
+		}
+	}
+	
+	return(FALSE);
+}
+
+
+// find all the items for the map (with a key hash of at least 'from') in the bucket, including the 
+// ones that have expired.  The items array needs to be freed by the caller.
+static void mapfind(mapfind_t *find, hash_t map_hash, bucket_data_t *data, hash_t from)
+{
+	mapkeys_t *mapkeys;
+	
+	assert(find);
+	assert(data);
+	
+	memset(find, 0, sizeof(mapfind_t));
+	find->map_hash = map_hash;
+	find->search_hash = data->hashmask;
+	find->search_mask = data->mask;
+	find->from = from;
+	
+	find->current = data;
+	while (find->current) {
+		assert(find->current->tree);
+		if (find->current->mapindex) {
+			mapkeys = g_tree_lookup(find->current->mapindex, &map_hash);
+			if (mapkeys) {
+				g_tree_foreach(mapkeys->keys, mapfind_index_fn, find);
+			}
+		}
+		else {
+			g_tree_foreach(find->current->tree, mapfind_hash_fn, find);
+		}
+		find->current = find->current->next;
+	}
+}
+
+
+static int mapitem_compare(const void *a, const void *b)
+{
+	const mapitem_t *aa = a;
+	const mapitem_t *bb = b;
+	
+	if (aa->item->item_key < bb->item->item_key)      { return(-1); }
+	else if (aa->item->item_key > bb->item->item_key) { return(1); }
+	else                                              { return(0); }
+}
+
+
+// used to find the first key in a map index that is at least 'from'.
+typedef struct {
+	hash_t from;
+	const hash_t *best;
+} mapnext_t;
+
+
+static gint mapnext_fn(gconstpointer p_key, gconstpointer p_data)
+{
+	const hash_t *key = p_key;
+	mapnext_t *next = (mapnext_t *) p_data;
+	
+	assert(key);
+	assert(next);
+	
+	if (*key < next->from) {
+		// look at the bigger keys.
+		return(1);
+	}
+	
+	// this one will do, unless there is a smaller one that is still big enough.
+	if (next->best == NULL || *key < *next->best) {
+		next->best = key;
+	}
+	return(*key == next->from ? 0 : -1);
+}
+
+
+// return the item in the map index that has the smallest key hash that is at least 'from'.
+static item_t * mapindex_next(mapkeys_t *mapkeys, hash_t from)
+{
+	mapnext_t next = { .from = from, .best = NULL };
+	item_t *item;
+	
+	assert(mapkeys);
+	assert(mapkeys->keys);
+	
+	item = g_tree_search(mapkeys->keys, mapnext_fn, &next);
+	if (item == NULL && next.best) {
+		item = g_tree_lookup(mapkeys->keys, next.best);
+		assert(item);
+	}
+	
+	return(item);
+}
+
+
+// the items for this bucket that are still in the older trees are moved up to the top one, so that 
+// all the items for the map are in the one index.
+static void mapindex_pull(hash_t map_hash, bucket_data_t *data)
+{
+	mapfind_t find;
+	hash_t key_hash;
+	int i;
+	
+	assert(data);
+	
+	if (data->next == NULL) {
+		return;
+	}
+	
+	mapfind(&find, map_hash, data->next, 0);
+	for (i=0; i<find.count; i++) {
+		key_hash = find.items[i].item->item_key;
+		if ((key_hash & data->mask) == data->hashmask) {
+			find_maplist(key_hash, data);
+		}
+	}
+	
+	free(find.items);
+}
+
+
+// Go through the items in a map (in key hash order), starting from the key hash in 'cursor'.  
+// 'item_fn' is called for up to 'limit' items (expired ones are skipped).  If there are more items 
+// in the bucket, 'more' is set, and 'cursor' is updated to the key hash of the next one.  Returns 
+// the number of items.
+int data_scan_map(hash_t map_hash, bucket_data_t *data, hash_t *cursor, int limit, int *more, data_item_fn item_fn, void *arg)
+{
+	mapkeys_t *mapkeys;
+	mapfind_t find;
+	item_t *item;
+	hash_t from;
+	int count = 0;
+	int i;
+	
+	assert(data);
+	assert(cursor);
+	assert(limit > 0);
+	assert(more);
+	assert(item_fn);
+	
+	*more = 0;
+	from = *cursor;
+	
+	if (data->mapindex) {
+		mapindex_pull(map_hash, data);
+		
+		mapkeys = g_tree_lookup(data->mapindex, &map_hash);
+		item = mapkeys ? mapindex_next(mapkeys, from) : NULL;
+		while (item) {
+			if (count >= limit) {
+				*cursor = item->item_key;
+				*more = 1;
+				break;
+			}
+			
+			if (item->expires == 0 || item->expires >= seconds_get()) {
+				item_fn(item, arg);
+				count ++;
+			}
+			
+			if (item->item_key == ULLONG_MAX) { break; }
+			item = mapindex_next(mapkeys, item->item_key + 1);
+		}
+	}
+	else {
+		// without the index, all the keys in the bucket need to be checked, and then sorted.
+		mapfind(&find, map_hash, data, from);
+		qsort(find.items, find.count, sizeof(mapitem_t), mapitem_compare);
+		for (i=0; i<find.count; i++) {
+			item = find.items[i].item;
+			if (count >= limit) {
+				*cursor = item->item_key;
+				*more = 1;
+				break;
+			}
+			
+			if (item->expires == 0 || item->expires >= seconds_get()) {
+				item_fn(item, arg);
+				count ++;
+			}
+		}
+		free(find.items);
+	}
+	
+	return(count);
+}
+
+
+// remove the item from the tree it is in ('data'), and destroy it.  Any clients that have a copy of 
+// it are told that it is gone.
+static void item_remove(bucket_data_t *data, maplist_t *list, item_t *item)
+{
+	hash_t map_hash;
+	hash_t key_hash;
+	
+	assert(data);
+	assert(list);
+	assert(item);
+	assert(item->item_key == list->item_key);
+	
+	map_hash = item->map_key;
+	key_hash = item->item_key;
+	
+	gboolean removed = g_tree_remove(list->mapstree, &map_hash);
+	assert(removed == TRUE);
+	mapindex_remove(data, item);
+	item_destroy(item);
+	
+	client_invalidate(map_hash, key_hash);
+	
+	// if that was the last thing stored for the key, then the list can go too.
+	if (g_tree_nnodes(list->mapstree) == 0 && list->keyvalue == NULL) {
+		g_tree_remove(data->tree, &list->item_key);
+		g_tree_destroy(list->mapstree);
+		free(list);
+	}
+}
+
+
+// Remove all the items for a map from the bucket.  The key hashes of the items that were removed are 
+// returned in 'key_hashes' (which needs to be freed by the caller), so that the backup can be told.  
+// Returns the number of items removed.
+int data_drop_map(hash_t map_hash, bucket_data_t *data, hash_t **key_hashes)
+{
+	mapfind_t find;
+	mapitem_t *found;
+	int i;
+	
+	assert(data);
+	assert(key_hashes);
+	
+	mapfind(&find, map_hash, data, 0);
+	
+	*key_hashes = NULL;
+	if (find.count > 0) {
+		*key_hashes = malloc(sizeof(hash_t) * find.count);
+		assert(*key_hashes);
+	}
+	
+	for (i=0; i<find.count; i++) {
+		found = &find.items[i];
+		assert(found->item->map_key == map_hash);
+		
+		(*key_hashes)[i] = found->item->item_key;
+		item_remove(found->data, found->list, found->item);
+	}
+	
+	logger(LOG_DEBUG, "data_drop_map: %d items removed for map %#llx in bucket %#llx.", find.count, map_hash, data->hashmask);
+	
+	free(find.items);
+	return(find.count);
+}
+
+
+// Remove a single item from the bucket.  Returns 1 if it was there, or 0 if it wasn't.
+int data_delete_key(hash_t map_hash, hash_t key_hash, bucket_data_t *data)
+{
+	maplist_t *list;
+	item_t *item;
+	
+	assert(data);
+	
+	list = find_maplist(key_hash, data);
+	if (list) {
+		assert(list->mapstree);
+		item = g_tree_lookup(list->mapstree, &map_hash);
+		if (item) {
+			// find_maplist has moved the list to the top tree, if it wasn't already.
+			item_remove(data, list, item);
+			return(1);
+		}
+	}
+	
+	return(0);
+}
+
+
+
+// add an item to a freshly created bucket (when loading a saved file).  Unlike data_set_value, it 
+// doesn't look through the chain of older trees, and doesn't send the item anywhere, and it doesn't 
+// log anything, so it is safe to call on different buckets from several threads at once.
+// NOTE: value is controlled by the tree after this function call.
+void data_restore_item(bucket_data_t *data, hash_t map_hash, hash_t key_hash, int expires, value_t *value)
+{
+	maplist_t *list;
+	item_t *item;
+	
+	assert(data);
+	assert(data->tree);
+	assert(data->next == NULL);
+	assert(value);
+	assert(expires >= 0);
+	
+	list = g_tree_lookup(data->tree, &key_hash);
+	if (list == NULL) {
+		list = list_new(key_hash);
+		g_tree_insert(data->tree, &list->item_key, list);
+	}
+	
+	assert(list->mapstree);
+	item = g_tree_lookup(list->mapstree, &map_hash);
+	if (item) {
+		assert(item->value);
+		value_move(item->value, value);
+		free(value);
+	}
+	else {
+		item = calloc(1, sizeof(item_t));
+		assert(item);
+		
+		item->item_key = key_hash;
+		item->map_key = map_hash;
+		item->value = value;
+		item->migrate = 0;
+		
+		g_tree_insert(list->mapstree, &item->map_key, item);
+		mapindex_add(data, item);
+	}
+	
+	item->expires = expires == 0 ? 0 : seconds_get() + expires;
+}
+
+
+// same as data_restore_item, but for a keyvalue.
+// NOTE: keyvalue is controlled by the tree after this function call.
+void data_restore_keyvalue(bucket_data_t *data, hash_t key_hash, char *keyvalue, int expires)
+{
+	maplist_t *list;
+	
+	assert(data);
+	assert(data->tree);
+	assert(keyvalue);
+	assert(expires >= 0);
+	
+	list = g_tree_lookup(data->tree, &key_hash);
+	if (list == NULL) {
+		list = list_new(key_hash);
+		g_tree_insert(data->tree, &list->item_key, list);
+	}
+	
+	if (list->keyvalue) {
+		free(list->keyvalue);
+	}
+	list->keyvalue = keyvalue;
+	list->keyvalue_expires = expires == 0 ? 0 : seconds_get() + expires;
+}
+
+
+
 void data_dump(bucket_data_t *data)
 {
 	stat_dumpstr("      Data Items: %ld", data->item_count);
@@ -27,6 +27,11 @@ typedef struct __bucket_data_t {
 	// inside this new one.   When the data is eventually moved out of it, it can be deleted.
 	struct __bucket_data_t *next;
 	
+	// if the map index is turned on, this has a tree for each map_hash, which has all the items for 
+	// that map (keyed by their key_hash), so that a map can be scanned or dropped without going 
+	// through all the keys.  It is NULL if the index is off.
+	GTree *mapindex;
+	
 	long long item_count;
 	long long data_size;
 
@@ -45,19 +50,33 @@ typedef struct {
 } maplist_t;
 
 
+// callbacks used by data_foreach.
+typedef void (*data_item_fn)(item_t *item, void *arg);
+typedef void (*data_keyvalue_fn)(hash_t key_hash, const char *keyvalue, long expires, void *arg);
+
+
+
+void data_set_mapindex(int enabled);
 
 bucket_data_t * data_new(hash_t mask, hash_t hashmask);
 void data_free(bucket_data_t *data);
 void data_destroy(bucket_data_t *data, hash_t mask, hash_t hashmask);
 
 value_t * data_get_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata);
-void data_set_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, value_t *value, int expires, client_t *backup_client);
+void data_set_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, value_t *value, int expires, client_t *backup_client, int sync_seq, client_t *logging_client);
+int data_incr_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, long long delta, long long min, long long max, int expires, client_t *backup_client, int sync_seq, client_t *logging_client, long long *result);
 const char * data_get_keyvalue(hash_t key_hash, bucket_data_t *data);
 void data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int expires);
-int data_migrate_items(client_t *client, bucket_data_t *data, hash_t hash, int limit);
-int data_in_transit(void);
-void data_in_transit_dec(void);
-void data_migrated(bucket_data_t *data, hash_t map, hash_t hash);
+int data_migrate_items(client_t *client, bucket_data_t *data, hash_t hash, int sync, int limit);
+void data_migrated(bucket_data_t *data, hash_t map, hash_t hash, int sync);
+
+void data_foreach(bucket_data_t *data, hash_t mask, hash_t hashmask, data_item_fn item_fn, data_keyvalue_fn keyvalue_fn, void *arg);
+void data_foreach_key(hash_t key_hash, bucket_data_t *data, data_item_fn item_fn, void *arg);
+int data_scan_map(hash_t map_hash, bucket_data_t *data, hash_t *cursor, int limit, int *more, data_item_fn item_fn, void *arg);
+int data_drop_map(hash_t map_hash, bucket_data_t *data, hash_t **key_hashes);
+int data_delete_key(hash_t map_hash, hash_t key_hash, bucket_data_t *data);
+void data_restore_item(bucket_data_t *data, hash_t map_hash, hash_t key_hash, int expires, value_t *value);
+void data_restore_keyvalue(bucket_data_t *data, hash_t key_hash, char *keyvalue, int expires);
 
 void data_dump(bucket_data_t *data);
 
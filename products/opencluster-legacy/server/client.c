@@ -13,7 +13,9 @@
 #include "push.h"
 #include "server.h"
 #include "stats.h"
+#include "throttle.h"
 #include "timeout.h"
+#include "translog.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -39,6 +41,11 @@ typedef struct {
 static client_t **_clients = NULL;
 static int _client_count = 0;
 
+// the number of clients that want to know when items change.  Most of the time there are none, so 
+// this lets client_invalidate() return straight away.
+static int _invalidation_clients = 0;
+static long long _invalidations_sent = 0;
+
 
 // char *_connectinfo = NULL;
 
@@ -222,6 +229,13 @@ client_t * client_new(void)
 	client->tries = 0;
 	
 	client->closing = 0;
+	client->channel = CHANNEL_CONTROL;
+	client->upload = NULL;
+	client->protocol = PROTOCOL_V1;
+	client->batching = 0;
+	client->old_replies = 0;
+	client->compress = NULL;
+	client->features = 0;
 
 	// add the new client to the clients list.
 	if (_client_count > 0) {
@@ -292,8 +306,21 @@ void client_free(client_t *client)
 	
 	logger(LOG_INFO, "client_free: handle=%d", client->handle);
 
+	// if there was any migration work waiting on the throttle, it cant be done now.
+	throttle_cancel(client);
+
+	client_set_invalidations(client, 0);
+
+	// a value that was still being streamed in is thrown away.
+	client_upload_free(client);
+
+	// if we are a logger, there could be replies waiting for the log to be written.
+	if (translog_active()) {
+		translog_client_gone(client);
+	}
+
 	if (client->node) {
-		node_detach_client(client->node);
+		node_detach_client(client->node, client);
 	}
 
 	assert(client->out.length == 0);
@@ -324,6 +351,11 @@ void client_free(client_t *client)
 	
 	assert(client->shutdown_event == NULL);
 
+	if (client->compress) {
+		compress_free(client->compress);
+		client->compress = NULL;
+	}
+
 	if (client->handle != INVALID_HANDLE) {
 		logger(LOG_DEBUG, "client_free: closing socket %d", client->handle);
 		EVUTIL_CLOSESOCKET(client->handle);
@@ -375,6 +407,91 @@ void client_free(client_t *client)
 
 
 
+// get the header of the next message in the incoming buffer.  Returns the size of the header, 0 if 
+// we dont have all of it yet, or -1 if it isn't valid (including a payload larger than 
+// FRAME_MAX_LENGTH, which we will never accept).  The v2 header is decoded a byte at a time 
+// here, rather than a field at a time, since it is done for every message.
+static int frame_header(client_t *client, header_t *header, int *flags)
+{
+	const unsigned char *data;
+	const raw_header_t *raw;
+	unsigned int length;
+	int avail;
+	int pos;
+	int shift;
+	
+	assert(client);
+	assert(header);
+	assert(flags);
+	
+	data = (const unsigned char *) client->in.buffer + client->in.offset;
+	avail = client->in.length;
+	
+	if (client->protocol != PROTOCOL_V2 || client->old_replies > 0) {
+		if (avail < HEADER_SIZE) {
+			return(0);
+		}
+		raw = (const void *) data;
+		header->command = be16toh(raw->command);
+		header->response_code = be16toh(raw->response_code);
+		header->userid = be32toh(raw->userid);
+		header->length = be32toh(raw->length);
+		*flags = 0;
+		if (header->length > FRAME_MAX_LENGTH) {
+			return(-1);
+		}
+		return(HEADER_SIZE);
+	}
+	
+	if (avail < FRAME_HEADER_MIN) {
+		return(0);
+	}
+	
+	// the fixed part of the header depends on the flags, and is followed by at least one byte of the 
+	// length.
+	*flags = data[0];
+	pos = FRAME_HEADER_MIN - 1;
+	if (*flags & FRAME_REPLY)  { pos += 2; }
+	if (*flags & FRAME_LONGID) { pos += 2; }
+	if (pos >= avail) {
+		return(0);
+	}
+	
+	header->command = (data[1] << 8) | data[2];
+	pos = 3;
+	header->response_code = 0;
+	if (*flags & FRAME_REPLY) {
+		header->response_code = (data[pos] << 8) | data[pos+1];
+		pos += 2;
+	}
+	header->userid = 0;
+	if (*flags & FRAME_LONGID) {
+		header->userid = (data[pos] << 24) | (data[pos+1] << 16);
+		pos += 2;
+	}
+	header->userid |= (data[pos] << 8) | data[pos+1];
+	pos += 2;
+	
+	length = 0;
+	for (shift = 0; pos < avail; shift += 7) {
+		if (shift > 28 || (shift == 28 && data[pos] > 0x07)) {
+			// more than 31 bits.
+			return(-1);
+		}
+		length |= (data[pos] & 0x7F) << shift;
+		if ((data[pos++] & 0x80) == 0) {
+			if (length > FRAME_MAX_LENGTH) {
+				return(-1);
+			}
+			header->length = length;
+			return(pos);
+		}
+	}
+	
+	return(0);
+}
+
+
 // Process the messages received.  The messages could be new commands, or replies to commands that were sent.
 static int process_data(client_t *client) 
 {
@@ -382,7 +499,9 @@ static int process_data(client_t *client)
 	int stopped = 0;
 	char *ptr;
 	header_t header;
-	raw_header_t *raw;
+	int header_size;
+	int frame_size;
+	int flags;
 
 	void (*func_cmd)(client_t *client, header_t *header, char *payload);
 	void (*func_response)(client_t *client, header_t *header, char *payload, payload_t *request);
@@ -414,44 +533,75 @@ static int process_data(client_t *client)
 		assert((client->in.length + client->in.offset) <= client->in.max);
 		
 		// if we dont have enough for a header, then we dont have enough to build a message.  Messages are at least that.
-		if (client->in.length < HEADER_SIZE) {
+		header_size = frame_header(client, &header, &flags);
+		if (header_size == 0) {
 			// we didn't have enough, even for the header, so we are stopping.
             logger(LOG_DEBUG, "[process_data] There wasn't enough data to build anything so not processing the buffer. in.length=%d", client->in.length);
 			stopped = 1;
 		}
+		else if (header_size < 0) {
+			// the length couldn't be right, so we can't tell where the next message starts.
+			client_fail(client);
+			client->in.offset = 0;
+			client->in.length = 0;
+			client_shutdown(client);
+			stopped = 1;
+		}
 		else {
 			
-			// keeping in mind the offset, get the 4 params, and determine what we need to do with 
-			// them.
-			
 			// *** performance tuning.  We should only parse the header once.  It should be saved in 
 			//     the client object and only done once.
 			
-			raw = (void *) (client->in.buffer + client->in.offset);
-
-			header.length  = be32toh(raw->length);
-			if ((client->in.length-HEADER_SIZE) < header.length) {
+			if ((client->in.length - header_size) < header.length) {
 				// we dont have enough data yet.
 				stopped = 1;
 			}
 			else {
 
-				header.command = be16toh(raw->command);
-				header.response_code  = be16toh(raw->response_code);
-				header.userid  = be32toh(raw->userid);
-
 				logger(LOG_DEBUG, "New telegram: Command=0x%X, repcmd=0x%X, userid=%d, length=%d, buffer_length=%d", 
 						header.command, header.response_code, 
 						header.userid, header.length, client->in.length);
 				
 				// get a pointer to the payload
+				frame_size = header_size + header.length;
 				if (header.length == 0) { ptr = NULL; }
 				else { 
-					ptr = client->in.buffer + client->in.offset + HEADER_SIZE;
+					ptr = client->in.buffer + client->in.offset + header_size;
 					assert(ptr);
 				}
 
-				if (header.command >= _command_max || _commands[header.command] == NULL) {
+				// a compressed payload is expanded, and the handlers see the expanded one.  The 
+				// expanded payload is only valid until the next frame.
+				if ((flags & FRAME_COMPRESSED) && client->compress) {
+					const char *expanded;
+					int length = compress_expand(client->compress, ptr, header.length, &expanded);
+					if (length < 0) {
+						// the two ends of the stream no longer agree, so nothing else on the 
+						// connection can be trusted.
+						client_fail(client);
+						client->in.offset = 0;
+						client->in.length = 0;
+						client_shutdown(client);
+						stopped = 1;
+						break;
+					}
+					ptr = (char *) expanded;
+					header.length = length;
+					flags &= ~FRAME_COMPRESSED;
+				}
+
+				// replies are held while the rest of a batch is still to come.
+				if (header.response_code == 0) {
+					client->batching = (flags & FRAME_BATCH) ? 1 : 0;
+				}
+
+				if (flags & (FRAME_COMPRESSED | FRAME_DURABLE)) {
+					logger(LOG_WARN, "Unsupported frame options: Command=%d, flags=%#x", header.command, flags);
+					if (header.response_code == 0) {
+						client_send_reply(client, &header, RESPONSE_UNKNOWN, NO_PAYLOAD);
+					}
+				}
+				else if (header.command >= _command_max || _commands[header.command] == NULL) {
 
 					if (header.response_code == 0) {
 						logger(LOG_ERROR, "Unknown command received: Command=%d, userid=%d, length=%d", header.command, header.userid, header.length);
@@ -503,6 +653,9 @@ static int process_data(client_t *client)
 							assert(client->pending > 0);
 							client->pending --;
 							assert(client->pending >= 0);
+							if (client->old_replies > 0) {
+								client->old_replies --;
+							}
 							
 							// TODO: This for loop can be optimised by having a lookup array by command 
 							// instead of an iterative list.  This would use up more memory, but would 
@@ -547,14 +700,14 @@ static int process_data(client_t *client)
 				}
 				
 				// need to adjust the details of the incoming buffer.
-				client->in.length -= (header.length + HEADER_SIZE);
+				client->in.length -= frame_size;
 				assert(client->in.length >= 0);
 				if (client->in.length == 0) {
 					client->in.offset = 0;
 					stopped = 1;
 				}
 				else {
-					client->in.offset += (header.length + HEADER_SIZE);
+					client->in.offset += frame_size;
 				}
 				assert( ( client->in.length + client->in.offset ) <= client->in.max);
 			}	
@@ -646,15 +799,27 @@ static void read_handler(int fd, short int flags, void *arg)
 {
 	client_t *client = (client_t *) arg;
 	int avail;
+	int needed;
+	int remaining;
+	int grow;
 	int res;
 	int processed;
+	char *start;
+	header_t header;
+	int header_size;
+	int frame_flags;
 	
 	assert(fd >= 0);
 	assert(flags != 0);
 	assert(client);
 	assert(client->handle == fd);
 
-	if (flags & EV_TIMEOUT) {
+	if ((flags & EV_TIMEOUT) && client->channel == CHANNEL_BULK) {
+		// bulk connections can be idle for as long as they like.  The control connection is the 
+		// one that is pinged to check that the node is still there.
+		assert(client->timeout == 0);
+	}
+	else if (flags & EV_TIMEOUT) {
 		
 		assert(client->timeout >= 0 && client->timeout < CLIENT_TIMEOUT_LIMIT);
 
@@ -682,21 +847,51 @@ static void read_handler(int fd, short int flags, void *arg)
 	else {
 		// Make sure we have room in our inbuffer.
 		assert((client->in.length + client->in.offset) <= client->in.max);
+
+		// if there is a partial message left over at the end of the buffer, move it to the front 
+		// when the offset has crept up too far, or when there isn't enough room after it.
+		if (client->in.offset > 0) {
+			avail = client->in.max - client->in.length - client->in.offset;
+			if (client->in.offset >= MAX_INCOMING_OFFSET || avail < DEFAULT_BUFSIZE) {
+				assert(client->in.length > 0);
+				memmove(client->in.buffer, client->in.buffer + client->in.offset, client->in.length);
+				client->in.offset = 0;
+			}
+		}
+
+		// if we already have the header of the message that is arriving, we know how big it is, so 
+		// make room for more of it at a time, rather than growing the buffer DEFAULT_BUFSIZE at a 
+		// time (which would realloc a large value over and over).  The length is only what the other 
+		// end says it is, so the buffer never grows by more than what has actually arrived.  It 
+		// still only takes a few reallocs to get to the full size.
+		needed = DEFAULT_BUFSIZE;
+		header_size = frame_header(client, &header, &frame_flags);
+		if (header_size > 0) {
+			remaining = (header_size + header.length) - client->in.length;
+			if (remaining > client->in.length) {
+				remaining = client->in.length;
+			}
+			if (remaining > needed) {
+				needed = remaining;
+			}
+		}
+
 		avail = client->in.max - client->in.length - client->in.offset;
-		if (avail < DEFAULT_BUFSIZE) {
-			// we want to increase buffer size, so we'll add another DEFAULT_BUFSIZE to the max.  
-			// This should keep it in multiples of DEFAULT_BUFSIZE, regardless of how much is 
-			// available for each read.
-			
-			client->in.buffer = realloc(client->in.buffer, client->in.max + DEFAULT_BUFSIZE);
-			client->in.max += DEFAULT_BUFSIZE;
-			avail += DEFAULT_BUFSIZE;
+		if (avail < needed) {
+			// we want to increase buffer size, but keep it in multiples of DEFAULT_BUFSIZE, 
+			// regardless of how much is available for each read.
+			grow = ((needed - avail + DEFAULT_BUFSIZE - 1) / DEFAULT_BUFSIZE) * DEFAULT_BUFSIZE;
+			client->in.buffer = realloc(client->in.buffer, client->in.max + grow);
+			assert(client->in.buffer);
+			client->in.max += grow;
+			avail += grow;
 		}
 		assert(avail >= DEFAULT_BUFSIZE);
 		
-		// read data from the socket.
+		// read data from the socket, after whatever we already have.
 		assert(client->in.buffer);
-		res = read(fd, client->in.buffer + client->in.offset, avail);
+		start = client->in.buffer + client->in.offset + client->in.length;
+		res = read(fd, start, avail);
 		if (res > 0) {
 			
 			client->timeout = 0;
@@ -705,7 +900,7 @@ static void read_handler(int fd, short int flags, void *arg)
 			client->in.total += res;
 			
 			if (log_getlevel() >= LOG_EXTRA) {
-				log_data(fd, "IN: ", (unsigned char *)client->in.buffer + client->in.offset, res);
+				log_data(fd, "IN: ", (unsigned char *)start, res);
 			}
 
 			// got some data.
@@ -717,13 +912,21 @@ static void read_handler(int fd, short int flags, void *arg)
 				// something failed while processing.  We need to close the client connection.
 				assert(0);
 			}
+
+			// if the buffer had to grow for a large message, and it is empty now, give the memory back.
+			if (client->in.length == 0 && client->in.max > MAX_IDLE_BUFFER) {
+				assert(client->in.offset == 0);
+				client->in.buffer = realloc(client->in.buffer, DEFAULT_BUFSIZE);
+				assert(client->in.buffer);
+				client->in.max = DEFAULT_BUFSIZE;
+			}
 		}
 		else {
 			// the connection was closed, or there was an error.
 			logger(LOG_ERROR, "socket %d closed. res=%d, errno=%d,'%s'", fd, res, errno, strerror(errno));
 			
 			// free the client resources.
-			if (client->node) {
+			if (client->node && client->channel == CHANNEL_CONTROL) {
 				// this client is actually a node connection.  We need to create an event to wait 
 				// and then try connecting again.
 				node_retry(client->node);
@@ -745,42 +948,125 @@ static void read_handler(int fd, short int flags, void *arg)
 	}
 }
 
-static void send_data(client_t *client, raw_header_t *rawheader, int length, void *payload)
+// start sending what is in the outgoing buffer, if we aren't already.
+static void write_start(client_t *client)
+{
+	assert(client);
+	assert(client->out.length > 0);
+	
+	// *** For data throughput performance, it may be better to attempt to send the data straight 
+	//     away if a write-event hasn't been set, and if the write fails, then set an event.  This 
+	//     will only work on non-blocking sockets though.
+	if (client->write_event == NULL) {
+		assert(_evbase);
+		assert(client->handle > 0);
+		client->write_event = event_new( _evbase, client->handle, EV_WRITE | EV_PERSIST, write_handler, (void *)client); 
+		assert(client->write_event);
+		event_add(client->write_event, NULL);
+	}
+}
+
+
+// build the header for a message in the framing that the connection uses.  Returns the size of the 
+// header (at most FRAME_HEADER_MAX).  Any flags for the payload (FRAME_COMPRESSED) are only 
+// possible with the v2 framing.
+static int frame_encode(client_t *client, unsigned char *out, int command, int code, unsigned int userid, unsigned int length, int flags)
+{
+	raw_header_t *raw;
+	int pos;
+	
+	assert(client);
+	assert(out);
+	assert(FRAME_HEADER_MAX >= HEADER_SIZE);
+	
+	if (client->protocol != PROTOCOL_V2) {
+		assert(flags == 0);
+		raw = (void *) out;
+		raw->command = htobe16(command);
+		raw->response_code = htobe16(code);
+		raw->userid = htobe32(userid);
+		raw->length = htobe32(length);
+		return(HEADER_SIZE);
+	}
+	
+	// the ids of the requests we send are payload handles, which could be larger than 16 bits.
+	if (code > 0)         { flags |= FRAME_REPLY; }
+	if (userid > 0xFFFF)  { flags |= FRAME_LONGID; }
+	
+	out[0] = flags;
+	out[1] = command >> 8;
+	out[2] = command & 0xFF;
+	pos = 3;
+	if (flags & FRAME_REPLY) {
+		out[pos++] = code >> 8;
+		out[pos++] = code & 0xFF;
+	}
+	if (flags & FRAME_LONGID) {
+		out[pos++] = userid >> 24;
+		out[pos++] = (userid >> 16) & 0xFF;
+	}
+	out[pos++] = (userid >> 8) & 0xFF;
+	out[pos++] = userid & 0xFF;
+	
+	while (length >= 0x80) {
+		out[pos++] = (length & 0x7F) | 0x80;
+		length >>= 7;
+	}
+	out[pos++] = length;
+	
+	assert(pos <= FRAME_HEADER_MAX);
+	return(pos);
+}
+
+
+static void send_data(client_t *client, int command, int code, unsigned int userid, int length, void *payload)
 {
 	char *ptr;
+	int needed;
+	int flags = 0;
 	
 	assert(client);
-	assert(rawheader);
 	assert((length == 0 && payload == NULL) || (length > 0 && payload));
 
 	assert(sizeof(raw_header_t) == HEADER_SIZE);
 
-	// make sure the clients out_buffer is big enough for the message.
-	while (client->out.max < client->out.length + client->out.offset + sizeof(raw_header_t) + length) {
-		client->out.buffer = realloc(client->out.buffer, client->out.max + DEFAULT_BUFSIZE);
-		client->out.max += DEFAULT_BUFSIZE;
+	// on a compressed link, the payload is replaced with the compressed one (unless it was too small, 
+	// or the link is currently bypassing compression).
+	if (client->compress && length > 0) {
+		const char *compressed;
+		int size = compress_frame(client->compress, payload, length, &compressed);
+		if (size > 0) {
+			assert(client->protocol == PROTOCOL_V2);
+			payload = (void *) compressed;
+			length = size;
+			flags |= FRAME_COMPRESSED;
+		}
+	}
+
+	// make sure the clients out_buffer is big enough for the message (keeping it in multiples of 
+	// DEFAULT_BUFSIZE).
+	needed = client->out.length + client->out.offset + FRAME_HEADER_MAX + length;
+	if (client->out.max < needed) {
+		client->out.max = ((needed / DEFAULT_BUFSIZE) + 1) * DEFAULT_BUFSIZE;
+		client->out.buffer = realloc(client->out.buffer, client->out.max);
 	}
 	assert(client->out.buffer);
 	
 	// add the header and the payload to the clients out_buffer, a
 	ptr = (client->out.buffer + client->out.offset + client->out.length);
 	
-	memcpy(ptr, rawheader, sizeof(raw_header_t));
-	ptr += sizeof(raw_header_t);
-	memcpy(ptr, payload, length);
-	client->out.length += (sizeof(raw_header_t) + length);
+	needed = frame_encode(client, (unsigned char *) ptr, command, code, userid, length, flags);
+	ptr += needed;
+	if (length > 0) {
+		memcpy(ptr, payload, length);
+	}
+	client->out.length += (needed + length);
 	
-	// if the clients write-event is not set, then set it.
-	// *** For data throughput performance, it may be better to attempt to send the data straight 
-	//     away if a write-event hasn't been set, and if the write fails, then set an event.  This 
-	//     will only work on non-blocking sockets though.
+	// if the client is part way through sending a batch of requests, the replies are sent together 
+	// when it is finished.
 	assert(client->out.length > 0);
-	if (client->write_event == NULL) {
-		assert(_evbase);
-		assert(client->handle > 0);
-		client->write_event = event_new( _evbase, client->handle, EV_WRITE | EV_PERSIST, write_handler, (void *)client); 
-		assert(client->write_event);
-		event_add(client->write_event, NULL);
+	if (client->batching == 0) {
+		write_start(client);
 	}
 }
 
@@ -797,19 +1083,13 @@ void client_send_message(PAYLOAD payload_id)
 	assert(payload->buffer);
 	assert(payload->command > 0);
 	
-	raw_header_t raw;
-	raw.command = htobe16(payload->command);
-	raw.response_code = 0;
-	raw.userid = htobe32(payload_id);
-	raw.length = htobe32(payload->length);
-	
 	client_t *client = payload->client;
 	assert(client);
 	assert(client->pending >= 0);
 	client->pending++;
 	assert(client->pending > 0);
 	
-	send_data(client, &raw, payload->length, 
+	send_data(client, payload->command, 0, payload_id, payload->length, 
 		payload->length > 0 ? payload->buffer : NULL );
 }
 
@@ -838,16 +1118,7 @@ void client_send_reply(client_t *client, header_t *header, short code, PAYLOAD p
 		}
 	}
 		
-	assert(sizeof(raw_header_t) == HEADER_SIZE);
-
-	// build the raw header.
-	raw_header_t raw;
-	raw.command = htobe16(header->command);
-	raw.response_code = htobe16(code);
-	raw.userid = htobe32(header->userid);
-	raw.length = htobe32(length);
-
-	send_data(client, &raw, length, ptr);
+	send_data(client, header->command, code, header->userid, length, ptr);
 
 	if (payload_id >= 0) {
 		// since this is a reply, we are not going to need the payload again, so we can release it now.
@@ -1035,12 +1306,17 @@ static void client_dump(client_t *client)
 {
 	assert(client);
 	
-	stat_dumpstr("    [%d] Node=%s, Data Received=%ld, Data Sent=%ld", 
+	stat_dumpstr("    [%d] Node=%s, Channel=%s, Data Received=%ld, Data Sent=%ld", 
 				 client->handle,
 				 client->node ? "yes" : "no",
+				 client->channel == CHANNEL_BULK ? "bulk" : "control",
 				 client->in.total,
 				 client->out.total
 				);
+
+	if (client->compress) {
+		compress_dump(client->compress);
+	}
 }
 
 
@@ -1049,6 +1325,8 @@ void clients_dump(void)
 	int i;
 	
 	stat_dumpstr("CLIENTS");
+	stat_dumpstr("  Invalidation clients: %d", _invalidation_clients);
+	stat_dumpstr("  Invalidations sent: %lld", _invalidations_sent);
 	
 	if (_client_count > 0) {
 		stat_dumpstr(NULL);
@@ -1094,6 +1372,73 @@ void client_update_hashmasks(hash_t mask, hash_t hashmask, int level)
 }
 
 
+// let the regular clients that asked for it (FEATURE_HOTKEYS) know which nodes have copies of a hot 
+// key, so that they can spread the reads for it.  Other nodes dont need to know.
+void client_update_hotkey(hash_t map_hash, hash_t key_hash, int count, const char **conninfos)
+{
+	int i;
+	
+	if (_clients) {
+		for (i=0; i<_client_count; i++) {
+			if (_clients[i]) {
+				if (_clients[i]->handle >= 0 && _clients[i]->node == NULL && (_clients[i]->features & FEATURE_HOTKEYS)) {
+					push_hotkey(_clients[i], map_hash, key_hash, count, conninfos);
+				}
+			}
+		}
+	}
+}
+
+
+void client_set_invalidations(client_t *client, int enabled)
+{
+	assert(client);
+	
+	enabled = enabled ? 1 : 0;
+	if (client->invalidations != enabled) {
+		client->invalidations = enabled;
+		_invalidation_clients += enabled ? 1 : -1;
+		assert(_invalidation_clients >= 0);
+	}
+}
+
+
+// discard a value that was being streamed in on this connection (if there was one).  Either the 
+// stream was abandoned, or something went wrong with it.
+void client_upload_free(client_t *client)
+{
+	assert(client);
+	
+	if (client->upload) {
+		assert(client->upload->value);
+		value_free(client->upload->value);
+		free(client->upload);
+		client->upload = NULL;
+	}
+}
+
+
+// an item has changed (or expired), so tell the clients that might have kept a copy of it.  We dont 
+// keep track of which clients read which items, so every client that asked for invalidations gets 
+// them all.  That is fine for the read-mostly data that clients would cache.
+void client_invalidate(hash_t map_hash, hash_t key_hash)
+{
+	int i;
+	
+	if (_invalidation_clients == 0) {
+		return;
+	}
+	
+	assert(_clients);
+	for (i=0; i<_client_count; i++) {
+		if (_clients[i] && _clients[i]->invalidations && _clients[i]->handle >= 0 && _clients[i]->closing == 0) {
+			push_invalidate(_clients[i], map_hash, key_hash);
+			_invalidations_sent ++;
+		}
+	}
+}
+
+
 int client_count(void)
 {
 	assert(_client_count >= 0);
@@ -1101,6 +1446,54 @@ int client_count(void)
 }
 
 
+// return the client at this position in the list (which could be NULL).  Used along with 
+// client_count() to go through all the clients.
+client_t * client_get(int index)
+{
+	assert(index >= 0 && index < _client_count);
+	assert(_clients);
+	return(_clients[index]);
+}
+
+
+// when taking over a connection from the node we are replacing (during an upgrade), any data that it 
+// had received but not processed (a partial message), or had not sent yet, is carried over.
+void client_restore_buffers(client_t *client, const char *in, int in_length, const char *out, int out_length)
+{
+	assert(client);
+	assert(client->handle > 0);
+	assert(in_length >= 0 && out_length >= 0);
+	assert(client->in.length == 0);
+	assert(client->out.length == 0);
+	
+	if (in_length > 0) {
+		assert(in);
+		client->in.max = ((in_length / DEFAULT_BUFSIZE) + 1) * DEFAULT_BUFSIZE;
+		client->in.buffer = realloc(client->in.buffer, client->in.max);
+		assert(client->in.buffer);
+		memcpy(client->in.buffer, in, in_length);
+		client->in.offset = 0;
+		client->in.length = in_length;
+	}
+	
+	if (out_length > 0) {
+		assert(out);
+		client->out.max = ((out_length / DEFAULT_BUFSIZE) + 1) * DEFAULT_BUFSIZE;
+		client->out.buffer = realloc(client->out.buffer, client->out.max);
+		assert(client->out.buffer);
+		memcpy(client->out.buffer, out, out_length);
+		client->out.offset = 0;
+		client->out.length = out_length;
+		
+		assert(client->write_event == NULL);
+		assert(_evbase);
+		client->write_event = event_new( _evbase, client->handle, EV_WRITE | EV_PERSIST, write_handler, (void *)client); 
+		assert(client->write_event);
+		event_add(client->write_event, NULL);
+	}
+}
+
+
 
 // setup events to shutdown all the clients.  It will shutdown all the client-only connections, and 
 // setup events to shutdown the server-node connections after all the buckets have finished 
@@ -3,14 +3,28 @@
 #ifndef __CLIENT_H
 #define __CLIENT_H
 
+#include "compress.h"
 #include "event-compat.h"
 #include "hash.h"
 #include "header.h"
 #include "payload.h"
+#include "value.h"
 
 
 
 
+// a large value that is being received in chunks (COMMAND_SET_STREAM followed by COMMAND_SET_CHUNK).  
+// The value is allocated at its full size when the stream starts, and each chunk is copied straight 
+// into it.  It isn't stored in the bucket until the last chunk has arrived.
+typedef struct {
+	hash_t map_hash;
+	hash_t key_hash;
+	int expires;
+	int received;
+	value_t *value;
+} upload_t;
+
+
 typedef struct {
 	void *node;	// node_t;
 	
@@ -35,7 +49,33 @@ typedef struct {
 	
 	int closing;
 
+	// node connections are either the control channel (CHANNEL_CONTROL), or one of the bulk 
+	// channels (CHANNEL_BULK) that carry the SYNC data.  Regular clients are always CHANNEL_CONTROL.
+	int channel;
+
+	// the framing that the connection is using (PROTOCOL_V1 or PROTOCOL_V2), and if a batch of 
+	// requests is still arriving, so the replies are being held until it is complete.
+	int protocol;
+	int batching;
+	
+	// when the framing changes, the client will already have replied to the messages we sent before 
+	// the change, using the old framing.  This is how many of those replies are still to come.
+	int old_replies;
+
+	// bulk connections to other nodes can be compressed, if both nodes agreed to it.
+	compress_t *compress;
+
+	// the optional features (FEATURE_*) that the client said it understands in its HELLO.
+	int features;
+
 	void *transfer_bucket;
+
+	// the client keeps its own copy of items it has read, and wants to be told (with 
+	// COMMAND_INVALIDATE) whenever an item changes or expires.
+	int invalidations;
+
+	// only one value can be streamed on a connection at a time.
+	upload_t *upload;
 } client_t;
 
 void clients_init(struct event_base *evbase);
@@ -57,12 +97,18 @@ void client_add_response(int cmd, int code, void *fn);
 void client_add_special(int code, void *fn);
 
 void client_update_hashmasks(hash_t mask, hash_t hashmask, int level);
+void client_update_hotkey(hash_t map_hash, hash_t key_hash, int count, const char **conninfos);
+void client_set_invalidations(client_t *client, int enabled);
+void client_upload_free(client_t *client);
+void client_invalidate(hash_t map_hash, hash_t key_hash);
 
 
 void clients_init_commands(int max);
 void clients_cleanup(void);
 
 int client_count(void);
+client_t * client_get(int index);
+void client_restore_buffers(client_t *client, const char *in, int in_length, const char *out, int out_length);
 
 void clients_shutdown(void);
 
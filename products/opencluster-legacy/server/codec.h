@@ -0,0 +1,634 @@
+// codec.h
+//
+// Generated by gencodec.awk from messages.def.  Do not edit, change messages.def instead.
+
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <assert.h>
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+
+// the payloads have no alignment, so the values are copied in and out (which the compiler turns
+// into a single load or store).
+static inline void codec_put32(char *p, int32_t value) { uint32_t v = htobe32((uint32_t) value); memcpy(p, &v, 4); }
+static inline void codec_put64(char *p, uint64_t value) { uint64_t v = htobe64(value); memcpy(p, &v, 8); }
+static inline int32_t codec_get32(const char *p) { uint32_t v; memcpy(&v, p, 4); return((int32_t) be32toh(v)); }
+static inline uint64_t codec_get64(const char *p) { uint64_t v; memcpy(&v, p, 8); return(be64toh(v)); }
+
+
+// GET_INT request.  max_stale (in seconds) allows a backup node to answer.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t max_stale;
+} msg_get_int_t;
+
+#define MSG_GET_INT_MIN 16
+
+static inline int msg_get_int_size(const msg_get_int_t *msg)
+{
+	assert(msg);
+	int size = MSG_GET_INT_MIN;
+	if (msg->max_stale != -1) { size += 4; }
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_get_int_encode(char *buffer, int max, const msg_get_int_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_get_int_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	if (msg->max_stale != -1) { codec_put32(p, msg->max_stale); p += 4; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_get_int_decode(const char *buffer, int length, msg_get_int_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 16) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	if (end - p >= 4) { msg->max_stale = codec_get32(p); p += 4; }
+	else { msg->max_stale = -1; }
+	return(p - buffer);
+}
+
+
+// GET_STRING request.  A max_length of 0 means there is no limit.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t max_length;
+	int32_t max_stale;
+} msg_get_str_t;
+
+#define MSG_GET_STR_MIN 20
+
+static inline int msg_get_str_size(const msg_get_str_t *msg)
+{
+	assert(msg);
+	int size = MSG_GET_STR_MIN;
+	if (msg->max_stale != -1) { size += 4; }
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_get_str_encode(char *buffer, int max, const msg_get_str_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_get_str_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->max_length); p += 4;
+	if (msg->max_stale != -1) { codec_put32(p, msg->max_stale); p += 4; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_get_str_decode(const char *buffer, int length, msg_get_str_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 20) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->max_length = codec_get32(p); p += 4;
+	if (end - p >= 4) { msg->max_stale = codec_get32(p); p += 4; }
+	else { msg->max_stale = -1; }
+	return(p - buffer);
+}
+
+
+// SET_INT request.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t expires;
+	int64_t value;
+} msg_set_int_t;
+
+#define MSG_SET_INT_MIN 28
+
+static inline int msg_set_int_size(const msg_set_int_t *msg)
+{
+	assert(msg);
+	int size = MSG_SET_INT_MIN;
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_set_int_encode(char *buffer, int max, const msg_set_int_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_set_int_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->expires); p += 4;
+	codec_put64(p, msg->value); p += 8;
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_set_int_decode(const char *buffer, int length, msg_set_int_t *msg)
+{
+	const char *p = buffer;
+	assert(buffer && msg);
+	if (length < 28) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->expires = codec_get32(p); p += 4;
+	msg->value = codec_get64(p); p += 8;
+	return(p - buffer);
+}
+
+
+// SET_STRING request.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t expires;
+	const char *value;
+	int32_t value_len;
+} msg_set_str_t;
+
+#define MSG_SET_STR_MIN 24
+
+static inline int msg_set_str_size(const msg_set_str_t *msg)
+{
+	assert(msg);
+	int size = MSG_SET_STR_MIN;
+	size += msg->value_len;
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_set_str_encode(char *buffer, int max, const msg_set_str_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_set_str_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->expires); p += 4;
+	assert(msg->value_len >= 0);
+	codec_put32(p, msg->value_len); p += 4;
+	if (msg->value_len > 0) { memcpy(p, msg->value, msg->value_len); p += msg->value_len; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_set_str_decode(const char *buffer, int length, msg_set_str_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 24) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->expires = codec_get32(p); p += 4;
+	msg->value_len = codec_get32(p); p += 4;
+	if (msg->value_len < 0 || msg->value_len > end - p) { return(-1); }
+	msg->value = p; p += msg->value_len;
+	return(p - buffer);
+}
+
+
+// DATA_INT reply to a GET_INT.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	uint64_t valuehash;
+	int64_t value;
+} msg_data_int_t;
+
+#define MSG_DATA_INT_MIN 32
+
+static inline int msg_data_int_size(const msg_data_int_t *msg)
+{
+	assert(msg);
+	int size = MSG_DATA_INT_MIN;
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_data_int_encode(char *buffer, int max, const msg_data_int_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_data_int_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put64(p, msg->valuehash); p += 8;
+	codec_put64(p, msg->value); p += 8;
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_data_int_decode(const char *buffer, int length, msg_data_int_t *msg)
+{
+	const char *p = buffer;
+	assert(buffer && msg);
+	if (length < 32) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->valuehash = codec_get64(p); p += 8;
+	msg->value = codec_get64(p); p += 8;
+	return(p - buffer);
+}
+
+
+// DATA_STRING reply to a GET_STRING.  If raw_length is set, the value is compressed (zlib), and that is
+// its length once it is expanded.  Only clients that asked for FEATURE_COMPRESSED_VALUES get those.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	uint64_t valuehash;
+	const char *value;
+	int32_t value_len;
+	int32_t raw_length;
+} msg_data_str_t;
+
+#define MSG_DATA_STR_MIN 28
+
+static inline int msg_data_str_size(const msg_data_str_t *msg)
+{
+	assert(msg);
+	int size = MSG_DATA_STR_MIN;
+	size += msg->value_len;
+	if (msg->raw_length != 0) { size += 4; }
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_data_str_encode(char *buffer, int max, const msg_data_str_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_data_str_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put64(p, msg->valuehash); p += 8;
+	assert(msg->value_len >= 0);
+	codec_put32(p, msg->value_len); p += 4;
+	if (msg->value_len > 0) { memcpy(p, msg->value, msg->value_len); p += msg->value_len; }
+	if (msg->raw_length != 0) { codec_put32(p, msg->raw_length); p += 4; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_data_str_decode(const char *buffer, int length, msg_data_str_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 28) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->valuehash = codec_get64(p); p += 8;
+	msg->value_len = codec_get32(p); p += 4;
+	if (msg->value_len < 0 || msg->value_len > end - p) { return(-1); }
+	msg->value = p; p += msg->value_len;
+	if (end - p >= 4) { msg->raw_length = codec_get32(p); p += 4; }
+	else { msg->raw_length = 0; }
+	return(p - buffer);
+}
+
+
+// SYNC_INT, sent to the backup node when an integer value is changed (or transferred).  The sync
+// counter of the primary was added later, so older nodes do not send it.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t expires;
+	int64_t value;
+	int32_t sync_seq;
+} msg_sync_int_t;
+
+#define MSG_SYNC_INT_MIN 28
+
+static inline int msg_sync_int_size(const msg_sync_int_t *msg)
+{
+	assert(msg);
+	int size = MSG_SYNC_INT_MIN;
+	if (msg->sync_seq != 0) { size += 4; }
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_sync_int_encode(char *buffer, int max, const msg_sync_int_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_sync_int_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->expires); p += 4;
+	codec_put64(p, msg->value); p += 8;
+	if (msg->sync_seq != 0) { codec_put32(p, msg->sync_seq); p += 4; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_sync_int_decode(const char *buffer, int length, msg_sync_int_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 28) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->expires = codec_get32(p); p += 4;
+	msg->value = codec_get64(p); p += 8;
+	if (end - p >= 4) { msg->sync_seq = codec_get32(p); p += 4; }
+	else { msg->sync_seq = 0; }
+	return(p - buffer);
+}
+
+
+// SYNC_STRING, the same as SYNC_INT but for a string value.  Values that are stored compressed are
+// sent that way (with raw_length set, as for DATA_STRING) to nodes that understand it.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t expires;
+	const char *value;
+	int32_t value_len;
+	int32_t sync_seq;
+	int32_t raw_length;
+} msg_sync_str_t;
+
+#define MSG_SYNC_STR_MIN 24
+
+static inline int msg_sync_str_size(const msg_sync_str_t *msg)
+{
+	assert(msg);
+	int size = MSG_SYNC_STR_MIN;
+	size += msg->value_len;
+	if (msg->sync_seq != 0 || msg->raw_length != 0) { size += 4; }
+	if (msg->raw_length != 0) { size += 4; }
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_sync_str_encode(char *buffer, int max, const msg_sync_str_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_sync_str_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->expires); p += 4;
+	assert(msg->value_len >= 0);
+	codec_put32(p, msg->value_len); p += 4;
+	if (msg->value_len > 0) { memcpy(p, msg->value, msg->value_len); p += msg->value_len; }
+	if (msg->sync_seq != 0 || msg->raw_length != 0) { codec_put32(p, msg->sync_seq); p += 4; }
+	if (msg->raw_length != 0) { codec_put32(p, msg->raw_length); p += 4; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_sync_str_decode(const char *buffer, int length, msg_sync_str_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 24) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->expires = codec_get32(p); p += 4;
+	msg->value_len = codec_get32(p); p += 4;
+	if (msg->value_len < 0 || msg->value_len > end - p) { return(-1); }
+	msg->value = p; p += msg->value_len;
+	if (end - p >= 4) { msg->sync_seq = codec_get32(p); p += 4; }
+	else { msg->sync_seq = 0; }
+	if (end - p >= 4) { msg->raw_length = codec_get32(p); p += 4; }
+	else { msg->raw_length = 0; }
+	return(p - buffer);
+}
+
+
+// SET_STREAM request, which starts a chunked upload.  It carries the first chunk of the value.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t expires;
+	int32_t total;
+	const char *chunk;
+	int32_t chunk_len;
+} msg_set_stream_t;
+
+#define MSG_SET_STREAM_MIN 28
+
+static inline int msg_set_stream_size(const msg_set_stream_t *msg)
+{
+	assert(msg);
+	int size = MSG_SET_STREAM_MIN;
+	size += msg->chunk_len;
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_set_stream_encode(char *buffer, int max, const msg_set_stream_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_set_stream_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->expires); p += 4;
+	codec_put32(p, msg->total); p += 4;
+	assert(msg->chunk_len >= 0);
+	codec_put32(p, msg->chunk_len); p += 4;
+	if (msg->chunk_len > 0) { memcpy(p, msg->chunk, msg->chunk_len); p += msg->chunk_len; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_set_stream_decode(const char *buffer, int length, msg_set_stream_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 28) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->expires = codec_get32(p); p += 4;
+	msg->total = codec_get32(p); p += 4;
+	msg->chunk_len = codec_get32(p); p += 4;
+	if (msg->chunk_len < 0 || msg->chunk_len > end - p) { return(-1); }
+	msg->chunk = p; p += msg->chunk_len;
+	return(p - buffer);
+}
+
+
+// SET_CHUNK request, the rest of the chunks of an upload (in order).
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t offset;
+	const char *chunk;
+	int32_t chunk_len;
+} msg_set_chunk_t;
+
+#define MSG_SET_CHUNK_MIN 24
+
+static inline int msg_set_chunk_size(const msg_set_chunk_t *msg)
+{
+	assert(msg);
+	int size = MSG_SET_CHUNK_MIN;
+	size += msg->chunk_len;
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_set_chunk_encode(char *buffer, int max, const msg_set_chunk_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_set_chunk_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->offset); p += 4;
+	assert(msg->chunk_len >= 0);
+	codec_put32(p, msg->chunk_len); p += 4;
+	if (msg->chunk_len > 0) { memcpy(p, msg->chunk, msg->chunk_len); p += msg->chunk_len; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_set_chunk_decode(const char *buffer, int length, msg_set_chunk_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 24) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->offset = codec_get32(p); p += 4;
+	msg->chunk_len = codec_get32(p); p += 4;
+	if (msg->chunk_len < 0 || msg->chunk_len > end - p) { return(-1); }
+	msg->chunk = p; p += msg->chunk_len;
+	return(p - buffer);
+}
+
+
+// GET_CHUNK request.  A max_length of 0 means the default chunk size.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int32_t offset;
+	int32_t max_length;
+	int32_t max_stale;
+} msg_get_chunk_t;
+
+#define MSG_GET_CHUNK_MIN 24
+
+static inline int msg_get_chunk_size(const msg_get_chunk_t *msg)
+{
+	assert(msg);
+	int size = MSG_GET_CHUNK_MIN;
+	if (msg->max_stale != -1) { size += 4; }
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_get_chunk_encode(char *buffer, int max, const msg_get_chunk_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_get_chunk_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put32(p, msg->offset); p += 4;
+	codec_put32(p, msg->max_length); p += 4;
+	if (msg->max_stale != -1) { codec_put32(p, msg->max_stale); p += 4; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_get_chunk_decode(const char *buffer, int length, msg_get_chunk_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 24) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->offset = codec_get32(p); p += 4;
+	msg->max_length = codec_get32(p); p += 4;
+	if (end - p >= 4) { msg->max_stale = codec_get32(p); p += 4; }
+	else { msg->max_stale = -1; }
+	return(p - buffer);
+}
+
+
+// DATA_CHUNK reply to a GET_CHUNK.
+typedef struct {
+	uint64_t map_hash;
+	uint64_t key_hash;
+	uint64_t valuehash;
+	int32_t total;
+	int32_t offset;
+	const char *chunk;
+	int32_t chunk_len;
+} msg_data_chunk_t;
+
+#define MSG_DATA_CHUNK_MIN 36
+
+static inline int msg_data_chunk_size(const msg_data_chunk_t *msg)
+{
+	assert(msg);
+	int size = MSG_DATA_CHUNK_MIN;
+	size += msg->chunk_len;
+	return(size);
+}
+
+// returns the number of bytes written, or -1 if the buffer is too small.
+static inline int msg_data_chunk_encode(char *buffer, int max, const msg_data_chunk_t *msg)
+{
+	char *p = buffer;
+	assert(buffer && msg);
+	if (max < msg_data_chunk_size(msg)) { return(-1); }
+	codec_put64(p, msg->map_hash); p += 8;
+	codec_put64(p, msg->key_hash); p += 8;
+	codec_put64(p, msg->valuehash); p += 8;
+	codec_put32(p, msg->total); p += 4;
+	codec_put32(p, msg->offset); p += 4;
+	assert(msg->chunk_len >= 0);
+	codec_put32(p, msg->chunk_len); p += 4;
+	if (msg->chunk_len > 0) { memcpy(p, msg->chunk, msg->chunk_len); p += msg->chunk_len; }
+	return(p - buffer);
+}
+
+// returns the number of bytes used, or -1 if the data does not match the layout.
+static inline int msg_data_chunk_decode(const char *buffer, int length, msg_data_chunk_t *msg)
+{
+	const char *p = buffer;
+	const char *end = buffer + length;
+	assert(buffer && msg);
+	if (length < 36) { return(-1); }
+	msg->map_hash = codec_get64(p); p += 8;
+	msg->key_hash = codec_get64(p); p += 8;
+	msg->valuehash = codec_get64(p); p += 8;
+	msg->total = codec_get32(p); p += 4;
+	msg->offset = codec_get32(p); p += 4;
+	msg->chunk_len = codec_get32(p); p += 4;
+	if (msg->chunk_len < 0 || msg->chunk_len > end - p) { return(-1); }
+	msg->chunk = p; p += msg->chunk_len;
+	return(p - buffer);
+}
+
+
+#endif
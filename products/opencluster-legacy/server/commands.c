@@ -3,18 +3,26 @@
 #include "auth.h"
 #include "bucket.h"
 #include "client.h"
+#include "codec.h"
 #include "commands.h"
+#include "compress.h"
+#include "constants.h"
 #include "hashfn.h"
 #include "header.h"
+#include "hotkeys.h"
 #include "logging.h"
+#include "node.h"
 #include "payload.h"
 #include "protocol.h"
 #include "push.h"
 #include "server.h"
 #include "timeout.h"
+#include "translog.h"
 #include "value.h"
 
 #include <assert.h>
+#include <endian.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -23,7 +31,7 @@
 // Get a value from storage.
 static void cmd_get_int(client_t *client, header_t *header, char *payload)
 {
-	char *next;
+	msg_get_int_t msg;
 	hash_t map_hash;
 	hash_t key_hash;
 	value_t *value;
@@ -32,23 +40,16 @@ static void cmd_get_int(client_t *client, header_t *header, char *payload)
 	assert(header);
 	assert(payload);
 
-	int avail = header->length;
-	assert(avail > 0);
-	
-	next = payload;
-	map_hash = data_long(&next, &avail);
-	assert(avail > 0);
-	key_hash = data_long(&next, &avail);
-	assert(avail >= 0);
-
-	if (avail < 0) {
-		// The data was invalid and the connection needs to be dropped.
-		assert(0);
+	// the client can optionally indicate how stale (in seconds) the data can be, which would allow 
+	// a backup copy to answer.  If it is not supplied, only the primary will answer.
+	if (msg_get_int_decode(payload, header->length, &msg) != header->length) {
+		// The data was invalid.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
 	}
 	else {
-		
-		// check payload meets protocol specifications.
-		assert(0);
+		map_hash = msg.map_hash;
+		key_hash = msg.key_hash;
+		int max_stale = msg.max_stale;
 
 		logger(LOG_INFO, "CMD: get (integer) [%#llx/%#llx]", map_hash, key_hash);
 
@@ -58,24 +59,31 @@ static void cmd_get_int(client_t *client, header_t *header, char *payload)
 		* quickest.  Therefore it is assumed that if the client is asking this node for the data, then 
 		* there is a good change the data is on this server.
 		* 
-		* The function will return NULL even if the data is there but this server is a backup node.  
-		* Since the source of truth is the primary store, it will not grab the data from the backup 
-		* node.
+		* The function will return NULL even if the data is there but this server is a backup node, 
+		* unless the client has said it will accept stale data, and the backup is not lagging 
+		* behind the primary more than that.
 		*/
-		value = buckets_get_value(map_hash, key_hash);
+		value = buckets_get_value(map_hash, key_hash, max_stale);
 		
 		if (value) {
+			// keep track of the keys that are being requested the most.
+			hotkeys_sample(map_hash, key_hash);
+			
 			if (value->type != VALUE_LONG) {
 				// need to indicate stored value is a different type.
 				assert(0);
 			}
 			else {
 				// we have the data, build the reply.
+				msg_data_int_t reply = {
+					.map_hash = map_hash,
+					.key_hash = key_hash,
+					.valuehash = value->valuehash,
+					.value = value->data.l,
+				};
 				PAYLOAD payload = payload_new_reply();
-				payload_long(payload, map_hash);
-				payload_long(payload, key_hash);
-				payload_long(payload, value->valuehash);
-				payload_long(payload, value->data.l);
+				int size = msg_data_int_size(&reply);
+				msg_data_int_encode(payload_reserve(payload, size), size, &reply);
 
 				client_send_reply(client, header, RESPONSE_DATA_INT, payload);
 			}
@@ -114,21 +122,10 @@ static void cmd_get_int(client_t *client, header_t *header, char *payload)
 				assert(server_name);
 				logger(LOG_DEBUG, "CMD: Bucket %#llx not here, it is at '%s'", key_hash, server_name);
 				
-				assert(0);
-
-				// create a structure with the data we will need when the response comes back.
-
-				// The data is no
-				
-				
-				
-	// 			assert(payload_length() == 0);
-	// 			payload_string(server);
-
-	// 			assert(payload_length() > 0);
-	// 			client_send_message(client, header, REPLY_TRYELSEWHERE, payload_length(), payload_ptr());
-	// 			payload_clear();
-
+				// tell the client which node has it.
+				PAYLOAD out = payload_new_reply();
+				payload_string(out, conninfo_str(node->conninfo));
+				client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
 			}
 		}
 	}
@@ -138,29 +135,27 @@ static void cmd_get_int(client_t *client, header_t *header, char *payload)
 // Get a value from storage.
 static void cmd_get_str(client_t *client, header_t *header, char *payload)
 {
-	char *next;
+	msg_get_str_t msg;
 	hash_t map_hash;
 	hash_t key_hash;
 	int max_length;
+	int max_stale;
 	value_t *value;
 	
 	assert(client);
 	assert(header);
 	assert(payload);
 
-	next = payload;
-	map_hash = data_long(&next);
-	key_hash = data_long(&next);
-	max_length = data_int(&next);
-	
-	// check payload meets protocol specifications.
-	assert(0);
-
-	if (max_length < 0) {
-		// the client gave a negative number which is invalid.
+	// the client can optionally indicate how stale (in seconds) the data can be.
+	if (msg_get_str_decode(payload, header->length, &msg) != header->length || msg.max_length < 0) {
+		// the data was invalid, or the client gave a negative number.
 		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
 	}
 	else {
+		map_hash = msg.map_hash;
+		key_hash = msg.key_hash;
+		max_length = msg.max_length;
+		max_stale = msg.max_stale;
 
 		/* First we will blindly attempt to get the data from this node.   If this data is not primarily 
 		* stored on this server, it is rather quick to exit.   Since we need to cater for clients that 
@@ -168,13 +163,16 @@ static void cmd_get_str(client_t *client, header_t *header, char *payload)
 		* quickest.  Therefore it is assumed that if the client is asking this node for the data, then 
 		* there is a good change the data is on this server.
 		* 
-		* The function will return NULL even if the data is there but this server is a backup node.  
-		* Since the source of truth is the primary store, it will not grab the data from the backup 
-		* node.
+		* The function will return NULL even if the data is there but this server is a backup node, 
+		* unless the client has said it will accept stale data, and the backup is not lagging 
+		* behind the primary more than that.
 		*/
-		value = buckets_get_value(map_hash, key_hash);
+		value = buckets_get_value(map_hash, key_hash, max_stale);
 		
 		if (value) {
+			// keep track of the keys that are being requested the most.
+			hotkeys_sample(map_hash, key_hash);
+			
 			if (value->type != VALUE_STRING) {
 				// need to indicate stored value is a different type.
 				client_send_reply(client, header, RESPONSE_WRONGTYPE, NO_PAYLOAD);
@@ -182,16 +180,28 @@ static void cmd_get_str(client_t *client, header_t *header, char *payload)
 			else {
 				
 				// the value is a string, but is it within the max length specified?
-				if (max_length > 0 && value->data.s.length > max_length) {
+				if (max_length > 0 && value_string_length(value) > max_length) {
 					client_send_reply(client, header, RESPONSE_TOOLARGE, NO_PAYLOAD);
 				}
 				else {
-					// everything is goog, so build the reply.
+					// everything is goog, so build the reply.  Clients that can expand compressed 
+					// values themselves get it the way it is stored.
+					msg_data_str_t reply = {
+						.map_hash = map_hash,
+						.key_hash = key_hash,
+						.valuehash = value->valuehash,
+					};
+					if (value->data.s.raw_length > 0 && (client->features & FEATURE_COMPRESSED_VALUES)) {
+						reply.value = value->data.s.data;
+						reply.value_len = value->data.s.length;
+						reply.raw_length = value->data.s.raw_length;
+					}
+					else {
+						reply.value = value_string(value, &reply.value_len);
+					}
 					PAYLOAD out = payload_new_reply();
-					payload_long(out, map_hash);
-					payload_long(out, key_hash);
-					payload_long(out, value->valuehash);
-					payload_data(out, value->data.s.length, value->data.s.data);
+					int size = msg_data_str_size(&reply);
+					msg_data_str_encode(payload_reserve(out, size), size, &reply);
 					
 					client_send_reply(client, header, RESPONSE_DATA_STRING, out);
 				}
@@ -226,9 +236,10 @@ static void cmd_get_str(client_t *client, header_t *header, char *payload)
 				assert(strlen(server_name) > 0);
 				logger(LOG_DEBUG, "CMD: Bucket %#llx not here, it is at '%s'", key_hash, server_name);
 				
-				// need to pass the request on to the appropriate server that has the data.
-				assert(0);
-
+				// tell the client which node has it.
+				PAYLOAD out = payload_new_reply();
+				payload_string(out, conninfo_str(node->conninfo));
+				client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
 			}
 		}
 	}
@@ -239,12 +250,12 @@ static void cmd_get_str(client_t *client, header_t *header, char *payload)
 // Set a value into the hash storage.
 static void cmd_set_str(client_t *client, header_t *header, char *payload)
 {
-	char *next;
+	msg_set_str_t msg;
 	hash_t map_hash;
 	hash_t key_hash;
 	int expires;
 	value_t *value;
-	char *str;
+	const char *str;
 	int result;
 	int str_len;
 	
@@ -252,22 +263,27 @@ static void cmd_set_str(client_t *client, header_t *header, char *payload)
 	assert(header);
 	assert(payload);
 	
-	next = payload;
-	map_hash = data_long(&next);
-	key_hash = data_long(&next);
-	expires = data_int(&next);
-	str = data_string(&next, &str_len);
+	if (msg_set_str_decode(payload, header->length, &msg) != header->length) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
 	
-	// check payload meets protocol specifications.
-	assert(0);
+	map_hash = msg.map_hash;
+	key_hash = msg.key_hash;
+	expires = msg.expires;
+	str = msg.value;
+	str_len = msg.value_len;
 
 	logger(LOG_DEBUG, "CMD: set (string): [%#llx/%#llx]", map_hash, key_hash);
 	
 	// first we need to check that this server is responsible for this data.  If not, we need to pass a message to the server that is.
 	node_t *node = buckets_get_primary_node(key_hash);
 	if (node) {
-		// this data is being served by another node... we need to relay the query.
-		assert(0);
+		// this data is being served by another node, so tell the client which one.
+		assert(node->conninfo);
+		PAYLOAD out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
 	}
 	else {
 		
@@ -281,6 +297,7 @@ static void cmd_set_str(client_t *client, header_t *header, char *payload)
 		memcpy(value->data.s.data, str, str_len);
 		value->data.s.data[str_len] = 0;
 		value->data.s.length = str_len;
+		value_compress(value);
 
 		// store the value into the trees.  If a value already exists, it will get released and this one 
 		// will replace it, so control of this value is given to the tree structure.
@@ -405,15 +422,24 @@ static void cmd_loadlevels(client_t *client, header_t *header)
 	int primary_count = buckets_get_primary_count();
 	int secondary_count = buckets_get_secondary_count();
 	int trans = buckets_transferring();
+	int trans_max = buckets_transfer_max();
 
 	assert(primary_count >= 0);
 	assert(secondary_count >= 0);
 	assert(trans >= 0);
+	assert(trans_max > 0);
+	
+	// if we are already transferring a bucket with this node, then it needs to look as if we are 
+	// full, because we will only handle one transfer per node at a time.
+	if (client->transfer_bucket) {
+		trans = trans_max;
+	}
 	
 	PAYLOAD out = payload_new_reply();
 	payload_int(out, primary_count);
 	payload_int(out, secondary_count);
 	payload_int(out, trans);
+	payload_int(out, trans_max);
 	
 	// send the reply.
 	client_send_reply(client, header, RESPONSE_LOADLEVELS, out);
@@ -438,6 +464,10 @@ static void cmd_accept_bucket(client_t *client, header_t *header, char *payload)
 		logger(LOG_ERROR, "Received an invalid CMD_ACCEPT_BUCKET command from client (%d)", client->handle);
 		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
 	}
+	else if (translog_active()) {
+		// logger nodes dont hold any buckets.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
 	else {
 	
 		logger(LOG_INFO, "CMD: accept bucket (%#llx/%#llx)", mask, hashmask);
@@ -454,65 +484,1462 @@ static void cmd_accept_bucket(client_t *client, header_t *header, char *payload)
 }
 
 
-
-
-// Set a value into the hash storage.
-static void cmd_set_int(client_t *client, header_t *header, char *payload)
+
+
+// Set a value into the hash storage.
+static void cmd_set_int(client_t *client, header_t *header, char *payload)
+{
+	msg_set_int_t msg;
+	hash_t map_hash;
+	hash_t key_hash;
+	int expires;
+	value_t *value;
+	int result;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	if (msg_set_int_decode(payload, header->length, &msg) != header->length) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	// create a new value.
+	// ** PERF: get the 'value' objects from a pool to improve performance.
+	value = calloc(1, sizeof(value_t));
+	assert(value);
+	
+	map_hash      = msg.map_hash;
+	key_hash      = msg.key_hash;
+	expires       = msg.expires;
+	value->data.l = msg.value;
+	value->type = VALUE_LONG;
+	value->valuehash = generate_hash_long(value->data.l);
+
+	// first we need to check that this server is responsible for this data.  If not, we need to pass a message to the server that is.
+	node_t *node = buckets_get_primary_node(key_hash);
+	if (node) {
+		// this data is being served by another node, so tell the client which one.
+		assert(node->conninfo);
+		PAYLOAD out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+	}
+	else {
+	
+		
+		logger(LOG_DEBUG, "CMD: set (integer): [%#llx/%#llx]=%d", map_hash, key_hash, value->data.l);
+
+		// store the value into the trees.  If a value already exists, it will get released and this one 
+		// will replace it, so control of this value is given to the tree structure.
+		// NOTE: value is controlled by the tree after this function call.
+		result = buckets_store_value(map_hash, key_hash, expires, value);
+		value = NULL;
+		
+		// send the ACK reply.
+		if (result == 0) {
+			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		}
+		else {
+			assert(0);
+		}
+	}
+	
+	// if the value was not passed to the storage system, then we need to free it ourself.
+	if (value) { free(value); }
+}
+
+
+
+// Get a value, unless the client already has it.  The payload is the same as a GET_INT, with the 
+// valuehash of the copy the client has added after the key (0 if it doesn't have one), and the 
+// optional max_stale after that.  If the value hasn't changed, RESPONSE_NOT_MODIFIED is sent with no 
+// payload, otherwise the reply is the same as a GET_INT or GET_STRING (depending on the type).
+static void cmd_get_ifchanged(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	hash_t valuehash;
+	value_t *value;
+	node_t *node;
+	PAYLOAD out;
+	int avail;
+	int max_stale = -1;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	if (header->length < (sizeof(hash_t) * 3)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	avail = header->length;
+	next = payload;
+	map_hash  = data_long(&next, &avail);
+	key_hash  = data_long(&next, &avail);
+	valuehash = data_long(&next, &avail);
+	if (header->length >= (sizeof(hash_t) * 3) + sizeof(int)) {
+		max_stale = data_int(&next, &avail);
+	}
+	
+	logger(LOG_DEBUG, "CMD: get if changed [%#llx/%#llx]", map_hash, key_hash);
+	
+	value = buckets_get_value(map_hash, key_hash, max_stale);
+	if (value) {
+		hotkeys_sample(map_hash, key_hash);
+		
+		if (valuehash != 0 && value->valuehash == valuehash) {
+			client_send_reply(client, header, RESPONSE_NOT_MODIFIED, NO_PAYLOAD);
+		}
+		else if (value->type == VALUE_LONG) {
+			out = payload_new_reply();
+			payload_long(out, map_hash);
+			payload_long(out, key_hash);
+			payload_long(out, value->valuehash);
+			payload_long(out, value->data.l);
+			client_send_reply(client, header, RESPONSE_DATA_INT, out);
+		}
+		else {
+			assert(value->type == VALUE_STRING);
+			int str_len;
+			const char *str = value_string(value, &str_len);
+			out = payload_new_reply();
+			payload_long(out, map_hash);
+			payload_long(out, key_hash);
+			payload_long(out, value->valuehash);
+			payload_data(out, str_len, str);
+			client_send_reply(client, header, RESPONSE_DATA_STRING, out);
+		}
+	}
+	else if ((node = buckets_get_primary_node(key_hash)) == NULL) {
+		// the bucket is here, so the key doesn't exist.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		// tell the client which node has it.
+		assert(node->conninfo);
+		out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+	}
+}
+
+
+
+// The entries in a MGET or MSET are processed in bucket order rather than the order they were sent, 
+// so that the lookups for each bucket are done together.  The reply has the index of each entry, so 
+// the client can match them up.
+typedef struct {
+	hash_t bucket;
+	int index;
+	char *entry;		// where the entry starts in the payload.
+} batch_entry_t;
+
+// size of each entry in a MGET request (map_hash, key_hash).
+#define MGET_ENTRY_SIZE (sizeof(hash_t) * 2)
+
+// the fixed part of each entry in a MSET request (map_hash, key_hash, expires, type).
+#define MSET_ENTRY_SIZE ((sizeof(hash_t) * 2) + (sizeof(int) * 2))
+
+
+static int batch_compare(const void *a, const void *b)
+{
+	const batch_entry_t *first = a;
+	const batch_entry_t *second = b;
+	
+	if (first->bucket != second->bucket) {
+		return(first->bucket < second->bucket ? -1 : 1);
+	}
+	else {
+		return(first->index - second->index);
+	}
+}
+
+
+static void batch_sort(batch_entry_t *entries, int count)
+{
+	hash_t mask;
+	hash_t key_hash;
+	int i;
+	
+	assert(entries);
+	assert(count > 0);
+	
+	mask = buckets_mask();
+	for (i=0; i<count; i++) {
+		assert(entries[i].entry);
+		key_hash = be64toh(*(uint64_t *) (entries[i].entry + sizeof(hash_t)));
+		entries[i].bucket = key_hash & mask;
+		entries[i].index = i;
+	}
+	
+	qsort(entries, count, sizeof(batch_entry_t), batch_compare);
+}
+
+
+// the entry is for a bucket that is on another node, so the client is told where to send it.
+static void batch_elsewhere(PAYLOAD out, node_t *node)
+{
+	assert(node);
+	assert(node->conninfo);
+	
+	payload_int(out, RESPONSE_TRYELSEWHERE);
+	payload_string(out, conninfo_str(node->conninfo));
+}
+
+
+// Get a number of values in one request.  The payload is the max_stale (-1 if only the primary can 
+// answer), the number of entries, and then the map and key hash for each one.  The reply has an 
+// entry for each one, with its index and the result it would have got as a single GET.  Entries 
+// for buckets that are on other nodes get RESPONSE_TRYELSEWHERE and the conninfo of that node.
+static void cmd_mget(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	char *entry;
+	int avail;
+	int max_stale;
+	int count;
+	int i;
+	hash_t map_hash;
+	hash_t key_hash;
+	value_t *value;
+	node_t *node;
+	batch_entry_t *entries;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	count = -1;
+	max_stale = -1;
+	if (avail >= (sizeof(int) * 2)) {
+		max_stale = data_int(&next, &avail);
+		count = data_int(&next, &avail);
+	}
+	
+	if (count <= 0 || header->length != (sizeof(int) * 2) + (count * MGET_ENTRY_SIZE)) {
+		// the payload doesn't match the number of entries it says it has.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_INFO, "CMD: mget (%d entries)", count);
+	
+	entries = malloc(sizeof(batch_entry_t) * count);
+	assert(entries);
+	for (i=0; i<count; i++) {
+		entries[i].entry = next + (i * MGET_ENTRY_SIZE);
+	}
+	batch_sort(entries, count);
+	
+	out = payload_new_reply();
+	payload_int(out, count);
+	
+	for (i=0; i<count; i++) {
+		entry = entries[i].entry;
+		avail = MGET_ENTRY_SIZE;
+		map_hash = data_long(&entry, &avail);
+		key_hash = data_long(&entry, &avail);
+		
+		payload_int(out, entries[i].index);
+		
+		value = buckets_get_value(map_hash, key_hash, max_stale);
+		if (value) {
+			hotkeys_sample(map_hash, key_hash);
+			
+			if (value->type == VALUE_LONG) {
+				payload_int(out, RESPONSE_DATA_INT);
+				payload_long(out, value->valuehash);
+				payload_long(out, value->data.l);
+			}
+			else {
+				assert(value->type == VALUE_STRING);
+				int str_len;
+				const char *str = value_string(value, &str_len);
+				payload_int(out, RESPONSE_DATA_STRING);
+				payload_long(out, value->valuehash);
+				payload_data(out, str_len, str);
+			}
+		}
+		else if ((node = buckets_get_primary_node(key_hash)) == NULL) {
+			// the bucket is here, so the key doesn't exist.
+			payload_int(out, RESPONSE_FAIL);
+		}
+		else {
+			batch_elsewhere(out, node);
+		}
+	}
+	
+	free(entries);
+	client_send_reply(client, header, RESPONSE_MULTI, out);
+}
+
+
+// Set a number of values in one request.  The payload is the number of entries, and then for each 
+// one the map and key hash, the expiry, the type (COMMAND_SET_INT or COMMAND_SET_STRING) and the 
+// value.  The reply has an entry for each one with its index and result (RESPONSE_OK, or 
+// RESPONSE_TRYELSEWHERE and the conninfo of the node that has the bucket).
+static void cmd_mset(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	char *end;
+	char *entry;
+	int avail;
+	int count;
+	int i;
+	int length;
+	int type;
+	int expires;
+	hash_t map_hash;
+	hash_t key_hash;
+	value_t *value;
+	node_t *node;
+	batch_entry_t *entries;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	end = payload + header->length;
+	count = -1;
+	if (avail >= sizeof(int)) {
+		count = data_int(&next, &avail);
+	}
+	
+	if (count <= 0 || count > (header->length / MSET_ENTRY_SIZE)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	// the entries are not all the same size, so we need to find where each one starts (which also 
+	// checks that they are all there) before they can be sorted.
+	entries = malloc(sizeof(batch_entry_t) * count);
+	assert(entries);
+	for (i=0; i<count && next != NULL; i++) {
+		entries[i].entry = next;
+		if ((end - next) < MSET_ENTRY_SIZE) {
+			next = NULL;
+		}
+		else {
+			type = be32toh(*(uint32_t *) (next + (sizeof(hash_t) * 2) + sizeof(int)));
+			next += MSET_ENTRY_SIZE;
+			if (type == COMMAND_SET_INT && (end - next) >= sizeof(long long)) {
+				next += sizeof(long long);
+			}
+			else if (type == COMMAND_SET_STRING && (end - next) >= sizeof(int)) {
+				length = be32toh(*(uint32_t *) next);
+				next += sizeof(int);
+				if (length < 0 || length > (end - next)) { next = NULL; }
+				else { next += length; }
+			}
+			else {
+				next = NULL;
+			}
+		}
+	}
+	
+	if (next != end) {
+		logger(LOG_ERROR, "CMD: mset with invalid entries.");
+		free(entries);
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_INFO, "CMD: mset (%d entries)", count);
+	batch_sort(entries, count);
+	
+	out = payload_new_reply();
+	payload_int(out, count);
+	
+	for (i=0; i<count; i++) {
+		entry = entries[i].entry;
+		avail = end - entry;
+		map_hash = data_long(&entry, &avail);
+		key_hash = data_long(&entry, &avail);
+		expires  = data_int(&entry, &avail);
+		type     = data_int(&entry, &avail);
+		
+		payload_int(out, entries[i].index);
+		
+		node = buckets_get_primary_node(key_hash);
+		if (node) {
+			batch_elsewhere(out, node);
+		}
+		else {
+			// NOTE: value is controlled by the tree after it is stored.
+			value = calloc(1, sizeof(value_t));
+			assert(value);
+			if (type == COMMAND_SET_INT) {
+				value->type = VALUE_LONG;
+				value->data.l = data_long(&entry, &avail);
+				value->valuehash = generate_hash_long(value->data.l);
+			}
+			else {
+				assert(type == COMMAND_SET_STRING);
+				length = data_int(&entry, &avail);
+				assert(length >= 0);
+				value->type = VALUE_STRING;
+				value->valuehash = generate_hash_str(entry, length);
+				value->data.s.data = malloc(length + 1);
+				assert(value->data.s.data);
+				memcpy(value->data.s.data, entry, length);
+				value->data.s.data[length] = 0;
+				value->data.s.length = length;
+				value_compress(value);
+			}
+			
+			if (buckets_store_value(map_hash, key_hash, expires, value) == 0) {
+				payload_int(out, RESPONSE_OK);
+			}
+			else {
+				payload_int(out, RESPONSE_FAIL);
+			}
+		}
+	}
+	
+	free(entries);
+	client_send_reply(client, header, RESPONSE_MULTI, out);
+}
+
+
+
+// the items that are collected for a reply (for GET_KEY_ALL and SCAN_MAP).
+typedef struct {
+	item_t **items;
+	int count;
+	int max;
+} itemlist_t;
+
+
+static void itemlist_add(item_t *item, void *arg)
+{
+	itemlist_t *itemlist = arg;
+	
+	assert(item);
+	assert(itemlist);
+	
+	if (itemlist->count >= itemlist->max) {
+		itemlist->max = itemlist->max == 0 ? 16 : itemlist->max * 2;
+		itemlist->items = realloc(itemlist->items, sizeof(item_t *) * itemlist->max);
+		assert(itemlist->items);
+	}
+	itemlist->items[itemlist->count++] = item;
+}
+
+
+// add the type (RESPONSE_DATA_INT or RESPONSE_DATA_STRING), valuehash and value of the item to a reply.
+static void payload_item_value(PAYLOAD out, item_t *item)
+{
+	assert(out);
+	assert(item);
+	assert(item->value);
+	
+	if (item->value->type == VALUE_LONG) {
+		payload_int(out, RESPONSE_DATA_INT);
+		payload_long(out, item->value->valuehash);
+		payload_long(out, item->value->data.l);
+	}
+	else {
+		assert(item->value->type == VALUE_STRING);
+		int str_len;
+		const char *str = value_string(item->value, &str_len);
+		payload_int(out, RESPONSE_DATA_STRING);
+		payload_long(out, item->value->valuehash);
+		payload_data(out, str_len, str);
+	}
+}
+
+
+// Get all the values that are stored with a key hash (one for each map it is in), which is usually 
+// all the fields of a record.  The payload is the key hash, optionally followed by the max_stale.  
+// The reply (RESPONSE_DATA_KEY) has the key hash and the number of items, and then for each one the 
+// map hash, the type (RESPONSE_DATA_INT or RESPONSE_DATA_STRING), the valuehash, and the value.
+static void cmd_get_key_all(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	int avail;
+	int max_stale = -1;
+	int i;
+	hash_t key_hash;
+	item_t *item;
+	node_t *node;
+	itemlist_t itemlist;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	if (avail != sizeof(hash_t) && avail != sizeof(hash_t) + sizeof(int)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	key_hash = data_long(&next, &avail);
+	if (header->length > sizeof(hash_t)) {
+		max_stale = data_int(&next, &avail);
+	}
+	
+	logger(LOG_DEBUG, "CMD: get key all [%#llx]", key_hash);
+	
+	memset(&itemlist, 0, sizeof(itemlist));
+	if (buckets_foreach_key(key_hash, max_stale, itemlist_add, &itemlist) != 0) {
+		node = buckets_get_primary_node(key_hash);
+		if (node) {
+			assert(node->conninfo);
+			out = payload_new_reply();
+			payload_string(out, conninfo_str(node->conninfo));
+			client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+		}
+		else {
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+	else {
+		out = payload_new_reply();
+		payload_long(out, key_hash);
+		payload_int(out, itemlist.count);
+		for (i=0; i<itemlist.count; i++) {
+			item = itemlist.items[i];
+			payload_long(out, item->map_key);
+			payload_item_value(out, item);
+		}
+		client_send_reply(client, header, RESPONSE_DATA_KEY, out);
+	}
+	
+	if (itemlist.items) {
+		free(itemlist.items);
+	}
+}
+
+
+// Scan through the items in a map.  The payload is the map hash, the cursor (0 to start), the most 
+// items to return, and optionally the max_stale.  The reply (RESPONSE_SCAN) has the map hash, the 
+// cursor to send for the next part of the scan (0 if it is finished), the number of items, and then 
+// for each one the key hash, the type, the valuehash and the value.  If the cursor is in a bucket that 
+// this node doesn't have, the client is told which node to send it to.
+static void cmd_scan_map(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	int avail;
+	int limit;
+	int max_stale = -1;
+	int count;
+	int i;
+	hash_t map_hash;
+	hash_t cursor;
+	item_t *item;
+	node_t *node;
+	itemlist_t itemlist;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	if (avail != (sizeof(hash_t) * 2) + sizeof(int) && avail != (sizeof(hash_t) * 2) + (sizeof(int) * 2)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	map_hash = data_long(&next, &avail);
+	cursor   = data_long(&next, &avail);
+	limit    = data_int(&next, &avail);
+	if (header->length > (sizeof(hash_t) * 2) + sizeof(int)) {
+		max_stale = data_int(&next, &avail);
+	}
+	
+	if (limit <= 0)                  { limit = 1; }
+	else if (limit > SCAN_LIMIT_MAX) { limit = SCAN_LIMIT_MAX; }
+	
+	logger(LOG_DEBUG, "CMD: scan map [%#llx] from %#llx", map_hash, cursor);
+	
+	memset(&itemlist, 0, sizeof(itemlist));
+	count = buckets_scan_map(map_hash, &cursor, limit, max_stale, itemlist_add, &itemlist);
+	if (count < 0) {
+		node = buckets_get_primary_node(cursor);
+		if (node) {
+			assert(node->conninfo);
+			out = payload_new_reply();
+			payload_string(out, conninfo_str(node->conninfo));
+			client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+		}
+		else {
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+	else {
+		assert(count == itemlist.count);
+		out = payload_new_reply();
+		payload_long(out, map_hash);
+		payload_long(out, cursor);
+		payload_int(out, itemlist.count);
+		for (i=0; i<itemlist.count; i++) {
+			item = itemlist.items[i];
+			payload_long(out, item->item_key);
+			payload_item_value(out, item);
+		}
+		client_send_reply(client, header, RESPONSE_SCAN, out);
+	}
+	
+	if (itemlist.items) {
+		free(itemlist.items);
+	}
+}
+
+
+// Remove all the items in a map.  The payload is the map hash.  When a client asks for it, the items 
+// in the primary buckets on this node are removed, and the request is passed on to the other nodes 
+// so they can do the same.  The backups are told about the removed items by the primaries.
+static void cmd_drop_map(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	int avail;
+	int count;
+	int i;
+	hash_t map_hash;
+	node_t *node;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	if (avail != sizeof(hash_t)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	map_hash = data_long(&next, &avail);
+	
+	logger(LOG_DEBUG, "CMD: drop map [%#llx]", map_hash);
+	
+	count = buckets_drop_map(map_hash);
+	assert(count >= 0);
+	
+	// if it came from another node, then that node has already passed it on to everyone else.
+	if (client->node == NULL) {
+		for (i=0; i<node_count(); i++) {
+			node = node_get(i);
+			if (node && node->state == READY && node->client && node->logger == 0) {
+				push_drop_map(node->client, map_hash);
+			}
+		}
+	}
+	
+	client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+}
+
+
+// Remove an item.  The payload is the map and key hash.  The item is freed straight away, and the 
+// backup is sent a tombstone for it.  The reply is RESPONSE_OK if it was removed, or 
+// RESPONSE_NOT_MODIFIED if there was nothing to remove.
+static void cmd_delete(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	int avail;
+	hash_t map_hash;
+	hash_t key_hash;
+	node_t *node;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	if (avail != MGET_ENTRY_SIZE) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	
+	logger(LOG_DEBUG, "CMD: delete [%#llx/%#llx]", map_hash, key_hash);
+	
+	node = buckets_get_primary_node(key_hash);
+	if (node) {
+		assert(node->conninfo);
+		out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+	}
+	else if (buckets_delete_value(map_hash, key_hash) > 0) {
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+	else {
+		client_send_reply(client, header, RESPONSE_NOT_MODIFIED, NO_PAYLOAD);
+	}
+}
+
+
+// Remove a number of items in one request.  The payload is the number of entries, and then the map 
+// and key hash for each one (the same as MGET, without the max_stale).  The reply has an entry for 
+// each one, with its index and the result it would have got as a single DELETE.
+static void cmd_mdelete(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	char *entry;
+	int avail;
+	int count = -1;
+	int i;
+	hash_t map_hash;
+	hash_t key_hash;
+	node_t *node;
+	batch_entry_t *entries;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	if (avail >= sizeof(int)) {
+		count = data_int(&next, &avail);
+	}
+	
+	if (count <= 0 || header->length != sizeof(int) + (count * MGET_ENTRY_SIZE)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_INFO, "CMD: mdelete (%d entries)", count);
+	
+	entries = malloc(sizeof(batch_entry_t) * count);
+	assert(entries);
+	for (i=0; i<count; i++) {
+		entries[i].entry = next + (i * MGET_ENTRY_SIZE);
+	}
+	batch_sort(entries, count);
+	
+	out = payload_new_reply();
+	payload_int(out, count);
+	
+	for (i=0; i<count; i++) {
+		entry = entries[i].entry;
+		avail = MGET_ENTRY_SIZE;
+		map_hash = data_long(&entry, &avail);
+		key_hash = data_long(&entry, &avail);
+		
+		payload_int(out, entries[i].index);
+		
+		node = buckets_get_primary_node(key_hash);
+		if (node) {
+			batch_elsewhere(out, node);
+		}
+		else if (buckets_delete_value(map_hash, key_hash) > 0) {
+			payload_int(out, RESPONSE_OK);
+		}
+		else {
+			payload_int(out, RESPONSE_NOT_MODIFIED);
+		}
+	}
+	
+	free(entries);
+	client_send_reply(client, header, RESPONSE_MULTI, out);
+}
+
+
+
+// the fixed part of each entry in a SET_KEY_MULTI request (map_hash, expires, type).
+#define KEYMULTI_ENTRY_SIZE (sizeof(hash_t) + (sizeof(int) * 2))
+
+// Set a number of values with the same key hash (the fields of a record).  The payload is the key 
+// hash, the number of entries, and then for each one the map hash, expiry, type (COMMAND_SET_INT or 
+// COMMAND_SET_STRING) and value.  They are all in the same bucket, so they are either all stored, or 
+// the client is told which node to send them to.
+static void cmd_set_key_multi(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	char *end;
+	char *entries;
+	int avail;
+	int count = -1;
+	int expires;
+	int length;
+	int type;
+	int i;
+	hash_t key_hash = 0;
+	hash_t map_hash;
+	value_t *value;
+	node_t *node;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	end = payload + header->length;
+	if (avail >= sizeof(hash_t) + sizeof(int)) {
+		key_hash = data_long(&next, &avail);
+		count = data_int(&next, &avail);
+	}
+	
+	// check that all the entries are there before any of them are stored.
+	entries = next;
+	for (i=0; i<count && next != NULL; i++) {
+		if ((end - next) < KEYMULTI_ENTRY_SIZE) {
+			next = NULL;
+		}
+		else {
+			type = be32toh(*(uint32_t *) (next + sizeof(hash_t) + sizeof(int)));
+			next += KEYMULTI_ENTRY_SIZE;
+			if (type == COMMAND_SET_INT && (end - next) >= sizeof(long long)) {
+				next += sizeof(long long);
+			}
+			else if (type == COMMAND_SET_STRING && (end - next) >= sizeof(int)) {
+				length = be32toh(*(uint32_t *) next);
+				next += sizeof(int);
+				if (length < 0 || length > (end - next)) { next = NULL; }
+				else { next += length; }
+			}
+			else {
+				next = NULL;
+			}
+		}
+	}
+	
+	if (count <= 0 || next != end) {
+		logger(LOG_ERROR, "CMD: set key multi with invalid entries.");
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_DEBUG, "CMD: set key multi [%#llx] (%d entries)", key_hash, count);
+	
+	node = buckets_get_primary_node(key_hash);
+	if (node) {
+		assert(node->conninfo);
+		out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+		return;
+	}
+	
+	next = entries;
+	avail = end - entries;
+	for (i=0; i<count; i++) {
+		map_hash = data_long(&next, &avail);
+		expires  = data_int(&next, &avail);
+		type     = data_int(&next, &avail);
+		
+		// NOTE: value is controlled by the tree after it is stored.
+		value = calloc(1, sizeof(value_t));
+		assert(value);
+		if (type == COMMAND_SET_INT) {
+			value->type = VALUE_LONG;
+			value->data.l = data_long(&next, &avail);
+			value->valuehash = generate_hash_long(value->data.l);
+		}
+		else {
+			assert(type == COMMAND_SET_STRING);
+			length = data_int(&next, &avail);
+			value->type = VALUE_STRING;
+			value->valuehash = generate_hash_str(next, length);
+			value->data.s.data = malloc(length + 1);
+			assert(value->data.s.data);
+			memcpy(value->data.s.data, next, length);
+			value->data.s.data[length] = 0;
+			value->data.s.length = length;
+			value_compress(value);
+			next += length;
+		}
+		
+		buckets_store_value(map_hash, key_hash, expires, value);
+	}
+	
+	client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+}
+
+
+
+// Add to an integer value, and return the new value.  The payload is the map and key hash, the amount 
+// to add (negative to decrement), and the expiry to use if the item has to be created.  It can 
+// optionally be followed by the minimum and maximum that the value will be kept within.  The reply 
+// is the same as a GET_INT.
+static void cmd_incr(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	int avail;
+	hash_t map_hash;
+	hash_t key_hash;
+	long long delta;
+	long long min = LLONG_MIN;
+	long long max = LLONG_MAX;
+	long long result;
+	int expires;
+	node_t *node;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	
+	if (avail != (sizeof(hash_t) * 3) + sizeof(int) && avail != (sizeof(hash_t) * 5) + sizeof(int)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	delta    = data_long(&next, &avail);
+	expires  = data_int(&next, &avail);
+	if (header->length > (sizeof(hash_t) * 3) + sizeof(int)) {
+		min = data_long(&next, &avail);
+		max = data_long(&next, &avail);
+	}
+	
+	if (min > max || expires < 0) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_DEBUG, "CMD: incr [%#llx/%#llx] %lld", map_hash, key_hash, delta);
+	
+	node = buckets_get_primary_node(key_hash);
+	if (node) {
+		assert(node->conninfo);
+		out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+	}
+	else if (buckets_incr_value(map_hash, key_hash, delta, min, max, expires, &result) != 0) {
+		client_send_reply(client, header, RESPONSE_WRONGTYPE, NO_PAYLOAD);
+	}
+	else {
+		out = payload_new_reply();
+		payload_long(out, map_hash);
+		payload_long(out, key_hash);
+		payload_long(out, generate_hash_long(result));
+		payload_long(out, result);
+		client_send_reply(client, header, RESPONSE_DATA_INT, out);
+	}
+}
+
+
+// the fixed part of each entry in a MINCR request (map_hash, key_hash, delta, expires).
+#define MINCR_ENTRY_SIZE ((sizeof(hash_t) * 3) + sizeof(int))
+
+// Add to a number of integer values in one request.  The payload is the minimum and maximum (which 
+// apply to all the entries), the number of entries, and then the map and key hash, amount to add, and 
+// expiry for each one.  The reply has an entry for each one, with its index and the result it would 
+// have got as a single INCR (in bucket order, as for MGET).
+static void cmd_mincr(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	char *entry;
+	int avail;
+	int count = -1;
+	int expires;
+	int i;
+	hash_t map_hash;
+	hash_t key_hash;
+	long long delta;
+	long long min = 0;
+	long long max = 0;
+	long long result;
+	node_t *node;
+	batch_entry_t *entries;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	avail = header->length;
+	next = payload;
+	if (avail >= (sizeof(long long) * 2) + sizeof(int)) {
+		min = data_long(&next, &avail);
+		max = data_long(&next, &avail);
+		count = data_int(&next, &avail);
+	}
+	
+	if (count <= 0 || min > max || header->length != (sizeof(long long) * 2) + sizeof(int) + (count * MINCR_ENTRY_SIZE)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_INFO, "CMD: mincr (%d entries)", count);
+	
+	entries = malloc(sizeof(batch_entry_t) * count);
+	assert(entries);
+	for (i=0; i<count; i++) {
+		entries[i].entry = next + (i * MINCR_ENTRY_SIZE);
+	}
+	batch_sort(entries, count);
+	
+	out = payload_new_reply();
+	payload_int(out, count);
+	
+	for (i=0; i<count; i++) {
+		entry = entries[i].entry;
+		avail = MINCR_ENTRY_SIZE;
+		map_hash = data_long(&entry, &avail);
+		key_hash = data_long(&entry, &avail);
+		delta    = data_long(&entry, &avail);
+		expires  = data_int(&entry, &avail);
+		
+		payload_int(out, entries[i].index);
+		
+		node = buckets_get_primary_node(key_hash);
+		if (node) {
+			batch_elsewhere(out, node);
+		}
+		else if (expires < 0 || buckets_incr_value(map_hash, key_hash, delta, min, max, expires, &result) != 0) {
+			payload_int(out, RESPONSE_WRONGTYPE);
+		}
+		else {
+			payload_int(out, RESPONSE_DATA_INT);
+			payload_long(out, generate_hash_long(result));
+			payload_long(out, result);
+		}
+	}
+	
+	free(entries);
+	client_send_reply(client, header, RESPONSE_MULTI, out);
+}
+
+
+
+// Set a value, but only if the value that is stored has not changed since the client read it.  The 
+// payload is the map and key hash, the valuehash of the value the client expects to be there (0 if 
+// it expects there to be none), the expiry, and then the value as for SET_INT or SET_STRING.  
+// 
+// If it was stored, RESPONSE_OK is sent with the valuehash of the new value.  If the stored value 
+// was different, it is sent back (as DATA_INT or DATA_STRING) so that the client can try again 
+// without reading it first.  If the client expected a value but there isn't one, RESPONSE_FAIL is 
+// sent.  Since all the changes to a bucket are done by its primary node, one command at a time, 
+// nothing can change the value between the check and the store.
+static void cmd_set_if(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	char *str;
+	hash_t map_hash;
+	hash_t key_hash;
+	hash_t expected;
+	hash_t valuehash;
+	int expires;
+	int str_len;
+	int avail;
+	value_t *value;
+	value_t *current;
+	node_t *node;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+	assert(header->command == COMMAND_SET_INT_IF || header->command == COMMAND_SET_STRING_IF);
+
+	avail = header->length;
+	next = payload;
+	
+	if (avail < (sizeof(hash_t) * 3) + (sizeof(int) * 2)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	expected = data_long(&next, &avail);
+	expires  = data_int(&next, &avail);
+	
+	value = calloc(1, sizeof(value_t));
+	assert(value);
+	
+	if (header->command == COMMAND_SET_INT_IF) {
+		if (header->length != (sizeof(hash_t) * 4) + sizeof(int)) {
+			free(value);
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+			return;
+		}
+		value->type = VALUE_LONG;
+		value->data.l = data_long(&next, &avail);
+		value->valuehash = generate_hash_long(value->data.l);
+	}
+	else {
+		str_len = be32toh(*(uint32_t *) next);
+		if (str_len < 0 || header->length != (sizeof(hash_t) * 3) + (sizeof(int) * 2) + str_len) {
+			free(value);
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+			return;
+		}
+		next += sizeof(int);
+		str = next;
+		
+		value->type = VALUE_STRING;
+		value->valuehash = generate_hash_str(str, str_len);
+		value->data.s.data = malloc(str_len + 1);
+		assert(value->data.s.data);
+		memcpy(value->data.s.data, str, str_len);
+		value->data.s.data[str_len] = 0;
+		value->data.s.length = str_len;
+		value_compress(value);
+	}
+	
+	logger(LOG_DEBUG, "CMD: set if (%s): [%#llx/%#llx] expected=%#llx", value->type == VALUE_LONG ? "integer" : "string", map_hash, key_hash, expected);
+	
+	node = buckets_get_primary_node(key_hash);
+	if (node) {
+		// the bucket is not here, so the client is told where it is.
+		assert(node->conninfo);
+		value_free(value);
+		out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+		return;
+	}
+	
+	current = buckets_get_value(map_hash, key_hash, -1);
+	if (current == NULL && expected != 0) {
+		value_free(value);
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else if (current && current->valuehash != expected) {
+		// someone else changed it, so send back what is there now.
+		value_free(value);
+		out = payload_new_reply();
+		payload_long(out, map_hash);
+		payload_long(out, key_hash);
+		payload_long(out, current->valuehash);
+		if (current->type == VALUE_LONG) {
+			payload_long(out, current->data.l);
+			client_send_reply(client, header, RESPONSE_DATA_INT, out);
+		}
+		else {
+			assert(current->type == VALUE_STRING);
+			int str_len;
+			const char *str = value_string(current, &str_len);
+			payload_data(out, str_len, str);
+			client_send_reply(client, header, RESPONSE_DATA_STRING, out);
+		}
+	}
+	else {
+		// the new value goes through the normal path, so it is synced to the backup the same as 
+		// any other SET.
+		// NOTE: value is controlled by the tree after this function call.
+		valuehash = value->valuehash;
+		if (buckets_store_value(map_hash, key_hash, expires, value) == 0) {
+			out = payload_new_reply();
+			payload_long(out, valuehash);
+			client_send_reply(client, header, RESPONSE_OK, out);
+		}
+		else {
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+}
+
+
+
+// the last chunk of a streamed value has arrived, so it can be stored.  The bucket could have moved 
+// to another node while the chunks were arriving, in which case the client needs to send it there.
+static void upload_complete(client_t *client, header_t *header)
+{
+	upload_t *upload;
+	value_t *value;
+	hash_t valuehash;
+	node_t *node;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(client->upload);
+	
+	upload = client->upload;
+	client->upload = NULL;
+	assert(upload->received == upload->value->data.s.length);
+	
+	value = upload->value;
+	assert(value->type == VALUE_STRING);
+	value->data.s.data[value->data.s.length] = 0;
+	value->valuehash = generate_hash_str(value->data.s.data, value->data.s.length);
+	value_compress(value);
+	
+	node = buckets_get_primary_node(upload->key_hash);
+	if (node) {
+		assert(node->conninfo);
+		value_free(value);
+		out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+	}
+	else {
+		// NOTE: value is controlled by the tree after this function call.
+		valuehash = value->valuehash;
+		if (buckets_store_value(upload->map_hash, upload->key_hash, upload->expires, value) == 0) {
+			out = payload_new_reply();
+			payload_long(out, valuehash);
+			client_send_reply(client, header, RESPONSE_OK, out);
+		}
+		else {
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+	
+	free(upload);
+}
+
+
+// Start storing a large value that will be sent in chunks.  The payload is the map and key hash, the 
+// expiry, the total length of the value, and then the first chunk (as a string).  The whole value is 
+// allocated now, and the chunks are copied straight into it as they arrive, so it is only ever held 
+// once.  Any stream that was already in progress on this connection is abandoned.  A value larger 
+// than 'value-max' (see values_max()) gets RESPONSE_TOOLARGE.
+// 
+// Each chunk gets RESPONSE_OK.  When the last one has arrived, the value is stored and its 
+// RESPONSE_OK includes the valuehash (the same as SET_STRING_IF).
+static void cmd_set_stream(client_t *client, header_t *header, char *payload)
+{
+	msg_set_stream_t msg;
+	hash_t map_hash;
+	hash_t key_hash;
+	int expires;
+	int total;
+	int chunk_len;
+	value_t *value;
+	node_t *node;
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	client_upload_free(client);
+	
+	if (msg_set_stream_decode(payload, header->length, &msg) != header->length 
+			|| msg.total <= 0 || msg.chunk_len > msg.total) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	map_hash = msg.map_hash;
+	key_hash = msg.key_hash;
+	expires  = msg.expires;
+	total    = msg.total;
+	chunk_len = msg.chunk_len;
+	
+	if (chunk_len > CHUNK_SIZE_MAX || total > values_max()) {
+		client_send_reply(client, header, RESPONSE_TOOLARGE, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_DEBUG, "CMD: set stream: [%#llx/%#llx] total=%d", map_hash, key_hash, total);
+	
+	node = buckets_get_primary_node(key_hash);
+	if (node) {
+		assert(node->conninfo);
+		out = payload_new_reply();
+		payload_string(out, conninfo_str(node->conninfo));
+		client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
+		return;
+	}
+	
+	// the value is allocated at its full size now, so this is where we find out if there isn't 
+	// enough memory for it.
+	value = calloc(1, sizeof(value_t));
+	assert(value);
+	value->data.s.data = malloc(total + 1);
+	if (value->data.s.data == NULL) {
+		logger(LOG_ERROR, "CMD: set stream: [%#llx/%#llx] unable to allocate %d bytes.", map_hash, key_hash, total);
+		free(value);
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	value->type = VALUE_STRING;
+	value->data.s.length = total;
+	if (chunk_len > 0) {
+		memcpy(value->data.s.data, msg.chunk, chunk_len);
+	}
+	
+	client->upload = calloc(1, sizeof(upload_t));
+	assert(client->upload);
+	client->upload->map_hash = map_hash;
+	client->upload->key_hash = key_hash;
+	client->upload->expires = expires;
+	client->upload->received = chunk_len;
+	client->upload->value = value;
+	
+	if (chunk_len == total) {
+		upload_complete(client, header);
+	}
+	else {
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
+// The next chunk of a value that was started with SET_STREAM.  The payload is the map and key hash, 
+// the offset of this chunk in the value, and the chunk (as a string).  The chunks must arrive in 
+// order, and fit within the total that was given.  If anything doesn't match, the stream is 
+// abandoned and RESPONSE_FAIL is sent.
+static void cmd_set_chunk(client_t *client, header_t *header, char *payload)
+{
+	msg_set_chunk_t msg;
+	hash_t map_hash;
+	hash_t key_hash;
+	int offset;
+	int chunk_len;
+	upload_t *upload;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	if (msg_set_chunk_decode(payload, header->length, &msg) != header->length) {
+		client_upload_free(client);
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	map_hash = msg.map_hash;
+	key_hash = msg.key_hash;
+	offset   = msg.offset;
+	chunk_len = msg.chunk_len;
+	
+	upload = client->upload;
+	if (upload == NULL || upload->map_hash != map_hash || upload->key_hash != key_hash 
+			|| offset != upload->received 
+			|| chunk_len > upload->value->data.s.length - upload->received) {
+		logger(LOG_WARN, "CMD: set chunk: [%#llx/%#llx] offset=%d does not match the stream.", map_hash, key_hash, offset);
+		client_upload_free(client);
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
+	if (chunk_len > CHUNK_SIZE_MAX) {
+		client_upload_free(client);
+		client_send_reply(client, header, RESPONSE_TOOLARGE, NO_PAYLOAD);
+		return;
+	}
+	
+	if (chunk_len > 0) {
+		memcpy(upload->value->data.s.data + upload->received, msg.chunk, chunk_len);
+		upload->received += chunk_len;
+	}
+	
+	if (upload->received == upload->value->data.s.length) {
+		upload_complete(client, header);
+	}
+	else {
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
+// Get part of a string value.  The payload is the map and key hash, the offset to start at, the most 
+// to return (0 for CHUNK_SIZE, and never more than CHUNK_SIZE_MAX), and optionally the max_stale.  
+// The reply (RESPONSE_DATA_CHUNK) has the map and key hash, the valuehash, the total length of the 
+// value, the offset, and the part of the value.  The client can check the valuehash of each chunk to 
+// know that the value didn't change while it was reading it.
+static void cmd_get_chunk(client_t *client, header_t *header, char *payload)
 {
-	char *next;
+	msg_get_chunk_t msg;
+	msg_data_chunk_t reply;
 	hash_t map_hash;
 	hash_t key_hash;
-	int expires;
+	int offset;
+	int max_length;
+	int length;
+	int size;
+	const char *str;
+	int str_len;
 	value_t *value;
-	int result;
+	node_t *node;
+	PAYLOAD out;
 	
 	assert(client);
 	assert(header);
 	assert(payload);
 
-	// create a new value.
-	// ** PERF: get the 'value' objects from a pool to improve performance.
-	value = calloc(1, sizeof(value_t));
-	assert(value);
+	if (msg_get_chunk_decode(payload, header->length, &msg) != header->length) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
 	
-	next = payload;
-	map_hash      = data_long(&next);
-	key_hash      = data_long(&next);
-	expires       = data_int(&next);
-	value->data.l = data_long(&next);
-	value->type = VALUE_LONG;
-
-	// check payload meets protocol specifications.
-	assert(0);
-
-	// first we need to check that this server is responsible for this data.  If not, we need to pass a message to the server that is.
-	node_t *node = buckets_get_primary_node(key_hash);
-	if (node) {
-		// this data is being served by another node... we need to relay the query.
-		assert(0);
+	map_hash = msg.map_hash;
+	key_hash = msg.key_hash;
+	offset   = msg.offset;
+	max_length = msg.max_length;
+	
+	if (offset < 0 || max_length < 0) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	if (max_length == 0) {
+		max_length = CHUNK_SIZE;
+	}
+	else if (max_length > CHUNK_SIZE_MAX) {
+		max_length = CHUNK_SIZE_MAX;
 	}
-	else {
 	
-		
-		logger(LOG_DEBUG, "CMD: set (integer): [%#llx/%#llx]=%d", map_hash, key_hash, value->data.l);
-
-		// store the value into the trees.  If a value already exists, it will get released and this one 
-		// will replace it, so control of this value is given to the tree structure.
-		// NOTE: value is controlled by the tree after this function call.
-		result = buckets_store_value(map_hash, key_hash, expires, value);
-		value = NULL;
-		
-		// send the ACK reply.
-		if (result == 0) {
-			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	value = buckets_get_value(map_hash, key_hash, msg.max_stale);
+	if (value == NULL) {
+		node = buckets_get_primary_node(key_hash);
+		if (node) {
+			assert(node->conninfo);
+			out = payload_new_reply();
+			payload_string(out, conninfo_str(node->conninfo));
+			client_send_reply(client, header, RESPONSE_TRYELSEWHERE, out);
 		}
 		else {
-			assert(0);
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
 		}
 	}
-	
-	// if the value was not passed to the storage system, then we need to free it ourself.
-	if (value) { free(value); }
+	else if (value->type != VALUE_STRING) {
+		client_send_reply(client, header, RESPONSE_WRONGTYPE, NO_PAYLOAD);
+	}
+	else if (offset > value_string_length(value)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		// only the first chunk counts as a read of the key.
+		if (offset == 0) {
+			hotkeys_sample(map_hash, key_hash);
+		}
+		
+		str = value_string(value, &str_len);
+		length = str_len - offset;
+		if (length > max_length) {
+			length = max_length;
+		}
+		
+		reply.map_hash = map_hash;
+		reply.key_hash = key_hash;
+		reply.valuehash = value->valuehash;
+		reply.total = str_len;
+		reply.offset = offset;
+		reply.chunk = str + offset;
+		reply.chunk_len = length;
+		
+		out = payload_new_reply();
+		size = msg_data_chunk_size(&reply);
+		msg_data_chunk_encode(payload_reserve(out, size), size, &reply);
+		client_send_reply(client, header, RESPONSE_DATA_CHUNK, out);
+	}
 }
 
 
@@ -530,6 +1957,46 @@ static void cmd_ping(client_t *client, header_t *header)
 }
 
 
+// the client wants to be told when items change (or stops wanting to), so that it can keep its own 
+// copy of the items it reads.  The payload is a single integer, non-zero to turn them on.
+static void cmd_invalidations(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	int enabled;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+
+	int avail = header->length;
+	next = payload;
+	enabled = data_int(&next, &avail);
+	
+	if (avail < 0 || client->node) {
+		// the data was invalid, or it came from another node (which shouldn't be caching anything).
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		logger(LOG_INFO, "CMD: invalidations %s", enabled ? "on" : "off");
+		client_set_invalidations(client, enabled);
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
+// HOTKEY and INVALIDATE are only ever sent from the server to clients, but they need a command 
+// entry so that the replies to them can be registered.  If something sends them to us, we dont 
+// know what to do with them.
+static void cmd_pushonly(client_t *client, header_t *header, char *payload)
+{
+	assert(client);
+	assert(header);
+	
+	logger(LOG_ERROR, "Received command %#x, which is only sent to clients.", header->command);
+	client_send_reply(client, header, RESPONSE_UNKNOWN, NO_PAYLOAD);
+}
+
+
 static void cmd_goodbye(client_t *client, header_t *header)
 {
 	assert(client);
@@ -565,6 +2032,31 @@ static void cmd_serverhello(client_t *client, header_t *header, char *payload)
 	char *auth = data_string_copy(&next, &avail);
 	assert(avail >= 0);
 	assert(auth);
+	
+	// newer nodes also tell us which channel this connection is for, and how many bulk connections 
+	// they would like.  Older nodes dont, and everything will go over this one connection.
+	int channel = CHANNEL_CONTROL;
+	int bulk = 0;
+	if (avail > 0) {
+		channel = data_int(&next, &avail);
+		bulk = data_int(&next, &avail);
+	}
+	
+	// and if they are a logger node.
+	int role = NODE_ROLE_DATA;
+	if (avail > 0) {
+		role = data_int(&next, &avail);
+	}
+
+	// and the compression they would like on a bulk connection, and the features they understand.
+	int compress = COMPRESS_NONE;
+	if (avail > 0) {
+		compress = data_int(&next, &avail);
+	}
+	int features = 0;
+	if (avail > 0) {
+		features = data_int(&next, &avail);
+	}
 
 	if (avail < 0) {
 		client_fail(client);
@@ -583,7 +2075,45 @@ static void cmd_serverhello(client_t *client, header_t *header, char *payload)
 		}
 		else {
 			
-			logger(LOG_DEBUG, "Received Server Hello from node claiming to be '%s'", conninfo_name(conninfo));
+			logger(LOG_DEBUG, "Received Server Hello from node claiming to be '%s' (channel:%d)", conninfo_name(conninfo), channel);
+			
+			if (channel == CHANNEL_BULK) {
+				// this is a bulk connection for a node that should already have its control 
+				// connection setup.
+				node_t *node = node_find(conninfo);
+				if (node == NULL || node->client == NULL || node->client == client) {
+					client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+				}
+				else {
+					client->node = node;
+					client->channel = CHANNEL_BULK;
+					node_attach_bulk(node, client);
+					
+					// if they asked for compression, tell them if we will use it too.  Nodes that 
+					// didn't ask get the same reply they always did.
+					PAYLOAD out = NO_PAYLOAD;
+					if (compress != COMPRESS_NONE) {
+						if (compress != nodes_compression()) { compress = COMPRESS_NONE; }
+						out = payload_new_reply();
+						payload_int(out, compress);
+					}
+					
+					// the reply goes out in the old framing, and everything after it is in the v2 
+					// framing so that the frames can be marked as compressed.
+					client_send_reply(client, header, RESPONSE_OK, out);
+					if (compress != COMPRESS_NONE) {
+						client->protocol = PROTOCOL_V2;
+						client->old_replies = client->pending;
+						client->compress = compress_new(compress);
+						logger(LOG_INFO, "Bulk connection from '%s' is compressed.", node_name(node));
+					}
+				}
+				
+				conninfo_free(conninfo);
+				free(conninfo_str); conninfo_str=NULL;
+				free(auth); auth=NULL;
+				return;
+			}
 			
 			// we have a server conninfo.  We need to check it against our node list.  If it is 
 			// there, then we dont do anything.  If it is not there, then we need to add it.
@@ -633,11 +2163,25 @@ static void cmd_serverhello(client_t *client, header_t *header, char *payload)
 							client->node = node;
 			}	}	}	}
 
+			// if the other node is a logger, then our primary buckets need to send it their updates.
+			if (role == NODE_ROLE_LOGGER) {
+				node->logger = 1;
+				buckets_set_logging_node(node);
+			}
+			node->features = features;
+
 			// since this connection is a node, we need to set a 'loadlevel' timer.
 			node_start_loadlevel(node);
 
-			// send the ACK reply.
-			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+			// send the ACK reply, with the number of bulk connections we will accept from it, our 
+			// role, and the features we understand.
+			if (bulk > nodes_bulk_channels()) { bulk = nodes_bulk_channels(); }
+			if (bulk < 0) { bulk = 0; }
+			PAYLOAD out = payload_new_reply();
+			payload_int(out, bulk);
+			payload_int(out, nodes_logger() ? NODE_ROLE_LOGGER : NODE_ROLE_DATA);
+			payload_int(out, FEATURE_COMPRESSED_VALUES);
+			client_send_reply(client, header, RESPONSE_OK, out);
 		}
 	}
 	
@@ -716,6 +2260,12 @@ static void cmd_hashmask(client_t *client, header_t *header, char *payload)
 
 	assert(client->node);
 
+	// logger nodes dont have any buckets, so they dont need to keep track of where they are.
+	if (translog_active()) {
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		return;
+	}
+
 	// get the data out of the payload.
 	next = payload;
 	mask = data_long(&next);
@@ -867,9 +2417,9 @@ static void cmd_finalise_migration(client_t *client, header_t *header, char *pay
 		// at this point, the bucket should have at least a source node, or a backup node listed.
 		assert(bucket->source_node || bucket->backup_node);
 
+		// buckets_finalize_migration() will have cleared the transfer for this client.
 		assert(bucket->transfer_client == NULL);
-
-		buckets_clear_transferring(bucket);
+		assert(client->transfer_bucket == NULL);
 		
 		conninfo_free(conninfo);
 	}
@@ -889,20 +2439,64 @@ static void cmd_finalise_migration(client_t *client, header_t *header, char *pay
 // However, it triggers a servermap, and a hashmasks command to follow it.
 static void cmd_hello(client_t *client, header_t *header, char *payload)
 {
+	char *next;
+	int auth_len;
+	int version = PROTOCOL_V1;
+	PAYLOAD out = NO_PAYLOAD;
+	
 	assert(client);
 	assert(header);
 
-	// there is payload required for this command.
-	assert(header->length > 0);
+	// there is payload required for this command.  The authentication string, and optionally the 
+	// framing the client would like to use, and the features (FEATURE_*) it understands.
+	if (header->length < sizeof(int)) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
 	
-	char *next = payload;
-	char *auth = data_string_copy(&next);
+	next = payload;
+	auth_len = be32toh(*(uint32_t *) next);
+	next += sizeof(int);
+	if (auth_len < 0 || header->length < sizeof(int) + auth_len) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
 
 // TODO: Need to actually parse the authentication information and compare against the server's authentication methods to determine if there is a match.
-	if (auth) { free(auth); }
+	next += auth_len;
+	
+	// if the client asked for a newer framing, tell it which one we will use.  Clients that didn't 
+	// ask get the same reply they always did.
+	if (header->length >= (sizeof(int) * 2) + auth_len) {
+		version = be32toh(*(uint32_t *) next);
+		next += sizeof(int);
+		if (version > PROTOCOL_V2) { version = PROTOCOL_V2; }
+		if (version < PROTOCOL_V1) { version = PROTOCOL_V1; }
+		out = payload_new_reply();
+		payload_int(out, version);
+	}
+	if (header->length >= (sizeof(int) * 3) + auth_len) {
+		client->features = be32toh(*(uint32_t *) next);
+	}
 	
-	// send the ACK reply.
-	client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	// if the client asked for them, send our current hashmasks before the reply, so that by the time 
+	// the client sees the reply, it knows which buckets it can send directly to us.  Older clients 
+	// dont know what to do with them.
+	if (client->features & FEATURE_HASHMASKS) {
+		buckets_push_hashmasks(client);
+	}
+	if (client->features & FEATURE_HOTKEYS) {
+		hotkeys_push(client);
+	}
+	
+	// send the ACK reply.  It goes out in the old framing, and everything after it uses the new one.  
+	// The client will reply to the hashmasks before it sees this, so those replies are in the old 
+	// framing too.
+	client_send_reply(client, header, RESPONSE_OK, out);
+	if (client->protocol != version) {
+		client->protocol = version;
+		client->old_replies = client->pending;
+	}
 }
 
 
@@ -912,12 +2506,12 @@ static void cmd_hello(client_t *client, header_t *header, char *payload)
 // cmd_set_str, except the data received is slightly different.
 static void cmd_sync_string(client_t *client, header_t *header, char *payload)
 {
-	char *next;
+	msg_sync_str_t msg;
 	hash_t map_hash;
 	hash_t key_hash;
 	int expires;
 	value_t *value;
-	char *str;
+	const char *str;
 	int result;
 	int str_len;
 	
@@ -925,34 +2519,81 @@ static void cmd_sync_string(client_t *client, header_t *header, char *payload)
 	assert(header);
 	assert(payload);
 
+	// the primary's sync counter was added later, so older nodes will not send it (and it will be 0).
+	if (msg_sync_str_decode(payload, header->length, &msg) != header->length) {
+		logger(LOG_ERROR, "Invalid SYNC_STRING received.");
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
 	// create a new value.
 	value = calloc(1, sizeof(value_t));
 	assert(value);
 	
-	next = payload;
-	
-	map_hash = data_long(&next);
-	key_hash = data_long(&next);
-	expires = data_int(&next);
-	str = data_string(&next, &str_len);
-	
-	// check payload meets protocol specifications.
-	assert(0);
-
-	// we cant treat the string as a typical C string, because it is actually a binary blob that may 
-	// contain NULL chars.
-	value->data.s.data = malloc(str_len + 1);
-	memcpy(value->data.s.data, str, str_len);
-	value->data.s.data[str_len] = 0;
-	value->data.s.length = str_len;
-	value->type = VALUE_STRING;
+	int sync_seq = msg.sync_seq;
+	map_hash = msg.map_hash;
+	key_hash = msg.key_hash;
+	expires = msg.expires;
+	str = msg.value;
+	str_len = msg.value_len;
+
+	if (msg.raw_length > 0) {
+		// the primary keeps this value compressed, so we keep it the same way.  It is expanded once, 
+		// to check it and to get the valuehash.  A logger node only writes it to the log (which has 
+		// the expanded string), so it keeps the expanded one instead.
+		char *raw = value_expand(str, str_len, msg.raw_length);
+		if (raw == NULL) {
+			logger(LOG_ERROR, "Invalid compressed SYNC_STRING received.");
+			free(value);
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+			return;
+		}
+		value->valuehash = generate_hash_str(raw, msg.raw_length);
+		if (translog_active()) {
+			value->data.s.data = raw;
+			value->data.s.length = msg.raw_length;
+			value->type = VALUE_STRING;
+		}
+		else {
+			free(raw);
+			value_set_compressed(value, str, str_len, msg.raw_length);
+		}
+	}
+	else {
+		// we cant treat the string as a typical C string, because it is actually a binary blob that 
+		// may contain NULL chars.
+		value->data.s.data = malloc(str_len + 1);
+		memcpy(value->data.s.data, str, str_len);
+		value->data.s.data[str_len] = 0;
+		value->data.s.length = str_len;
+		value->type = VALUE_STRING;
+		value->valuehash = generate_hash_str(value->data.s.data, str_len);
+		if (translog_active() == 0) {
+			value_compress(value);
+		}
+	}
 	
 	// store the value into the trees.  If a value already exists, it will get released and this one 
 	// will replace it, so control of this value is given to the tree structure.
 	// NOTE: value is controlled by the tree after this function call.
 	// NOTE: name is controlled by the tree after this function call.
-	result = buckets_store_value(map_hash, key_hash, expires, value);
-	value = NULL;
+	if (translog_active()) {
+		// we are a logger node, so we dont store the data, we just add it to the log.  The ACK is 
+		// sent once it has been written to the disk.
+		translog_append(map_hash, key_hash, expires, value);
+		value_free(value);
+		value = NULL;
+		translog_ack(client, header);
+		return;
+	}
+	else {
+		result = buckets_store_value(map_hash, key_hash, expires, value);
+		value = NULL;
+		
+		if (sync_seq > 0) {
+			buckets_sync_seen(key_hash, sync_seq);
+		}
+	}
 	
 	// send the ACK reply.
 	if (result == 0) {
@@ -970,7 +2611,7 @@ static void cmd_sync_string(client_t *client, header_t *header, char *payload)
 // cmd_set_str, except the data received is slightly different.
 static void cmd_sync_int(client_t *client, header_t *header, char *payload)
 {
-	char *next;
+	msg_sync_int_t msg;
 	hash_t map_hash;
 	hash_t key_hash;
 	int expires;
@@ -981,27 +2622,46 @@ static void cmd_sync_int(client_t *client, header_t *header, char *payload)
 	assert(header);
 	assert(payload);
 
+	// the primary's sync counter was added later, so older nodes will not send it (and it will be 0).
+	if (msg_sync_int_decode(payload, header->length, &msg) != header->length) {
+		logger(LOG_ERROR, "Invalid SYNC_INT received.");
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	
 	// create a new value.
 	value = calloc(1, sizeof(value_t));
 	assert(value);
 	
-	next = payload;
-	
-	map_hash = data_long(&next);
-	key_hash = data_long(&next);
-	expires = data_int(&next);
-	value->data.l = data_long(&next);
+	int sync_seq = msg.sync_seq;
+	map_hash = msg.map_hash;
+	key_hash = msg.key_hash;
+	expires = msg.expires;
+	value->data.l = msg.value;
 	value->type = VALUE_LONG;
-	
-	// check payload meets protocol specifications.
-	assert(0);
+	value->valuehash = generate_hash_long(value->data.l);
 
 	// store the value into the trees.  If a value already exists, it will get released and this one 
 	// will replace it, so control of this value is given to the tree structure.
 	// NOTE: value is controlled by the tree after this function call.
 	// NOTE: name is controlled by the tree after this function call (if it is supplied).
-	result = buckets_store_value(map_hash, key_hash, expires, value);
-	value = NULL;
+	if (translog_active()) {
+		// we are a logger node, so we dont store the data, we just add it to the log.  The ACK is 
+		// sent once it has been written to the disk.
+		translog_append(map_hash, key_hash, expires, value);
+		value_free(value);
+		value = NULL;
+		translog_ack(client, header);
+		return;
+	}
+	else {
+		result = buckets_store_value(map_hash, key_hash, expires, value);
+		value = NULL;
+		
+		if (sync_seq > 0) {
+			buckets_sync_seen(key_hash, sync_seq);
+		}
+	}
 	
 	// send the ACK reply.
 	if (result == 0) {
@@ -1050,6 +2710,151 @@ static void cmd_sync_keyvalue(client_t *client, header_t *header, char *payload)
 }
 
 
+// The primary for some of our backup buckets is telling us what its sync counters are up to, so 
+// that we can tell how far behind we are.
+// Another node is sending us a read-only copy of one of its hot keys.
+static void cmd_sync_replica(client_t *client, header_t *header, char *payload)
+{
+	value_t *value;
+	char *str;
+	int str_len;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+	
+	int avail = header->length;
+	char *next = payload;
+	hash_t map_hash = data_long(&next, &avail);
+	hash_t key_hash = data_long(&next, &avail);
+	int ttl         = data_int(&next, &avail);
+	int type        = data_int(&next, &avail);
+	
+	value = calloc(1, sizeof(value_t));
+	assert(value);
+	
+	if (type == VALUE_LONG) {
+		value->data.l = data_long(&next, &avail);
+		value->type = VALUE_LONG;
+		value->valuehash = generate_hash_long(value->data.l);
+	}
+	else if (type == VALUE_STRING) {
+		str = data_string(&next, &str_len, &avail);
+		if (avail >= 0) {
+			value->data.s.data = malloc(str_len + 1);
+			memcpy(value->data.s.data, str, str_len);
+			value->data.s.data[str_len] = 0;
+			value->data.s.length = str_len;
+			value->type = VALUE_STRING;
+			value->valuehash = generate_hash_str(value->data.s.data, str_len);
+		}
+	}
+	
+	if (avail < 0 || ttl <= 0 || value->type == VALUE_DELETED || client->node == NULL) {
+		// The data was invalid and the connection needs to be dropped.
+		assert(0);
+		value_free(value);
+	}
+	else {
+		// NOTE: value is controlled by the hotkeys after this function call.
+		hotkeys_store_replica(map_hash, key_hash, ttl, value);
+		value = NULL;
+		
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
+// The primary has removed some items from a map (they were deleted, or the whole map was dropped), 
+// so they need to be removed from our backup copy too.  The same message is sent to a node that a 
+// bucket is being migrated to, and to the logger.
+static void cmd_sync_delete(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	int avail;
+	int sync_seq = 0;
+	int count = -1;
+	int i;
+	hash_t map_hash = 0;
+	hash_t *key_hashes;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+	
+	avail = header->length;
+	next = payload;
+	if (avail >= sizeof(hash_t) + (sizeof(int) * 2)) {
+		map_hash = data_long(&next, &avail);
+		sync_seq = data_int(&next, &avail);
+		count    = data_int(&next, &avail);
+	}
+	
+	if (count <= 0 || header->length != sizeof(hash_t) + (sizeof(int) * 2) + (sizeof(hash_t) * count) || client->node == NULL) {
+		// The data was invalid and the connection needs to be dropped.
+		assert(0);
+		return;
+	}
+	
+	key_hashes = malloc(sizeof(hash_t) * count);
+	assert(key_hashes);
+	for (i=0; i<count; i++) {
+		key_hashes[i] = data_long(&next, &avail);
+	}
+	
+	if (translog_active()) {
+		// we are a logger node, so we dont have the items, but the log needs to show that they are gone.
+		for (i=0; i<count; i++) {
+			translog_delete(map_hash, key_hashes[i]);
+		}
+		translog_ack(client, header);
+	}
+	else {
+		buckets_delete_keys(map_hash, count, key_hashes);
+		if (sync_seq > 0) {
+			buckets_sync_seen(key_hashes[0], sync_seq);
+		}
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+	free(key_hashes);
+}
+
+
+static void cmd_sync_mark(client_t *client, header_t *header, char *payload)
+{
+	int i;
+	
+	assert(client);
+	assert(header);
+	assert(payload);
+	
+	int avail = header->length;
+	char *next = payload;
+	hash_t mask = data_long(&next, &avail);
+	int count   = data_int(&next, &avail);
+	
+	if (avail < 0 || count < 0 || client->node == NULL) {
+		// The data was invalid and the connection needs to be dropped.
+		assert(0);
+	}
+	else {
+		// if the mask has changed since the mark was sent, then the hashmasks dont line up with our 
+		// buckets anymore, so we just ignore it and wait for the next one.
+		if (mask == buckets_mask()) {
+			for (i=0; i<count && avail > 0; i++) {
+				hash_t hashmask = data_long(&next, &avail);
+				int seq = data_int(&next, &avail);
+				if (avail >= 0) {
+					buckets_sync_mark(client->node, hashmask, seq);
+				}
+			}
+		}
+		
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
 
 
 void cmd_init(void)
@@ -1060,6 +2865,22 @@ void cmd_init(void)
  	client_add_cmd(COMMAND_GET_STRING, cmd_get_str);
  	client_add_cmd(COMMAND_SET_INT, cmd_set_int);
  	client_add_cmd(COMMAND_SET_STRING, cmd_set_str);
+ 	client_add_cmd(COMMAND_GET_IF_CHANGED, cmd_get_ifchanged);
+ 	client_add_cmd(COMMAND_MGET, cmd_mget);
+ 	client_add_cmd(COMMAND_MSET, cmd_mset);
+ 	client_add_cmd(COMMAND_SET_INT_IF, cmd_set_if);
+ 	client_add_cmd(COMMAND_SET_STRING_IF, cmd_set_if);
+ 	client_add_cmd(COMMAND_INCR, cmd_incr);
+ 	client_add_cmd(COMMAND_MINCR, cmd_mincr);
+ 	client_add_cmd(COMMAND_GET_KEY_ALL, cmd_get_key_all);
+ 	client_add_cmd(COMMAND_SET_KEY_MULTI, cmd_set_key_multi);
+ 	client_add_cmd(COMMAND_SCAN_MAP, cmd_scan_map);
+ 	client_add_cmd(COMMAND_DROP_MAP, cmd_drop_map);
+ 	client_add_cmd(COMMAND_DELETE, cmd_delete);
+ 	client_add_cmd(COMMAND_MDELETE, cmd_mdelete);
+ 	client_add_cmd(COMMAND_SET_STREAM, cmd_set_stream);
+ 	client_add_cmd(COMMAND_SET_CHUNK, cmd_set_chunk);
+ 	client_add_cmd(COMMAND_GET_CHUNK, cmd_get_chunk);
 
 	client_add_cmd(COMMAND_SET_KEYVALUE, cmd_set_keyvalue);
 	client_add_cmd(COMMAND_GET_KEYVALUE, cmd_get_keyvalue);
@@ -1067,6 +2888,9 @@ void cmd_init(void)
 	client_add_cmd(COMMAND_SYNC_INT, cmd_sync_int);
  	client_add_cmd(COMMAND_SYNC_KEYVALUE, cmd_sync_keyvalue);
  	client_add_cmd(COMMAND_SYNC_STRING, cmd_sync_string);
+ 	client_add_cmd(COMMAND_SYNC_MARK, cmd_sync_mark);
+ 	client_add_cmd(COMMAND_SYNC_REPLICA, cmd_sync_replica);
+ 	client_add_cmd(COMMAND_SYNC_DELETE, cmd_sync_delete);
 
 	client_add_cmd(COMMAND_PING, cmd_ping);
  	client_add_cmd(COMMAND_LOADLEVELS, cmd_loadlevels);
@@ -1075,6 +2899,9 @@ void cmd_init(void)
  	client_add_cmd(COMMAND_FINALISE_MIGRATION, cmd_finalise_migration);
  	client_add_cmd(COMMAND_HASHMASK, cmd_hashmask);
  	client_add_cmd(COMMAND_HELLO, cmd_hello);
+ 	client_add_cmd(COMMAND_INVALIDATIONS, cmd_invalidations);
+ 	client_add_cmd(COMMAND_HOTKEY, cmd_pushonly);
+ 	client_add_cmd(COMMAND_INVALIDATE, cmd_pushonly);
  	client_add_cmd(COMMAND_GOODBYE, cmd_goodbye);
  	client_add_cmd(COMMAND_SERVERHELLO, cmd_serverhello);
 }
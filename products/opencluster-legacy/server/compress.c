@@ -0,0 +1,257 @@
+// compress.c
+
+// Migration and backup syncing send a lot of values to the other nodes, and values are often text
+// (JSON, HTML, etc) that compress well.  When two nodes agree to it (in the SERVERHELLO for each
+// bulk connection), the frames on that connection are compressed.
+//
+// Each direction of the connection is a single deflate stream, and every frame is flushed
+// (Z_SYNC_FLUSH) so that it can be expanded as soon as it arrives.  Because the stream keeps its
+// window between frames, a value that looks like the ones before it compresses very well even when
+// it is small.  That also means the two ends must see exactly the same compressed frames, so once
+// a frame has been compressed it has to be sent compressed, even if it didn't get any smaller.  The
+// decision to skip compression (for small frames, or data that doesn't compress) is made before
+// compressing, and those frames are sent without the FRAME_COMPRESSED flag.
+
+#include "compress.h"
+
+#include "constants.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zlib.h>
+
+
+struct __compress_t {
+	int method;
+
+	z_stream deflate;
+	z_stream inflate;
+
+	// the output of the last frame that was compressed or expanded.  It is only valid until the next
+	// one.
+	struct {
+		char *buffer;
+		int max;
+	} out, in;
+
+	// frames in a row that didn't compress well, and how many frames are still to be sent without
+	// compressing.
+	int poor;
+	int bypass;
+
+	// stats.
+	long long raw_out;
+	long long sent;
+	long long raw_in;
+	long long received;
+	long long frames;
+	long long bypassed;
+	long long deflate_usec;
+	long long inflate_usec;
+};
+
+
+static long long usec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000));
+}
+
+
+static void buffer_fit(char **buffer, int *max, int needed)
+{
+	assert(buffer);
+	assert(max);
+	assert(needed > 0);
+
+	if (*max < needed) {
+		*max = ((needed / DEFAULT_BUFSIZE) + 1) * DEFAULT_BUFSIZE;
+		*buffer = realloc(*buffer, *max);
+		assert(*buffer);
+	}
+}
+
+
+compress_t * compress_new(int method)
+{
+	compress_t *link;
+	int result;
+
+	assert(method == COMPRESS_DEFLATE);
+
+	link = calloc(1, sizeof(compress_t));
+	assert(link);
+
+	link->method = method;
+
+	// raw deflate streams (negative window bits), since the frame already says where the data ends.
+	result = deflateInit2(&link->deflate, COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	assert(result == Z_OK);
+	result = inflateInit2(&link->inflate, -MAX_WBITS);
+	assert(result == Z_OK);
+	(void) result;
+
+	link->out.buffer = NULL;
+	link->out.max = 0;
+	link->in.buffer = NULL;
+	link->in.max = 0;
+
+	return(link);
+}
+
+
+void compress_free(compress_t *link)
+{
+	assert(link);
+
+	deflateEnd(&link->deflate);
+	inflateEnd(&link->inflate);
+
+	if (link->out.buffer) { free(link->out.buffer); }
+	if (link->in.buffer) { free(link->in.buffer); }
+
+	free(link);
+}
+
+
+// compress the payload of a frame that is about to be sent.  Returns the compressed length (and
+// 'out' points to it), or 0 if the frame should be sent as it is.
+int compress_frame(compress_t *link, const char *data, int length, const char **out)
+{
+	long long start;
+	int result;
+	int size;
+
+	assert(link);
+	assert(out);
+	assert(length >= 0);
+
+	if (length < COMPRESS_MIN_SIZE) {
+		return(0);
+	}
+
+	if (link->bypass > 0) {
+		link->bypass --;
+		link->bypassed ++;
+		return(0);
+	}
+
+	assert(data);
+
+	start = usec_now();
+
+	buffer_fit(&link->out.buffer, &link->out.max, deflateBound(&link->deflate, length) + 16);
+
+	link->deflate.next_in = (Bytef *) data;
+	link->deflate.avail_in = length;
+	link->deflate.next_out = (Bytef *) link->out.buffer;
+	link->deflate.avail_out = link->out.max;
+	result = deflate(&link->deflate, Z_SYNC_FLUSH);
+	assert(result == Z_OK);
+	assert(link->deflate.avail_in == 0);
+	assert(link->deflate.avail_out > 0);
+	(void) result;
+
+	size = link->out.max - link->deflate.avail_out;
+	assert(size > 0);
+
+	link->deflate_usec += usec_now() - start;
+	link->raw_out += length;
+	link->sent += size;
+	link->frames ++;
+
+	// if the data isn't compressing, stop wasting time on it for a while.
+	if ((length - size) < (length / COMPRESS_POOR_RATIO)) {
+		link->poor ++;
+		if (link->poor >= COMPRESS_POOR_FRAMES) {
+			logger(LOG_DEBUG, "Link data is not compressing, bypassing the next %d frames.", COMPRESS_BYPASS_FRAMES);
+			link->bypass = COMPRESS_BYPASS_FRAMES;
+			link->poor = 0;
+		}
+	}
+	else {
+		link->poor = 0;
+	}
+
+	*out = link->out.buffer;
+	return(size);
+}
+
+
+// expand the payload of a frame that arrived with FRAME_COMPRESSED set.  Returns the expanded
+// length (and 'out' points to it), or -1 if it couldn't be expanded, in which case the stream is no
+// good and the connection needs to be closed.
+int compress_expand(compress_t *link, const char *data, int length, const char **out)
+{
+	long long start;
+	int result;
+	int size;
+
+	assert(link);
+	assert(out);
+
+	if (length <= 0) {
+		return(-1);
+	}
+	assert(data);
+
+	start = usec_now();
+
+	buffer_fit(&link->in.buffer, &link->in.max, length * 4);
+
+	link->inflate.next_in = (Bytef *) data;
+	link->inflate.avail_in = length;
+	size = 0;
+
+	for (;;) {
+		link->inflate.next_out = (Bytef *) link->in.buffer + size;
+		link->inflate.avail_out = link->in.max - size;
+		result = inflate(&link->inflate, Z_SYNC_FLUSH);
+		size = link->in.max - link->inflate.avail_out;
+
+		if (result != Z_OK && result != Z_BUF_ERROR) {
+			logger(LOG_ERROR, "Unable to expand compressed frame: %s", link->inflate.msg ? link->inflate.msg : "unknown");
+			return(-1);
+		}
+
+		// it is all there when the input is used up, and there was still room left for more output.
+		if (link->inflate.avail_in == 0 && link->inflate.avail_out > 0) {
+			break;
+		}
+
+		if (link->in.max >= COMPRESS_EXPAND_MAX) {
+			logger(LOG_ERROR, "Compressed frame expands to more than %d bytes.", COMPRESS_EXPAND_MAX);
+			return(-1);
+		}
+		buffer_fit(&link->in.buffer, &link->in.max, link->in.max * 2);
+	}
+
+	link->inflate_usec += usec_now() - start;
+	link->raw_in += size;
+	link->received += length;
+
+	*out = link->in.buffer;
+	return(size);
+}
+
+
+// the stats for the link, shown under the connection in the clients stats.
+void compress_dump(compress_t *link)
+{
+	assert(link);
+
+	stat_dumpstr("        Compression: Sent=%lld/%lld (%.1f%%), Received=%lld/%lld (%.1f%%), Frames=%lld, Bypassed=%lld, Deflate=%lldus, Inflate=%lldus",
+				 link->sent, link->raw_out,
+				 link->raw_out > 0 ? (100.0 * link->sent) / link->raw_out : 100.0,
+				 link->received, link->raw_in,
+				 link->raw_in > 0 ? (100.0 * link->received) / link->raw_in : 100.0,
+				 link->frames,
+				 link->bypassed,
+				 link->deflate_usec,
+				 link->inflate_usec
+				);
+}
@@ -0,0 +1,24 @@
+// compress.h
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+
+// the compression that two nodes can agree to use on a bulk connection (sent in COMMAND_SERVERHELLO).
+#define COMPRESS_NONE     0
+#define COMPRESS_DEFLATE  1
+
+
+typedef struct __compress_t compress_t;
+
+
+compress_t * compress_new(int method);
+void compress_free(compress_t *link);
+
+int compress_frame(compress_t *link, const char *data, int length, const char **out);
+int compress_expand(compress_t *link, const char *data, int length, const char **out);
+
+void compress_dump(compress_t *link);
+
+
+#endif
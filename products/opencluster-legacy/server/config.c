@@ -32,52 +32,55 @@ typedef struct {
 config_t * _current = NULL;
 
 
-// free the resources for the current config that is loaded.
-void config_free(void)
+// free the resources for a config.
+static void config_destroy(config_t *config)
 {
-	assert(_current);
-	if (_current->pairs) {
-		assert(_current->items >= 0);
+	assert(config);
+	if (config->pairs) {
+		assert(config->items >= 0);
 		
-		while(_current->items > 0) {
-			_current->items --;
-			assert(_current->pairs[_current->items].key);
-			free(_current->pairs[_current->items].key);
-			_current->pairs[_current->items].key = NULL;
+		while(config->items > 0) {
+			config->items --;
+			assert(config->pairs[config->items].key);
+			free(config->pairs[config->items].key);
+			config->pairs[config->items].key = NULL;
 			
-			assert(_current->pairs[_current->items].value);
-			free(_current->pairs[_current->items].value);
-			_current->pairs[_current->items].value = NULL;
+			assert(config->pairs[config->items].value);
+			free(config->pairs[config->items].value);
+			config->pairs[config->items].value = NULL;
 		}
 		
-		free(_current->pairs);
+		free(config->pairs);
 	}
 	
-	if (_current->path) { free(_current->path); }
+	if (config->path) { free(config->path); }
 	
-	free(_current);
+	free(config);
+}
+
+
+// free the resources for the current config that is loaded.
+void config_free(void)
+{
+	assert(_current);
+	config_destroy(_current);
 	_current = NULL;
 }
 
 
-// load a config file into an array.   Return 0 on success.
-int config_load(const char *path)
+// parse a config file into a new config.  Returns NULL if the file could not be read.
+static config_t * config_parse(const char *path)
 {
 	assert(path);
 	int result = 0;
 	
-	// if there is a config already loaded, we need to free it.
-	if (_current) {
-		config_free();
-		assert(_current == NULL);
-	}
-	
-	_current = calloc(1, sizeof(config_t));
-	assert(_current->items == 0);
-	assert(_current->pairs == NULL);
+	config_t *config = calloc(1, sizeof(config_t));
+	assert(config);
+	assert(config->items == 0);
+	assert(config->pairs == NULL);
 	
 	// store the path to the config, so that we can know which one it is if we switch configs.
-	_current->path = strdup(path);
+	config->path = strdup(path);
 	
 	// open the file
 	int fd = open(path, 0);
@@ -155,14 +158,14 @@ int config_load(const char *path)
 								
 								// trim leading and trailing spaces from keys and values.
 // 								printf("%s='%s'\n", line, value);
-								assert(_current);
-								assert(_current->items >= 0);
-								_current->pairs = realloc(_current->pairs, sizeof(config_pair_t) * (_current->items+1));
-								assert(_current->pairs);
+								assert(config);
+								assert(config->items >= 0);
+								config->pairs = realloc(config->pairs, sizeof(config_pair_t) * (config->items+1));
+								assert(config->pairs);
 								
-								_current->pairs[_current->items].key = strdup(line);
-								_current->pairs[_current->items].value = strdup(value);
-								_current->items++;
+								config->pairs[config->items].key = strdup(line);
+								config->pairs[config->items].value = strdup(value);
+								config->items++;
 							}
 						}
 					}
@@ -173,12 +176,61 @@ int config_load(const char *path)
 			free(buffer);
 			buffer =  NULL;
 		}
+		else {
+			result = -1;
+		}
 		
 		// close the file
 		close(fd);
 		fd = -1;
 	}	
 	
+	if (result != 0) {
+		config_destroy(config);
+		config = NULL;
+	}
+	
+	return(config);
+}
+
+
+// load a config file into an array.   Return 0 on success.  The file is parsed completely before 
+// it replaces the config that is already loaded, so if it fails, the existing config remains.
+int config_load(const char *path)
+{
+	assert(path);
+	
+	config_t *config = config_parse(path);
+	if (config == NULL) {
+		return(-1);
+	}
+	
+	// if there is a config already loaded, we need to free it.
+	if (_current) {
+		config_free();
+		assert(_current == NULL);
+	}
+	
+	_current = config;
+	return(0);
+}
+
+
+
+// re-load the config file that is currently loaded, so that changes can be picked up while running.  
+// Return 0 on success.
+int config_reload(void)
+{
+	assert(_current);
+	assert(_current->path);
+	
+	// config_load will free the current config (including the path) if the new one loads, so we 
+	// need our own copy.
+	char *path = strdup(_current->path);
+	assert(path);
+	int result = config_load(path);
+	free(path);
+	
 	return(result);
 }
 
@@ -12,6 +12,7 @@
 
 // load the configfile
 int config_load(const char *path);
+int config_reload(void);
 
 const char * config_get(const char *key);
 int config_get_bool(const char *key);
@@ -21,15 +21,112 @@
 // client protocol header size in bytes.
 #define HEADER_SIZE 12
 
+// the largest message payload that will be accepted.  A header that says the payload is larger than 
+// this is treated as a broken connection, and it is closed.
+#define FRAME_MAX_LENGTH (256*1024*1024)
+
 #define STARTING_MASK  0x0F
 
 
 #define CLIENT_TIMEOUT_LIMIT 6
 
+// the default number of bulk (SYNC data) connections that will be opened to each node, in addition 
+// to the control connection.  Can be overridden with 'node-bulk-channels' in the config.  The 
+// maximum is the most we will ever agree to, regardless of what the other node asks for.
+#define NODE_BULK_CHANNELS 1
+#define NODE_BULK_CHANNELS_MAX 8
+
+// bulk connections can be compressed ('node-compression' in the config).  Frames smaller than
+// COMPRESS_MIN_SIZE are sent as they are.  If COMPRESS_POOR_FRAMES frames in a row shrink by less than
+// 1/COMPRESS_POOR_RATIO of their size, the data isn't worth compressing, so the next
+// COMPRESS_BYPASS_FRAMES frames are sent as they are, before trying again.  A compressed frame will
+// never expand to more than COMPRESS_EXPAND_MAX bytes.
+#define COMPRESS_LEVEL 1
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESS_POOR_RATIO 8
+#define COMPRESS_POOR_FRAMES 8
+#define COMPRESS_BYPASS_FRAMES 256
+#define COMPRESS_EXPAND_MAX (256*1024*1024)
+
+// string values can be kept compressed in memory ('value-compression' in the config is the size of
+// the smallest value that is compressed).  A value is only kept compressed if it shrinks by at least
+// 1/VALUE_COMPRESS_RATIO of its size.
+#define VALUE_COMPRESS_LEVEL 6
+#define VALUE_COMPRESS_RATIO 8
+
 // number of items to send to another node during sync or migrate.
 #define TRANSIT_MIN 0
 #define TRANSIT_MAX 1
 
+// default maximum number of buckets that can be migrating (in or out) at the same time.  Only one 
+// bucket will be migrating to or from any particular node at a time, so this is really the number 
+// of node links that can be busy with migrations.  Can be overridden with 'migrate-max' in the config.
+#define DEFAULT_TRANSFER_MAX 4
+
+// event priorities.  Events that are not given a priority will get the one in the middle 
+// (PRIORITY_LEVELS/2), which is where all the client processing is done.  Migration work is done at 
+// the background priority, so that it only runs when there is nothing else to do.
+#define PRIORITY_LEVELS 3
+#define PRIORITY_BACKGROUND 2
+
+// the throttle refills its tokens this many times a second.  It will never reduce the migration 
+// rate below the minimum (in bytes per second), otherwise a migration may never finish.
+#define THROTTLE_TICKS 10
+#define THROTTLE_MIN_RATE (64*1024)
+
+// hot-key tracking.  One in every HOTKEY_SAMPLE_RATE GETs is counted in a count-min sketch 
+// (HOTKEY_SKETCH_DEPTH rows of HOTKEY_SKETCH_WIDTH counters), and the HOTKEY_TOP keys with the 
+// highest counts are kept.  Keys that are hotter than the threshold ('hotkey-threshold' in the config, 
+// in samples per interval) get read-only copies sent to up to HOTKEY_REPLICAS other nodes, and each 
+// node will hold up to HOTKEY_REPLICA_MAX of those copies from other nodes.
+#define HOTKEY_SAMPLE_RATE 16
+#define HOTKEY_SKETCH_DEPTH 4
+#define HOTKEY_SKETCH_WIDTH 1024
+#define HOTKEY_TOP 16
+#define HOTKEY_THRESHOLD 1000
+#define HOTKEY_REPLICAS 2
+#define HOTKEY_REPLICA_MAX 64
+
+// transaction log (for logger nodes).  The log is written in segment files of TRANSLOG_SEGMENT_SIZE 
+// bytes, which are pre-allocated when they are created.  Updates are buffered and written (and 
+// synced to disk) together, either when there is TRANSLOG_BATCH bytes waiting, or every 
+// TRANSLOG_INTERVAL milliseconds ('logger-interval' in the config).
+#define TRANSLOG_SEGMENT_SIZE (64*1024*1024)
+#define TRANSLOG_BATCH (256*1024)
+#define TRANSLOG_INTERVAL 10
+
+// the save file is written through a buffer of this size, and loaded by this many threads.
+#define SAVEFILE_BUFFER (4*1024*1024)
+#define SAVEFILE_THREADS 4
+
+// when upgrading, the running node waits for all outstanding requests to finish before handing over 
+// to the new process.  It checks every _timeout_upgrade, and gives up after this many checks.  The 
+// bucket data is sent to the new process in chunks of UPGRADE_CHUNK bytes, and the old process 
+// waits up to UPGRADE_ACK_WAIT milliseconds for the new one to confirm it has taken over.
+#define UPGRADE_QUIESCE_LIMIT 100
+#define UPGRADE_CHUNK (1024*1024)
+#define UPGRADE_ACK_WAIT 30000
+
+// a snapshot child reports how far it has got (and how much memory has been copied because of
+// writes in the parent) at most every SNAPSHOT_REPORT milliseconds.
+#define SNAPSHOT_REPORT 250
+
+// when a whole map is dropped, the keys that were removed are sent to the backup nodes in batches of 
+// up to this many.  A scan will return no more than SCAN_LIMIT_MAX items at a time.
+#define DROP_BATCH 256
+#define SCAN_LIMIT_MAX 1024
+
+// large values can be sent in chunks (COMMAND_SET_STREAM/SET_CHUNK and GET_CHUNK), so that neither 
+// side needs to buffer the whole value in a single frame, and other requests on the connection can 
+// be processed between the chunks.  CHUNK_SIZE is the size the client library uses, and the server 
+// will not accept (or send) a chunk larger than CHUNK_SIZE_MAX.
+#define CHUNK_SIZE (64*1024)
+#define CHUNK_SIZE_MAX (1024*1024)
+
+// the largest value that can be streamed in with SET_STREAM, unless 'value-max' is set in the config.  
+// The whole value is allocated when the stream starts.
+#define VALUE_MAX_SIZE (64*1024*1024)
+
 
 // When data is received on a socket, and processed, the offset is where processed items are still 
 // in the incoming buffer.  This occurs if data arrives fragmented.  If the server receives a lot 
@@ -39,6 +136,11 @@
 // to be moving data in memory like that.
 #define MAX_INCOMING_OFFSET  65536
 
+// the incoming buffer grows to fit the largest frame that has been received.  When the buffer is 
+// empty again, and it has grown larger than this, it is shrunk back to DEFAULT_BUFSIZE so that a 
+// connection that sent one large value doesnt hold on to that memory for the rest of its life.
+#define MAX_IDLE_BUFFER  (256*1024)
+
 // minimum number of buckets that a node should have before it splits the buckets.  This means that 
 // if some action causes the server to get less than this many buckets (but not if the server never 
 // had this many to begin with), then the buckets need to be split.  This would only occur if a 
@@ -5,6 +5,8 @@
 #include <assert.h>
 #include <ctype.h>
 #include <endian.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 // This function will return a pointer to the internal data.  It will also 
@@ -27,13 +29,13 @@ char * data_string(char **data, int *length, int *avail)
 		int *ptr = (void*) *data;
 		length[0] = be32toh(ptr[0]);
 		*data += (sizeof(int));
-		avail[0] += sizeof(int);
+		avail[0] -= sizeof(int);
 		if (length[0] > 0) {
 			assert(avail[0] >= length[0]);
 			if (avail[0] >= length[0]) {
 				str = *data;
 				*data += length[0];
-				avail[0] += length[0];
+				avail[0] -= length[0];
 			}
 		}
 	}
@@ -96,7 +98,7 @@ int data_int(char **data, int *avail)
 		value = be32toh(ptr[0]);
 
 		*data += sizeof(int);
-		avail[0] += sizeof(int);
+		avail[0] -= sizeof(int);
 	}
 	
 	assert(avail[0] >= 0);
@@ -128,7 +130,7 @@ long long data_long(char **data, int *avail)
 		value = be64toh(ptr[0]);
 
 		*data += sizeof(long long);
-		avail[0] += sizeof(long long);
+		avail[0] -= sizeof(long long);
 	}
 	
 	assert(avail[0] >= 0);
@@ -197,15 +197,8 @@ struct evconnlistener * evconnlistener_new_bind(struct event_base *evbase, void
 		}
 		else {
 			// we've got a listener.
-			
-			listener = calloc(1, sizeof(*listener));
+			listener = evconnlistener_new(evbase, fn, arg, flags, queues, sfd);
 			assert(listener);
-			
-			listener->handle = sfd;
-			listener->listen_event = event_new(evbase, sfd, EV_READ | EV_PERSIST, evconn_cb, (void *)listener);
-			event_add(listener->listen_event, NULL);
-			listener->fn = fn;
-			listener->arg = arg;
 		}
 	}
 	
@@ -213,6 +206,50 @@ struct evconnlistener * evconnlistener_new_bind(struct event_base *evbase, void
 }
 
 
+// wrap a socket that is already listening.
+struct evconnlistener * evconnlistener_new(struct event_base *evbase, void (*fn)(struct evconnlistener *, int, struct sockaddr *, int, void *), void *arg, int flags, int queues, evutil_socket_t sfd)
+{
+	struct evconnlistener *listener;
+	
+	assert(evbase && fn);
+	assert(sfd >= 0);
+	
+	listener = calloc(1, sizeof(*listener));
+	assert(listener);
+	
+	listener->handle = sfd;
+	listener->listen_event = event_new(evbase, sfd, EV_READ | EV_PERSIST, evconn_cb, (void *)listener);
+	event_add(listener->listen_event, NULL);
+	listener->fn = fn;
+	listener->arg = arg;
+	
+	return(listener);
+}
+
+
+evutil_socket_t evconnlistener_get_fd(struct evconnlistener *listener)
+{
+	assert(listener);
+	return(listener->handle);
+}
+
+
+int evconnlistener_disable(struct evconnlistener *listener)
+{
+	assert(listener);
+	assert(listener->listen_event);
+	return(event_del(listener->listen_event));
+}
+
+
+int evconnlistener_enable(struct evconnlistener *listener)
+{
+	assert(listener);
+	assert(listener->listen_event);
+	return(event_add(listener->listen_event, NULL));
+}
+
+
 void evconnlistener_free(struct evconnlistener * listener)
 {
 	assert(listener);
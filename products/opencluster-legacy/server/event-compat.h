@@ -51,7 +51,11 @@ struct evconnlistener {
 };
 
 struct evconnlistener * evconnlistener_new_bind(struct event_base *evbase, void (*fn)(struct evconnlistener *, int, struct sockaddr *, int, void *), void *arg, int flags, int queues, struct sockaddr *sin, int slen );
+struct evconnlistener * evconnlistener_new(struct event_base *evbase, void (*fn)(struct evconnlistener *, int, struct sockaddr *, int, void *), void *arg, int flags, int queues, evutil_socket_t sfd);
 void evconnlistener_free(struct evconnlistener * listener);
+evutil_socket_t evconnlistener_get_fd(struct evconnlistener *listener);
+int evconnlistener_disable(struct evconnlistener *listener);
+int evconnlistener_enable(struct evconnlistener *listener);
 
 
 #else
@@ -0,0 +1,224 @@
+# gencodec.awk
+#
+# Generates codec.h from messages.def (see that file for the format).
+#
+#   awk -f gencodec.awk messages.def > codec.h
+#
+# For each message it writes a struct, and _size(), _encode() and _decode() functions.  They are
+# all static inline, so each one compiles down to the loads and stores for that layout, with the
+# bounds checks done once for each run of fixed-size fields rather than for every field.
+
+
+function fail(msg) {
+	printf("messages.def:%d: %s\n", NR, msg) > "/dev/stderr";
+	failed = 1;
+	exit 1;
+}
+
+function width(type) {
+	if (type == "hash" || type == "long") { return 8; }
+	return 4;
+}
+
+function ctype(type) {
+	if (type == "hash") { return "uint64_t"; }
+	if (type == "long") { return "int64_t"; }
+	return "int32_t";
+}
+
+function bits(type) {
+	return (width(type) == 8) ? "64" : "32";
+}
+
+# the number of fixed bytes from field 'i' up to (and including) the length of the next data field,
+# or the end of the required fields.
+function fixed_run(i,    n) {
+	n = 0;
+	for (; i <= count && !opt[i]; i++) {
+		n += width(type[i]);
+		if (type[i] == "data") { break; }
+	}
+	return n;
+}
+
+# the condition for writing optional field 'i'.  The decoder can only tell which optional fields were
+# sent by how many there are, so a field is also written when any of the ones after it are.
+function opt_sent(i,    j, cond) {
+	cond = "";
+	for (j = i; j <= count; j++) {
+		if (cond != "") { cond = cond " || "; }
+		cond = cond sprintf("msg->%s != %s", field[j], dflt[j]);
+	}
+	return cond;
+}
+
+function emit(    i, fixed, name, upper, variable, after) {
+	name = "msg_" message;
+	upper = toupper(name);
+
+	fixed = 0;
+	variable = 0;
+	for (i = 1; i <= count; i++) {
+		if (!opt[i]) { fixed += width(type[i]); }
+		if (opt[i] || type[i] == "data") { variable = 1; }
+	}
+
+	print "";
+	print "";
+	if (comment != "") { printf("%s", comment); }
+	print "typedef struct {";
+	for (i = 1; i <= count; i++) {
+		if (type[i] == "data") {
+			printf("\tconst char *%s;\n", field[i]);
+			printf("\tint32_t %s_len;\n", field[i]);
+		}
+		else {
+			printf("\t%s %s;\n", ctype(type[i]), field[i]);
+		}
+	}
+	printf("} %s_t;\n\n", name);
+
+	printf("#define %s_MIN %d\n\n", upper, fixed);
+
+	# size
+	printf("static inline int %s_size(const %s_t *msg)\n{\n", name, name);
+	printf("\tassert(msg);\n");
+	printf("\tint size = %s_MIN;\n", upper);
+	for (i = 1; i <= count; i++) {
+		if (type[i] == "data") {
+			printf("\tsize += msg->%s_len;\n", field[i]);
+		}
+		else if (opt[i]) {
+			printf("\tif (%s) { size += %d; }\n", opt_sent(i), width(type[i]));
+		}
+	}
+	printf("\treturn(size);\n}\n\n");
+
+	# encode
+	printf("// returns the number of bytes written, or -1 if the buffer is too small.\n");
+	printf("static inline int %s_encode(char *buffer, int max, const %s_t *msg)\n{\n", name, name);
+	printf("\tchar *p = buffer;\n");
+	printf("\tassert(buffer && msg);\n");
+	printf("\tif (max < %s_size(msg)) { return(-1); }\n", name);
+	for (i = 1; i <= count; i++) {
+		if (type[i] == "data") {
+			printf("\tassert(msg->%s_len >= 0);\n", field[i]);
+			printf("\tcodec_put32(p, msg->%s_len); p += 4;\n", field[i]);
+			printf("\tif (msg->%s_len > 0) { memcpy(p, msg->%s, msg->%s_len); p += msg->%s_len; }\n", field[i], field[i], field[i], field[i]);
+		}
+		else if (opt[i]) {
+			printf("\tif (%s) { codec_put%s(p, msg->%s); p += %d; }\n", opt_sent(i), bits(type[i]), field[i], width(type[i]));
+		}
+		else {
+			printf("\tcodec_put%s(p, msg->%s); p += %d;\n", bits(type[i]), field[i], width(type[i]));
+		}
+	}
+	printf("\treturn(p - buffer);\n}\n\n");
+
+	# decode
+	printf("// returns the number of bytes used, or -1 if the data does not match the layout.\n");
+	printf("static inline int %s_decode(const char *buffer, int length, %s_t *msg)\n{\n", name, name);
+	printf("\tconst char *p = buffer;\n");
+	if (variable) { printf("\tconst char *end = buffer + length;\n"); }
+	printf("\tassert(buffer && msg);\n");
+	printf("\tif (length < %d) { return(-1); }\n", fixed_run(1));
+	for (i = 1; i <= count; i++) {
+		if (type[i] == "data") {
+			printf("\tmsg->%s_len = codec_get32(p); p += 4;\n", field[i]);
+			after = fixed_run(i+1);
+			if (after > 0) {
+				printf("\tif (msg->%s_len < 0 || msg->%s_len > (end - p) - %d) { return(-1); }\n", field[i], field[i], after);
+			}
+			else {
+				printf("\tif (msg->%s_len < 0 || msg->%s_len > end - p) { return(-1); }\n", field[i], field[i]);
+			}
+			printf("\tmsg->%s = p; p += msg->%s_len;\n", field[i], field[i]);
+		}
+		else if (opt[i]) {
+			printf("\tif (end - p >= %d) { msg->%s = codec_get%s(p); p += %d; }\n", width(type[i]), field[i], bits(type[i]), width(type[i]));
+			printf("\telse { msg->%s = %s; }\n", field[i], dflt[i]);
+		}
+		else {
+			printf("\tmsg->%s = codec_get%s(p); p += %d;\n", field[i], bits(type[i]), width(type[i]));
+		}
+	}
+	printf("\treturn(p - buffer);\n}\n");
+}
+
+
+BEGIN {
+	message = "";
+	comment = "";
+	print "// codec.h";
+	print "//";
+	print "// Generated by gencodec.awk from messages.def.  Do not edit, change messages.def instead.";
+	print "";
+	print "#ifndef __CODEC_H";
+	print "#define __CODEC_H";
+	print "";
+	print "#include <assert.h>";
+	print "#include <endian.h>";
+	print "#include <stdint.h>";
+	print "#include <string.h>";
+	print "";
+	print "";
+	print "// the payloads have no alignment, so the values are copied in and out (which the compiler turns";
+	print "// into a single load or store).";
+	print "static inline void codec_put32(char *p, int32_t value) { uint32_t v = htobe32((uint32_t) value); memcpy(p, &v, 4); }";
+	print "static inline void codec_put64(char *p, uint64_t value) { uint64_t v = htobe64(value); memcpy(p, &v, 8); }";
+	print "static inline int32_t codec_get32(const char *p) { uint32_t v; memcpy(&v, p, 4); return((int32_t) be32toh(v)); }";
+	print "static inline uint64_t codec_get64(const char *p) { uint64_t v; memcpy(&v, p, 8); return(be64toh(v)); }";
+}
+
+/^##/ {
+	line = $0;
+	sub(/^## ?/, "", line);
+	comment = comment "// " line "\n";
+	next;
+}
+
+/^#/ || /^[ \t]*$/ { next; }
+
+$1 == "message" {
+	if (message != "") { fail("'message' inside '" message "'"); }
+	if (NF != 2) { fail("expected 'message <name>'"); }
+	message = $2;
+	count = 0;
+	seen_opt = 0;
+	next;
+}
+
+$1 == "end" {
+	if (message == "") { fail("'end' without 'message'"); }
+	emit();
+	message = "";
+	comment = "";
+	next;
+}
+
+{
+	if (message == "") { fail("field outside of a message"); }
+
+	o = 0;
+	if ($1 == "opt") { o = 1; $0 = substr($0, index($0, "opt") + 3); }
+	if ($1 != "hash" && $1 != "long" && $1 != "int" && $1 != "data") { fail("unknown type '" $1 "'"); }
+	if (o && $1 == "data") { fail("data fields can not be optional"); }
+	if (!o && seen_opt) { fail("required field '" $2 "' after an optional one"); }
+	if (o && ($3 != "=" || NF != 4)) { fail("optional fields need a default"); }
+	if (!o && NF != 2) { fail("unexpected text after '" $2 "'"); }
+
+	count ++;
+	type[count] = $1;
+	field[count] = $2;
+	opt[count] = o;
+	dflt[count] = o ? $4 : "";
+	if (o) { seen_opt = 1; }
+}
+
+END {
+	if (failed) { exit 1; }
+	if (message != "") { fail("message '" message "' has no 'end'"); }
+	print "";
+	print "";
+	print "#endif";
+}
@@ -25,5 +25,25 @@ typedef struct {
 #pragma pack(pop)
 
 
+// v2 framing (agreed on with COMMAND_HELLO, see PROTOCOL_V2).  Instead of the fixed 12 byte header, 
+// each message starts with:
+//     flags           1 byte
+//     command         2 bytes
+//     response_code   2 bytes (only if FRAME_REPLY is set)
+//     userid          2 bytes (4 if FRAME_LONGID is set)
+//     length          varint (7 bits per byte, lowest first, top bit set if more bytes follow)
+// The payload that follows is the same as for v1.  FRAME_BATCH means that more requests follow that 
+// were sent together, so the replies can be held until the end of the batch.  Messages that use 
+// options that aren't supported (compression, durability) get RESPONSE_UNKNOWN.
+#define FRAME_REPLY       0x01
+#define FRAME_BATCH       0x02
+#define FRAME_COMPRESSED  0x04
+#define FRAME_DURABLE     0x08
+#define FRAME_LONGID      0x10
+
+#define FRAME_HEADER_MIN  6
+#define FRAME_HEADER_MAX  14
+
+
 
 #endif
@@ -0,0 +1,475 @@
+// hotkeys.c
+
+// A single very popular key can keep one node busy while the rest of the cluster sits idle, because
+// every request for it goes to the same primary bucket.
+//
+// To find these keys, a sample of the GET requests are counted in a count-min sketch, which gives a
+// good estimate of how often a key is being requested without having to keep a counter for every
+// key.  The keys with the highest estimates are kept in a small top-K list.  Every interval, the
+// counts are halved, so that keys that are no longer popular drop out of the list.
+//
+// Any key in the list that is above the threshold (and that this node is primary for) has a
+// read-only copy of its value sent to some of the other nodes.  Those nodes can then answer GETs for
+// the key from clients that have indicated they will accept slightly stale data.  The copies are
+// only kept for a couple of intervals, so if the key stops being hot (or the node stops refreshing
+// them), they will go away by themselves.  The clients that asked for it (FEATURE_HOTKEYS) are also
+// told which nodes have the copies, so that they can spread the reads for that key.
+//
+// There is one sketch for the whole node rather than one per bucket.  A node only counts the GETs it
+// answers, and what matters is which keys are the busiest on this node, so the top-K list has to
+// compare keys from all the buckets anyway.  One sketch per bucket would also multiply the memory
+// (and the decay work) by the number of buckets.  When a bucket moves away, its keys stop being
+// counted here and decay out of the list in a few intervals.
+
+#include "hotkeys.h"
+
+#include "bucket.h"
+#include "client.h"
+#include "constants.h"
+#include "logging.h"
+#include "push.h"
+#include "seconds.h"
+#include "stats.h"
+#include "timeout.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+
+typedef struct {
+	hash_t map_hash;
+	hash_t key_hash;
+	int count;
+
+	// the nodes that we have sent copies of this key to.  Only used if we are the primary.  Nodes are 
+	// removed from here when they are freed (see hotkeys_node_gone()).
+	node_t *replicas[HOTKEY_REPLICAS];
+	int replica_count;
+} hotkey_t;
+
+
+typedef struct {
+	hash_t map_hash;
+	hash_t key_hash;
+	value_t *value;
+	int received;
+	int expires;
+} replica_t;
+
+
+static struct event_base *_evbase = NULL;
+static struct event *_interval_event = NULL;
+
+// the count-min sketch.
+static int _sketch[HOTKEY_SKETCH_DEPTH][HOTKEY_SKETCH_WIDTH];
+
+// odd multipliers used to get a different index for each row of the sketch.
+static const hash_t _seeds[HOTKEY_SKETCH_DEPTH] = {
+	0x9E3779B97F4A7C15ULL,
+	0xC2B2AE3D27D4EB4FULL,
+	0x165667B19E3779F9ULL,
+	0xD6E8FEB86659FD93ULL
+};
+
+// the hottest keys that we have seen.
+static hotkey_t _top[HOTKEY_TOP];
+static int _top_count = 0;
+
+// only one in every HOTKEY_SAMPLE_RATE requests is counted.
+static int _sample_tick = 0;
+static long long _samples = 0;
+
+// number of samples (per interval) a key needs before it is replicated.  0 disables replication.
+static int _threshold = HOTKEY_THRESHOLD;
+
+// copies of hot keys that other nodes have sent to us.
+static replica_t _replicas[HOTKEY_REPLICA_MAX];
+static int _replica_hits = 0;
+
+
+
+static int sketch_index(int row, hash_t map_hash, hash_t key_hash)
+{
+	assert(row >= 0 && row < HOTKEY_SKETCH_DEPTH);
+	hash_t h = (key_hash ^ (map_hash * _seeds[0])) * _seeds[row];
+	return((int) ((h >> 32) % HOTKEY_SKETCH_WIDTH));
+}
+
+
+// increment the counters for this key in the sketch, and return the new estimate (which is the
+// lowest of the counters, since the others will have been bumped by other keys as well).
+static int sketch_add(hash_t map_hash, hash_t key_hash)
+{
+	int row;
+	int index;
+	int estimate = -1;
+
+	for (row=0; row<HOTKEY_SKETCH_DEPTH; row++) {
+		index = sketch_index(row, map_hash, key_hash);
+		_sketch[row][index] ++;
+		if (estimate < 0 || _sketch[row][index] < estimate) {
+			estimate = _sketch[row][index];
+		}
+	}
+
+	assert(estimate > 0);
+	return(estimate);
+}
+
+
+static void hotkey_drop(hotkey_t *hotkey);
+
+
+// update the top-K list with the new estimate for the key.  If the key is not in the list, it will
+// replace the coldest entry if it is hotter than it.
+static void top_update(hash_t map_hash, hash_t key_hash, int estimate)
+{
+	int i;
+	int coldest = -1;
+
+	for (i=0; i<_top_count; i++) {
+		if (_top[i].map_hash == map_hash && _top[i].key_hash == key_hash) {
+			_top[i].count = estimate;
+			return;
+		}
+		if (coldest < 0 || _top[i].count < _top[coldest].count) {
+			coldest = i;
+		}
+	}
+
+	if (_top_count < HOTKEY_TOP) {
+		i = _top_count;
+		_top_count ++;
+	}
+	else if (estimate > _top[coldest].count) {
+		i = coldest;
+		hotkey_drop(&_top[i]);
+	}
+	else {
+		return;
+	}
+
+	_top[i].map_hash = map_hash;
+	_top[i].key_hash = key_hash;
+	_top[i].count = estimate;
+	_top[i].replica_count = 0;
+}
+
+
+// a GET was made for this key.
+void hotkeys_sample(hash_t map_hash, hash_t key_hash)
+{
+	_sample_tick ++;
+	if (_sample_tick >= HOTKEY_SAMPLE_RATE) {
+		_sample_tick = 0;
+		_samples ++;
+
+		top_update(map_hash, key_hash, sketch_add(map_hash, key_hash));
+	}
+}
+
+
+// let the clients know where the copies of the hot key are.
+static void hotkey_announce(hotkey_t *hotkey)
+{
+	const char *conninfos[HOTKEY_REPLICAS];
+	int i;
+	
+	assert(hotkey);
+	
+	for (i=0; i<hotkey->replica_count; i++) {
+		assert(hotkey->replicas[i]->conninfo);
+		conninfos[i] = conninfo_str(hotkey->replicas[i]->conninfo);
+	}
+	
+	logger(LOG_INFO, "Hot key [%#llx/%#llx] is replicated to %d nodes.", hotkey->map_hash, hotkey->key_hash, hotkey->replica_count);
+	client_update_hotkey(hotkey->map_hash, hotkey->key_hash, hotkey->replica_count, conninfos);
+}
+
+
+// the key is no longer in the list, so the clients should stop sending reads for it to the copies.  
+// The copies themselves expire on their own.
+static void hotkey_drop(hotkey_t *hotkey)
+{
+	assert(hotkey);
+	
+	if (hotkey->replica_count > 0) {
+		hotkey->replica_count = 0;
+		hotkey_announce(hotkey);
+	}
+}
+
+
+// send a copy of the hot key to some of the other nodes.  The backup node for the bucket is skipped,
+// because it can already answer stale reads for it.
+static void hotkey_replicate(hotkey_t *hotkey, value_t *value)
+{
+	int i, j;
+	node_t *node;
+	node_t *backup;
+	int ttl;
+	int changed = 0;
+
+	assert(hotkey);
+	assert(value);
+
+	// the copies need to last until the next interval has had a chance to refresh them.
+	ttl = _timeout_hotkeys.tv_sec * 2;
+	assert(ttl > 0);
+
+	// refresh the copies we have already sent.  If the node has gone, then it is dropped from the list.
+	for (i=0; i<hotkey->replica_count; ) {
+		node = hotkey->replicas[i];
+		if (node->state == READY && node->client) {
+			push_sync_replica(node->client, hotkey->map_hash, hotkey->key_hash, ttl, value);
+			i++;
+		}
+		else {
+			hotkey->replica_count --;
+			hotkey->replicas[i] = hotkey->replicas[hotkey->replica_count];
+			changed ++;
+		}
+	}
+
+	// if we dont have enough copies out there, find some more nodes.
+	backup = buckets_get_backup_node(hotkey->key_hash);
+	for (i=0; i<node_count() && hotkey->replica_count < HOTKEY_REPLICAS; i++) {
+		node = node_get(i);
+		if (node && node != backup && node->state == READY && node->client && node->logger == 0) {
+			for (j=0; j<hotkey->replica_count && hotkey->replicas[j] != node; j++) { }
+			if (j == hotkey->replica_count) {
+				push_sync_replica(node->client, hotkey->map_hash, hotkey->key_hash, ttl, value);
+				hotkey->replicas[hotkey->replica_count] = node;
+				hotkey->replica_count ++;
+				changed ++;
+			}
+		}
+	}
+
+	if (changed > 0) {
+		hotkey_announce(hotkey);
+	}
+}
+
+
+static void replica_clear(replica_t *replica)
+{
+	assert(replica);
+	assert(replica->value);
+	value_free(replica->value);
+	replica->value = NULL;
+}
+
+
+static void interval_handler(evutil_socket_t fd, short what, void *arg)
+{
+	int i, row, col;
+	int now;
+	value_t *value;
+
+	assert(fd == -1);
+	assert(arg == NULL);
+	assert(_interval_event);
+
+	// replicate the keys that are hot enough.
+	if (_threshold > 0) {
+		for (i=0; i<_top_count; i++) {
+			if (_top[i].count >= _threshold) {
+				// we only replicate the keys that we are primary for.
+				value = buckets_get_value(_top[i].map_hash, _top[i].key_hash, -1);
+				if (value) {
+					hotkey_replicate(&_top[i], value);
+				}
+			}
+		}
+	}
+
+	// decay the counts, so that keys that are not being requested anymore will cool down.
+	for (row=0; row<HOTKEY_SKETCH_DEPTH; row++) {
+		for (col=0; col<HOTKEY_SKETCH_WIDTH; col++) {
+			_sketch[row][col] /= 2;
+		}
+	}
+	for (i=0; i<_top_count; ) {
+		_top[i].count /= 2;
+		if (_top[i].count == 0) {
+			hotkey_drop(&_top[i]);
+			_top_count --;
+			_top[i] = _top[_top_count];
+		}
+		else {
+			i++;
+		}
+	}
+
+	// remove the copies we have been given that have not been refreshed.
+	now = seconds_get();
+	for (i=0; i<HOTKEY_REPLICA_MAX; i++) {
+		if (_replicas[i].value && _replicas[i].expires <= now) {
+			replica_clear(&_replicas[i]);
+		}
+	}
+
+	evtimer_add(_interval_event, &_timeout_hotkeys);
+}
+
+
+void hotkeys_init(struct event_base *evbase)
+{
+	assert(_evbase == NULL);
+	assert(evbase);
+	_evbase = evbase;
+
+	assert(_interval_event == NULL);
+	_interval_event = evtimer_new(_evbase, interval_handler, NULL);
+	assert(_interval_event);
+	evtimer_add(_interval_event, &_timeout_hotkeys);
+}
+
+
+void hotkeys_shutdown(void)
+{
+	int i;
+
+	if (_interval_event) {
+		event_free(_interval_event);
+		_interval_event = NULL;
+	}
+
+	for (i=0; i<HOTKEY_REPLICA_MAX; i++) {
+		if (_replicas[i].value) {
+			replica_clear(&_replicas[i]);
+		}
+	}
+
+	_top_count = 0;
+}
+
+
+// the node is being freed, so it can't be in any of the replica lists anymore.
+void hotkeys_node_gone(node_t *node)
+{
+	int i, j;
+	
+	assert(node);
+	
+	for (i=0; i<_top_count; i++) {
+		for (j=0; j<_top[i].replica_count; j++) {
+			if (_top[i].replicas[j] == node) {
+				_top[i].replica_count --;
+				_top[i].replicas[j] = _top[i].replicas[_top[i].replica_count];
+				hotkey_announce(&_top[i]);
+				break;
+			}
+		}
+	}
+}
+
+
+// a client that asked for FEATURE_HOTKEYS has connected, so tell it about the keys that already have 
+// copies.  Like the hashmasks, these are sent before the HELLO reply.
+void hotkeys_push(client_t *client)
+{
+	const char *conninfos[HOTKEY_REPLICAS];
+	int i, j;
+	
+	assert(client);
+	
+	for (i=0; i<_top_count; i++) {
+		if (_top[i].replica_count > 0) {
+			for (j=0; j<_top[i].replica_count; j++) {
+				assert(_top[i].replicas[j]->conninfo);
+				conninfos[j] = conninfo_str(_top[i].replicas[j]->conninfo);
+			}
+			push_hotkey(client, _top[i].map_hash, _top[i].key_hash, _top[i].replica_count, conninfos);
+		}
+	}
+}
+
+
+void hotkeys_set_threshold(int threshold)
+{
+	assert(threshold >= 0);
+	_threshold = threshold;
+	logger(LOG_INFO, "Hot key replication threshold: %d", _threshold);
+}
+
+
+// another node has sent us a copy of one of its hot keys.
+// NOTE: value is controlled by the hotkeys after this function call.
+void hotkeys_store_replica(hash_t map_hash, hash_t key_hash, int ttl, value_t *value)
+{
+	int i;
+	int slot = -1;
+
+	assert(ttl > 0);
+	assert(value);
+
+	// if we already have a copy of this key, replace it.  Otherwise use an empty slot, or if they are
+	// all in use, the one that is going to expire first.
+	for (i=0; i<HOTKEY_REPLICA_MAX; i++) {
+		if (_replicas[i].value && _replicas[i].map_hash == map_hash && _replicas[i].key_hash == key_hash) {
+			slot = i;
+			break;
+		}
+		if (slot < 0 || (_replicas[slot].value && (_replicas[i].value == NULL || _replicas[i].expires < _replicas[slot].expires))) {
+			slot = i;
+		}
+	}
+
+	assert(slot >= 0 && slot < HOTKEY_REPLICA_MAX);
+	if (_replicas[slot].value) {
+		replica_clear(&_replicas[slot]);
+	}
+
+	_replicas[slot].map_hash = map_hash;
+	_replicas[slot].key_hash = key_hash;
+	_replicas[slot].value = value;
+	_replicas[slot].received = seconds_get();
+	_replicas[slot].expires = _replicas[slot].received + ttl;
+}
+
+
+// if we have a copy of the key (and it is not older than the client allows), return it.
+value_t * hotkeys_get_replica(hash_t map_hash, hash_t key_hash, int max_stale)
+{
+	int i;
+
+	if (max_stale >= 0) {
+		for (i=0; i<HOTKEY_REPLICA_MAX; i++) {
+			if (_replicas[i].value && _replicas[i].map_hash == map_hash && _replicas[i].key_hash == key_hash) {
+				if ((int)seconds_get() - _replicas[i].received <= max_stale) {
+					_replica_hits ++;
+					return(_replicas[i].value);
+				}
+				break;
+			}
+		}
+	}
+
+	return(NULL);
+}
+
+
+void hotkeys_dump(void)
+{
+	int i;
+	int held = 0;
+
+	stat_dumpstr("HOTKEYS");
+	stat_dumpstr("  Threshold: %d", _threshold);
+	stat_dumpstr("  Samples: %lld (1 in %d)", _samples, HOTKEY_SAMPLE_RATE);
+	stat_dumpstr("  Top Keys:");
+	for (i=0; i<_top_count; i++) {
+		stat_dumpstr("    [%#llx/%#llx] Count:%d, Replicas:%d", _top[i].map_hash, _top[i].key_hash, _top[i].count, _top[i].replica_count);
+	}
+
+	for (i=0; i<HOTKEY_REPLICA_MAX; i++) {
+		if (_replicas[i].value) { held ++; }
+	}
+	stat_dumpstr("  Replicas Held: %d (max %d)", held, HOTKEY_REPLICA_MAX);
+	stat_dumpstr("  Replica Hits: %d", _replica_hits);
+	stat_dumpstr(NULL);
+
+	_replica_hits = 0;
+}
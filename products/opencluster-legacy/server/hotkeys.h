@@ -0,0 +1,29 @@
+// hotkeys.h
+
+#ifndef __HOTKEYS_H
+#define __HOTKEYS_H
+
+#include "client.h"
+#include "hash.h"
+#include "node.h"
+#include "value.h"
+
+#include "event-compat.h"
+
+
+void hotkeys_init(struct event_base *evbase);
+void hotkeys_shutdown(void);
+
+void hotkeys_set_threshold(int threshold);
+
+void hotkeys_sample(hash_t map_hash, hash_t key_hash);
+void hotkeys_node_gone(node_t *node);
+void hotkeys_push(client_t *client);
+
+void hotkeys_store_replica(hash_t map_hash, hash_t key_hash, int ttl, value_t *value);
+value_t * hotkeys_get_replica(hash_t map_hash, hash_t key_hash, int max_stale);
+
+void hotkeys_dump(void);
+
+
+#endif
@@ -2,9 +2,15 @@
 
 #include "node.h"
 
+#include "bucket.h"
+#include "compress.h"
+#include "constants.h"
 #include "event-compat.h"
+#include "hotkeys.h"
 #include "logging.h"
+#include "protocol.h"
 #include "push.h"
+#include "savefile.h"
 #include "server.h"
 #include "stats.h"
 #include "timeout.h"
@@ -38,6 +44,15 @@ static void node_loadlevel_handler(int fd, short int flags, void *arg);
 
 conninfo_t *_this_conninfo = NULL;
 
+// the number of bulk connections we will ask for (and agree to) with each node.
+static int _bulk_channels = NODE_BULK_CHANNELS;
+
+// the compression we will ask for (and agree to) on the bulk connections.
+static int _compression = COMPRESS_NONE;
+
+// non-zero if this node is running as a logger.
+static int _logger = 0;
+
 
 
 void nodes_init(struct event_base evbase, conninfo_t conninfo)
@@ -48,13 +63,25 @@ void nodes_init(struct event_base evbase, conninfo_t conninfo)
 	// let the nodes-subsystem know what the conninfo is for this node.
 	nodes_set_master_conninfo(conninfo);
 	
-	// If we dont have any nodes configured, then we must be starting a new cluster.
-	if (node_count() == 0) {
+	// If we dont have any nodes configured, then we must be starting a new cluster.  A logger node 
+	// cannot start a cluster though, because it doesn't hold any buckets.
+	if (node_count() == 0 && _logger) {
+		logger(LOG_ERROR, "A logger node needs to connect to an existing cluster.");
+	}
+	else if (node_count() == 0) {
+		
+		// startup new cluster.  If the last node of a previous cluster saved its buckets, then we 
+		// create the buckets the same way, and load them back in.
+		hash_t mask = savefile_mask();
+		if (mask == 0) { mask = STARTING_MASK; }
 		
-		// startup new cluster.
 		assert(_evbase);
-		buckets_init(STARTING_MASK, _evbase);
+		buckets_init(mask, _evbase);
 		logger(LOG_INFO, "Created New Cluster: %d buckets", buckets_get_primary_count() + buckets_get_secondary_count());
+		
+		if (savefile_enabled()) {
+			savefile_load();
+		}
 	}
 
 	node_connect_start();
@@ -105,6 +132,9 @@ static node_t * node_new(conninfo_t *conninfo)
 	node->nodehash = 0;
 
 	node->client = NULL;
+	node->bulk = NULL;
+	node->bulk_count = 0;
+	node->bulk_max = 0;
 	node->connect_event = NULL;
 	node->loadlevel_event = NULL;
 	node->wait_event = NULL;
@@ -249,10 +279,12 @@ static void node_connect_handler(int fd, short int flags, void *arg)
 			assert(node->state == CONNECTING);
 			node->state = AUTHENTICATING;
 			
-			// should send a SERVERHELLO command to the server we've connected to.
+			// should send a SERVERHELLO command to the server we've connected to.  This is the 
+			// control connection, and we let it know how many bulk connections we would like.  When 
+			// it replies, we will open the bulk connections.
 			assert(_this_conninfo);
 			assert(_auth);
-			push_serverhello(node->client, conninfo_str(_this_conninfo), _auth);
+			push_serverhello(node->client, conninfo_str(_this_conninfo), _auth, CHANNEL_CONTROL, _bulk_channels, _logger ? NODE_ROLE_LOGGER : NODE_ROLE_DATA, COMPRESS_NONE);
 		}	
 	}	
 }
@@ -328,10 +360,158 @@ static void node_connect(node_t *node)
 
 
 
+// a bulk connection has connected (or failed to).  If it connected, we send the SERVERHELLO for it, 
+// and it will be added to the node's bulk list when the other node replies.
+static void node_bulk_connect_handler(int fd, short int flags, void *arg)
+{
+	node_t *node = arg;
+	int error = 0;
+	socklen_t foo = sizeof(error);
+	
+	assert(fd >= 0);
+	assert(node);
+	
+	if ((flags & EV_TIMEOUT) == 0) {
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &foo);
+	}
+	
+	if ((flags & EV_TIMEOUT) || error != 0 || node->client == NULL) {
+		// we couldn't connect, or the control connection has gone away while we were connecting.  
+		// The node will still work, it just wont have this bulk connection.
+		logger(LOG_WARN, "Unable to open bulk connection to: %s", node_name(node));
+		close(fd);
+	}
+	else {
+		logger(LOG_INFO, "Opened bulk connection to node: %s", node_name(node));
+	
+		client_t *client = client_new();
+		assert(client);
+		client->channel = CHANNEL_BULK;
+		client_attach_node(client, node, fd);
+		
+		assert(_this_conninfo);
+		assert(_auth);
+		push_serverhello(client, conninfo_str(_this_conninfo), _auth, CHANNEL_BULK, 0, _logger ? NODE_ROLE_LOGGER : NODE_ROLE_DATA, _compression);
+	}
+}
+
+
+// The other node has agreed to a number of bulk connections, so we open them.  
+void node_connect_bulk(node_t *node, int count)
+{
+	int i;
+	int len;
+	int sock;
+	struct sockaddr saddr;
+
+	assert(node);
+	assert(node->client);
+	assert(count >= 0 && count <= NODE_BULK_CHANNELS_MAX);
+	assert(node->conninfo);
+	
+	const char *remote_addr = conninfo_remoteaddr(node->conninfo);
+	assert(remote_addr);
+	len = sizeof(saddr);
+	if (evutil_parse_sockaddr_port(remote_addr, &saddr, &len) != 0) {
+		// we already connected the control channel with this address, so this should not happen.
+		assert(0);
+		count = 0;
+	}
+
+	for (i=0; i<count; i++) {
+		sock = socket(AF_INET,SOCK_STREAM,0);
+		assert(sock >= 0);
+		evutil_make_socket_nonblocking(sock);
+
+		int result = connect(sock, &saddr, sizeof(struct sockaddr));
+		assert(result < 0);
+		assert(errno == EINPROGRESS);
+		
+		server_conn_inc();
+		
+		logger(LOG_DEBUG, "Attempting bulk connect %d to node: %s", i, node_name(node));
+		
+		// we dont need to keep the connect event, so we let libevent clean it up for us.
+		assert(_evbase);
+		event_base_once(_evbase, sock, EV_WRITE, node_bulk_connect_handler, node, &_timeout_connect);
+	}
+}
+
+
+// add this client as one of the bulk connections for this node.
+void node_attach_bulk(node_t *node, client_t *client)
+{
+	assert(node);
+	assert(client);
+	assert(client->channel == CHANNEL_BULK);
+	assert(client->node == node);
+	
+	if (node->bulk_count >= node->bulk_max) {
+		node->bulk = realloc(node->bulk, sizeof(client_t *) * (node->bulk_max + 1));
+		assert(node->bulk);
+		node->bulk_max ++;
+	}
+	
+	node->bulk[node->bulk_count] = client;
+	node->bulk_count ++;
+	
+	logger(LOG_INFO, "Node '%s' now has %d bulk connections.", node_name(node), node->bulk_count);
+}
+
+
+// return the connection that SYNC data for this key should be sent on.  All the keys in a bucket go 
+// to the same connection, so that the changes for a bucket arrive in the order they were made.  The 
+// backup relies on that to know how far behind it is (see buckets_sync_seen()).
+client_t * node_bulk_client(node_t *node, hash_t key_hash)
+{
+	assert(node);
+	
+	if (node->bulk_count > 0) {
+		assert(node->bulk);
+		return(node->bulk[(key_hash & buckets_mask()) % node->bulk_count]);
+	}
+	else {
+		return(node->client);
+	}
+}
+
+
+
 // we have a node that contains a pointer to the client object.  For whatever reason, we need to 
 // clear that.
-void node_detach_client(node_t *node)
+void node_detach_client(node_t *node, client_t *client)
 {
+	int i;
+	
+	assert(node);
+	assert(client);
+	
+	if (client->channel == CHANNEL_BULK) {
+		// one of the bulk connections has gone.  We only need to remove it from the list, the 
+		// node will just use the remaining ones (or the control connection).
+		for (i=0; i<node->bulk_count; i++) {
+			if (node->bulk[i] == client) {
+				node->bulk_count --;
+				node->bulk[i] = node->bulk[node->bulk_count];
+				node->bulk[node->bulk_count] = NULL;
+				break;
+			}
+		}
+		return;
+	}
+	
+	assert(node->client == client);
+	
+	// the control connection is gone, so the bulk connections need to go too.  They will be 
+	// re-opened when the control connection is established again.
+	for (i=0; i<node->bulk_count; i++) {
+		assert(node->bulk[i]);
+		node->bulk[i]->node = NULL;
+		client_shutdown(node->bulk[i]);
+		node->bulk[i] = NULL;
+	}
+	node->bulk_count = 0;
+	
 	// if we have a loadlevel event set for this node, then we need to cancel it.
 	if (node->loadlevel_event) {
 		event_free(node->loadlevel_event);
@@ -449,7 +629,8 @@ int node_active_count(void)
 	int count=0;
 	for (i=0; i<_node_count; i++) {
 		if (_nodes[i]) {
-			if (_nodes[i]->state == READY) {
+			// logger nodes dont hold any buckets, so they dont count.
+			if (_nodes[i]->state == READY && _nodes[i]->logger == 0) {
 				count++;
 			}
 		}
@@ -501,6 +682,16 @@ static void node_free(node_t *node)
 	assert(node->loadlevel_event == NULL);
 	assert(node->wait_event == NULL);
 	assert(node->shutdown_event == NULL);
+	assert(node->bulk_count == 0);
+
+	if (node->bulk) {
+		free(node->bulk);
+		node->bulk = NULL;
+		node->bulk_max = 0;
+	}
+
+	// the hot keys might have sent copies to this node.
+	hotkeys_node_gone(node);
 
 	// remove the node from the list.
 	int i;
@@ -576,10 +767,11 @@ static void node_dump(int index, node_t *node)
 
 	assert(node->state < sizeof(_node_state_str));
 	
-	stat_dumpstr("    [%02d] '%s', Connected=%s, Connect_attempts=%d, State=%s", 
+	stat_dumpstr("    [%02d] '%s', Connected=%s, Bulk Connections=%d, Connect_attempts=%d, State=%s", 
 				 index, 
 				 node_name(node), 
 				 node->client ? "yes" : "no", 
+				 node->bulk_count,
 				 node->connect_attempts,
 				 _node_state_str[node->state]
 				);
@@ -638,6 +830,79 @@ int node_count(void)
 }
 
 
+// When taking over from a node that is being upgraded, the connections to the other nodes are passed 
+// to us already established and authenticated.  This finds (or creates) the node object for the 
+// connection string.  If 'is_logger' is -1, the node's role is left as it is.
+node_t * node_adopt(const char *conninfo_str, int is_logger)
+{
+	conninfo_t *conninfo;
+	node_t *node = NULL;
+	int i;
+	
+	assert(conninfo_str);
+	
+	conninfo = conninfo_parse(conninfo_str);
+	if (conninfo == NULL) {
+		logger(LOG_ERROR, "Unable to parse node connection info: %s", conninfo_str);
+		return(NULL);
+	}
+	
+	// nodes that were loaded from the nodes directory will not have a client attached yet, so we 
+	// cant use node_find().
+	for (i=0; i<_node_count && node == NULL; i++) {
+		if (_nodes[i] && conninfo_compare(_nodes[i]->conninfo, conninfo) == 0) {
+			node = _nodes[i];
+		}
+	}
+	
+	if (node) {
+		conninfo_free(conninfo);
+	}
+	else {
+		node = node_new(conninfo);
+		assert(node);
+	}
+	
+	if (is_logger >= 0) {
+		node->logger = is_logger;
+	}
+	return(node);
+}
+
+
+// attach the adopted control connection to the node.  It was already authenticated by the node we 
+// are replacing, so it is ready to go.
+void node_adopt_client(node_t *node, client_t *client)
+{
+	assert(node);
+	assert(client);
+	assert(client->node == node);
+	assert(client->channel == CHANNEL_CONTROL);
+	assert(node->client == NULL);
+	
+	node->client = client;
+	node->state = READY;
+	
+	if (node->logger) {
+		buckets_set_logging_node(node);
+	}
+	
+	node_start_loadlevel(node);
+	
+	logger(LOG_INFO, "Adopted connection to node: %s", node_name(node));
+}
+
+
+// return the node at this position in the list (which could be NULL).  Used along with node_count() 
+// to go through all the nodes.
+node_t * node_get(int index)
+{
+	assert(index >= 0 && index < _node_count);
+	assert(_nodes);
+	return(_nodes[index]);
+}
+
+
 void nodes_setauth(const char *auth)
 {
 	assert(_auth == NULL);
@@ -648,12 +913,63 @@ void nodes_setauth(const char *auth)
 }
 
 
+// set the number of bulk connections we want to each node.  0 means that everything will go over 
+// the control connection.
+void nodes_set_bulk_channels(int channels)
+{
+	assert(channels >= 0);
+	if (channels > NODE_BULK_CHANNELS_MAX) { channels = NODE_BULK_CHANNELS_MAX; }
+	_bulk_channels = channels;
+}
+
+
+int nodes_bulk_channels(void)
+{
+	assert(_bulk_channels >= 0 && _bulk_channels <= NODE_BULK_CHANNELS_MAX);
+	return(_bulk_channels);
+}
+
+
+// set the compression we would like on the bulk connections to the other nodes (COMPRESS_NONE or 
+// COMPRESS_DEFLATE).  It is only used if the other node wants it too.
+void nodes_set_compression(int method)
+{
+	assert(method == COMPRESS_NONE || method == COMPRESS_DEFLATE);
+	_compression = method;
+}
+
+
+int nodes_compression(void)
+{
+	return(_compression);
+}
+
+
+// when running as a logger, this node will not take any buckets, and it tells the other nodes so 
+// that they send it a copy of their updates.
+void nodes_set_logger(int logger)
+{
+	_logger = logger;
+}
+
+
+int nodes_logger(void)
+{
+	return(_logger);
+}
+
+
 // start the node loadlevel timer.  This timer will fire frequently to check the load on the other 
 // nodes in the system.
 void node_start_loadlevel(node_t *node)
 {
 	assert(node);
 	
+	// buckets are never moved to or from a logger node, so there is no need to compare load levels.
+	if (_logger || node->logger) {
+		return;
+	}
+	
 	assert(node->loadlevel_event == NULL);
 	assert(_evbase);
 	node->loadlevel_event = evtimer_new(_evbase, node_loadlevel_handler, (void *) node);
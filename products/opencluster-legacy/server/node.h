@@ -33,12 +33,29 @@ typedef enum {
 typedef struct {
 	hash_t nodehash;
 	conninfo_t *conninfo;
+	
+	// the control connection to the node.  
+	client_t *client;
+	
+	// the bulk connections to the node, which are used for SYNC data.  If there aren't any (the 
+	// other node is an older version, or they aren't connected yet), then everything goes over 
+	// the control connection.
+	client_t **bulk;
+	int bulk_count;
+	int bulk_max;
+	
 	struct event *connect_event;
 	struct event *loadlevel_event;
 	struct event *wait_event;
 	struct event *shutdown_event;
 	int connect_attempts;
 	node_state_e state;
+	
+	// logger nodes dont take any buckets, they only get sent a copy of the updates.
+	int logger;
+	
+	// the optional features (FEATURE_*) the node said it understands in the SERVERHELLO.
+	int features;
 } node_t;
 
 void nodes_dump(void);
@@ -49,20 +66,35 @@ node_t * node_new_file(const char *filename);
 node_t * node_add(client_t *client, conninfo_t *conninfo);
 
 void node_connect_start(void);
-void node_detach_client(node_t *node);
+void node_detach_client(node_t *node, client_t *client);
+void node_connect_bulk(node_t *node, int count);
+void node_attach_bulk(node_t *node, client_t *client);
+client_t * node_bulk_client(node_t *node, hash_t key_hash);
+void nodes_set_bulk_channels(int channels);
+int nodes_bulk_channels(void);
+void nodes_set_compression(int method);
+int nodes_compression(void);
+void nodes_set_logger(int logger);
+int nodes_logger(void);
 void node_retry(node_t *node);
 void node_shutdown(node_t *node);
 
 node_t * node_find(conninfo_t *conninfo);
+node_t * node_adopt(const char *conninfo_str, int is_logger);
+void node_adopt_client(node_t *node, client_t *client);
 
 int node_active_count(void);
 int node_count(void);
+node_t * node_get(int index);
 
 
 const char * node_name(node_t *node);
 
 void node_start_loadlevel(node_t *node);
 
+void nodes_set_evbase(struct event_base *evbase);
+void nodes_set_master_conninfo(conninfo_t *conninfo);
+
 
 
 
@@ -10,19 +10,28 @@
 // includes
 #include "auth.h"
 #include "bucket.h"
+#include "compress.h"
 #include "constants.h"
 #include "daemon.h"
+#include "hotkeys.h"
 #include "item.h"
 #include "params.h"
 #include "payload.h"
+#include "savefile.h"
 #include "seconds.h"
 #include "server.h"
 #include "shutdown.h"
+#include "snapshot.h"
 #include "stats.h"
+#include "throttle.h"
 #include "timeout.h"
+#include "translog.h"
+#include "upgrade.h"
 #include "usage.h"
+#include "value.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 
 
@@ -36,6 +45,62 @@ struct event_base *_evbase = NULL;
 // signal catchers that are used to clean up, and store final data before shutting down.
 struct event *_sigint_event = NULL;
 
+// SIGUSR1 will re-load the config file and apply the options that can be changed while running.
+struct event *_sigusr1_event = NULL;
+
+// SIGUSR2 will start a new process (from the installed binary) and hand everything over to it.
+struct event *_sigusr2_event = NULL;
+
+
+
+//--------------------------------------------------------------------------------------------------
+// Some of the config options can be changed while the service is running.  These are applied on 
+// startup, and then again whenever the config is re-loaded.
+static void apply_runtime_config(void)
+{
+	// the number of buckets that can be migrating at the same time.  This is optional.
+	long long migrate_max = config_get_long("migrate-max");
+	if (migrate_max > 0) {
+		buckets_set_transfer_max(migrate_max);
+	}
+	
+	// the bandwidth that migration and backup syncing can use, and the latency budget for client 
+	// requests while it is happening.  Both are optional, 0 means no limit.
+	long long migrate_rate = config_get_long("migrate-rate");
+	if (migrate_rate >= 0) {
+		throttle_set_rate(migrate_rate);
+	}
+	
+	long long migrate_latency = config_get_long("migrate-latency");
+	if (migrate_latency >= 0) {
+		throttle_set_budget(migrate_latency);
+	}
+	
+	// the largest value that a client can stream in.  This is optional.
+	long long value_max = config_get_long("value-max");
+	if (value_max > 0 && value_max < INT_MAX) {
+		values_set_max(value_max);
+	}
+	
+	// how hot a key needs to get before copies of it are sent to other nodes.  0 disables it.
+	long long hotkey_threshold = config_get_long("hotkey-threshold");
+	if (hotkey_threshold >= 0) {
+		hotkeys_set_threshold(hotkey_threshold);
+	}
+	
+	// how long (in milliseconds) a logger node will let updates build up before writing them out.
+	long long logger_interval = config_get_long("logger-interval");
+	if (logger_interval > 0) {
+		translog_set_interval(logger_interval);
+	}
+	
+	// how often (in seconds) the save file is written in the background.  0 turns it off.
+	long long save_interval = config_get_long("save-interval");
+	if (save_interval >= 0 && savefile_enabled()) {
+		savefile_set_interval(save_interval);
+	}
+}
+
 
 
 //--------------------------------------------------------------------------------------------------
@@ -51,11 +116,49 @@ static void sigint_handler(evutil_socket_t fd, short what, void *arg)
 	assert(_sigint_event);
 	event_free(_sigint_event);
 	_sigint_event = NULL;
+	
+	if (_sigusr1_event) {
+		event_free(_sigusr1_event);
+		_sigusr1_event = NULL;
+	}
+	
+	if (_sigusr2_event) {
+		event_free(_sigusr2_event);
+		_sigusr2_event = NULL;
+	}
 
 	shutdown_start();
 }
 
 
+//--------------------------------------------------------------------------------------------------
+// Re-load the config file.  Only the options handled by apply_runtime_config() will take effect, 
+// the rest need a restart.
+static void sigusr1_handler(evutil_socket_t fd, short what, void *arg)
+{
+	assert(arg == NULL);
+
+	if (config_reload() != 0) {
+		syslog(LOG_ERR, "SIGUSR1 received, but unable to re-load the config file.  Keeping the existing config.");
+	}
+	else {
+		syslog(LOG_INFO, "SIGUSR1 received.  Config re-loaded.");
+		apply_runtime_config();
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Upgrade to the installed binary without dropping any connections or moving any buckets.
+static void sigusr2_handler(evutil_socket_t fd, short what, void *arg)
+{
+	assert(arg == NULL);
+
+	syslog(LOG_INFO, "SIGUSR2 received.  Upgrading.");
+	upgrade_start(_evbase);
+}
+
+
 
 
 
@@ -86,6 +189,9 @@ int main(int argc, char **argv)
 	
 	params_parse_args(argc, argv);
 	
+	// keep a copy of the arguments, so that an upgraded binary can be started the same way.
+	upgrade_init(argc, argv);
+	
 	// if the user is requesting help(usage), then we do it and exit.
 	if (params_usage() > 0) {
 		usage();
@@ -156,6 +262,29 @@ int main(int argc, char **argv)
 	if (node_dir) {
 		nodes_loaddir(node_dir);
 	}
+	
+	// the number of bulk connections to open to each node (for SYNC data).  This is optional.
+	const char *bulk_channels = config_get("node-bulk-channels");
+	if (bulk_channels) {
+		nodes_set_bulk_channels(atoi(bulk_channels));
+	}
+	
+	// compress the data sent over the bulk connections (if the other node wants to as well).
+	if (config_get_bool("node-compression")) {
+		nodes_set_compression(COMPRESS_DEFLATE);
+	}
+	
+	// keep string values of at least this size compressed in memory.  This is optional.
+	const char *value_compression = config_get("value-compression");
+	if (value_compression && atoi(value_compression) > 0) {
+		values_set_compression(atoi(value_compression));
+	}
+	
+	// keep an index of the keys in each map, so that maps can be scanned and dropped quickly.  This 
+	// needs to be set before any buckets are created.
+	if (config_get_bool("map-index")) {
+		data_set_mapindex(1);
+	}
 
 	
 	// daemonize
@@ -171,6 +300,10 @@ int main(int argc, char **argv)
 	// create our event base which will be the pivot point for pretty much everything.
 	_evbase = event_base_new();
 	assert(_evbase);
+	
+	// client processing is done at the default priority, and migration work is done at a lower 
+	// priority so that it does not hold up the clients.
+	event_base_priority_init(_evbase, PRIORITY_LEVELS);
 
 	// initialise signal handlers.
 	assert(_evbase);
@@ -178,6 +311,16 @@ int main(int argc, char **argv)
 	assert(_sigint_event);
 	event_add(_sigint_event, NULL);
 
+	assert(_sigusr1_event == NULL);
+	_sigusr1_event = evsignal_new(_evbase, SIGUSR1, sigusr1_handler, NULL);
+	assert(_sigusr1_event);
+	event_add(_sigusr1_event, NULL);
+
+	assert(_sigusr2_event == NULL);
+	_sigusr2_event = evsignal_new(_evbase, SIGUSR2, sigusr2_handler, NULL);
+	assert(_sigusr2_event);
+	event_add(_sigusr2_event, NULL);
+
 	// some of the operations need to know the current time.  It does not need to be extremely 
 	// accurate.  Rouchly accurate to the second is adequate.  This is mostly to know when items 
 	// have expired.  Expiry is done at intervals of one second.
@@ -187,10 +330,61 @@ int main(int argc, char **argv)
 	
 	// statistics are generated every second, setup a timer that can fire and handle the stats.
 	stats_init(_evbase);
+	
+	// migration and sync bandwidth is limited by the throttle.
+	throttle_init(_evbase);
+	
+	// the hottest keys are tracked, and copies sent to other nodes.
+	hotkeys_init(_evbase);
 
-	sync_init(_evbase, conninfo);
+	// operations that go through all the buckets can be run in a forked child.
+	snapshot_init(_evbase);
 	
-	query_init(_evbase);
+	// if this is the last node in the cluster when it shuts down, the buckets will be saved to this 
+	// file, and loaded again when it starts up.  It can also be saved regularly while running.
+	savefile_init(_evbase);
+	const char *save_file = config_get("save-file");
+	if (save_file) {
+		savefile_set_path(save_file);
+	}
+
+	apply_runtime_config();
+
+	// if a logger directory is specified, then this node will not hold any data, it will just write 
+	// all the updates from the cluster to a transaction log.
+	const char *logger_dir = config_get("logger-dir");
+	if (logger_dir) {
+		if (translog_init(_evbase, logger_dir) != 0) {
+			syslog(LOG_CRIT, "Unable to start the transaction log in: %s", logger_dir);
+			fprintf(stderr, "Unable to start the transaction log in: %s\n", logger_dir);
+			exit(1);
+		}
+		nodes_set_logger(1);
+	}
+
+	// primary buckets regularly tell their backups how far along the sync is, so that the backups 
+	// can serve reads for clients that will accept slightly stale data.
+	buckets_sync_start(_evbase);
+
+	// the binary that an upgrade will start (by default, the one we were started from).
+	const char *upgrade_binary = config_get("upgrade-binary");
+	if (upgrade_binary) {
+		upgrade_set_binary(upgrade_binary);
+	}
+
+	// if we were started by a node that is upgrading, then we take over its connections and buckets 
+	// instead of joining the cluster.
+	if (upgrade_pending()) {
+		if (upgrade_adopt(_evbase, conninfo) != 0) {
+			syslog(LOG_CRIT, "Unable to take over from the node being upgraded.");
+			exit(1);
+		}
+	}
+	else {
+		sync_init(_evbase, conninfo);
+		
+		query_init(_evbase);
+	}
 	
 
 ///============================================================================
@@ -33,6 +33,12 @@ int _avail_count = 0;
 #define DEFAULT_BUFSIZE 2048
 #endif
 
+// a payload that had to grow to hold a large value is shrunk back down when it is released, so that 
+// the buffers sitting in the 'avail' list stay small.
+#ifndef PAYLOAD_IDLE_MAX
+#define PAYLOAD_IDLE_MAX (256*1024)
+#endif
+
 
 void payload_init(void)
 {
@@ -225,7 +231,7 @@ void payload_long(PAYLOAD entry, long long value)
 
 
 
-void payload_data(PAYLOAD entry, int length, void *data)
+void payload_data(PAYLOAD entry, int length, const void *data)
 {
 	assert(entry >= 0);
 	assert(entry < _active_count);
@@ -240,9 +246,11 @@ void payload_data(PAYLOAD entry, int length, void *data)
 	assert(payload->length <= payload->max);
 	assert(payload->buffer);
 	
+	// only grow the buffer by what is actually needed (rounded up to DEFAULT_BUFSIZE), so that a 
+	// large value doesnt end up with a buffer that is much bigger than it.
 	int avail = payload->max - payload->length;
-	if (avail < (DEFAULT_BUFSIZE + length)) {
-		payload->max += (DEFAULT_BUFSIZE + length);
+	if (avail < (sizeof(int) + length)) {
+		payload->max += (((sizeof(int) + length - avail) / DEFAULT_BUFSIZE) + 1) * DEFAULT_BUFSIZE;
 		payload->buffer = realloc(payload->buffer, payload->max);
 		assert(payload->buffer);
 		assert(payload->max > 0);
@@ -253,7 +261,7 @@ void payload_data(PAYLOAD entry, int length, void *data)
 	assert(sizeof(length) == 4);
 	
 	// add the length of the string first.
-	char *ptr = ((char*) payload->buffer + payload->length);
+	int *ptr = ((void*) payload->buffer + payload->length);
 	ptr[0] = htobe32(length);
 
 	if (length > 0) {
@@ -268,6 +276,41 @@ void payload_data(PAYLOAD entry, int length, void *data)
 
 
 
+// make room for 'length' more bytes at the end of the payload, and return a pointer to them.  This 
+// is for the generated encoders (codec.h), which write a whole message at once.
+char * payload_reserve(PAYLOAD entry, int length)
+{
+	assert(entry >= 0);
+	assert(entry < _active_count);
+	assert(_active_count <= _active_max);
+	assert(_active_list);
+	assert(length >= 0);
+	
+	payload_t *payload = _active_list[entry];
+	assert(payload);
+	assert(payload->used > 0);
+	
+	assert(payload->max >= 0 && payload->length >= 0);
+	assert(payload->length <= payload->max);
+	assert(payload->buffer);
+	
+	int avail = payload->max - payload->length;
+	if (avail < length) {
+		payload->max += (((length - avail) / DEFAULT_BUFSIZE) + 1) * DEFAULT_BUFSIZE;
+		payload->buffer = realloc(payload->buffer, payload->max);
+		assert(payload->buffer);
+		assert(payload->max > 0);
+	}
+	
+	char *ptr = payload->buffer + payload->length;
+	payload->length += length;
+	
+	assert(payload->length <= payload->max);
+	return(ptr);
+}
+
+
+
 void payload_string(PAYLOAD entry, const char *str)
 {
 	if (str == NULL) {
@@ -332,13 +375,20 @@ void payload_release(PAYLOAD entry)
 		if (_avail_count == _avail_max) {
 			_avail_max ++;
 			_avail_list = realloc(_avail_list, sizeof(payload_t *) * _avail_max);
-			_avail_list[_avail_count] = payload;
-			_avail_count ++;
+		}
+		_avail_list[_avail_count] = payload;
+		_avail_count ++;
+
+		if (payload->max > PAYLOAD_IDLE_MAX) {
+			payload->buffer = realloc(payload->buffer, DEFAULT_BUFSIZE);
+			assert(payload->buffer);
+			payload->max = DEFAULT_BUFSIZE;
 		}
 
-		// if this entry was at the end of the list, then move the 'count' to the previous one.
+		// if this entry was at the end of the list, then move the 'count' back past any empty slots, 
+		// so that the handles (which are sent as the request ids) stay small.
 		_active_list[entry] = NULL;
-		if (entry > 0 && entry == _active_count) {
+		while (_active_count > 0 && _active_list[_active_count - 1] == NULL) {
 			_active_count --;
 		}
 		assert(_active_count >= 0);
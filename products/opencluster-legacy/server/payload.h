@@ -81,7 +81,8 @@ void payload_release(PAYLOAD payload);
 void payload_int(PAYLOAD entry, int value);
 void payload_long(PAYLOAD entry, long long value);
 void payload_string(PAYLOAD entry, const char *str);
-void payload_data(PAYLOAD entry, int length, void *data);
+void payload_data(PAYLOAD entry, int length, const void *data);
+char * payload_reserve(PAYLOAD entry, int length);
 
 void payload_free_client(void *client_ptr);
 
@@ -2,6 +2,8 @@
 
 #include "bucket.h"
 #include "client.h"
+#include "codec.h"
+#include "compress.h"
 #include "constants.h"
 #include "header.h"
 #include "item.h"
@@ -12,6 +14,7 @@
 #include "protocol.h"
 #include "push.h"
 #include "server.h"
+#include "throttle.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -62,27 +65,89 @@ static void process_quiet_ok(client_t *client, header_t *header, void *ptr, payl
 }
 
 
+// the reply to a message that had a payload, but there is nothing we need to do with the reply.
+static void process_ignore_ok(client_t *client, header_t *header, void *ptr, payload_t *request)
+{
+	assert(header->response_code == RESPONSE_OK);
+	assert(ptr == NULL);
+	assert(request);
+}
+
+
 
 
 static void process_serverhello_ok(client_t *client, header_t *header, void *ptr, payload_t *request)
 {
 	assert(header->command == COMMAND_SERVERHELLO);
 	assert(header->response_code == RESPONSE_OK);
-	assert(ptr == NULL);
 	assert(request);
-	assert(request->length == 0);
 
 	// Need to find the node that this client is referring to, so that we can mark it as active.
 	node_t *node = client->node;
 	assert(node);
 	
+	if (client->channel == CHANNEL_BULK) {
+		// this is one of our bulk connections, which has now been accepted.  If we asked for 
+		// compression, newer nodes tell us if they agreed to it, and everything after this reply will 
+		// be in the v2 framing (and compressed).  Older nodes dont send anything.
+		assert(node->state == READY);
+		if (ptr) {
+			char *next = ptr;
+			int avail = header->length;
+			int compress = data_int(&next, &avail);
+			if (avail < 0 || (compress != COMPRESS_NONE && compress != nodes_compression())) {
+				// it agreed to something we didn't ask for, so we cant understand anything it sends.
+				logger(LOG_ERROR, "Bulk connection to '%s' agreed to unknown compression (%d).", node_name(node), compress);
+				client_closing(client);
+				return;
+			}
+			if (compress != COMPRESS_NONE) {
+				client->protocol = PROTOCOL_V2;
+				client->old_replies = client->pending;
+				client->compress = compress_new(compress);
+				logger(LOG_INFO, "Bulk connection to '%s' is compressed.", node_name(node));
+			}
+		}
+		node_attach_bulk(node, client);
+		return;
+	}
+	
+	// newer nodes reply with the number of bulk connections they will accept.  Older nodes dont 
+	// send anything, so we will use the control connection for everything.
+	int bulk = 0;
+	int role = NODE_ROLE_DATA;
+	if (ptr) {
+		char *next = ptr;
+		int avail = header->length;
+		bulk = data_int(&next, &avail);
+		if (avail < 0 || bulk < 0 || bulk > NODE_BULK_CHANNELS_MAX) { bulk = 0; }
+		
+		// and if it is a logger node, and the features it understands.
+		if (avail > 0) {
+			role = data_int(&next, &avail);
+		}
+		if (avail > 0) {
+			node->features = data_int(&next, &avail);
+		}
+	}
+	
 	// Since we were sending a SERVER_HELLO to the node, it should be in a specific state.
 	assert(node->state == AUTHENTICATING);
 	
 	// Since we got an OK, then we change the state to READY.
 	node->state = READY;
 	
+	// if the other node is a logger, then our primary buckets need to send it their updates.
+	if (role == NODE_ROLE_LOGGER) {
+		node->logger = 1;
+		buckets_set_logging_node(node);
+	}
+	
 	logger(LOG_INFO, "Active cluster node connections: %d", node_active_count());
+	
+	if (bulk > 0) {
+		node_connect_bulk(node, bulk);
+	}
 }
 
 
@@ -93,7 +158,13 @@ static void process_serverhello_fail(client_t *client, header_t *header, void *p
 	assert(header->response_code == RESPONSE_FAIL);
 	assert(ptr == NULL);
 	assert(request);
-	assert(request->length == 0);
+	
+	if (client->channel == CHANNEL_BULK) {
+		// the other node didn't want this bulk connection.  We will just do without it.
+		logger(LOG_WARN, "Bulk connection to '%s' was refused.", node_name(client->node));
+		client_closing(client);
+		return;
+	}
 
 	// the server responded with a fail.  Could be the 'auth' is wrong.  What do we do?   
 	// Might need to figure out which node this is (from the client), and then remove it from the list.
@@ -105,8 +176,9 @@ static void process_serverhello_fail(client_t *client, header_t *header, void *p
 // this function is called when it receives a LOADLEVELS reply from a server node.  Based on that 
 // reply, and the state of this currrent node, we determine if we are going to try and send a bucket 
 // to that node or not.  If we are going to send the bucket to the node, we will send out a message 
-// to the node, indicating what we are going to do, and then we wait for a reply back.  Once we 
-// decide to send a bucket, we do not attempt to send buckets to any other node.
+// to the node, indicating what we are going to do, and then we wait for a reply back.  Only one 
+// bucket is transferred with each node at a time, but we can be sending buckets to several nodes at 
+// once (up to the transfer limit on each side).
 static void process_loadlevels(client_t *client, header_t *header, void *ptr, payload_t *request)
 {
 	assert(client);
@@ -121,17 +193,29 @@ static void process_loadlevels(client_t *client, header_t *header, void *ptr, pa
 	// we wouldn't have stored any extra data for this request, so original payload should be empty.
 	assert(request->length == 0);
 
-	// need to get the data out of the payload.
+	// need to get the data out of the payload.  Nodes that don't send a transfer limit will only do 
+	// one transfer at a time.
 	char *next = ptr;
-	int primary = data_int(&next);
-	int backups = data_int(&next);
-	int transferring = data_int(&next);
+	int avail = header->length;
+	if (avail < sizeof(int) * 3) {
+		logger(LOG_WARN, "Invalid LoadLevel data from '%s'.", node_name(node));
+		return;
+	}
+	int primary = data_int(&next, &avail);
+	int backups = data_int(&next, &avail);
+	int transferring = data_int(&next, &avail);
+	int transfer_max = 1;
+	if (avail >= sizeof(int)) {
+		transfer_max = data_int(&next, &avail);
+	}
 
-	logger(LOG_DEBUG, "Received LoadLevel data from '%s'.  Primary:%d, Backups:%d, Transferring:%d", node_name(node), primary, backups, transferring); 
+	logger(LOG_DEBUG, "Received LoadLevel data from '%s'.  Primary:%d, Backups:%d, Transferring:%d/%d", node_name(node), primary, backups, transferring, transfer_max); 
 	
 	int switching = 0;
 	
-	if (transferring == 0) {
+	// only start something if the other node has room for another transfer, and we are not already 
+	// transferring something with it.
+	if (transferring < transfer_max && client->transfer_bucket == NULL && buckets_transferring() < buckets_transfer_max()) {
 
 		// first check to see if the target needs to have some buckets switched (if it has more secondaries than primaries)
 		// before contemplating promoting any buckets, we need to make sure it wont destabilize us.
@@ -188,7 +272,7 @@ static void finalize_migration(client_t *client)
 	
 	assert(client);
 	
-	bucket_t *bucket = buckets_current_transfer();
+	bucket_t *bucket = buckets_current_transfer(client);
 	assert(bucket);
 
 	if (bucket->level == 0) {
@@ -266,6 +350,8 @@ static void finalize_migration(client_t *client)
 
 
 
+// send the next lot of items for the bucket being migrated to this client.  This is always called 
+// through the throttle (at the background priority), never directly from a reply.
 static void send_transfer_items(client_t *client)
 {
 	assert(client);
@@ -305,8 +391,8 @@ static void process_acceptbucket_ok(client_t *client, header_t *header, void *pt
 
 	if (buckets_send_bucket(client, mask, hashmask) == 1) {
 		// bucket is ok to send.
-		// send the first queued item.
-		send_transfer_items(client);
+		// send the first queued item when the throttle allows it.
+		throttle_schedule(client, send_transfer_items);
 	}
 }
 
@@ -328,12 +414,63 @@ static void process_acceptbucket_fail(client_t *client, header_t *header, void *
 	assert(request->buffer);
 	
 	char *next = request->buffer;
-	hash_t mask = data_long(&next);
-	hash_t hashmask = data_long(&next);
-	
+	int avail = request->length;
+	hash_t mask = data_long(&next, &avail);
+	hash_t hashmask = data_long(&next, &avail);
+	
+	// the other node would not accept the bucket (most likely it is already busy with as many 
+	// transfers as it will allow).  So we release the bucket so that it can be offered again (to this 
+	// node or another one) the next time the loadlevels are checked.  The mask may have changed since 
+	// the bucket was offered, but the transfer slot still needs to be released, otherwise it is lost.
+	bucket_t *bucket = buckets_current_transfer(client);
+	if (bucket && bucket->hashmask == hashmask) {
+		if (mask != buckets_mask()) {
+			logger(LOG_DEBUG, "Mask changed from %#llx to %#llx while bucket #%#llx was being offered.", mask, buckets_mask(), hashmask);
+		}
+		logger(LOG_INFO, "Node '%s' declined bucket #%#llx.", node_name(client->node), hashmask);
+		buckets_clear_transferring(bucket);
+	}
+}
+
+
 
-	// what do we do if the bucket transfer failed?
-	assert(0);	
+// A SYNC item was received by the other node.  If the item was sent as part of a bucket migration, 
+// then we can send more items for that bucket.  Otherwise it was just a backup sync, and nothing 
+// needs to be done.
+static void process_sync_ok(client_t *client, header_t *header, void *ptr, payload_t *request)
+{
+	assert(client && header);
+	assert(client->node);
+	assert(ptr == NULL);
+	
+	// We need look at the original request to determine what item this reply is about.
+	assert(request);
+	assert(request->length > 0);
+	assert(request->buffer);
+	
+	hash_t map_hash;
+	hash_t key_hash;
+	if (request->command == COMMAND_SYNC_INT) {
+		msg_sync_int_t msg;
+		if (msg_sync_int_decode(request->buffer, request->length, &msg) < 0) { assert(0); return; }
+		map_hash = msg.map_hash;
+		key_hash = msg.key_hash;
+	}
+	else {
+		msg_sync_str_t msg;
+		assert(request->command == COMMAND_SYNC_STRING);
+		if (msg_sync_str_decode(request->buffer, request->length, &msg) < 0) { assert(0); return; }
+		map_hash = msg.map_hash;
+		key_hash = msg.key_hash;
+	}
+	
+	// the SYNC was probably sent over one of the bulk connections, but the transfer is attached to 
+	// the control connection.
+	node_t *node = client->node;
+	client_t *control = node->client;
+	if (control && buckets_transfer_ack(control, map_hash, key_hash) > 0) {
+		throttle_schedule(control, send_transfer_items);
+	}
 }
 
 
@@ -663,6 +800,16 @@ void process_init(void)
 
 	client_add_response(COMMAND_ACCEPT_BUCKET, RESPONSE_OK,         process_acceptbucket_ok);
 	client_add_response(COMMAND_ACCEPT_BUCKET, RESPONSE_FAIL,       process_acceptbucket_fail);
+
+	client_add_response(COMMAND_SYNC_INT,      RESPONSE_OK,         process_sync_ok);
+	client_add_response(COMMAND_SYNC_STRING,   RESPONSE_OK,         process_sync_ok);
+	client_add_response(COMMAND_SYNC_MARK,     RESPONSE_OK,         process_ignore_ok);
+	client_add_response(COMMAND_SYNC_REPLICA,  RESPONSE_OK,         process_ignore_ok);
+	client_add_response(COMMAND_SYNC_DELETE,   RESPONSE_OK,         process_ignore_ok);
+	client_add_response(COMMAND_DROP_MAP,      RESPONSE_OK,         process_ignore_ok);
+	client_add_response(COMMAND_HOTKEY,        RESPONSE_OK,         process_ignore_ok);
+	client_add_response(COMMAND_HASHMASK,      RESPONSE_OK,         process_ignore_ok);
+	client_add_response(COMMAND_INVALIDATE,    RESPONSE_OK,         process_ignore_ok);
 	
 	
 	
@@ -9,21 +9,43 @@
 #define COMMAND_PING                        0x0050
 #define COMMAND_SERVERHELLO                 0x0060
 #define COMMAND_HASHMASK                    0x0080
+#define COMMAND_HOTKEY                      0x0090
+#define COMMAND_INVALIDATIONS               0x00A0
+#define COMMAND_INVALIDATE                  0x00B0
 #define COMMAND_LOADLEVELS                  0x0100
 #define COMMAND_ACCEPT_BUCKET               0x0110
 #define COMMAND_CONTROL_BUCKET              0x0120
 #define COMMAND_FINALISE_MIGRATION          0x0130
 #define COMMAND_GET_INT                     0x2010
 #define COMMAND_GET_STRING                  0x2020
+#define COMMAND_MGET                        0x2030
+#define COMMAND_GET_IF_CHANGED              0x2040
+#define COMMAND_GET_KEY_ALL                 0x2050
+#define COMMAND_SCAN_MAP                    0x2060
+#define COMMAND_GET_CHUNK                   0x2070
 #define COMMAND_SET_INT                     0x2200
 #define COMMAND_SET_STRING                  0x2210
+#define COMMAND_MSET                        0x2220
+#define COMMAND_SET_STREAM                  0x2230
+#define COMMAND_SET_CHUNK                   0x2240
+#define COMMAND_SET_INT_IF                  0x2300
+#define COMMAND_SET_STRING_IF               0x2310
+#define COMMAND_SET_KEY_MULTI               0x2320
+#define COMMAND_INCR                        0x2400
+#define COMMAND_MINCR                       0x2410
 
 #define COMMAND_SET_KEYVALUE                0x2500
 #define COMMAND_GET_KEYVALUE                0x2520
+#define COMMAND_DROP_MAP                    0x2600
+#define COMMAND_DELETE                      0x2610
+#define COMMAND_MDELETE                     0x2620
 
 #define COMMAND_SYNC_INT                    0x3000
 #define COMMAND_SYNC_STRING                 0x3010
 #define COMMAND_SYNC_KEYVALUE               0x3060
+#define COMMAND_SYNC_MARK                   0x3070
+#define COMMAND_SYNC_REPLICA                0x3080
+#define COMMAND_SYNC_DELETE                 0x3090
 
 
 
@@ -31,13 +53,50 @@
 #define RESPONSE_FAIL             0x0003
 #define RESPONSE_WRONGTYPE        0x0005
 #define RESPONSE_TOOLARGE         0x0006
+#define RESPONSE_TRYELSEWHERE     0x0007
 
 #define RESPONSE_OK               0x0010
+#define RESPONSE_NOT_MODIFIED     0x0011
 #define RESPONSE_KEYVALUE_HASH    0x001F
 #define RESPONSE_KEYVALUE         0x0020
 #define RESPONSE_LOADLEVELS       0x0013
 #define RESPONSE_DATA_INT         0x0110
 #define RESPONSE_DATA_STRING      0x0120
+#define RESPONSE_MULTI            0x0130
+#define RESPONSE_DATA_KEY         0x0140
+#define RESPONSE_SCAN             0x0150
+#define RESPONSE_DATA_CHUNK       0x0160
+
+
+// the framing used on a connection.  Everything starts out with PROTOCOL_V1.  A client can add the 
+// version it would like to use to COMMAND_HELLO, and the reply says which one the server agreed to 
+// (no payload means v1).  Both ends switch straight after the HELLO reply.  Node connections use v1, 
+// except for compressed bulk connections.
+#define PROTOCOL_V1               1
+#define PROTOCOL_V2               2
+
+// optional features that a client (after the version in COMMAND_HELLO) or another node (at the end of 
+// COMMAND_SERVERHELLO and its reply) can say it understands.  FEATURE_COMPRESSED_VALUES means that 
+// string values can be sent the way they are stored, compressed, with the expanded length (see 
+// data_str and sync_str in messages.def).  FEATURE_HASHMASKS means that a client wants to be sent all 
+// of our hashmasks (COMMAND_HASHMASK) when it connects, so that it can route its own requests.  
+// FEATURE_HOTKEYS means that it wants to be told which nodes have copies of the hot keys 
+// (COMMAND_HOTKEY), so that it can spread the reads for them.
+#define FEATURE_COMPRESSED_VALUES 0x0001
+#define FEATURE_HASHMASKS         0x0002
+#define FEATURE_HOTKEYS           0x0004
+
+// the type of connection being setup between two nodes (sent with COMMAND_SERVERHELLO).  The control 
+// channel carries everything except the SYNC data, which goes over the bulk channels (if any were 
+// agreed on), so that pings and migration control messages dont get stuck behind a large backlog.
+#define CHANNEL_CONTROL           0
+#define CHANNEL_BULK              1
+
+// the role of a node (sent with COMMAND_SERVERHELLO and its reply).  Logger nodes do not take any 
+// buckets, they only receive a copy of the updates from the primary buckets and write them to a 
+// transaction log.
+#define NODE_ROLE_DATA            0
+#define NODE_ROLE_LOGGER          1
 
 
 
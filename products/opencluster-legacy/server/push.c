@@ -1,6 +1,8 @@
 // push.c
 
 #include "client.h"
+#include "codec.h"
+#include "constants.h"
 #include "logging.h"
 #include "node.h"
 #include "payload.h"
@@ -8,6 +10,7 @@
 #include "push.h"
 #include "seconds.h"
 #include "server.h"
+#include "throttle.h"
 
 #include <assert.h>
 #include <string.h>
@@ -67,19 +70,29 @@ void push_hashmask(client_t *client, hash_t mask, hash_t hashmask, int level)
 
 
 // Pushes out a command to the specified client (which should be a cluster node), informing it that 
-// we are a cluster node also, that our interface is such and such.
-void push_serverhello(client_t *client, const char *conninfo_str, const char *server_auth)
+// we are a cluster node also, that our interface is such and such.  We also tell it if this is the 
+// control connection (and how many bulk connections we want), or one of the bulk connections, and 
+// if we are a logger node.  Bulk connections also ask for the compression we would like to use, and 
+// we tell it the optional features we understand.
+void push_serverhello(client_t *client, const char *conninfo_str, const char *server_auth, int channel, int bulk, int role, int compress)
 {
 	assert(client);
 	assert(client->handle > 0);
 	assert(conninfo_str);
 	assert(server_auth);
+	assert(channel == CHANNEL_CONTROL || channel == CHANNEL_BULK);
+	assert(bulk >= 0);
 	
 	PAYLOAD payload = payload_new(client, COMMAND_SERVERHELLO);
 	payload_string(payload, conninfo_str);
 	payload_string(payload, server_auth);
+	payload_int(payload, channel);
+	payload_int(payload, bulk);
+	payload_int(payload, role);
+	payload_int(payload, compress);
+	payload_int(payload, FEATURE_COMPRESSED_VALUES);
 	
-	logger(LOG_DEBUG, "SERVERHELLO sent to '%s'", node_name(client->node));
+	logger(LOG_DEBUG, "SERVERHELLO sent to '%s' (channel:%d, bulk:%d, role:%d, compress:%d)", node_name(client->node), channel, bulk, role, compress);
 	client_send_message(payload);
 }
 
@@ -167,7 +180,7 @@ void push_finalise_migration(client_t *client, hash_t mask, hash_t hashmask, con
 
 
 
-void push_sync_item(client_t *client, item_t *item)
+void push_sync_item(client_t *client, item_t *item, int sync_seq)
 {
 	assert(client);
 	assert(client->handle > 0);
@@ -175,28 +188,58 @@ void push_sync_item(client_t *client, item_t *item)
 	assert(item);
 	assert(item->value);
 
+	node_t *node = client->node;
 	int expires = 0;
 	if (item->expires > 0) {
 		expires = item->expires - seconds_get();
 	}
 	
+	// SYNC data goes over the bulk connections to the node (if there are any), so that it doesn't 
+	// hold up the control messages.
+	if (client->node) {
+		client = node_bulk_client(client->node, item->item_key);
+		assert(client);
+	}
+	
 	if (item->value->type == VALUE_LONG) {
+		msg_sync_int_t msg = {
+			.map_hash = item->map_key,
+			.key_hash = item->item_key,
+			.expires = expires,
+			.value = item->value->data.l,
+			.sync_seq = sync_seq > 0 ? sync_seq : 0,
+		};
 		PAYLOAD payload = payload_new(client, COMMAND_SYNC_INT);
-		payload_long(payload, item->map_key);
-		payload_long(payload, item->item_key);
-		payload_int(payload, expires);
-		payload_long(payload, item->value->data.l);
+		int size = msg_sync_int_size(&msg);
+		msg_sync_int_encode(payload_reserve(payload, size), size, &msg);
 		logger(LOG_DEBUG, "sending SYNC_INT: (%#llx:%#llx, %ld)", item->map_key, item->item_key, item->value->data.l);
 		client_send_message(payload);
+		throttle_consume(HEADER_SIZE + size);
 	}
 	else if (item->value->type == VALUE_STRING) {
-		PAYLOAD payload = payload_new(client, COMMAND_SYNC_INT);
-		payload_long(payload, item->map_key);
-		payload_long(payload, item->item_key);
-		payload_int(payload, expires);
-		payload_data(payload, item->value->data.s.length, item->value->data.s.data);
+		msg_sync_str_t msg = {
+			.map_hash = item->map_key,
+			.key_hash = item->item_key,
+			.expires = expires,
+			.sync_seq = sync_seq > 0 ? sync_seq : 0,
+		};
+		
+		// values that are stored compressed are sent that way, unless the other node is too old to 
+		// understand it.
+		if (item->value->data.s.raw_length > 0 && node && (node->features & FEATURE_COMPRESSED_VALUES)) {
+			msg.value = item->value->data.s.data;
+			msg.value_len = item->value->data.s.length;
+			msg.raw_length = item->value->data.s.raw_length;
+		}
+		else {
+			msg.value = value_string(item->value, &msg.value_len);
+		}
+		PAYLOAD payload = payload_new(client, COMMAND_SYNC_STRING);
+		int size = msg_sync_str_size(&msg);
+		msg_sync_str_encode(payload_reserve(payload, size), size, &msg);
 		logger(LOG_DEBUG, "sending SYNC_STRING: (%#llx:%#llx)", item->map_key, item->item_key);
 		client_send_message(payload);
+		throttle_consume(HEADER_SIZE + size);
 	}
 	else {
 		assert(0);
@@ -211,6 +254,11 @@ void push_sync_keyvalue(client_t *client, hash_t keyhash, int length, char *keyv
 	assert(length > 0);
 	assert(keyvalue);
 	
+	if (client->node) {
+		client = node_bulk_client(client->node, keyhash);
+		assert(client);
+	}
+	
 	PAYLOAD payload = payload_new(client, COMMAND_SYNC_KEYVALUE);
 	payload_long(payload, keyhash);
 	payload_int(payload, 0);
@@ -220,6 +268,141 @@ void push_sync_keyvalue(client_t *client, hash_t keyhash, int length, char *keyv
 }
 
 
+// tell the backup node what our sync counters are up to for the buckets it is backing up.  This is 
+// sent over the control connection, so that it isn't stuck behind the SYNC data it is measuring.
+void push_sync_mark(client_t *client, hash_t mask, int count, hash_t *hashmasks, int *seqs)
+{
+	int i;
+	
+	assert(client);
+	assert(client->handle > 0);
+	assert(count > 0);
+	assert(hashmasks);
+	assert(seqs);
+	
+	PAYLOAD payload = payload_new(client, COMMAND_SYNC_MARK);
+	payload_long(payload, mask);
+	payload_int(payload, count);
+	for (i=0; i<count; i++) {
+		payload_long(payload, hashmasks[i]);
+		payload_int(payload, seqs[i]);
+	}
+	client_send_message(payload);
+}
+
+
+// tell the backup node that some items in a map have been removed (they are all from the same 
+// bucket).  The delete is sent over the same bulk connection as the SYNC items for the bucket, so 
+// that it can't overtake an earlier SET for the same key.
+void push_sync_delete(client_t *client, hash_t map_hash, int count, hash_t *key_hashes, int sync_seq)
+{
+	int i;
+	
+	assert(client);
+	assert(client->handle > 0);
+	assert(count > 0);
+	assert(key_hashes);
+	
+	if (client->node) {
+		client = node_bulk_client(client->node, key_hashes[0]);
+		assert(client);
+	}
+	
+	PAYLOAD payload = payload_new(client, COMMAND_SYNC_DELETE);
+	payload_long(payload, map_hash);
+	payload_int(payload, sync_seq);
+	payload_int(payload, count);
+	for (i=0; i<count; i++) {
+		payload_long(payload, key_hashes[i]);
+	}
+	logger(LOG_DEBUG, "sending SYNC_DELETE: (%#llx, %d keys)", map_hash, count);
+	client_send_message(payload);
+	throttle_consume(HEADER_SIZE + 8 + 4 + 4 + (8 * count));
+}
+
+
+// pass on a DROP_MAP from a client to another node, so that it can drop the items in its buckets.
+void push_drop_map(client_t *client, hash_t map_hash)
+{
+	assert(client);
+	assert(client->handle > 0);
+	
+	PAYLOAD payload = payload_new(client, COMMAND_DROP_MAP);
+	payload_long(payload, map_hash);
+	client_send_message(payload);
+}
+
+
+// send a read-only copy of a hot key to another node.  It will only keep it for 'ttl' seconds, so it 
+// needs to be sent again before then if the key is still hot.
+void push_sync_replica(client_t *client, hash_t map_hash, hash_t key_hash, int ttl, value_t *value)
+{
+	assert(client);
+	assert(client->handle > 0);
+	assert(ttl > 0);
+	assert(value);
+	
+	if (client->node) {
+		client = node_bulk_client(client->node, key_hash);
+		assert(client);
+	}
+	
+	PAYLOAD payload = payload_new(client, COMMAND_SYNC_REPLICA);
+	payload_long(payload, map_hash);
+	payload_long(payload, key_hash);
+	payload_int(payload, ttl);
+	payload_int(payload, value->type);
+	if (value->type == VALUE_LONG) {
+		payload_long(payload, value->data.l);
+	}
+	else {
+		assert(value->type == VALUE_STRING);
+		int str_len;
+		const char *str = value_string(value, &str_len);
+		payload_data(payload, str_len, str);
+	}
+	logger(LOG_DEBUG, "sending SYNC_REPLICA: (%#llx:%#llx)", map_hash, key_hash);
+	client_send_message(payload);
+}
+
+
+// tell a client which nodes have copies of a hot key.
+void push_hotkey(client_t *client, hash_t map_hash, hash_t key_hash, int count, const char **conninfos)
+{
+	int i;
+	
+	assert(client);
+	assert(client->handle > 0);
+	assert(count >= 0);
+	assert(count == 0 || conninfos);
+	
+	PAYLOAD payload = payload_new(client, COMMAND_HOTKEY);
+	payload_long(payload, map_hash);
+	payload_long(payload, key_hash);
+	payload_int(payload, count);
+	for (i=0; i<count; i++) {
+		assert(conninfos[i]);
+		payload_string(payload, conninfos[i]);
+	}
+	client_send_message(payload);
+}
+
+
+// tell a client that has asked for invalidations that an item has changed, so it should drop any copy 
+// it has of it.
+void push_invalidate(client_t *client, hash_t map_hash, hash_t key_hash)
+{
+	assert(client);
+	assert(client->handle > 0);
+	assert(client->invalidations);
+	
+	PAYLOAD payload = payload_new(client, COMMAND_INVALIDATE);
+	payload_long(payload, map_hash);
+	payload_long(payload, key_hash);
+	client_send_message(payload);
+}
+
+
 
 
 
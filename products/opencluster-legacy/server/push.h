@@ -11,12 +11,18 @@ void push_ping(client_t *client);
 void push_shuttingdown(client_t *client);
 void push_hashmask(client_t *client, hash_t mask, hash_t hashmask, int level);
 void push_serverlist(client_t *client);
-void push_serverhello(client_t *client, const char *conninfo_str, const char *server_auth);
+void push_serverhello(client_t *client, const char *conninfo_str, const char *server_auth, int channel, int bulk, int role, int compress);
 void push_loadlevels(client_t *client);
 void push_accept_bucket(client_t *client, hash_t mask, hash_t hashmask);
 void push_promote(client_t *client, hash_t hash);
 void push_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int level);
-void push_sync_item(client_t *client, item_t *item);
+void push_sync_item(client_t *client, item_t *item, int sync_seq);
+void push_sync_replica(client_t *client, hash_t map_hash, hash_t key_hash, int ttl, value_t *value);
+void push_sync_delete(client_t *client, hash_t map_hash, int count, hash_t *key_hashes, int sync_seq);
+void push_drop_map(client_t *client, hash_t map_hash);
+void push_hotkey(client_t *client, hash_t map_hash, hash_t key_hash, int count, const char **conninfos);
+void push_invalidate(client_t *client, hash_t map_hash, hash_t key_hash);
+void push_sync_mark(client_t *client, hash_t mask, int count, hash_t *hashmasks, int *seqs);
 void push_sync_keyvalue(client_t *client, hash_t keyhash, int length, char *keyvalue);
 void push_sync_keyvalue_int(client_t *client, hash_t key, long long int_key);
 void push_finalise_migration(client_t *client, hash_t mask, hash_t hashmask, const char *conninfo, int level);
@@ -0,0 +1,813 @@
+// savefile.c
+
+// Writing and loading of the save file (see savefile.h for the layout).
+//
+// The file is written sequentially through a large buffer into a temporary file, which is renamed
+// over the old one once it is complete and synced, so a failure part way through doesn't destroy the
+// last good save.  The section headers are filled in when each section is finished.  Usually the
+// header is still in the buffer, otherwise it is patched in place on the file.
+//
+// While the node is running, the file can also be written regularly ('save-interval') by a snapshot
+// child, so that the parent carries on serving requests while it is written.
+//
+// When loading, the whole file is mapped into memory.  Each section belongs to a single bucket, and
+// each bucket has its own trees, so the sections are shared out to several threads and parsed at
+// the same time.
+
+#include "savefile.h"
+
+#include "bucket.h"
+#include "constants.h"
+#include "hashfn.h"
+#include "item.h"
+#include "logging.h"
+#include "seconds.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "value.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+
+typedef struct {
+	const char *data;
+	long long length;
+	hash_t hashmask;
+} load_section_t;
+
+typedef struct {
+	pthread_t thread;
+	int started;
+	long long items;
+	long long expired;
+	long long damaged;
+} load_worker_t;
+
+
+// the file to save to (and load from).  NULL if saving is not enabled.
+static char *_path = NULL;
+
+// saves done in the background.  The interval is 0 if they are not enabled.
+static struct event_base *_evbase = NULL;
+static struct event *_interval_event = NULL;
+static struct timeval _interval = {0, 0};
+
+// the file being written.
+static int _fd = -1;
+static char *_buffer = NULL;
+static int _buffer_len = 0;
+static long long _file_pos = 0;
+static int _write_failed = 0;
+
+// the section being written.
+static long long _section_pos = 0;
+static long long _section_records = 0;
+
+// the time when the save was started, used to convert the expiry times.
+static time_t _save_time = 0;
+static unsigned int _save_seconds = 0;
+
+// the sections that are being loaded.  The threads take the next one from the list until there are
+// none left.
+static load_section_t *_sections = NULL;
+static int _section_count = 0;
+static int _next_section = 0;
+static time_t _load_time = 0;
+
+// stats.
+static long long _saved_items = 0;
+static int _saved_buckets = 0;
+static int _save_msecs = 0;
+static long long _loaded_items = 0;
+static long long _loaded_expired = 0;
+static int _loaded_buckets = 0;
+static int _load_msecs = 0;
+
+
+
+void savefile_set_path(const char *path)
+{
+	assert(path);
+
+	if (_path) { free(_path); }
+	_path = strdup(path);
+	assert(_path);
+}
+
+
+// returns non-zero if the buckets should be saved when the last node shuts down.
+int savefile_enabled(void)
+{
+	return(_path != NULL);
+}
+
+
+static int elapsed_msecs(struct timeval *start)
+{
+	struct timeval end;
+
+	assert(start);
+	gettimeofday(&end, NULL);
+	return(((end.tv_sec - start->tv_sec) * 1000) + ((end.tv_usec - start->tv_usec) / 1000));
+}
+
+
+
+static void write_flush(void)
+{
+	int done = 0;
+	ssize_t written;
+
+	assert(_fd >= 0);
+	assert(_buffer);
+
+	while (done < _buffer_len && _write_failed == 0) {
+		written = write(_fd, _buffer + done, _buffer_len - done);
+		if (written < 0) {
+			if (errno != EINTR) {
+				logger(LOG_ERROR, "Unable to write to the save file: %s", strerror(errno));
+				_write_failed ++;
+			}
+		}
+		else {
+			done += written;
+		}
+	}
+
+	_file_pos += _buffer_len;
+	_buffer_len = 0;
+}
+
+
+static void write_data(const char *data, int length)
+{
+	int avail;
+	int chunk;
+
+	assert(length >= 0);
+	assert(length == 0 || data);
+
+	while (length > 0) {
+		avail = SAVEFILE_BUFFER - _buffer_len;
+		if (avail == 0) {
+			write_flush();
+			avail = SAVEFILE_BUFFER;
+		}
+
+		chunk = length < avail ? length : avail;
+		memcpy(_buffer + _buffer_len, data, chunk);
+		_buffer_len += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+
+// fill in a record header.  'expires' is the absolute (unix) time, and 'length' is the length of 
+// the data that will follow it.
+void savefile_record_set(savefile_record_t *record, int type, hash_t map_hash, hash_t key_hash, int64_t expires, int length)
+{
+	assert(record);
+	assert(length >= 0);
+
+	record->length = htobe32(sizeof(savefile_record_t) + length);
+	record->type = htobe16(type);
+	record->reserved = 0;
+	record->map_hash = htobe64(map_hash);
+	record->key_hash = htobe64(key_hash);
+	record->expires = htobe64(expires);
+}
+
+
+// 'expires' is in the same form as item->expires (seconds since the node started).
+// write the header of a record.  The 'length' bytes of data need to be written straight after it.
+static void write_header(int type, hash_t map_hash, hash_t key_hash, long expires, int length)
+{
+	savefile_record_t record;
+
+	savefile_record_set(&record, type, map_hash, key_hash, expires == 0 ? 0 : (int64_t) _save_time + (expires - (long) _save_seconds), length);
+
+	write_data((const char *) &record, sizeof(record));
+
+	_section_records ++;
+}
+
+
+static void write_record(int type, hash_t map_hash, hash_t key_hash, long expires, const char *data, int length)
+{
+	write_header(type, map_hash, key_hash, expires, length);
+	write_data(data, length);
+}
+
+
+static void save_item_fn(item_t *item, void *arg)
+{
+	value_t *value;
+	int64_t l;
+
+	assert(item);
+	assert(arg == NULL);
+
+	value = item->value;
+	assert(value);
+
+	if (value->type == VALUE_LONG) {
+		l = htobe64(value->data.l);
+		write_record(SAVEFILE_RECORD_INT, item->map_key, item->item_key, item->expires, (const char *) &l, sizeof(l));
+	}
+	else if (value->type == VALUE_STRING && value->data.s.raw_length > 0) {
+		// compressed strings are saved as they are, so they dont need to be compressed again.
+		uint32_t raw_length = htobe32(value->data.s.raw_length);
+		write_header(SAVEFILE_RECORD_ZSTRING, item->map_key, item->item_key, item->expires, sizeof(raw_length) + value->data.s.length);
+		write_data((const char *) &raw_length, sizeof(raw_length));
+		write_data(value->data.s.data, value->data.s.length);
+	}
+	else if (value->type == VALUE_STRING) {
+		write_record(SAVEFILE_RECORD_STRING, item->map_key, item->item_key, item->expires, value->data.s.data, value->data.s.length);
+	}
+}
+
+
+static void save_keyvalue_fn(hash_t key_hash, const char *keyvalue, long expires, void *arg)
+{
+	assert(keyvalue);
+	assert(arg == NULL);
+
+	write_record(SAVEFILE_RECORD_KEYVALUE, 0, key_hash, expires, keyvalue, strlen(keyvalue));
+}
+
+
+static void section_start(hash_t hashmask)
+{
+	savefile_section_t section;
+
+	// the length and record count are not known yet.  They are filled in when it is finished.
+	memset(&section, 0, sizeof(section));
+	section.hashmask = htobe64(hashmask);
+
+	_section_pos = _file_pos + _buffer_len;
+	_section_records = 0;
+	write_data((const char *) &section, sizeof(section));
+}
+
+
+static void section_finish(hash_t hashmask)
+{
+	savefile_section_t section;
+	long long end;
+
+	end = _file_pos + _buffer_len;
+	assert(end >= _section_pos + sizeof(section));
+
+	section.hashmask = htobe64(hashmask);
+	section.length = htobe64(end - _section_pos - sizeof(section));
+	section.records = htobe64(_section_records);
+
+	if (_section_pos >= _file_pos) {
+		// the header hasn't been written out yet, so we can just update it in the buffer.
+		memcpy(_buffer + (_section_pos - _file_pos), &section, sizeof(section));
+	}
+	else {
+		write_flush();
+		if (pwrite(_fd, &section, sizeof(section), _section_pos) != sizeof(section)) {
+			logger(LOG_ERROR, "Unable to write to the save file: %s", strerror(errno));
+			_write_failed ++;
+		}
+	}
+
+	_saved_items += _section_records;
+}
+
+
+// write all the buckets to the save file.  This is done when this is the last node in the cluster
+// and it is shutting down, so it is done all in one go, without returning to the event loop.
+// Returns 0 if the file was saved.
+int savefile_save(void)
+{
+	char tmpfile[4096];
+	savefile_header_t header;
+	struct timeval start;
+	bucket_t *bucket;
+	hash_t mask;
+	hash_t i;
+	int total = 0;
+
+	assert(_path);
+	assert(_fd < 0);
+	assert(_buffer == NULL);
+
+	mask = buckets_mask();
+	if (mask == 0) {
+		// we dont have any buckets, so there is nothing to save.
+		return(-1);
+	}
+
+	gettimeofday(&start, NULL);
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", _path);
+	_fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (_fd < 0) {
+		logger(LOG_ERROR, "Unable to create save file '%s': %s", tmpfile, strerror(errno));
+		return(-1);
+	}
+
+	_buffer = malloc(SAVEFILE_BUFFER);
+	assert(_buffer);
+	_buffer_len = 0;
+	_file_pos = 0;
+	_write_failed = 0;
+
+	_save_time = time(NULL);
+	_save_seconds = seconds_get();
+	_saved_items = 0;
+	_saved_buckets = 0;
+
+	// the header is written last, so that the section count is correct.  For now, just leave space
+	// for it.
+	memset(&header, 0, sizeof(header));
+	write_data((const char *) &header, sizeof(header));
+
+	for (i=0; i<=mask; i++) {
+		bucket = buckets_get(i);
+		if (bucket && bucket->data) {
+			total ++;
+		}
+	}
+
+	for (i=0; i<=mask; i++) {
+		bucket = buckets_get(i);
+		if (bucket && bucket->data) {
+			section_start(i);
+			data_foreach(bucket->data, mask, i, save_item_fn, save_keyvalue_fn, NULL);
+			section_finish(i);
+			_saved_buckets ++;
+			snapshot_progress(_saved_buckets, total, _saved_items);
+		}
+	}
+	write_flush();
+
+	memcpy(header.magic, SAVEFILE_MAGIC, sizeof(header.magic));
+	header.mask = htobe64(mask);
+	header.sections = htobe32(_saved_buckets);
+	header.reserved = 0;
+	header.saved = htobe64((int64_t) _save_time);
+	if (pwrite(_fd, &header, sizeof(header), 0) != sizeof(header)) {
+		_write_failed ++;
+	}
+
+	if (fsync(_fd) != 0) {
+		_write_failed ++;
+	}
+	close(_fd);
+	_fd = -1;
+
+	free(_buffer);
+	_buffer = NULL;
+	_buffer_len = 0;
+
+	if (_write_failed > 0) {
+		logger(LOG_ERROR, "Unable to save the buckets to '%s'.", _path);
+		unlink(tmpfile);
+		return(-1);
+	}
+
+	if (rename(tmpfile, _path) != 0) {
+		logger(LOG_ERROR, "Unable to rename save file '%s': %s", tmpfile, strerror(errno));
+		unlink(tmpfile);
+		return(-1);
+	}
+
+	_save_msecs = elapsed_msecs(&start);
+	logger(LOG_INFO, "Saved %lld items from %d buckets to '%s' in %d ms.", _saved_items, _saved_buckets, _path, _save_msecs);
+
+	return(0);
+}
+
+
+
+static int background_save(void *arg)
+{
+	assert(arg == NULL);
+	return(savefile_save());
+}
+
+
+// write the save file from a snapshot child.  Returns 0 if the child was started.
+int savefile_background(void)
+{
+	assert(_path);
+
+	if (buckets_mask() == 0) {
+		return(-1);
+	}
+
+	return(snapshot_start("save", background_save, NULL));
+}
+
+
+static void interval_handler(evutil_socket_t fd, short what, void *arg)
+{
+	assert(fd == -1);
+	assert(arg == NULL);
+	assert(_interval_event);
+
+	// if the last one is still going, this one is skipped.
+	if (snapshot_running() == 0) {
+		savefile_background();
+	}
+
+	evtimer_add(_interval_event, &_interval);
+}
+
+
+void savefile_init(struct event_base *evbase)
+{
+	assert(_evbase == NULL);
+	assert(evbase);
+	_evbase = evbase;
+}
+
+
+// save the buckets every 'seconds' in the background.  0 turns it off.
+void savefile_set_interval(int seconds)
+{
+	assert(seconds >= 0);
+	assert(_evbase);
+
+	_interval.tv_sec = seconds;
+	_interval.tv_usec = 0;
+
+	if (_interval_event) {
+		event_free(_interval_event);
+		_interval_event = NULL;
+	}
+
+	if (seconds > 0 && _path) {
+		_interval_event = evtimer_new(_evbase, interval_handler, NULL);
+		assert(_interval_event);
+		evtimer_add(_interval_event, &_interval);
+	}
+}
+
+
+
+// return the mask the save file was written with, or 0 if there is no (valid) save file.  When
+// starting a new cluster, the buckets need to be created with the same mask, so that each section
+// in the file belongs to exactly one bucket.
+hash_t savefile_mask(void)
+{
+	savefile_header_t header;
+	hash_t mask = 0;
+	int fd;
+
+	if (_path) {
+		fd = open(_path, O_RDONLY);
+		if (fd >= 0) {
+			if (read(fd, &header, sizeof(header)) == sizeof(header)) {
+				if (memcmp(header.magic, SAVEFILE_MAGIC, sizeof(header.magic)) == 0) {
+					mask = be64toh(header.mask);
+				}
+			}
+			close(fd);
+		}
+	}
+
+	return(mask);
+}
+
+
+// parse a block of records into the bucket data.  Items that expired before 'now' are skipped.  
+// This is used by the loader threads, so it must not use anything that is shared (which includes 
+// the logger).  Returns 0 if all the records were valid.
+int savefile_parse(bucket_data_t *data, const char *records, long long length, time_t now, long long *items, long long *expired)
+{
+	const savefile_record_t *record;
+	const char *payload;
+	value_t *value;
+	char *keyvalue;
+	char *raw;
+	long long pos = 0;
+	int64_t absolute;
+	int64_t l;
+	uint32_t raw_length;
+	int record_len;
+	int data_len;
+	int expires;
+	int damaged = 0;
+
+	assert(data);
+	assert(records || length == 0);
+	assert(items && expired);
+
+	while (pos + sizeof(savefile_record_t) <= length) {
+		record = (const savefile_record_t *) (records + pos);
+		record_len = be32toh(record->length);
+		if (record_len < sizeof(savefile_record_t) || pos + record_len > length) {
+			damaged ++;
+			break;
+		}
+
+		data_len = record_len - sizeof(savefile_record_t);
+		payload = records + pos + sizeof(savefile_record_t);
+		pos += record_len;
+
+		expires = 0;
+		absolute = be64toh(record->expires);
+		if (absolute != 0) {
+			if (absolute <= now) {
+				(*expired) ++;
+				continue;
+			}
+			expires = absolute - now;
+		}
+
+		switch (be16toh(record->type)) {
+			case SAVEFILE_RECORD_INT:
+				if (data_len != sizeof(l)) {
+					damaged ++;
+					break;
+				}
+				memcpy(&l, payload, sizeof(l));
+
+				value = calloc(1, sizeof(value_t));
+				assert(value);
+				value->type = VALUE_LONG;
+				value->data.l = be64toh(l);
+				value->valuehash = generate_hash_long(value->data.l);
+
+				data_restore_item(data, be64toh(record->map_hash), be64toh(record->key_hash), expires, value);
+				(*items) ++;
+				break;
+
+			case SAVEFILE_RECORD_STRING:
+				value = calloc(1, sizeof(value_t));
+				assert(value);
+				value->type = VALUE_STRING;
+				value->valuehash = generate_hash_str(payload, data_len);
+				value->data.s.data = malloc(data_len + 1);
+				assert(value->data.s.data);
+				memcpy(value->data.s.data, payload, data_len);
+				value->data.s.data[data_len] = 0;
+				value->data.s.length = data_len;
+
+				data_restore_item(data, be64toh(record->map_hash), be64toh(record->key_hash), expires, value);
+				(*items) ++;
+				break;
+
+			case SAVEFILE_RECORD_ZSTRING:
+				// it is expanded here to check it, and to get the valuehash.
+				if (data_len <= sizeof(raw_length)) {
+					damaged ++;
+					break;
+				}
+				memcpy(&raw_length, payload, sizeof(raw_length));
+				raw_length = be32toh(raw_length);
+				raw = value_expand(payload + sizeof(raw_length), data_len - sizeof(raw_length), raw_length);
+				if (raw == NULL) {
+					damaged ++;
+					break;
+				}
+
+				value = calloc(1, sizeof(value_t));
+				assert(value);
+				value->valuehash = generate_hash_str(raw, raw_length);
+				free(raw);
+				value_set_compressed(value, payload + sizeof(raw_length), data_len - sizeof(raw_length), raw_length);
+
+				data_restore_item(data, be64toh(record->map_hash), be64toh(record->key_hash), expires, value);
+				(*items) ++;
+				break;
+
+			case SAVEFILE_RECORD_KEYVALUE:
+				keyvalue = malloc(data_len + 1);
+				assert(keyvalue);
+				memcpy(keyvalue, payload, data_len);
+				keyvalue[data_len] = 0;
+
+				data_restore_keyvalue(data, be64toh(record->key_hash), keyvalue, expires);
+				break;
+
+			default:
+				// record types we dont know about are skipped.
+				break;
+		}
+	}
+
+	return(damaged > 0 ? -1 : 0);
+}
+
+
+static void load_section(load_section_t *section, load_worker_t *worker)
+{
+	bucket_t *bucket;
+
+	assert(section);
+	assert(worker);
+
+	bucket = buckets_get(section->hashmask);
+	if (bucket == NULL || bucket->data == NULL) {
+		worker->damaged ++;
+		return;
+	}
+
+	if (savefile_parse(bucket->data, section->data, section->length, _load_time, &worker->items, &worker->expired) != 0) {
+		worker->damaged ++;
+	}
+}
+
+
+static void * load_thread(void *arg)
+{
+	load_worker_t *worker = arg;
+	int index;
+
+	assert(worker);
+
+	for (;;) {
+		index = __sync_fetch_and_add(&_next_section, 1);
+		if (index >= _section_count) {
+			break;
+		}
+		load_section(&_sections[index], worker);
+	}
+
+	return(NULL);
+}
+
+
+// load the buckets from the save file.  The buckets must have already been created (with the mask
+// from savefile_mask).  If the file is loaded, it is renamed so that it doesn't get loaded again if
+// the node is restarted before it is saved again.  Returns 0 if there was nothing to load, or it was
+// loaded.
+int savefile_load(void)
+{
+	const savefile_header_t *header;
+	const savefile_section_t *section;
+	load_worker_t *workers;
+	char oldfile[4096];
+	struct timeval start;
+	struct stat st;
+	long long pos;
+	long long length;
+	char *data;
+	int threads;
+	int sections;
+	int damaged = 0;
+	int fd;
+	int i;
+
+	assert(_path);
+	assert(_sections == NULL);
+
+	fd = open(_path, O_RDONLY);
+	if (fd < 0) {
+		// there is no save file, which is fine.
+		return(0);
+	}
+
+	gettimeofday(&start, NULL);
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(savefile_header_t)) {
+		logger(LOG_ERROR, "Save file '%s' is not valid.", _path);
+		close(fd);
+		return(-1);
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		logger(LOG_ERROR, "Unable to map save file '%s': %s", _path, strerror(errno));
+		return(-1);
+	}
+	madvise(data, st.st_size, MADV_WILLNEED);
+
+	header = (const savefile_header_t *) data;
+	if (memcmp(header->magic, SAVEFILE_MAGIC, sizeof(header->magic)) != 0 || be64toh(header->mask) != buckets_mask()) {
+		logger(LOG_ERROR, "Save file '%s' is not valid for these buckets.", _path);
+		munmap(data, st.st_size);
+		return(-1);
+	}
+
+	// go through the section headers first, so that we know where each one is.
+	sections = be32toh(header->sections);
+	_sections = calloc(sections + 1, sizeof(load_section_t));
+	assert(_sections);
+	_section_count = 0;
+	pos = sizeof(savefile_header_t);
+	for (i=0; i<sections; i++) {
+		if (pos + sizeof(savefile_section_t) > st.st_size) {
+			damaged ++;
+			break;
+		}
+		section = (const savefile_section_t *) (data + pos);
+		length = be64toh(section->length);
+		pos += sizeof(savefile_section_t);
+		if (pos + length > st.st_size) {
+			damaged ++;
+			break;
+		}
+
+		_sections[_section_count].data = data + pos;
+		_sections[_section_count].length = length;
+		_sections[_section_count].hashmask = be64toh(section->hashmask);
+		_section_count ++;
+
+		pos += length;
+	}
+
+	_load_time = time(NULL);
+	_next_section = 0;
+
+	// this thread does its share of the work too.
+	threads = SAVEFILE_THREADS;
+	if (threads > _section_count) { threads = _section_count; }
+	if (threads < 1) { threads = 1; }
+	workers = calloc(threads, sizeof(load_worker_t));
+	assert(workers);
+	for (i=1; i<threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, load_thread, &workers[i]) == 0) {
+			workers[i].started = 1;
+		}
+	}
+	load_thread(&workers[0]);
+
+	_loaded_items = 0;
+	_loaded_expired = 0;
+	for (i=0; i<threads; i++) {
+		if (workers[i].started) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		_loaded_items += workers[i].items;
+		_loaded_expired += workers[i].expired;
+		damaged += workers[i].damaged;
+	}
+	_loaded_buckets = _section_count;
+	free(workers);
+
+	free(_sections);
+	_sections = NULL;
+	_section_count = 0;
+	munmap(data, st.st_size);
+
+	if (damaged > 0) {
+		logger(LOG_ERROR, "Save file '%s' is damaged.  Some items might not have been loaded.", _path);
+	}
+
+	snprintf(oldfile, sizeof(oldfile), "%s.loaded", _path);
+	if (rename(_path, oldfile) != 0) {
+		logger(LOG_ERROR, "Unable to rename save file '%s': %s", _path, strerror(errno));
+	}
+
+	_load_msecs = elapsed_msecs(&start);
+	logger(LOG_INFO, "Loaded %lld items (%lld expired) into %d buckets from '%s' in %d ms using %d threads.",
+		_loaded_items, _loaded_expired, _loaded_buckets, _path, _load_msecs, threads);
+
+	return(0);
+}
+
+
+void savefile_shutdown(void)
+{
+	if (_interval_event) {
+		event_free(_interval_event);
+		_interval_event = NULL;
+	}
+
+	if (_path) {
+		free(_path);
+		_path = NULL;
+	}
+}
+
+
+void savefile_dump(void)
+{
+	if (_path == NULL) {
+		return;
+	}
+
+	stat_dumpstr("SAVE FILE");
+	stat_dumpstr("  File: %s", _path);
+	if (_interval.tv_sec > 0) {
+		stat_dumpstr("  Background save every: %d seconds", (int) _interval.tv_sec);
+	}
+	if (_loaded_buckets > 0) {
+		stat_dumpstr("  Loaded: %lld items (%lld expired) into %d buckets in %d ms", _loaded_items, _loaded_expired, _loaded_buckets, _load_msecs);
+	}
+	if (_saved_buckets > 0) {
+		stat_dumpstr("  Saved: %lld items from %d buckets in %d ms", _saved_items, _saved_buckets, _save_msecs);
+	}
+	stat_dumpstr(NULL);
+}
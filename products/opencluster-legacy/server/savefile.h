@@ -0,0 +1,74 @@
+// savefile.h
+
+#ifndef __SAVEFILE_H
+#define __SAVEFILE_H
+
+#include "bucket_data.h"
+#include "event-compat.h"
+#include "hash.h"
+
+#include <stdint.h>
+#include <time.h>
+
+
+// When the last node in a cluster shuts down, there is nowhere to migrate its buckets to, so they
+// are written to the save file instead, and loaded again when the node starts up a new cluster.
+//
+// The file starts with a header, followed by one section for each bucket (in hashmask order).  Each
+// section has a header, followed by the items for that bucket, which use the same record layout as
+// the transaction log.  All the fields are in network byte order.  Expiry times are stored as
+// absolute (unix) time, so that the time the node was down is taken into account.
+#define SAVEFILE_MAGIC "OCSAVE01"
+
+#define SAVEFILE_RECORD_INT       1
+#define SAVEFILE_RECORD_STRING    2
+#define SAVEFILE_RECORD_KEYVALUE  3
+
+// a string that is stored compressed.  The data is the expanded length (32 bits), followed by the 
+// compressed string.  Older versions skip records they dont know, so they wont load these.
+#define SAVEFILE_RECORD_ZSTRING   4
+
+#pragma pack(push,1)
+typedef struct {
+	char magic[8];
+	uint64_t mask;
+	uint32_t sections;
+	uint32_t reserved;
+	int64_t saved;			// when the file was written.
+} savefile_header_t;
+
+typedef struct {
+	uint64_t hashmask;
+	uint64_t length;		// length of the records that follow.
+	uint64_t records;
+} savefile_section_t;
+
+typedef struct {
+	uint32_t length;		// length of the whole record, including this header.
+	uint16_t type;
+	uint16_t reserved;
+	uint64_t map_hash;		// 0 for keyvalues.
+	uint64_t key_hash;
+	int64_t expires;		// absolute (unix) time, or 0 if the item doesn't expire.
+} savefile_record_t;
+#pragma pack(pop)
+
+
+void savefile_init(struct event_base *evbase);
+void savefile_set_path(const char *path);
+void savefile_set_interval(int seconds);
+int savefile_enabled(void);
+
+hash_t savefile_mask(void);
+int savefile_save(void);
+int savefile_background(void);
+int savefile_load(void);
+
+void savefile_record_set(savefile_record_t *record, int type, hash_t map_hash, hash_t key_hash, int64_t expires, int length);
+int savefile_parse(bucket_data_t *data, const char *records, long long length, time_t now, long long *items, long long *expired);
+
+void savefile_shutdown(void);
+void savefile_dump(void);
+
+
+#endif
@@ -119,6 +119,57 @@ void server_listen(struct event_base *evbase, conninfo_t *conninfo)
 
 
 
+// take over a socket that is already listening (passed to us by the node we are replacing when it 
+// was upgraded).
+void server_adopt(struct event_base *evbase, conninfo_t *conninfo, evutil_socket_t handle)
+{
+	assert(evbase);
+	assert(_evbase == NULL);
+	_evbase = evbase;
+	
+	assert(conninfo);
+	assert(handle >= 0);
+	assert(_listener == NULL);
+	assert(_conninfo == NULL);
+	_conninfo = conninfo;
+	
+	logger(LOG_INFO, "listen: %s (adopted)", conninfo_remoteaddr(_conninfo));
+	
+	_listener = evconnlistener_new(
+							_evbase,
+							accept_conn_cb,
+							NULL,
+							LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE,
+							-1,
+							handle
+						);
+	assert(_listener);
+}
+
+
+// the listening socket, or -1 if we are not listening.
+evutil_socket_t server_listener_fd(void)
+{
+	if (_listener) {
+		return(evconnlistener_get_fd(_listener));
+	}
+	else {
+		return(-1);
+	}
+}
+
+
+// stop (or start again) accepting new connections.  The connections will wait in the backlog.
+void server_pause(int paused)
+{
+	if (_listener) {
+		if (paused) { evconnlistener_disable(_listener); }
+		else { evconnlistener_enable(_listener); }
+	}
+}
+
+
+
 void server_shutdown(void)
 {
 	assert(_conninfo);
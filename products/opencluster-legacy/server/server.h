@@ -19,6 +19,9 @@ typedef struct {
 void server_evbase(struct event_base *evbase);
 void server_listen(conninfo_t *conninfo);
 void server_shutdown(void);
+void server_adopt(struct event_base *evbase, conninfo_t *conninfo, evutil_socket_t handle);
+evutil_socket_t server_listener_fd(void);
+void server_pause(int paused);
 
 
 conninfo_t * server_conninfo(void);
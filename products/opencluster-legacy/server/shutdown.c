@@ -3,12 +3,18 @@
 #include "shutdown.h"
 
 #include "bucket.h"
+#include "hotkeys.h"
 #include "logging.h"
 #include "node.h"
+#include "savefile.h"
 #include "seconds.h"
 #include "server.h"
+#include "snapshot.h"
 #include "stats.h"
+#include "throttle.h"
 #include "timeout.h"
+#include "translog.h"
+#include "upgrade.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -27,11 +33,17 @@ void shutdown_start(void)
 	else {
 		_shutdown_started ++;
 	
+		hotkeys_shutdown();
+		snapshot_shutdown();
 		buckets_shutdown();
+		savefile_shutdown();
 		nodes_shutdown();
 		clients_shutdown();
 		server_shutdown();
 		seconds_shutdown();
+		throttle_shutdown();
+		translog_shutdown();
+		upgrade_shutdown();
 		stats_shutdown();
 
 		logger(LOG_INFO, "SHUTDOWN Initiated.\n");
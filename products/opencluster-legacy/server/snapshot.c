@@ -0,0 +1,319 @@
+// snapshot.c
+
+// Running whole-bucket operations in a forked child (see snapshot.h).
+//
+// The child writes fixed size progress reports to a pipe.  They are smaller than PIPE_BUF, so each
+// one arrives whole.  When the child exits, the pipe is closed, and the parent collects its exit
+// status.
+//
+// The memory that has been copied since the fork is the child's Private_Dirty total (pages that
+// are no longer shared with the parent), which the child reads from /proc when it reports.
+
+#include "snapshot.h"
+
+#include "constants.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+typedef struct {
+	int32_t done;
+	int32_t total;
+	int64_t items;
+	int64_t cow_kb;
+} snapshot_report_t;
+
+
+static struct event_base *_evbase = NULL;
+
+// the running snapshot.  In the child, _pipe is the write end, in the parent it is the read end.
+static pid_t _child = 0;
+static int _pipe = -1;
+static int _in_child = 0;
+static struct event *_report_event = NULL;
+static char *_name = NULL;
+static struct timeval _started;
+static struct timeval _last_report;
+static snapshot_report_t _current;
+static long long _cow_peak = 0;
+
+// stats for the snapshots that have finished.
+static int _completed = 0;
+static int _failed = 0;
+static char *_last_name = NULL;
+static int _last_ok = 0;
+static int _last_msecs = 0;
+static long long _last_items = 0;
+static long long _last_cow = 0;
+
+
+
+void snapshot_init(struct event_base *evbase)
+{
+	assert(_evbase == NULL);
+	assert(evbase);
+	_evbase = evbase;
+}
+
+
+static int elapsed_msecs(struct timeval *start)
+{
+	struct timeval end;
+
+	assert(start);
+	gettimeofday(&end, NULL);
+	return(((end.tv_sec - start->tv_sec) * 1000) + ((end.tv_usec - start->tv_usec) / 1000));
+}
+
+
+// the amount of memory (in KB) that this process no longer shares with the one it was forked from.
+static long long private_dirty_kb(void)
+{
+	FILE *fp;
+	char line[256];
+	long long kb;
+	long long total = 0;
+
+	fp = fopen("/proc/self/smaps_rollup", "r");
+	if (fp == NULL) {
+		return(0);
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "Private_Dirty: %lld kB", &kb) == 1) {
+			total += kb;
+		}
+	}
+	fclose(fp);
+
+	return(total);
+}
+
+
+static void send_report(void)
+{
+	ssize_t written;
+
+	assert(_in_child);
+	assert(_pipe >= 0);
+
+	_current.cow_kb = private_dirty_kb();
+	do {
+		written = write(_pipe, &_current, sizeof(_current));
+	} while (written < 0 && errno == EINTR);
+
+	gettimeofday(&_last_report, NULL);
+}
+
+
+// called by the snapshot function (in the child) to say how far it has got.  Does nothing if we
+// are not a snapshot child.
+void snapshot_progress(int done, int total, long long items)
+{
+	if (_in_child == 0) {
+		return;
+	}
+
+	_current.done = done;
+	_current.total = total;
+	_current.items = items;
+
+	if (done >= total || elapsed_msecs(&_last_report) >= SNAPSHOT_REPORT) {
+		send_report();
+	}
+}
+
+
+// the child has exited, so collect its status.
+static void snapshot_finish(void)
+{
+	int status = 0;
+
+	assert(_child > 0);
+
+	if (_report_event) {
+		event_free(_report_event);
+		_report_event = NULL;
+	}
+	if (_pipe >= 0) {
+		close(_pipe);
+		_pipe = -1;
+	}
+
+	while (waitpid(_child, &status, 0) < 0 && errno == EINTR);
+	_child = 0;
+
+	_last_ok = (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	_last_msecs = elapsed_msecs(&_started);
+	_last_items = _current.items;
+	_last_cow = _cow_peak;
+	if (_last_name) { free(_last_name); }
+	_last_name = _name;
+	_name = NULL;
+
+	if (_last_ok) {
+		_completed ++;
+		logger(LOG_INFO, "Snapshot '%s' finished: %lld items in %d ms (%lld KB copied-on-write).", _last_name, _last_items, _last_msecs, _last_cow);
+	}
+	else {
+		_failed ++;
+		logger(LOG_ERROR, "Snapshot '%s' failed after %d ms.", _last_name, _last_msecs);
+	}
+}
+
+
+static void report_handler(evutil_socket_t fd, short what, void *arg)
+{
+	snapshot_report_t reports[16];
+	ssize_t got;
+	int count;
+
+	assert(fd == _pipe);
+	assert(arg == NULL);
+
+	for (;;) {
+		got = read(_pipe, reports, sizeof(reports));
+		if (got > 0) {
+			// each report is written in one go, so they are never split.
+			count = got / sizeof(snapshot_report_t);
+			assert(count > 0);
+			_current = reports[count - 1];
+			if (_current.cow_kb > _cow_peak) {
+				_cow_peak = _current.cow_kb;
+			}
+		}
+		else if (got == 0) {
+			snapshot_finish();
+			return;
+		}
+		else if (errno != EINTR) {
+			assert(errno == EAGAIN || errno == EWOULDBLOCK);
+			return;
+		}
+	}
+}
+
+
+// fork a child to run the function.  Returns 0 if the child was started.  Only one snapshot can
+// run at a time, otherwise several children could end up with a copy of everything.
+int snapshot_start(const char *name, snapshot_fn fn, void *arg)
+{
+	int fds[2];
+	pid_t pid;
+	int result;
+
+	assert(name);
+	assert(fn);
+	assert(_evbase);
+	assert(_in_child == 0);
+
+	if (_child > 0) {
+		logger(LOG_INFO, "Snapshot '%s' not started, '%s' is still running.", name, _name);
+		return(-1);
+	}
+
+	if (pipe(fds) != 0) {
+		logger(LOG_ERROR, "Unable to create snapshot pipe: %s", strerror(errno));
+		return(-1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		logger(LOG_ERROR, "Unable to fork snapshot '%s': %s", name, strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return(-1);
+	}
+
+	memset(&_current, 0, sizeof(_current));
+
+	if (pid == 0) {
+		// the child.  It must not touch any of the sockets or events, it just does its job and
+		// exits without any cleanup.
+		close(fds[0]);
+		_pipe = fds[1];
+		_in_child = 1;
+		gettimeofday(&_last_report, NULL);
+
+		result = fn(arg);
+		send_report();
+		_exit(result == 0 ? 0 : 1);
+	}
+
+	close(fds[1]);
+	_pipe = fds[0];
+	_child = pid;
+	_cow_peak = 0;
+	gettimeofday(&_started, NULL);
+
+	assert(_name == NULL);
+	_name = strdup(name);
+	assert(_name);
+
+	evutil_make_socket_nonblocking(_pipe);
+	assert(_report_event == NULL);
+	_report_event = event_new(_evbase, _pipe, EV_READ | EV_PERSIST, report_handler, NULL);
+	assert(_report_event);
+	event_add(_report_event, NULL);
+
+	logger(LOG_INFO, "Snapshot '%s' started (pid %d).", _name, (int) _child);
+
+	return(0);
+}
+
+
+int snapshot_running(void)
+{
+	return(_child > 0);
+}
+
+
+// stop any snapshot that is still running.  The files they write are only put in place when they
+// are complete, so nothing is lost except the work.
+void snapshot_shutdown(void)
+{
+	if (_child > 0) {
+		logger(LOG_INFO, "Stopping snapshot '%s'.", _name);
+		kill(_child, SIGKILL);
+		snapshot_finish();
+	}
+
+	if (_last_name) {
+		free(_last_name);
+		_last_name = NULL;
+	}
+}
+
+
+void snapshot_dump(void)
+{
+	if (_child == 0 && _completed == 0 && _failed == 0) {
+		return;
+	}
+
+	stat_dumpstr("SNAPSHOTS");
+	if (_child > 0) {
+		stat_dumpstr("  Running: %s (pid %d) for %d ms", _name, (int) _child, elapsed_msecs(&_started));
+		stat_dumpstr("    Progress: %d/%d buckets, %lld items", _current.done, _current.total, (long long) _current.items);
+		stat_dumpstr("    Copied-on-write: %lld KB (peak %lld KB)", (long long) _current.cow_kb, _cow_peak);
+	}
+	stat_dumpstr("  Completed: %d", _completed);
+	stat_dumpstr("  Failed: %d", _failed);
+	if (_last_name) {
+		stat_dumpstr("  Last: %s, %s, %lld items in %d ms, peak copied-on-write %lld KB", _last_name, _last_ok ? "ok" : "failed", _last_items, _last_msecs, _last_cow);
+	}
+	stat_dumpstr(NULL);
+}
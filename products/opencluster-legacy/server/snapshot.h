@@ -0,0 +1,28 @@
+// snapshot.h
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "event-compat.h"
+
+
+// Operations that need to go through all the buckets (like writing the save file) can be run in a
+// forked child process.  The child sees the data exactly as it was when it was forked (the kernel
+// copies pages as the parent changes them), so it gets a consistent view without the parent having
+// to stop serving requests.  The child reports its progress back to the parent through a pipe.
+//
+// The function runs in the child, and returns 0 if it was successful.  It can call
+// snapshot_progress() as it goes.
+typedef int (*snapshot_fn)(void *arg);
+
+void snapshot_init(struct event_base *evbase);
+void snapshot_shutdown(void);
+
+int snapshot_start(const char *name, snapshot_fn fn, void *arg);
+int snapshot_running(void);
+void snapshot_progress(int done, int total, long long items);
+
+void snapshot_dump(void);
+
+
+#endif
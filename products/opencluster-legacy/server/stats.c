@@ -3,9 +3,15 @@
 #include "stats.h"
 
 #include "bucket.h"
+#include "hotkeys.h"
 #include "logging.h"
 #include "node.h"
+#include "savefile.h"
+#include "snapshot.h"
+#include "throttle.h"
 #include "timeout.h"
+#include "translog.h"
+#include "value.h"
 
 #include <assert.h>
 #include <string.h>
@@ -136,6 +142,24 @@ static void sighup_handler(evutil_socket_t fd, short what, void *arg)
 	// dump the list of buckets.
 	buckets_dump();
 	
+	// dump the migration throttle.
+	throttle_dump();
+	
+	// dump the compressed values.
+	values_dump();
+	
+	// dump the hot keys.
+	hotkeys_dump();
+	
+	// dump the transaction log (if this is a logger node).
+	translog_dump();
+	
+	// dump the save file details.
+	savefile_dump();
+	
+	// dump the background snapshots.
+	snapshot_dump();
+	
 	stat_dumpstr("--------------------------------------------------------------");
 	
 	assert(_dump);
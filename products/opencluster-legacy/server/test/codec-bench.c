@@ -0,0 +1,138 @@
+// codec-bench.c
+//
+// Measures the generated message codecs (codec.h) against decoding the same payloads one field at a
+// time with the data.c functions.
+//
+//   make codec-bench && ./codec-bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../codec.h"
+#include "../data.h"
+#include "../hash.h"
+
+
+#define DEFAULT_ITERATIONS 10000000
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + (ts.tv_nsec / 1e9));
+}
+
+
+static void report(const char *name, long iterations, double start, long long check)
+{
+	double elapsed = now() - start;
+	printf("%-28s %8.2f ns/op   (check %lld)\n", name, (elapsed * 1e9) / iterations, check);
+}
+
+
+int main(int argc, char **argv)
+{
+	long iterations = DEFAULT_ITERATIONS;
+	long i;
+	double start;
+	long long check;
+	char buffer[256];
+	char value[64];
+	int length;
+
+	if (argc > 1) {
+		iterations = atol(argv[1]);
+	}
+
+	memset(value, 'x', sizeof(value));
+
+	msg_set_int_t set_int = { .map_hash = 0x1234, .key_hash = 0x5678, .expires = 60, .value = -42 };
+	msg_sync_str_t sync_str = { .map_hash = 0x1234, .key_hash = 0x5678, .expires = 60, .value = value, .value_len = sizeof(value), .sync_seq = 7 };
+
+	// encoding.
+	start = now();
+	check = 0;
+	for (i = 0; i < iterations; i++) {
+		set_int.key_hash = i;
+		check += msg_set_int_encode(buffer, sizeof(buffer), &set_int);
+	}
+	report("encode set_int", iterations, start, check);
+
+	start = now();
+	check = 0;
+	for (i = 0; i < iterations; i++) {
+		sync_str.key_hash = i;
+		check += msg_sync_str_encode(buffer, sizeof(buffer), &sync_str);
+	}
+	report("encode sync_str", iterations, start, check);
+
+	// decoding a set_int, generated and field by field.
+	length = msg_set_int_encode(buffer, sizeof(buffer), &set_int);
+
+	start = now();
+	check = 0;
+	for (i = 0; i < iterations; i++) {
+		msg_set_int_t msg;
+		buffer[15] = (char) i;
+		if (msg_set_int_decode(buffer, length, &msg) == length) {
+			check += msg.key_hash + msg.value;
+		}
+	}
+	report("decode set_int (codec)", iterations, start, check);
+
+	start = now();
+	check = 0;
+	for (i = 0; i < iterations; i++) {
+		char *next = buffer;
+		int avail = length;
+		buffer[15] = (char) i;
+		data_long(&next, &avail);
+		hash_t key_hash = data_long(&next, &avail);
+		data_int(&next, &avail);
+		long long v = data_long(&next, &avail);
+		if (avail == 0) {
+			check += key_hash + v;
+		}
+	}
+	report("decode set_int (data.c)", iterations, start, check);
+
+	// decoding a sync_str, which has a variable length field and an optional one.
+	length = msg_sync_str_encode(buffer, sizeof(buffer), &sync_str);
+
+	start = now();
+	check = 0;
+	for (i = 0; i < iterations; i++) {
+		msg_sync_str_t msg;
+		buffer[15] = (char) i;
+		if (msg_sync_str_decode(buffer, length, &msg) == length) {
+			check += msg.key_hash + msg.value_len + msg.sync_seq;
+		}
+	}
+	report("decode sync_str (codec)", iterations, start, check);
+
+	start = now();
+	check = 0;
+	for (i = 0; i < iterations; i++) {
+		char *next = buffer;
+		int avail = length;
+		int str_len;
+		int sync_seq = 0;
+		buffer[15] = (char) i;
+		data_long(&next, &avail);
+		hash_t key_hash = data_long(&next, &avail);
+		data_int(&next, &avail);
+		data_string(&next, &str_len, &avail);
+		if (avail > 0) {
+			sync_seq = data_int(&next, &avail);
+		}
+		if (avail == 0) {
+			check += key_hash + str_len + sync_seq;
+		}
+	}
+	report("decode sync_str (data.c)", iterations, start, check);
+
+	return(0);
+}
@@ -9,6 +9,13 @@ int main(void)
 
 	printf("test-setting: %s\n", config_get("test-setting"));
 
+	// a config that cannot be loaded should leave the current one in place.
+	if (config_load("missing.conf") == 0) {
+		printf("loaded a config that does not exist.\n");
+		return(1);
+	}
+	printf("test-setting after failed load: %s\n", config_get("test-setting"));
+
 	config_free();
 
 	return(0);
@@ -0,0 +1,125 @@
+// incr-stale-test.c
+//
+// An INCR on a value that isn't an integer must not leave the backup waiting for a change that was
+// never sent.  Needs a cluster of two nodes, so that each is the backup for the other's buckets.
+//
+//   make incr-stale-test && ./incr-stale-test <primary-host> <port> <backup-host> <port>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../protocol.h"
+#include "testconn.h"
+
+
+#define TEST_MAP        0x7465737400000042llu
+#define MAX_STALE       2
+
+// the backup hears where the primary is up to once a second (see _timeout_sync_mark).
+#define SETTLE_SECONDS  3
+#define WAIT_SECONDS    (MAX_STALE + 4)
+
+
+static int set_str(testconn_t *conn, hash_t key_hash, const char *value)
+{
+	testmsg_t reply;
+	char payload[64];
+	int length;
+	int code;
+
+	length = testconn_long(payload, TEST_MAP);
+	length += testconn_long(payload + length, key_hash);
+	length += testconn_int(payload + length, 0);
+	length += testconn_data(payload + length, value, strlen(value));
+
+	code = testconn_request(conn, COMMAND_SET_STRING, payload, length, &reply);
+	free(reply.payload);
+	return(code);
+}
+
+
+// a GET that the backup can answer if it is no more than MAX_STALE seconds behind.
+static int get_stale(testconn_t *conn, hash_t key_hash)
+{
+	testmsg_t reply;
+	char payload[32];
+	int length;
+	int code;
+
+	length = testconn_long(payload, TEST_MAP);
+	length += testconn_long(payload + length, key_hash);
+	length += testconn_int(payload + length, 0);
+	length += testconn_int(payload + length, MAX_STALE);
+
+	code = testconn_request(conn, COMMAND_GET_STRING, payload, length, &reply);
+	free(reply.payload);
+	return(code);
+}
+
+
+int main(int argc, char **argv)
+{
+	testconn_t *primary;
+	testconn_t *backup;
+	testmsg_t reply;
+	char payload[32];
+	hash_t key_hash;
+	int length;
+	int code;
+
+	if (argc != 5) {
+		fprintf(stderr, "usage: %s <primary-host> <port> <backup-host> <port>\n", argv[0]);
+		return(2);
+	}
+
+	primary = testconn_open(argv[1], atoi(argv[2]), 0);
+	backup = testconn_open(argv[3], atoi(argv[4]), 0);
+	if (primary == NULL || backup == NULL) {
+		fprintf(stderr, "unable to connect.\n");
+		return(2);
+	}
+
+	// find a key that the first node is the primary for.
+	code = RESPONSE_TRYELSEWHERE;
+	for (key_hash = 1; key_hash < 1024 && code == RESPONSE_TRYELSEWHERE; key_hash++) {
+		code = set_str(primary, key_hash, "not a number");
+	}
+	key_hash --;
+	if (code != RESPONSE_OK) {
+		fprintf(stderr, "unable to store a value on the primary (%#x).\n", code);
+		return(2);
+	}
+
+	sleep(SETTLE_SECONDS);
+	code = get_stale(backup, key_hash);
+	if (code != RESPONSE_DATA_STRING) {
+		fprintf(stderr, "the backup is not answering stale reads (%#x).\n", code);
+		return(2);
+	}
+
+	length = testconn_long(payload, TEST_MAP);
+	length += testconn_long(payload + length, key_hash);
+	length += testconn_long(payload + length, 1);
+	length += testconn_int(payload + length, 0);
+	code = testconn_request(primary, COMMAND_INCR, payload, length, &reply);
+	free(reply.payload);
+	if (code != RESPONSE_WRONGTYPE) {
+		printf("FAIL: INCR of a string returned %#x.\n", code);
+		return(1);
+	}
+
+	// nothing else changes in the bucket, so the backup has to be current from the marks alone.
+	sleep(WAIT_SECONDS);
+	code = get_stale(backup, key_hash);
+	if (code != RESPONSE_DATA_STRING) {
+		printf("FAIL: the backup stopped answering after a failed INCR (%#x).\n", code);
+		return(1);
+	}
+
+	printf("OK\n");
+	testconn_close(primary);
+	testconn_close(backup);
+	return(0);
+}
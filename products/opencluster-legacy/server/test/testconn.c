@@ -0,0 +1,238 @@
+// testconn.c
+
+#include "testconn.h"
+
+// header.h needs the fixed size types.
+#include <stdint.h>
+#include "../header.h"
+#include "../protocol.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static int send_all(testconn_t *conn, const char *data, int length)
+{
+	int sent;
+
+	while (length > 0) {
+		sent = send(conn->handle, data, length, MSG_NOSIGNAL);
+		if (sent <= 0) { return(-1); }
+		data += sent;
+		length -= sent;
+	}
+	return(0);
+}
+
+
+static int recv_all(testconn_t *conn, char *data, int length)
+{
+	int got;
+
+	while (length > 0) {
+		got = recv(conn->handle, data, length, 0);
+		if (got <= 0) { return(-1); }
+		data += got;
+		length -= got;
+	}
+	return(0);
+}
+
+
+static int send_msg(testconn_t *conn, int command, int code, int userid, const char *payload, int length)
+{
+	raw_header_t raw;
+
+	raw.command = htobe16(command);
+	raw.response_code = htobe16(code);
+	raw.userid = htobe32(userid);
+	raw.length = htobe32(length);
+
+	if (send_all(conn, (const char *) &raw, sizeof(raw)) != 0) { return(-1); }
+	if (length > 0 && send_all(conn, payload, length) != 0) { return(-1); }
+	return(0);
+}
+
+
+static int read_msg(testconn_t *conn, testmsg_t *msg)
+{
+	raw_header_t raw;
+
+	assert(msg);
+
+	if (recv_all(conn, (char *) &raw, sizeof(raw)) != 0) { return(-1); }
+	msg->command = be16toh(raw.command);
+	msg->code = be16toh(raw.response_code);
+	msg->userid = be32toh(raw.userid);
+	msg->length = be32toh(raw.length);
+	msg->payload = NULL;
+
+	if (msg->length > 0) {
+		msg->payload = malloc(msg->length);
+		assert(msg->payload);
+		if (recv_all(conn, msg->payload, msg->length) != 0) {
+			free(msg->payload);
+			msg->payload = NULL;
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+
+// the node has pushed something to us (it isn't a reply), so count it and say OK.
+static int answer_push(testconn_t *conn, testmsg_t *msg)
+{
+	assert(msg->code == 0);
+
+	if (msg->command == COMMAND_INVALIDATE)    { conn->invalidates ++; }
+	else if (msg->command == COMMAND_HOTKEY)   { conn->hotkeys ++; }
+	else if (msg->command == COMMAND_HASHMASK) { conn->hashmasks ++; }
+
+	return(send_msg(conn, msg->command, RESPONSE_OK, msg->userid, NULL, 0));
+}
+
+
+testconn_t * testconn_open(const char *host, int port, int features)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	testconn_t *conn;
+	testmsg_t reply;
+	char service[16];
+	char payload[12];
+	int length;
+
+	assert(host);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &addrs) != 0) {
+		return(NULL);
+	}
+
+	conn = calloc(1, sizeof(testconn_t));
+	assert(conn);
+	conn->next_id = 1;
+	conn->handle = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+	if (conn->handle < 0 || connect(conn->handle, addrs->ai_addr, addrs->ai_addrlen) != 0) {
+		freeaddrinfo(addrs);
+		testconn_close(conn);
+		return(NULL);
+	}
+	freeaddrinfo(addrs);
+
+	// no authentication, the original framing, and the features we were asked for.
+	length = testconn_data(payload, NULL, 0);
+	length += testconn_int(payload + length, PROTOCOL_V1);
+	length += testconn_int(payload + length, features);
+	if (testconn_request(conn, COMMAND_HELLO, payload, length, &reply) != RESPONSE_OK) {
+		testconn_close(conn);
+		return(NULL);
+	}
+	free(reply.payload);
+
+	return(conn);
+}
+
+
+void testconn_close(testconn_t *conn)
+{
+	assert(conn);
+	if (conn->handle >= 0) {
+		close(conn->handle);
+	}
+	free(conn);
+}
+
+
+int testconn_request(testconn_t *conn, int command, const char *payload, int length, testmsg_t *reply)
+{
+	int userid;
+
+	assert(conn);
+	assert(reply);
+
+	userid = conn->next_id ++;
+	if (send_msg(conn, command, 0, userid, payload, length) != 0) {
+		return(-1);
+	}
+
+	for (;;) {
+		if (read_msg(conn, reply) != 0) {
+			return(-1);
+		}
+		if (reply->code == 0) {
+			answer_push(conn, reply);
+			free(reply->payload);
+		}
+		else if (reply->userid == userid) {
+			return(reply->code);
+		}
+		else {
+			free(reply->payload);
+		}
+	}
+}
+
+
+void testconn_wait(testconn_t *conn, int seconds)
+{
+	struct pollfd pfd;
+	testmsg_t msg;
+	time_t until;
+
+	assert(conn);
+
+	until = time(NULL) + seconds;
+	while (time(NULL) < until) {
+		pfd.fd = conn->handle;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0) {
+			if (read_msg(conn, &msg) != 0) {
+				return;
+			}
+			if (msg.code == 0) {
+				answer_push(conn, &msg);
+			}
+			free(msg.payload);
+		}
+	}
+}
+
+
+int testconn_int(char *buffer, int value)
+{
+	uint32_t raw = htobe32(value);
+	memcpy(buffer, &raw, sizeof(raw));
+	return(sizeof(raw));
+}
+
+
+int testconn_long(char *buffer, long long value)
+{
+	uint64_t raw = htobe64(value);
+	memcpy(buffer, &raw, sizeof(raw));
+	return(sizeof(raw));
+}
+
+
+int testconn_data(char *buffer, const char *data, int length)
+{
+	testconn_int(buffer, length);
+	if (length > 0) {
+		memcpy(buffer + sizeof(uint32_t), data, length);
+	}
+	return(sizeof(uint32_t) + length);
+}
@@ -0,0 +1,49 @@
+// testconn.h
+//
+// A minimal blocking connection to a running node, for the tests that need a cluster.  It only uses
+// the original (v1) framing, and answers anything the node pushes to it (HASHMASK, HOTKEY,
+// INVALIDATE) with an OK, counting the ones it sees.
+
+#ifndef __TESTCONN_H
+#define __TESTCONN_H
+
+#include "../hash.h"
+
+
+typedef struct {
+	int handle;
+	int next_id;
+
+	// the number of each push that has been received.
+	int invalidates;
+	int hotkeys;
+	int hashmasks;
+} testconn_t;
+
+// a message that was read from the node.  'payload' is allocated, and must be freed by the caller.
+typedef struct {
+	int command;
+	int code;
+	int userid;
+	int length;
+	char *payload;
+} testmsg_t;
+
+
+// connect and say HELLO, asking for the FEATURE_* bits in 'features'.  Returns NULL if it failed.
+testconn_t * testconn_open(const char *host, int port, int features);
+void testconn_close(testconn_t *conn);
+
+// send a request, and wait for its reply.  Returns the reply code, or -1 if the connection failed.
+int testconn_request(testconn_t *conn, int command, const char *payload, int length, testmsg_t *reply);
+
+// answer whatever the node pushes for 'seconds'.
+void testconn_wait(testconn_t *conn, int seconds);
+
+// build the payloads for the requests the tests use.  Each returns the length.
+int testconn_int(char *buffer, int value);
+int testconn_long(char *buffer, long long value);
+int testconn_data(char *buffer, const char *data, int length);
+
+
+#endif
@@ -0,0 +1,114 @@
+// upgrade-invalidate-test.c
+//
+// A client that asked for invalidations must still get them after the node it is connected to has
+// been upgraded (SIGUSR2).  Needs a running node, and its pid so that it can be told to upgrade.
+//
+//   make upgrade-invalidate-test && ./upgrade-invalidate-test <host> <port> <pid>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../protocol.h"
+#include "testconn.h"
+
+
+#define TEST_MAP         0x7465737400000038llu
+#define UPGRADE_SECONDS  5
+#define WAIT_SECONDS     3
+
+
+static int set_str(testconn_t *conn, hash_t key_hash, const char *value)
+{
+	testmsg_t reply;
+	char payload[64];
+	int length;
+	int code;
+
+	length = testconn_long(payload, TEST_MAP);
+	length += testconn_long(payload + length, key_hash);
+	length += testconn_int(payload + length, 0);
+	length += testconn_data(payload + length, value, strlen(value));
+
+	code = testconn_request(conn, COMMAND_SET_STRING, payload, length, &reply);
+	free(reply.payload);
+	return(code);
+}
+
+
+int main(int argc, char **argv)
+{
+	testconn_t *cache;
+	testconn_t *writer;
+	testmsg_t reply;
+	char payload[32];
+	hash_t key_hash;
+	pid_t pid;
+	int code;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s <host> <port> <pid>\n", argv[0]);
+		return(2);
+	}
+	pid = atoi(argv[3]);
+
+	cache = testconn_open(argv[1], atoi(argv[2]), 0);
+	if (cache == NULL) {
+		fprintf(stderr, "unable to connect.\n");
+		return(2);
+	}
+
+	testconn_int(payload, 1);
+	code = testconn_request(cache, COMMAND_INVALIDATIONS, payload, sizeof(int), &reply);
+	free(reply.payload);
+	if (code != RESPONSE_OK) {
+		fprintf(stderr, "unable to ask for invalidations (%#x).\n", code);
+		return(2);
+	}
+
+	// find a key that this node is the primary for.
+	code = RESPONSE_TRYELSEWHERE;
+	for (key_hash = 1; key_hash < 1024 && code == RESPONSE_TRYELSEWHERE; key_hash++) {
+		code = set_str(cache, key_hash, "before");
+	}
+	key_hash --;
+	if (code != RESPONSE_OK) {
+		fprintf(stderr, "unable to store a value (%#x).\n", code);
+		return(2);
+	}
+
+	testconn_wait(cache, 1);
+	cache->invalidates = 0;
+
+	if (kill(pid, SIGUSR2) != 0) {
+		fprintf(stderr, "unable to signal %d.\n", (int) pid);
+		return(2);
+	}
+	testconn_wait(cache, UPGRADE_SECONDS);
+
+	// the change comes from another connection, to the new process.
+	writer = testconn_open(argv[1], atoi(argv[2]), 0);
+	if (writer == NULL) {
+		printf("FAIL: unable to connect after the upgrade.\n");
+		return(1);
+	}
+	code = set_str(writer, key_hash, "after");
+	if (code != RESPONSE_OK) {
+		printf("FAIL: unable to change the value after the upgrade (%#x).\n", code);
+		return(1);
+	}
+
+	testconn_wait(cache, WAIT_SECONDS);
+	if (cache->invalidates == 0) {
+		printf("FAIL: no INVALIDATE after the upgrade.\n");
+		return(1);
+	}
+
+	printf("OK\n");
+	testconn_close(writer);
+	testconn_close(cache);
+	return(0);
+}
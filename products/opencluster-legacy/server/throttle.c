@@ -0,0 +1,323 @@
+// throttle.c
+
+// Bucket migration and backup syncing share the event loop (and the network) with the clients that
+// are making requests.  Without any limits, a rebalance will happily take everything it can get,
+// and client requests end up queued behind thousands of SYNC messages.
+//
+// This module keeps a token-bucket of the bytes that can be spent on migration and syncing per
+// second.  Every byte of SYNC data that is sent uses up tokens (backup syncs cannot be delayed, so
+// they just use them up and can take the bucket negative), and migration only continues while there
+// are tokens available.  Migration work is also run at a lower event priority than everything
+// else, so anything a client is waiting for is always processed first.
+//
+// To protect foreground latency, the refill timer also measures how late it fires.  If the event
+// loop is lagging more than the configured budget, the effective rate is halved, and when it is
+// within the budget again, the rate is slowly increased again back up to the configured maximum.
+// This way the migration will use whatever capacity is left over.
+
+#include "throttle.h"
+
+#include "constants.h"
+#include "logging.h"
+#include "stats.h"
+#include "timeout.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+
+typedef struct {
+	client_t *client;
+	void (*fn)(client_t *);
+} throttle_wait_t;
+
+
+static struct event_base *_evbase = NULL;
+
+// timer that fires several times a second to refill the tokens and check the event loop lag.
+static struct event *_refill_event = NULL;
+
+// low priority event that is activated when there are waiting clients and tokens available.
+static struct event *_resume_event = NULL;
+
+// the configured maximum rate (bytes per second).  0 means unlimited.
+static long long _rate_max = 0;
+
+// the current effective rate, which is reduced when the latency budget is exceeded.  0 means
+// unlimited.
+static long long _rate = 0;
+
+// the number of bytes that can still be sent.  Can go negative because backup syncs are never held
+// back.
+static long long _tokens = 0;
+
+// the bytes used since the last refill.
+static long long _used = 0;
+
+// the maximum event loop lag (in microseconds) that we will allow before backing off.  0 disables
+// the latency protection.
+static int _budget = 0;
+
+// the lag measured on the last refill, and the worst one since the last stats dump.
+static int _lag = 0;
+static int _lag_worst = 0;
+static int _backoffs = 0;
+
+// when the refill timer is expected to fire.
+static struct timeval _expected = {0,0};
+
+// the list of clients that have migration work waiting for tokens.
+static throttle_wait_t *_waiting = NULL;
+static int _waiting_count = 0;
+static int _waiting_max = 0;
+
+
+
+// returns non-zero if there is room for more migration data to be sent.
+static int throttle_ready(void)
+{
+	return(_rate == 0 || _tokens > 0);
+}
+
+
+// run everything that was waiting.  If we run out of tokens part way through, the rest will have
+// to wait for the next refill.
+static void resume_handler(evutil_socket_t fd, short what, void *arg)
+{
+	int i;
+	throttle_wait_t wait;
+
+	assert(arg == NULL);
+
+	for (i=0; i<_waiting_count && throttle_ready(); i++) {
+		if (_waiting[i].client) {
+			wait = _waiting[i];
+			_waiting[i].client = NULL;
+			_waiting[i].fn = NULL;
+
+			assert(wait.fn);
+			(*wait.fn)(wait.client);
+		}
+	}
+
+	// compact the list.  The callbacks may have added new entries to the end of the list, so we
+	// need to keep those.
+	int j = 0;
+	for (i=0; i<_waiting_count; i++) {
+		if (_waiting[i].client) {
+			_waiting[j] = _waiting[i];
+			j++;
+		}
+	}
+	_waiting_count = j;
+}
+
+
+static void throttle_activate(void)
+{
+	if (_waiting_count > 0 && throttle_ready()) {
+		assert(_resume_event);
+		event_active(_resume_event, EV_TIMEOUT, 0);
+	}
+}
+
+
+static void refill_handler(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval now;
+	long long lag;
+
+	assert(fd == -1);
+	assert(arg == NULL);
+
+	// figure out how late the timer fired.  If the event loop is busy, this is roughly how long a
+	// client request would be waiting before we got to it.
+	gettimeofday(&now, NULL);
+	lag = ((now.tv_sec - _expected.tv_sec) * 1000000) + (now.tv_usec - _expected.tv_usec);
+	if (lag < 0) { lag = 0; }
+	_lag = lag;
+	if (_lag > _lag_worst) { _lag_worst = _lag; }
+
+	if (_budget > 0 && _lag > _budget) {
+		// we are over the budget, so we back off.  If we were unlimited, we start from what we
+		// actually sent during the last period.
+		long long current = _rate;
+		if (current == 0) { current = _used * THROTTLE_TICKS; }
+		_rate = current / 2;
+		if (_rate < THROTTLE_MIN_RATE) { _rate = THROTTLE_MIN_RATE; }
+		if (_rate_max > 0 && _rate > _rate_max) { _rate = _rate_max; }
+		_backoffs ++;
+
+		logger(LOG_DEBUG, "throttle: event loop lag %dus is over budget (%dus).  Rate is now %lld", _lag, _budget, _rate);
+	}
+	else if (_rate != _rate_max) {
+		// we are within the budget, so we can slowly give some more back to the migration.
+		assert(_rate > 0);
+		_rate += (_rate / 8) + 1;
+		if (_rate_max > 0) {
+			if (_rate > _rate_max) { _rate = _rate_max; }
+		}
+		else if (_rate > (_used * THROTTLE_TICKS * 2)) {
+			// we are not even using half of what we are allowed, so we can go back to being unlimited.
+			_rate = 0;
+		}
+	}
+
+	if (_rate > 0) {
+		// add the tokens for this period, but dont allow more than one second worth to build up.
+		_tokens += _rate / THROTTLE_TICKS;
+		if (_tokens > _rate) { _tokens = _rate; }
+	}
+	else {
+		_tokens = 0;
+	}
+	_used = 0;
+
+	throttle_activate();
+
+	gettimeofday(&_expected, NULL);
+	timeradd(&_expected, &_timeout_throttle, &_expected);
+	evtimer_add(_refill_event, &_timeout_throttle);
+}
+
+
+void throttle_init(struct event_base *evbase)
+{
+	assert(_evbase == NULL);
+	assert(evbase);
+	_evbase = evbase;
+
+	assert(_refill_event == NULL);
+	_refill_event = evtimer_new(_evbase, refill_handler, NULL);
+	assert(_refill_event);
+	gettimeofday(&_expected, NULL);
+	timeradd(&_expected, &_timeout_throttle, &_expected);
+	evtimer_add(_refill_event, &_timeout_throttle);
+
+	// the resume event is never added, it is only activated when there is work to do.  It runs at
+	// the background priority, so that all the client processing is done before it.
+	assert(_resume_event == NULL);
+	_resume_event = event_new(_evbase, -1, 0, resume_handler, NULL);
+	assert(_resume_event);
+	event_priority_set(_resume_event, PRIORITY_BACKGROUND);
+}
+
+
+void throttle_shutdown(void)
+{
+	if (_refill_event) {
+		event_free(_refill_event);
+		_refill_event = NULL;
+	}
+
+	if (_resume_event) {
+		event_free(_resume_event);
+		_resume_event = NULL;
+	}
+
+	if (_waiting) {
+		free(_waiting);
+		_waiting = NULL;
+		_waiting_count = 0;
+		_waiting_max = 0;
+	}
+}
+
+
+// set the maximum number of bytes per second that can be used for migration and syncing.  0
+// means unlimited.  Can be changed while running.
+void throttle_set_rate(long long rate)
+{
+	assert(rate >= 0);
+
+	_rate_max = rate;
+	_rate = rate;
+	if (_rate > 0 && _tokens > _rate) { _tokens = _rate; }
+
+	logger(LOG_INFO, "Migration rate limit: %lld bytes/sec", _rate_max);
+	throttle_activate();
+}
+
+
+// set the maximum event loop lag (in milliseconds) that is allowed before migration backs off.  0
+// disables it.
+void throttle_set_budget(int msecs)
+{
+	assert(msecs >= 0);
+	_budget = msecs * 1000;
+	logger(LOG_INFO, "Migration latency budget: %d ms", msecs);
+}
+
+
+// SYNC data has been sent (either migration or backup).
+void throttle_consume(int bytes)
+{
+	assert(bytes > 0);
+	_used += bytes;
+	if (_rate > 0) {
+		_tokens -= bytes;
+	}
+}
+
+
+// the client has migration work to do.  The function will be called (at the background priority)
+// when there are tokens available.  Only one function can be waiting per client.
+void throttle_schedule(client_t *client, void (*fn)(client_t *))
+{
+	int i;
+
+	assert(client);
+	assert(fn);
+
+#ifndef NDEBUG
+	for (i=0; i<_waiting_count; i++) {
+		assert(_waiting[i].client != client);
+	}
+#endif
+
+	if (_waiting_count >= _waiting_max) {
+		_waiting = realloc(_waiting, sizeof(throttle_wait_t) * (_waiting_max + 4));
+		assert(_waiting);
+		_waiting_max += 4;
+	}
+
+	i = _waiting_count;
+	_waiting[i].client = client;
+	_waiting[i].fn = fn;
+	_waiting_count ++;
+
+	throttle_activate();
+}
+
+
+// the client is going away, so any work it has waiting needs to be dropped.
+void throttle_cancel(client_t *client)
+{
+	int i;
+
+	assert(client);
+
+	for (i=0; i<_waiting_count; i++) {
+		if (_waiting[i].client == client) {
+			_waiting[i].client = NULL;
+			_waiting[i].fn = NULL;
+		}
+	}
+}
+
+
+void throttle_dump(void)
+{
+	stat_dumpstr("THROTTLE");
+	stat_dumpstr("  Configured Rate: %lld bytes/sec", _rate_max);
+	stat_dumpstr("  Effective Rate: %lld bytes/sec", _rate);
+	stat_dumpstr("  Tokens: %lld", _tokens);
+	stat_dumpstr("  Latency Budget: %d us", _budget);
+	stat_dumpstr("  Event Loop Lag: %d us (worst %d us)", _lag, _lag_worst);
+	stat_dumpstr("  Backoffs: %d", _backoffs);
+	stat_dumpstr("  Waiting: %d", _waiting_count);
+	stat_dumpstr(NULL);
+
+	_lag_worst = 0;
+}
@@ -0,0 +1,23 @@
+// throttle.h
+
+#ifndef __THROTTLE_H
+#define __THROTTLE_H
+
+#include "client.h"
+#include "event-compat.h"
+
+
+void throttle_init(struct event_base *evbase);
+void throttle_shutdown(void);
+
+void throttle_set_rate(long long rate);
+void throttle_set_budget(int msecs);
+
+void throttle_consume(int bytes);
+void throttle_schedule(client_t *client, void (*fn)(client_t *));
+void throttle_cancel(client_t *client);
+
+void throttle_dump(void);
+
+
+#endif
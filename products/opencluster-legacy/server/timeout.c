@@ -22,6 +22,11 @@ struct timeval _timeout_connect = {.tv_sec = 30, .tv_usec = 0};
 struct timeval _timeout_node_wait = {.tv_sec = 5, .tv_usec = 0};
 struct timeval _timeout_node_loadlevel = {.tv_sec = 5, .tv_usec = 0};
 struct timeval _timeout_client = {.tv_sec = 1, .tv_usec = 0};
+struct timeval _timeout_throttle = {.tv_sec = 0, .tv_usec = 100000};  // 10 times a second.
+struct timeval _timeout_sync_mark = {.tv_sec = 1, .tv_usec = 0};
+struct timeval _timeout_hotkeys = {.tv_sec = 5, .tv_usec = 0};
+struct timeval _timeout_upgrade = {.tv_sec = 0, .tv_usec = 100000};
+struct timeval _timeout_upgrade_ready = {.tv_sec = 30, .tv_usec = 0};
 
 
 
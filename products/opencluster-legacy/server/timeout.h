@@ -16,6 +16,11 @@
 	extern struct timeval _timeout_node_wait;
 	extern struct timeval _timeout_node_loadlevel;
 	extern struct timeval _timeout_client;
+	extern struct timeval _timeout_throttle;
+	extern struct timeval _timeout_sync_mark;
+	extern struct timeval _timeout_hotkeys;
+	extern struct timeval _timeout_upgrade;
+	extern struct timeval _timeout_upgrade_ready;
 #endif
 
 
@@ -0,0 +1,472 @@
+// translog.c
+
+// When a node is running as a logger, it does not hold any buckets.  Instead, the primary nodes send
+// it a copy of every update (the same SYNC messages they send to the backups), and it appends them
+// to a transaction log, which can then be replayed into a cluster with the oc_replay tool.
+//
+// To keep the cost of durability down, the updates are not written to disk one at a time.  They are
+// collected in a buffer, and the whole buffer is written out and synced (with a single fdatasync)
+// when it gets big enough, or when the commit timer fires, whichever comes first.  The SYNC messages 
+// are only acknowledged once the commit has worked.  If it fails, the batch is kept and tried again 
+// with the next commit.  The log is split
+// into segment files, which are pre-allocated when they are created, so that the file-system doesn't
+// need to update the file size (and its metadata) with every sync.
+//
+// Segments are named by their sequence number.  When the logger starts up, it continues on from the
+// highest segment already in the directory, and never appends to an existing one.
+
+#include "translog.h"
+
+#include "constants.h"
+#include "logging.h"
+#include "protocol.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static struct event_base *_evbase = NULL;
+static struct event *_commit_event = NULL;
+static struct timeval _commit_interval = {0, TRANSLOG_INTERVAL * 1000};
+
+// directory the segments are written to.
+static char *_dir = NULL;
+
+// the current segment.
+static int _fd = -1;
+static unsigned int _segment = 0;
+static long long _segment_pos = 0;
+
+// updates that have not been written yet.
+static char *_buffer = NULL;
+static int _buffer_len = 0;
+static int _buffer_max = 0;
+
+// the SYNC messages in the buffer, which are acknowledged when it has been written.
+typedef struct {
+	client_t *client;
+	header_t header;
+} translog_ack_t;
+
+static translog_ack_t *_acks = NULL;
+static int _ack_count = 0;
+static int _ack_max = 0;
+
+// stats.
+static long long _records = 0;
+static long long _bytes = 0;
+static long long _commits = 0;
+static long long _commit_failures = 0;
+
+// set while the commits are failing, so that they are only retried by the timer, instead of with 
+// every record that is added.
+static int _failing = 0;
+static int _commit_worst = 0;
+
+
+
+// figure out what the highest segment number is in the directory.
+static unsigned int last_segment(const char *dir)
+{
+	DIR *dp;
+	struct dirent *entry;
+	unsigned int highest = 0;
+	unsigned int segment;
+	char tail;
+
+	assert(dir);
+
+	dp = opendir(dir);
+	if (dp) {
+		while ((entry = readdir(dp)) != NULL) {
+			if (sscanf(entry->d_name, "%u.octlog%c", &segment, &tail) == 1) {
+				if (segment > highest) { highest = segment; }
+			}
+		}
+		closedir(dp);
+	}
+
+	return(highest);
+}
+
+
+// create the next segment file, and pre-allocate the space for it.
+static int segment_open(void)
+{
+	char path[4096];
+	translog_header_t header;
+	int result;
+
+	assert(_fd < 0);
+	assert(_dir);
+
+	_segment ++;
+	snprintf(path, sizeof(path), "%s/%08u.octlog", _dir, _segment);
+
+	_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0640);
+	if (_fd < 0) {
+		logger(LOG_ERROR, "Unable to create transaction log segment '%s': %s", path, strerror(errno));
+		return(-1);
+	}
+
+	// if the pre-allocation fails (not all file-systems support it), we can still continue, it will
+	// just be a bit slower.
+	result = posix_fallocate(_fd, 0, TRANSLOG_SEGMENT_SIZE);
+	if (result != 0) {
+		logger(LOG_INFO, "Unable to pre-allocate transaction log segment '%s': %s", path, strerror(result));
+	}
+
+	memcpy(header.magic, TRANSLOG_MAGIC, sizeof(header.magic));
+	header.segment = htobe32(_segment);
+	header.reserved = 0;
+	if (pwrite(_fd, &header, sizeof(header), 0) != sizeof(header)) {
+		logger(LOG_ERROR, "Unable to write transaction log segment '%s': %s", path, strerror(errno));
+		close(_fd);
+		_fd = -1;
+		return(-1);
+	}
+	_segment_pos = sizeof(header);
+
+	logger(LOG_INFO, "Transaction log segment started: %s", path);
+	return(0);
+}
+
+
+// tell the nodes that sent the updates in the buffer that they are on the disk.
+static void acks_send(void)
+{
+	int i;
+
+	for (i=0; i<_ack_count; i++) {
+		if (_acks[i].client) {
+			client_send_reply(_acks[i].client, &_acks[i].header, RESPONSE_OK, NO_PAYLOAD);
+		}
+	}
+	_ack_count = 0;
+}
+
+
+// write out everything in the buffer, and make sure it is on the disk.  Returns 0 if it worked.  If 
+// it didn't, the buffer is kept (and not acknowledged), so that it can be tried again.
+static int translog_commit(void)
+{
+	struct timeval start, end;
+	int done = 0;
+	ssize_t written;
+
+	if (_buffer_len == 0) {
+		acks_send();
+		return(0);
+	}
+
+	assert(_buffer);
+	if (_fd < 0) {
+		// we were not able to open the segment.  We keep trying with each commit.
+		if (segment_open() != 0) {
+			logger(LOG_ERROR, "Transaction log is not available.  %d bytes waiting.", _buffer_len);
+			_commit_failures ++;
+			_failing = 1;
+			return(-1);
+		}
+	}
+
+	gettimeofday(&start, NULL);
+
+	while (done < _buffer_len) {
+		written = pwrite(_fd, _buffer + done, _buffer_len - done, _segment_pos + done);
+		if (written < 0) {
+			if (errno != EINTR) {
+				logger(LOG_ERROR, "Unable to write to the transaction log: %s", strerror(errno));
+				_commit_failures ++;
+				_failing = 1;
+				return(-1);
+			}
+		}
+		else {
+			done += written;
+		}
+	}
+
+	// one sync for everything in the batch.  If it fails, we dont know what made it to the disk, so 
+	// the whole batch is written again (to the same place) next time.
+	if (fdatasync(_fd) != 0) {
+		logger(LOG_ERROR, "Unable to sync the transaction log: %s", strerror(errno));
+		_commit_failures ++;
+		_failing = 1;
+		return(-1);
+	}
+
+	_segment_pos += done;
+	_bytes += done;
+	_buffer_len = 0;
+	_commits ++;
+	_failing = 0;
+
+	acks_send();
+
+	gettimeofday(&end, NULL);
+	int usecs = ((end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec);
+	if (usecs > _commit_worst) { _commit_worst = usecs; }
+	
+	return(0);
+}
+
+
+// the current segment is full.  Anything left in the buffer is written to it first (if that fails, 
+// it goes into the next one instead).
+static void segment_close(void)
+{
+	translog_commit();
+
+	if (_fd >= 0) {
+		close(_fd);
+		_fd = -1;
+	}
+	_segment_pos = 0;
+}
+
+
+static void commit_handler(evutil_socket_t fd, short what, void *arg)
+{
+	assert(fd == -1);
+	assert(arg == NULL);
+	assert(_commit_event);
+
+	translog_commit();
+
+	evtimer_add(_commit_event, &_commit_interval);
+}
+
+
+// start logging to the directory.  Returns 0 if it is ready.
+int translog_init(struct event_base *evbase, const char *dir)
+{
+	assert(_evbase == NULL);
+	assert(evbase);
+	assert(dir);
+
+	_evbase = evbase;
+	_dir = strdup(dir);
+	assert(_dir);
+
+	_segment = last_segment(_dir);
+	if (segment_open() != 0) {
+		return(-1);
+	}
+
+	assert(_buffer == NULL);
+	_buffer_max = TRANSLOG_BATCH * 2;
+	_buffer = malloc(_buffer_max);
+	assert(_buffer);
+	_buffer_len = 0;
+
+	assert(_commit_event == NULL);
+	_commit_event = evtimer_new(_evbase, commit_handler, NULL);
+	assert(_commit_event);
+	evtimer_add(_commit_event, &_commit_interval);
+
+	return(0);
+}
+
+
+void translog_shutdown(void)
+{
+	if (_commit_event) {
+		event_free(_commit_event);
+		_commit_event = NULL;
+	}
+
+	if (_dir) {
+		segment_close();
+
+		if (_buffer_len > 0) {
+			logger(LOG_ERROR, "Transaction log closed with %d bytes that could not be written.", _buffer_len);
+		}
+		free(_buffer);
+		_buffer = NULL;
+		_buffer_max = 0;
+		_buffer_len = 0;
+
+		free(_acks);
+		_acks = NULL;
+		_ack_count = 0;
+		_ack_max = 0;
+
+		free(_dir);
+		_dir = NULL;
+	}
+}
+
+
+// returns non-zero if this node is a logger.
+int translog_active(void)
+{
+	return(_dir != NULL);
+}
+
+
+// set the maximum time (in milliseconds) that an update can wait in the buffer before it is written.
+void translog_set_interval(int msecs)
+{
+	assert(msecs > 0);
+	_commit_interval.tv_sec = msecs / 1000;
+	_commit_interval.tv_usec = (msecs % 1000) * 1000;
+}
+
+
+// add a record to the buffer, with room for 'data_len' bytes after the header (which the caller 
+// fills in).  'expires' is the absolute time (or 0).
+static translog_record_t * record_add(int type, hash_t map_hash, hash_t key_hash, int64_t expires, int data_len)
+{
+	translog_record_t *record;
+	int length;
+
+	assert(_dir);
+	assert(data_len >= 0);
+
+	length = sizeof(translog_record_t) + data_len;
+
+	// if this record wont fit in the current segment, then we start a new one.  If it is bigger than
+	// a whole segment, it will just get written to a new one anyway.
+	if (_segment_pos + _buffer_len + length > TRANSLOG_SEGMENT_SIZE && _segment_pos + _buffer_len > sizeof(translog_header_t)) {
+		segment_close();
+		segment_open();
+	}
+
+	if (_buffer_len + length > _buffer_max) {
+		_buffer_max = _buffer_len + length + TRANSLOG_BATCH;
+		_buffer = realloc(_buffer, _buffer_max);
+		assert(_buffer);
+	}
+
+	record = (translog_record_t *) (_buffer + _buffer_len);
+	record->length = htobe32(length);
+	record->type = htobe16(type);
+	record->reserved = 0;
+	record->map_hash = htobe64(map_hash);
+	record->key_hash = htobe64(key_hash);
+	record->expires = htobe64(expires);
+
+	_buffer_len += length;
+	_records ++;
+
+	return(record);
+}
+
+
+// the buffer is written out once enough records have been added to it (otherwise the commit timer 
+// will do it).
+static void record_done(void)
+{
+	if (_buffer_len >= TRANSLOG_BATCH && _failing == 0) {
+		translog_commit();
+	}
+}
+
+
+// add the update to the log.  'expires' is the number of seconds from now (or 0).
+void translog_append(hash_t map_hash, hash_t key_hash, int expires, value_t *value)
+{
+	translog_record_t *record;
+	char *data;
+
+	assert(_dir);
+	assert(value);
+	assert(expires >= 0);
+
+	if (value->type == VALUE_LONG) {
+		int64_t l = htobe64(value->data.l);
+		record = record_add(TRANSLOG_RECORD_INT, map_hash, key_hash, expires == 0 ? 0 : (int64_t) time(NULL) + expires, sizeof(l));
+		data = (char *) record + sizeof(translog_record_t);
+		memcpy(data, &l, sizeof(l));
+	}
+	else {
+		// the log always has the expanded string.  The values given to us here are not normally 
+		// compressed (see cmd_sync_string), so this doesn't need to expand them.
+		assert(value->type == VALUE_STRING);
+		int str_len;
+		const char *str = value_string(value, &str_len);
+		record = record_add(TRANSLOG_RECORD_STRING, map_hash, key_hash, expires == 0 ? 0 : (int64_t) time(NULL) + expires, str_len);
+		data = (char *) record + sizeof(translog_record_t);
+		if (str_len > 0) {
+			memcpy(data, str, str_len);
+		}
+	}
+
+	record_done();
+}
+
+
+// add a tombstone to the log, so that a replay removes the item (if an earlier record set it).  
+// There is no data with it, just the header.
+void translog_delete(hash_t map_hash, hash_t key_hash)
+{
+	assert(_dir);
+
+	record_add(TRANSLOG_RECORD_DELETE, map_hash, key_hash, 0, 0);
+	record_done();
+}
+
+
+// reply to a SYNC once the records it added to the buffer have been written to the disk.
+void translog_ack(client_t *client, header_t *header)
+{
+	assert(_dir);
+	assert(client);
+	assert(header);
+
+	if (_ack_count >= _ack_max) {
+		_ack_max = _ack_max == 0 ? 1024 : _ack_max * 2;
+		_acks = realloc(_acks, sizeof(translog_ack_t) * _ack_max);
+		assert(_acks);
+	}
+
+	_acks[_ack_count].client = client;
+	_acks[_ack_count].header = *header;
+	_ack_count ++;
+}
+
+
+// the connection is going away, so it cant be sent the replies that are waiting for the commit.
+void translog_client_gone(client_t *client)
+{
+	int i;
+
+	assert(client);
+	for (i=0; i<_ack_count; i++) {
+		if (_acks[i].client == client) {
+			_acks[i].client = NULL;
+		}
+	}
+}
+
+
+void translog_dump(void)
+{
+	if (_dir == NULL) {
+		return;
+	}
+
+	stat_dumpstr("TRANSACTION LOG");
+	stat_dumpstr("  Directory: %s", _dir);
+	stat_dumpstr("  Segment: %u (%lld bytes)", _segment, _segment_pos);
+	stat_dumpstr("  Records: %lld", _records);
+	stat_dumpstr("  Bytes Written: %lld", _bytes);
+	stat_dumpstr("  Commits: %lld", _commits);
+	stat_dumpstr("  Failed Commits: %lld", _commit_failures);
+	stat_dumpstr("  Pending: %d bytes (%d acks)", _buffer_len, _ack_count);
+	stat_dumpstr("  Slowest Commit: %d us", _commit_worst);
+	stat_dumpstr(NULL);
+
+	_commit_worst = 0;
+}
@@ -0,0 +1,56 @@
+// translog.h
+
+#ifndef __TRANSLOG_H
+#define __TRANSLOG_H
+
+#include "client.h"
+#include "hash.h"
+#include "header.h"
+#include "value.h"
+
+#include "event-compat.h"
+#include <stdint.h>
+
+
+// Each segment file starts with a header, followed by the records.  The rest of the file is
+// pre-allocated (and zero-filled), so a record with a length of zero marks the end of the segment.
+// All the fields are in network byte order, so that the logs can be replayed on a different machine.
+#define TRANSLOG_MAGIC "OCTLOG01"
+
+#define TRANSLOG_RECORD_INT     1
+#define TRANSLOG_RECORD_STRING  2
+#define TRANSLOG_RECORD_DELETE  3
+
+#pragma pack(push,1)
+typedef struct {
+	char magic[8];
+	uint32_t segment;
+	uint32_t reserved;
+} translog_header_t;
+
+typedef struct {
+	uint32_t length;		// length of the whole record, including this header.
+	uint16_t type;
+	uint16_t reserved;
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int64_t expires;		// absolute (unix) time, or 0 if the item doesn't expire.
+} translog_record_t;
+#pragma pack(pop)
+
+
+int translog_init(struct event_base *evbase, const char *dir);
+void translog_shutdown(void);
+int translog_active(void);
+
+void translog_set_interval(int msecs);
+
+void translog_append(hash_t map_hash, hash_t key_hash, int expires, value_t *value);
+void translog_delete(hash_t map_hash, hash_t key_hash);
+void translog_ack(client_t *client, header_t *header);
+void translog_client_gone(client_t *client);
+
+void translog_dump(void);
+
+
+#endif
@@ -0,0 +1,1107 @@
+// upgrade.c
+
+// Replacing a running node with a new build (see upgrade.h for the messages).
+//
+// The old node stops accepting new connections (they wait in the listen backlog), starts the new
+// binary, and waits for it to say it is ready.  It then waits for a moment when none of its own
+// requests are waiting for replies, and no buckets are migrating, so that no state is lost that
+// only lives in the payload and transfer tables.  From that point everything is done blocking,
+// without returning to the event loop, so nothing can change while it is being handed over.
+//
+// If anything goes wrong before the new process confirms it has everything, the new process is
+// killed and the old one carries on as if nothing happened.
+
+#include "upgrade.h"
+
+#include "bucket.h"
+#include "client.h"
+#include "constants.h"
+#include "item.h"
+#include "logging.h"
+#include "node.h"
+#include "protocol.h"
+#include "savefile.h"
+#include "seconds.h"
+#include "server.h"
+#include "timeout.h"
+#include "value.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+typedef enum {
+	UPGRADE_IDLE,
+	UPGRADE_STARTING,		// waiting for the new process to be ready.
+	UPGRADE_QUIESCING,		// waiting for outstanding requests and migrations to finish.
+	UPGRADE_HANDOFF
+} upgrade_state_e;
+
+
+// the binary to start, and the arguments to give it (the same ones we were started with).
+static char *_binary = NULL;
+static char **_argv = NULL;
+
+static struct event_base *_evbase = NULL;
+static upgrade_state_e _state = UPGRADE_IDLE;
+static struct event *_upgrade_event = NULL;
+static int _quiesce_checks = 0;
+
+// our end of the socket to the other process, and the pid of the new process.
+static int _sock = -1;
+static pid_t _child = 0;
+
+// the records for a bucket are collected into chunks before they are sent.
+static char *_chunk = NULL;
+static int _chunk_len = 0;
+static int _chunk_max = 0;
+static int _send_failed = 0;
+static long long _sent_items = 0;
+
+// converts item->expires (seconds since start) to absolute time.
+static time_t _handoff_time = 0;
+static unsigned int _handoff_seconds = 0;
+
+
+
+void upgrade_init(int argc, char **argv)
+{
+	char path[4096];
+	ssize_t len;
+	int i;
+
+	assert(argc > 0);
+	assert(argv);
+	assert(_argv == NULL);
+
+	_argv = calloc(argc + 1, sizeof(char *));
+	assert(_argv);
+	for (i=0; i<argc; i++) {
+		_argv[i] = strdup(argv[i]);
+		assert(_argv[i]);
+	}
+
+	// by default, the new process is started from whatever binary is now installed where we were
+	// started from.
+	assert(_binary == NULL);
+	len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (len > 0) {
+		path[len] = 0;
+		_binary = strdup(path);
+	}
+	else {
+		_binary = strdup(argv[0]);
+	}
+	assert(_binary);
+}
+
+
+void upgrade_set_binary(const char *binary)
+{
+	assert(binary);
+
+	if (_binary) { free(_binary); }
+	_binary = strdup(binary);
+	assert(_binary);
+}
+
+
+void upgrade_shutdown(void)
+{
+	int i;
+
+	if (_upgrade_event) {
+		event_free(_upgrade_event);
+		_upgrade_event = NULL;
+	}
+
+	if (_argv) {
+		for (i=0; _argv[i]; i++) {
+			free(_argv[i]);
+		}
+		free(_argv);
+		_argv = NULL;
+	}
+
+	if (_binary) {
+		free(_binary);
+		_binary = NULL;
+	}
+
+	if (_chunk) {
+		free(_chunk);
+		_chunk = NULL;
+		_chunk_max = 0;
+	}
+}
+
+
+
+static int send_all(const char *data, int length)
+{
+	int done = 0;
+	ssize_t sent;
+
+	assert(_sock >= 0);
+
+	while (done < length) {
+		sent = send(_sock, data + done, length - done, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno != EINTR) {
+				logger(LOG_ERROR, "Upgrade: unable to send: %s", strerror(errno));
+				return(-1);
+			}
+		}
+		else {
+			done += sent;
+		}
+	}
+
+	return(0);
+}
+
+
+static int recv_all(char *data, int length)
+{
+	int done = 0;
+	ssize_t got;
+
+	assert(_sock >= 0);
+
+	while (done < length) {
+		got = recv(_sock, data + done, length - done, 0);
+		if (got == 0) {
+			logger(LOG_ERROR, "Upgrade: the other process closed the connection.");
+			return(-1);
+		}
+		else if (got < 0) {
+			if (errno != EINTR) {
+				logger(LOG_ERROR, "Upgrade: unable to receive: %s", strerror(errno));
+				return(-1);
+			}
+		}
+		else {
+			done += got;
+		}
+	}
+
+	return(0);
+}
+
+
+// send a message, and optionally a file descriptor along with it.
+static int send_msg(int type, const void *data, int length, int fd)
+{
+	upgrade_msg_t msg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t sent;
+
+	assert(length >= 0);
+	assert(length == 0 || data);
+
+	msg.type = type;
+	msg.length = length;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do {
+		sent = sendmsg(_sock, &mh, MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent < 0) {
+		logger(LOG_ERROR, "Upgrade: unable to send: %s", strerror(errno));
+		return(-1);
+	}
+
+	// the fd went with the first byte, so the rest of the header can be sent normally.
+	if (sent < sizeof(msg)) {
+		if (send_all(((const char *) &msg) + sent, sizeof(msg) - sent) != 0) {
+			return(-1);
+		}
+	}
+
+	return(send_all(data, length));
+}
+
+
+// receive a message.  The data (if there is any) is allocated, and must be freed by the caller.
+// If a file descriptor came with the message, it is returned in 'fd', otherwise it is set to -1.
+static int recv_msg(upgrade_msg_t *msg, char **data, int *fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t got;
+
+	assert(msg);
+	assert(data);
+	assert(fd);
+
+	*data = NULL;
+	*fd = -1;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	do {
+		got = recvmsg(_sock, &mh, 0);
+	} while (got < 0 && errno == EINTR);
+
+	if (got <= 0) {
+		logger(LOG_ERROR, "Upgrade: unable to receive: %s", got == 0 ? "closed" : strerror(errno));
+		return(-1);
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	if (got < sizeof(*msg)) {
+		if (recv_all(((char *) msg) + got, sizeof(*msg) - got) != 0) {
+			return(-1);
+		}
+	}
+
+	if (msg->length > 0) {
+		*data = malloc(msg->length);
+		assert(*data);
+		if (recv_all(*data, msg->length) != 0) {
+			free(*data);
+			*data = NULL;
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+
+
+// the upgrade could not be completed, so get rid of the new process and carry on.
+static void upgrade_abort(const char *reason)
+{
+	assert(reason);
+
+	logger(LOG_ERROR, "Upgrade aborted: %s", reason);
+
+	if (_upgrade_event) {
+		event_free(_upgrade_event);
+		_upgrade_event = NULL;
+	}
+
+	if (_sock >= 0) {
+		close(_sock);
+		_sock = -1;
+	}
+
+	if (_child > 0) {
+		kill(_child, SIGKILL);
+		waitpid(_child, NULL, 0);
+		_child = 0;
+	}
+
+	server_pause(0);
+	_state = UPGRADE_IDLE;
+}
+
+
+
+static void chunk_flush(void)
+{
+	if (_chunk_len > 0) {
+		if (send_msg(UPGRADE_MSG_RECORDS, _chunk, _chunk_len, -1) != 0) {
+			_send_failed ++;
+		}
+		_chunk_len = 0;
+	}
+}
+
+
+// add a record to the chunk, and return where its 'length' bytes of data go.
+static char * chunk_add(int type, hash_t map_hash, hash_t key_hash, long expires, int length)
+{
+	char *ptr;
+	int size;
+
+	assert(length >= 0);
+
+	size = sizeof(savefile_record_t) + length;
+	if (_chunk_len > 0 && _chunk_len + size > UPGRADE_CHUNK) {
+		chunk_flush();
+	}
+
+	if (_chunk_len + size > _chunk_max) {
+		_chunk_max = _chunk_len + size > UPGRADE_CHUNK ? _chunk_len + size : UPGRADE_CHUNK;
+		_chunk = realloc(_chunk, _chunk_max);
+		assert(_chunk);
+	}
+
+	savefile_record_set((savefile_record_t *) (_chunk + _chunk_len), type, map_hash, key_hash,
+		expires == 0 ? 0 : (int64_t) _handoff_time + (expires - (long) _handoff_seconds), length);
+	_chunk_len += sizeof(savefile_record_t);
+	ptr = _chunk + _chunk_len;
+	_chunk_len += length;
+
+	_sent_items ++;
+	return(ptr);
+}
+
+
+static void chunk_record(int type, hash_t map_hash, hash_t key_hash, long expires, const char *data, int length)
+{
+	char *ptr = chunk_add(type, map_hash, key_hash, expires, length);
+	if (length > 0) {
+		memcpy(ptr, data, length);
+	}
+}
+
+
+static void handoff_item_fn(item_t *item, void *arg)
+{
+	value_t *value;
+	int64_t l;
+
+	assert(item);
+	assert(arg == NULL);
+
+	value = item->value;
+	assert(value);
+
+	if (value->type == VALUE_LONG) {
+		l = htobe64(value->data.l);
+		chunk_record(SAVEFILE_RECORD_INT, item->map_key, item->item_key, item->expires, (const char *) &l, sizeof(l));
+	}
+	else if (value->type == VALUE_STRING && value->data.s.raw_length > 0) {
+		uint32_t raw_length = htobe32(value->data.s.raw_length);
+		char *ptr = chunk_add(SAVEFILE_RECORD_ZSTRING, item->map_key, item->item_key, item->expires, sizeof(raw_length) + value->data.s.length);
+		memcpy(ptr, &raw_length, sizeof(raw_length));
+		memcpy(ptr + sizeof(raw_length), value->data.s.data, value->data.s.length);
+	}
+	else if (value->type == VALUE_STRING) {
+		chunk_record(SAVEFILE_RECORD_STRING, item->map_key, item->item_key, item->expires, value->data.s.data, value->data.s.length);
+	}
+}
+
+
+static void handoff_keyvalue_fn(hash_t key_hash, const char *keyvalue, long expires, void *arg)
+{
+	assert(keyvalue);
+	assert(arg == NULL);
+
+	chunk_record(SAVEFILE_RECORD_KEYVALUE, 0, key_hash, expires, keyvalue, strlen(keyvalue));
+}
+
+
+// send a connection, along with whatever has been read from it but not processed yet, and whatever
+// is waiting to be written to it.
+static int send_conn(int type, client_t *client, node_t *node)
+{
+	upgrade_conn_t conn;
+	const char *name = NULL;
+	char *buffer;
+	int length;
+	int pos;
+	int result;
+
+	assert(client);
+	assert(client->handle >= 0);
+
+	if (node) {
+		name = conninfo_str(node->conninfo);
+		assert(name);
+	}
+
+	memset(&conn, 0, sizeof(conn));
+	conn.channel = client->channel;
+	conn.logger = node ? node->logger : 0;
+	conn.name_len = name ? strlen(name) : 0;
+	conn.in_len = client->in.length;
+	conn.out_len = client->out.length;
+	conn.protocol = client->protocol;
+	conn.batching = client->batching;
+	conn.old_replies = client->old_replies;
+	conn.features = client->features;
+	conn.invalidations = client->invalidations;
+
+	conn.upload_len = -1;
+	if (client->upload) {
+		assert(client->upload->value);
+		conn.upload_map_hash = client->upload->map_hash;
+		conn.upload_key_hash = client->upload->key_hash;
+		conn.upload_expires = client->upload->expires;
+		conn.upload_total = client->upload->value->data.s.length;
+		conn.upload_len = client->upload->received;
+	}
+
+	length = sizeof(conn) + conn.name_len + conn.in_len + conn.out_len + (conn.upload_len > 0 ? conn.upload_len : 0);
+	buffer = malloc(length);
+	assert(buffer);
+
+	memcpy(buffer, &conn, sizeof(conn));
+	pos = sizeof(conn);
+	if (conn.name_len > 0) {
+		memcpy(buffer + pos, name, conn.name_len);
+		pos += conn.name_len;
+	}
+	if (conn.in_len > 0) {
+		memcpy(buffer + pos, client->in.buffer + client->in.offset, conn.in_len);
+		pos += conn.in_len;
+	}
+	if (conn.out_len > 0) {
+		memcpy(buffer + pos, client->out.buffer + client->out.offset, conn.out_len);
+		pos += conn.out_len;
+	}
+	if (conn.upload_len > 0) {
+		memcpy(buffer + pos, client->upload->value->data.s.data, conn.upload_len);
+		pos += conn.upload_len;
+	}
+	assert(pos == length);
+
+	result = send_msg(type, buffer, length, client->handle);
+	free(buffer);
+	return(result);
+}
+
+
+static int send_bucket(bucket_t *bucket, hash_t mask)
+{
+	upgrade_bucket_t info;
+	node_t *nodes[4];
+	const char *names[4];
+	char *buffer;
+	int length;
+	int pos;
+	int i;
+	int result;
+
+	assert(bucket);
+
+	nodes[0] = bucket->primary_node;
+	nodes[1] = bucket->secondary_node;
+	nodes[2] = bucket->source_node;
+	nodes[3] = bucket->backup_node;
+
+	info.hashmask = bucket->hashmask;
+	info.level = bucket->level;
+	info.has_data = bucket->data ? 1 : 0;
+	info.sync_seq = bucket->sync_seq;
+
+	length = sizeof(info);
+	for (i=0; i<4; i++) {
+		names[i] = nodes[i] ? conninfo_str(nodes[i]->conninfo) : NULL;
+		info.name_len[i] = names[i] ? strlen(names[i]) : 0;
+		length += info.name_len[i];
+	}
+
+	buffer = malloc(length);
+	assert(buffer);
+	memcpy(buffer, &info, sizeof(info));
+	pos = sizeof(info);
+	for (i=0; i<4; i++) {
+		if (info.name_len[i] > 0) {
+			memcpy(buffer + pos, names[i], info.name_len[i]);
+			pos += info.name_len[i];
+		}
+	}
+	assert(pos == length);
+
+	result = send_msg(UPGRADE_MSG_BUCKET, buffer, length, -1);
+	free(buffer);
+
+	if (result == 0 && bucket->data) {
+		_chunk_len = 0;
+		data_foreach(bucket->data, mask, bucket->hashmask, handoff_item_fn, handoff_keyvalue_fn, NULL);
+		chunk_flush();
+	}
+
+	return(result);
+}
+
+
+// wait for the new process to confirm that it has everything.
+static int wait_ack(void)
+{
+	struct pollfd pfd;
+	upgrade_msg_t msg;
+	char *data;
+	int fd;
+	int result;
+
+	pfd.fd = _sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	do {
+		result = poll(&pfd, 1, UPGRADE_ACK_WAIT);
+	} while (result < 0 && errno == EINTR);
+
+	if (result <= 0) {
+		return(-1);
+	}
+
+	if (recv_msg(&msg, &data, &fd) != 0) {
+		return(-1);
+	}
+	if (data) { free(data); }
+	if (fd >= 0) { close(fd); }
+
+	return(msg.type == UPGRADE_MSG_ACK ? 0 : -1);
+}
+
+
+// hand everything over to the new process.  This is done in one go, without returning to the event
+// loop.
+static void handoff(void)
+{
+	struct timeval start;
+	struct timeval end;
+	upgrade_mask_t mask_msg;
+	hash_t mask;
+	hash_t i;
+	int n, j;
+	node_t *node;
+	client_t *client;
+	bucket_t *bucket;
+	evutil_socket_t listener;
+
+	assert(_state == UPGRADE_QUIESCING);
+	_state = UPGRADE_HANDOFF;
+
+	gettimeofday(&start, NULL);
+	_send_failed = 0;
+	_sent_items = 0;
+	_handoff_time = time(NULL);
+	_handoff_seconds = seconds_get();
+
+	listener = server_listener_fd();
+	if (listener < 0) {
+		upgrade_abort("not listening.");
+		return;
+	}
+	if (send_msg(UPGRADE_MSG_LISTENER, NULL, 0, listener) != 0) { _send_failed ++; }
+
+	mask = buckets_mask();
+	mask_msg.mask = mask;
+	if (send_msg(UPGRADE_MSG_MASK, &mask_msg, sizeof(mask_msg), -1) != 0) { _send_failed ++; }
+
+	// the connections to the other nodes.  Connections that are still being set up are not sent,
+	// they will be re-established by one side or the other.  Compressed bulk connections are not sent
+	// either, since the state of the compression can't be handed over.  They are closed when this
+	// process exits, and the data goes over the other connections to the node.
+	for (n=0; n<node_count() && _send_failed == 0; n++) {
+		node = node_get(n);
+		if (node && node->client && node->state == READY && node->client->closing == 0) {
+			if (send_conn(UPGRADE_MSG_NODE, node->client, node) != 0) { _send_failed ++; }
+			for (j=0; j<node->bulk_count && _send_failed == 0; j++) {
+				if (node->bulk[j] && node->bulk[j]->closing == 0 && node->bulk[j]->compress == NULL) {
+					if (send_conn(UPGRADE_MSG_NODE, node->bulk[j], node) != 0) { _send_failed ++; }
+				}
+			}
+		}
+	}
+
+	for (i=0; i<=mask && _send_failed == 0; i++) {
+		bucket = buckets_get(i);
+		if (bucket) {
+			if (send_bucket(bucket, mask) != 0) { _send_failed ++; }
+		}
+	}
+
+	for (n=0; n<client_count() && _send_failed == 0; n++) {
+		client = client_get(n);
+		if (client && client->node == NULL && client->handle >= 0 && client->closing == 0) {
+			if (send_conn(UPGRADE_MSG_CLIENT, client, NULL) != 0) { _send_failed ++; }
+		}
+	}
+
+	if (_send_failed == 0) {
+		if (send_msg(UPGRADE_MSG_DONE, NULL, 0, -1) != 0) { _send_failed ++; }
+	}
+
+	if (_send_failed > 0) {
+		upgrade_abort("unable to send everything to the new process.");
+		return;
+	}
+
+	if (wait_ack() != 0) {
+		upgrade_abort("the new process did not confirm the handover.");
+		return;
+	}
+
+	gettimeofday(&end, NULL);
+	logger(LOG_INFO, "Upgrade complete.  Handed %lld items to the new process (pid %d) in %d ms.  Exiting.",
+		_sent_items, (int) _child,
+		(int) (((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec) / 1000)));
+
+	// the new process has its own copies of all the sockets, so we just leave.  Nothing is shut down
+	// cleanly, because that would close the connections from the other side's point of view.
+	_exit(0);
+}
+
+
+static int quiesced(void)
+{
+	int i;
+	client_t *client;
+
+	if (buckets_transferring() > 0) {
+		return(0);
+	}
+
+	for (i=0; i<client_count(); i++) {
+		client = client_get(i);
+		if (client && client->pending > 0) {
+			return(0);
+		}
+	}
+
+	return(1);
+}
+
+
+static void quiesce_handler(evutil_socket_t fd, short what, void *arg)
+{
+	assert(fd == -1);
+	assert(arg == NULL);
+	assert(_state == UPGRADE_QUIESCING);
+
+	if (quiesced()) {
+		handoff();
+	}
+	else if (_quiesce_checks >= UPGRADE_QUIESCE_LIMIT) {
+		upgrade_abort("outstanding requests did not finish.");
+	}
+	else {
+		_quiesce_checks ++;
+		assert(_upgrade_event);
+		evtimer_add(_upgrade_event, &_timeout_upgrade);
+	}
+}
+
+
+// the new process has started up (or failed to).
+static void ready_handler(evutil_socket_t fd, short what, void *arg)
+{
+	upgrade_msg_t msg;
+	char *data;
+	int msg_fd;
+
+	assert(fd == _sock);
+	assert(arg == NULL);
+	assert(_state == UPGRADE_STARTING);
+
+	if (what & EV_TIMEOUT) {
+		upgrade_abort("the new process did not start.");
+		return;
+	}
+
+	if (recv_msg(&msg, &data, &msg_fd) != 0 || msg.type != UPGRADE_MSG_READY) {
+		upgrade_abort("the new process did not start.");
+		return;
+	}
+	if (data) { free(data); }
+	if (msg_fd >= 0) { close(msg_fd); }
+
+	logger(LOG_INFO, "Upgrade: new process (pid %d) is ready.", (int) _child);
+
+	event_free(_upgrade_event);
+	_state = UPGRADE_QUIESCING;
+	_quiesce_checks = 0;
+	_upgrade_event = evtimer_new(_evbase, quiesce_handler, NULL);
+	assert(_upgrade_event);
+	evtimer_add(_upgrade_event, &_timeout_now);
+}
+
+
+// start the new binary, with one end of a socket to talk to it.
+static int spawn(void)
+{
+	int sv[2];
+	pid_t pid;
+	long maxfd;
+	int fd;
+	char env[16];
+
+	assert(_binary);
+	assert(_argv);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		logger(LOG_ERROR, "Upgrade: unable to create socket: %s", strerror(errno));
+		return(-1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		logger(LOG_ERROR, "Upgrade: unable to fork: %s", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return(-1);
+	}
+
+	if (pid == 0) {
+		// the new process must not inherit any of our sockets, except for the one that it uses to
+		// talk to us.  It will be sent the ones it needs.
+		maxfd = sysconf(_SC_OPEN_MAX);
+		if (maxfd < 0) { maxfd = 1024; }
+		for (fd=3; fd<maxfd; fd++) {
+			if (fd != sv[1]) {
+				close(fd);
+			}
+		}
+
+		snprintf(env, sizeof(env), "%d", sv[1]);
+		setenv(UPGRADE_ENV, env, 1);
+		execv(_binary, _argv);
+		_exit(1);
+	}
+
+	close(sv[1]);
+	_sock = sv[0];
+	_child = pid;
+
+	return(0);
+}
+
+
+// start upgrading to the new binary.  This is triggered by a SIGUSR2.
+void upgrade_start(struct event_base *evbase)
+{
+	assert(evbase);
+
+	if (_state != UPGRADE_IDLE) {
+		logger(LOG_INFO, "Upgrade already in progress.");
+		return;
+	}
+
+	assert(_evbase == NULL || _evbase == evbase);
+	_evbase = evbase;
+
+	logger(LOG_INFO, "Upgrade: starting '%s'.", _binary);
+
+	// new connections will wait in the backlog, and be accepted by the new process.
+	server_pause(1);
+
+	if (spawn() != 0) {
+		server_pause(0);
+		return;
+	}
+
+	_state = UPGRADE_STARTING;
+	assert(_upgrade_event == NULL);
+	_upgrade_event = event_new(_evbase, _sock, EV_READ, ready_handler, NULL);
+	assert(_upgrade_event);
+	event_add(_upgrade_event, &_timeout_upgrade_ready);
+}
+
+
+
+// returns non-zero if this process was started by a node that is upgrading.
+int upgrade_pending(void)
+{
+	return(getenv(UPGRADE_ENV) != NULL);
+}
+
+
+static char * copy_str(const char *data, int length)
+{
+	char *str;
+
+	assert(length >= 0);
+
+	str = malloc(length + 1);
+	assert(str);
+	memcpy(str, data, length);
+	str[length] = 0;
+	return(str);
+}
+
+
+static node_t * adopt_node_str(const char *data, int length, int is_logger)
+{
+	char *name;
+	node_t *node;
+
+	if (length == 0) {
+		return(NULL);
+	}
+
+	name = copy_str(data, length);
+	node = node_adopt(name, is_logger);
+	free(name);
+	return(node);
+}
+
+
+// a value was part way through being streamed on the connection (see cmd_set_stream), so the 
+// rest of it can still arrive.
+static int adopt_upload(client_t *client, upgrade_conn_t *conn, const char *data)
+{
+	value_t *value;
+
+	assert(client);
+	assert(conn);
+	assert(client->upload == NULL);
+
+	if (conn->upload_total <= 0 || conn->upload_len > conn->upload_total) {
+		return(-1);
+	}
+
+	value = calloc(1, sizeof(value_t));
+	assert(value);
+	value->data.s.data = malloc(conn->upload_total + 1);
+	if (value->data.s.data == NULL) {
+		logger(LOG_ERROR, "Upgrade: unable to allocate %d bytes for a streamed value.", conn->upload_total);
+		free(value);
+		return(-1);
+	}
+	value->type = VALUE_STRING;
+	value->data.s.length = conn->upload_total;
+	if (conn->upload_len > 0) {
+		memcpy(value->data.s.data, data, conn->upload_len);
+	}
+
+	client->upload = calloc(1, sizeof(upload_t));
+	assert(client->upload);
+	client->upload->map_hash = conn->upload_map_hash;
+	client->upload->key_hash = conn->upload_key_hash;
+	client->upload->expires = conn->upload_expires;
+	client->upload->received = conn->upload_len;
+	client->upload->value = value;
+	return(0);
+}
+
+
+static int adopt_conn(int type, const char *data, int length, int fd)
+{
+	upgrade_conn_t conn;
+	const char *in;
+	const char *out;
+	const char *upload;
+	client_t *client;
+	node_t *node = NULL;
+
+	if (fd < 0 || length < sizeof(conn)) {
+		return(-1);
+	}
+
+	memcpy(&conn, data, sizeof(conn));
+	if (sizeof(conn) + conn.name_len + conn.in_len + conn.out_len + (conn.upload_len > 0 ? conn.upload_len : 0) != length) {
+		return(-1);
+	}
+
+	in = data + sizeof(conn) + conn.name_len;
+	out = in + conn.in_len;
+	upload = out + conn.out_len;
+
+	client = client_new();
+	assert(client);
+
+	if (type == UPGRADE_MSG_NODE) {
+		node = adopt_node_str(data + sizeof(conn), conn.name_len, conn.logger);
+		if (node == NULL) {
+			return(-1);
+		}
+
+		client->channel = conn.channel;
+		client_attach_node(client, node, fd);
+		client_restore_buffers(client, in, conn.in_len, out, conn.out_len);
+
+		if (conn.channel == CHANNEL_CONTROL) {
+			node_adopt_client(node, client);
+		}
+		else {
+			node_attach_bulk(node, client);
+		}
+	}
+	else {
+		client_accept(client, fd, NULL, 0);
+		client->protocol = conn.protocol;
+		client->old_replies = conn.old_replies;
+		client->features = conn.features;
+		client_set_invalidations(client, conn.invalidations);
+		client_restore_buffers(client, in, conn.in_len, out, conn.out_len);
+	}
+
+	// replies that are being held for the rest of a batch stay held.
+	client->batching = conn.batching;
+
+	if (conn.upload_len >= 0 && adopt_upload(client, &conn, upload) != 0) {
+		return(-1);
+	}
+
+	server_conn_inc();
+	return(0);
+}
+
+
+static bucket_t * adopt_bucket(const char *data, int length)
+{
+	upgrade_bucket_t info;
+	node_t *nodes[4];
+	int pos;
+	int i;
+
+	if (length < sizeof(info)) {
+		return(NULL);
+	}
+
+	memcpy(&info, data, sizeof(info));
+	pos = sizeof(info);
+	for (i=0; i<4; i++) {
+		if (info.name_len[i] < 0 || pos + info.name_len[i] > length) {
+			return(NULL);
+		}
+		nodes[i] = adopt_node_str(data + pos, info.name_len[i], -1);
+		pos += info.name_len[i];
+	}
+
+	return(buckets_adopt_bucket(info.hashmask, info.level, info.has_data, info.sync_seq, nodes[0], nodes[1], nodes[2], nodes[3]));
+}
+
+
+// take over from the node that started us.  Returns 0 if everything was taken over.
+int upgrade_adopt(struct event_base *evbase, conninfo_t *conninfo)
+{
+	const char *env;
+	upgrade_msg_t msg;
+	upgrade_mask_t mask_msg;
+	char *data;
+	int fd;
+	int done = 0;
+	int failed = 0;
+	bucket_t *bucket = NULL;
+	time_t now;
+	long long items = 0;
+	long long expired = 0;
+	int n;
+	node_t *node;
+
+	assert(evbase);
+	assert(conninfo);
+
+	env = getenv(UPGRADE_ENV);
+	assert(env);
+	_sock = atoi(env);
+	unsetenv(UPGRADE_ENV);
+
+	_evbase = evbase;
+	clients_init(evbase);
+	nodes_set_evbase(evbase);
+	nodes_set_master_conninfo(conninfo);
+
+	if (send_msg(UPGRADE_MSG_READY, NULL, 0, -1) != 0) {
+		close(_sock);
+		_sock = -1;
+		return(-1);
+	}
+
+	now = time(NULL);
+
+	while (done == 0 && failed == 0) {
+		if (recv_msg(&msg, &data, &fd) != 0) {
+			failed ++;
+			break;
+		}
+
+		switch (msg.type) {
+			case UPGRADE_MSG_LISTENER:
+				if (fd < 0) { failed ++; }
+				else { server_adopt(evbase, conninfo, fd); }
+				break;
+
+			case UPGRADE_MSG_MASK:
+				if (msg.length != sizeof(mask_msg)) { failed ++; }
+				else {
+					memcpy(&mask_msg, data, sizeof(mask_msg));
+					buckets_adopt_init(mask_msg.mask, evbase);
+				}
+				break;
+
+			case UPGRADE_MSG_NODE:
+			case UPGRADE_MSG_CLIENT:
+				if (adopt_conn(msg.type, data, msg.length, fd) != 0) { failed ++; }
+				break;
+
+			case UPGRADE_MSG_BUCKET:
+				bucket = adopt_bucket(data, msg.length);
+				if (bucket == NULL) { failed ++; }
+				break;
+
+			case UPGRADE_MSG_RECORDS:
+				if (bucket == NULL || bucket->data == NULL) { failed ++; }
+				else if (savefile_parse(bucket->data, data, msg.length, now, &items, &expired) != 0) { failed ++; }
+				break;
+
+			case UPGRADE_MSG_DONE:
+				done ++;
+				break;
+
+			default:
+				logger(LOG_ERROR, "Upgrade: unexpected message %d.", msg.type);
+				failed ++;
+				break;
+		}
+
+		if (data) { free(data); }
+	}
+
+	if (failed > 0) {
+		logger(LOG_ERROR, "Upgrade: unable to take over from the old process.");
+		close(_sock);
+		_sock = -1;
+		return(-1);
+	}
+
+	send_msg(UPGRADE_MSG_ACK, NULL, 0, -1);
+	close(_sock);
+	_sock = -1;
+
+	// the nodes that weren't connected when we took over need to be connected again.
+	for (n=0; n<node_count(); n++) {
+		node = node_get(n);
+		if (node && node->client == NULL && node->wait_event == NULL && node->connect_event == NULL) {
+			node_retry(node);
+		}
+	}
+
+	logger(LOG_INFO, "Upgrade: took over %lld items (%lld had expired).", items, expired);
+	return(0);
+}
@@ -0,0 +1,80 @@
+// upgrade.h
+
+#ifndef __UPGRADE_H
+#define __UPGRADE_H
+
+#include "conninfo.h"
+#include "event-compat.h"
+
+#include <stdint.h>
+
+
+// A running node can be replaced with a new build without its buckets leaving it.  The running node
+// starts the new binary with one end of a unix socket (the fd number is in the environment variable
+// below).  When the new process is ready, the old one sends it the listening socket, the connections
+// to clients and other nodes (using SCM_RIGHTS), and streams it the bucket data.  Once the new process
+// confirms that it has everything, the old process exits.
+#define UPGRADE_ENV "OCD_UPGRADE_FD"
+
+// The messages sent over the upgrade socket.  Both ends are on the same machine, so host byte order
+// is used.
+#define UPGRADE_MSG_READY     1		// new -> old: ready to take over.
+#define UPGRADE_MSG_LISTENER  2		// fd: the listening socket.
+#define UPGRADE_MSG_MASK      3		// upgrade_mask_t
+#define UPGRADE_MSG_NODE      4		// fd: upgrade_conn_t, conninfo, in-data, out-data, upload-data
+#define UPGRADE_MSG_BUCKET    5		// upgrade_bucket_t, followed by the node conninfo strings.
+#define UPGRADE_MSG_RECORDS   6		// save file records for the last bucket.
+#define UPGRADE_MSG_CLIENT    7		// fd: upgrade_conn_t, in-data, out-data, upload-data
+#define UPGRADE_MSG_DONE      8
+#define UPGRADE_MSG_ACK       9		// new -> old: everything has been taken over.
+
+typedef struct {
+	uint32_t type;
+	uint32_t length;
+} upgrade_msg_t;
+
+typedef struct {
+	uint64_t mask;
+} upgrade_mask_t;
+
+typedef struct {
+	int32_t channel;
+	int32_t logger;
+	int32_t name_len;
+	int32_t in_len;
+	int32_t out_len;
+	int32_t protocol;
+	int32_t batching;
+	int32_t old_replies;
+	int32_t features;
+	int32_t invalidations;
+	// the value being streamed on the connection (upload_len is -1 if there isn't one).  The part 
+	// that has arrived so far (upload_len bytes) follows the out-data.
+	uint64_t upload_map_hash;
+	uint64_t upload_key_hash;
+	int32_t upload_expires;
+	int32_t upload_total;
+	int32_t upload_len;
+} upgrade_conn_t;
+
+typedef struct {
+	uint64_t hashmask;
+	int32_t level;
+	int32_t has_data;
+	int32_t sync_seq;
+	// lengths of the primary, secondary, source and backup node strings that follow (0 if none).
+	int32_t name_len[4];
+} upgrade_bucket_t;
+
+
+void upgrade_init(int argc, char **argv);
+void upgrade_set_binary(const char *binary);
+void upgrade_shutdown(void);
+
+void upgrade_start(struct event_base *evbase);
+
+int upgrade_pending(void);
+int upgrade_adopt(struct event_base *evbase, conninfo_t *conninfo);
+
+
+#endif
@@ -2,9 +2,49 @@
 
 #include "value.h"
 
+#include "constants.h"
+#include "stats.h"
+
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+
+// the largest value that a client can stream in (see cmd_set_stream).
+static int _value_max = VALUE_MAX_SIZE;
+
+// the smallest string that will be compressed when it is set.  0 means values are not compressed
+// (although compressed values can still be received from other nodes).
+static int _compress_min = 0;
+
+// the number of strings that are stored compressed, and their size before and after.  Values are
+// also created by the threads that load the save file, so these are updated atomically.
+static long long _compressed_count = 0;
+static long long _compressed_raw = 0;
+static long long _compressed_stored = 0;
 
+// strings that compress well enough to keep are compressed into here first, and compressed strings
+// are expanded into here when they are needed.  Only used from the main thread.
+static char *_scratch = NULL;
+static int _scratch_max = 0;
+
+// the value that is expanded in the scratch buffer, so that a large value that is read in chunks is
+// only expanded once.  The valuehash is kept as well, in case the memory has been reused since.
+static const char *_expanded = NULL;
+static long long _expanded_hash = 0;
+
+
+
+static void scratch_fit(int needed)
+{
+	assert(needed > 0);
+	if (_scratch_max < needed) {
+		_scratch_max = ((needed / DEFAULT_BUFSIZE) + 1) * DEFAULT_BUFSIZE;
+		_scratch = realloc(_scratch, _scratch_max);
+		assert(_scratch);
+	}
+}
 
 
 // assumes that the value object has valid data already in it.
@@ -14,6 +54,12 @@ void value_clear(value_t *value)
 
 	if (value->type == VALUE_STRING) {
 		assert(value->data.s.data);
+		if (value->data.s.raw_length > 0) {
+			__sync_fetch_and_sub(&_compressed_count, 1);
+			__sync_fetch_and_sub(&_compressed_raw, value->data.s.raw_length);
+			__sync_fetch_and_sub(&_compressed_stored, value->data.s.length);
+			value->data.s.raw_length = 0;
+		}
 		free(value->data.s.data);
 		value->data.s.data = NULL;
 	}
@@ -51,8 +97,10 @@ void value_move(value_t *dest, value_t *src)
 		case VALUE_STRING:
 			dest->data.s.data = src->data.s.data;
 			dest->data.s.length = src->data.s.length;
+			dest->data.s.raw_length = src->data.s.raw_length;
 			src->data.s.data = NULL;
 			src->data.s.length = 0;
+			src->data.s.raw_length = 0;
 			src->type = VALUE_DELETED;
 			break;
 			
@@ -63,5 +111,178 @@ void value_move(value_t *dest, value_t *src)
 }
 
 
+// set the size of the largest value that a client can stream in.
+void values_set_max(int max_size)
+{
+	assert(max_size > 0);
+	_value_max = max_size;
+}
+
+
+int values_max(void)
+{
+	assert(_value_max > 0);
+	return(_value_max);
+}
+
+
+// set the size of the smallest string that will be kept compressed.  0 turns it off.
+void values_set_compression(int min_size)
+{
+	assert(min_size >= 0);
+	_compress_min = min_size;
+}
+
+
+// a string value has just been set, so compress it (if that is turned on, and it is worth it).
+void value_compress(value_t *value)
+{
+	uLongf size;
+	int length;
+	char *data;
+
+	assert(value);
+
+	if (_compress_min == 0 || value->type != VALUE_STRING || value->data.s.raw_length > 0) {
+		return;
+	}
+
+	length = value->data.s.length;
+	if (length < _compress_min) {
+		return;
+	}
+	assert(value->data.s.data);
+
+	size = compressBound(length);
+	scratch_fit(size);
+	_expanded = NULL;
+	if (compress2((Bytef *) _scratch, &size, (const Bytef *) value->data.s.data, length, VALUE_COMPRESS_LEVEL) != Z_OK) {
+		return;
+	}
+
+	if ((length - (int) size) < (length / VALUE_COMPRESS_RATIO)) {
+		// not worth the time it will take to expand it every time it is read.
+		return;
+	}
+
+	data = malloc(size);
+	assert(data);
+	memcpy(data, _scratch, size);
+	free(value->data.s.data);
+	value->data.s.data = data;
+	value->data.s.length = size;
+	value->data.s.raw_length = length;
+
+	__sync_fetch_and_add(&_compressed_count, 1);
+	__sync_fetch_and_add(&_compressed_raw, length);
+	__sync_fetch_and_add(&_compressed_stored, size);
+}
 
 
+// set a string value that is already compressed (from another node, or the save file).  The data is
+// copied.
+void value_set_compressed(value_t *value, const char *data, int length, int raw_length)
+{
+	assert(value);
+	assert(value->type == VALUE_DELETED);
+	assert(data);
+	assert(length > 0);
+	assert(raw_length > 0);
+
+	value->type = VALUE_STRING;
+	value->data.s.data = malloc(length);
+	assert(value->data.s.data);
+	memcpy(value->data.s.data, data, length);
+	value->data.s.length = length;
+	value->data.s.raw_length = raw_length;
+
+	__sync_fetch_and_add(&_compressed_count, 1);
+	__sync_fetch_and_add(&_compressed_raw, raw_length);
+	__sync_fetch_and_add(&_compressed_stored, length);
+}
+
+
+// get the contents of a string value.  If it is stored compressed, it is expanded into a buffer that
+// is only valid until the next call (and so this can only be used from the main thread).  Compressed
+// values are always checked before they are stored, so they will expand.
+const char * value_string(value_t *value, int *length)
+{
+	uLongf size;
+	int result;
+
+	assert(value);
+	assert(value->type == VALUE_STRING);
+	assert(length);
+
+	if (value->data.s.raw_length == 0) {
+		*length = value->data.s.length;
+		return(value->data.s.data);
+	}
+
+	if (_expanded == value->data.s.data && _expanded_hash == value->valuehash) {
+		*length = value->data.s.raw_length;
+		return(_scratch);
+	}
+
+	size = value->data.s.raw_length;
+	scratch_fit(size + 1);
+	result = uncompress((Bytef *) _scratch, &size, (const Bytef *) value->data.s.data, value->data.s.length);
+	assert(result == Z_OK);
+	assert(size == value->data.s.raw_length);
+	(void) result;
+	_scratch[size] = 0;
+	_expanded = value->data.s.data;
+	_expanded_hash = value->valuehash;
+
+	*length = size;
+	return(_scratch);
+}
+
+
+// the length of a string value, once it is expanded.
+int value_string_length(value_t *value)
+{
+	assert(value);
+	assert(value->type == VALUE_STRING);
+	return(value->data.s.raw_length > 0 ? value->data.s.raw_length : value->data.s.length);
+}
+
+
+// expand compressed data into a new (null terminated) buffer, which the caller must free.  Unlike
+// value_string(), this can be used from any thread.  Returns NULL if the data doesn't expand to
+// 'raw_length' bytes.
+char * value_expand(const char *data, int length, int raw_length)
+{
+	uLongf size;
+	char *raw;
+
+	assert(data);
+
+	if (length <= 0 || raw_length <= 0) {
+		return(NULL);
+	}
+
+	raw = malloc(raw_length + 1);
+	assert(raw);
+
+	size = raw_length;
+	if (uncompress((Bytef *) raw, &size, (const Bytef *) data, length) != Z_OK || size != raw_length) {
+		free(raw);
+		return(NULL);
+	}
+	raw[size] = 0;
+
+	return(raw);
+}
+
+
+void values_dump(void)
+{
+	stat_dumpstr("VALUES");
+	stat_dumpstr("  Compress Strings From: %d bytes%s", _compress_min, _compress_min == 0 ? " (off)" : "");
+	stat_dumpstr("  Compressed Strings: %lld", _compressed_count);
+	stat_dumpstr("  Compressed Size: %lld of %lld bytes (%.1f%%)",
+				 _compressed_stored, _compressed_raw,
+				 _compressed_raw > 0 ? (100.0 * _compressed_stored) / _compressed_raw : 100.0);
+	stat_dumpstr(NULL);
+}
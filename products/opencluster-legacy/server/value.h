@@ -18,6 +18,10 @@ typedef struct {
 		struct {
 			char *data;
 			int length;
+			// strings can be stored compressed (zlib), in which case 'data' and 'length' are the
+			// compressed form, and this is the length once it is expanded.  It is 0 for strings that
+			// are stored as they are.
+			int raw_length;
 		} s;					// string
 	} data;
 } value_t;
@@ -27,4 +31,14 @@ void value_clear(value_t *value);
 void value_free(value_t *value);
 void value_move(value_t *dest, value_t *src);
 
-#endif
\ No newline at end of file
+void values_set_max(int max_size);
+int values_max(void);
+void values_set_compression(int min_size);
+void value_compress(value_t *value);
+void value_set_compressed(value_t *value, const char *data, int length, int raw_length);
+const char * value_string(value_t *value, int *length);
+int value_string_length(value_t *value);
+char * value_expand(const char *data, int length, int raw_length);
+void values_dump(void);
+
+#endif
@@ -1,5 +1,5 @@
 /*
-	Command-line tool to SET a value in a cluster.
+	Command-line tool to DELETE a value from a cluster.
 */
 
 
@@ -9,7 +9,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-static char *_node = "127.0.0.1:13600";
+static char *_conninfo = NULL;
 static char *_map_s = NULL;
 static char *_key_s = NULL;
 static int _map_i = 0;
@@ -23,8 +23,8 @@ static int _fieldmap = 0;
 static void usage(void) {
 	printf(
 		"Usage:\n"
-		"  oc_get <options> -m|-M mapname -k|-K keyname\n\n"
-		"  -n <node>    Cluster node to connect to.\n"
+		"  oc_delete <options> -m|-M mapname -k|-K keyname\n\n"
+		"  -c <file>    Connection info file for a node in the cluster.\n"
 		"  -h           print this help and exit\n\n"
 		"The -m and -k options indicate strings.\n"
 		"The -M and -K options indicate integers.\n\n"
@@ -36,35 +36,34 @@ static void usage(void) {
 static void parse_params(int argc, char **argv)
 {
 	int c;
-	
+
 	assert(argc >= 0);
 	assert(argv);
-	
+
 	_fieldmap = 0;
-	
+
 	// process arguments
-	/// Need to check the options in here, there're possibly ones that we dont need.
-	while ((c = getopt(argc, argv, 
+	while ((c = getopt(argc, argv,
 		"h"     /* help */
-		"n:"    /* cluster node to connect to */
+		"c:"    /* connection info for a cluster node */
 		"m:"    /* map string */
 		"k:"    /* key string */
 		"M:"    /* map integer */
 		"K:"    /* key integer */
 		)) != -1) {
 		switch (c) {
-			
+
 			/* help */
 			case 'h':
 				usage();
 				exit(EXIT_SUCCESS);
 				break;
-				
-			/* cluster node to connect to */
-			case 'n':
-				_node = optarg;
+
+			/* connection info for a cluster node */
+			case 'c':
+				_conninfo = optarg;
 				break;
-				
+
 			/* map string */
 			case 'm':
 				assert(_map_i == 0);
@@ -72,7 +71,7 @@ static void parse_params(int argc, char **argv)
 				_map_s = optarg;
 				_fieldmap |= 1;
 				break;
-				
+
 			/* key string */
 			case 'k':
 				assert(_key_i == 0);
@@ -80,7 +79,7 @@ static void parse_params(int argc, char **argv)
 				_key_s = optarg;
 				_fieldmap |= 2;
 				break;
-				
+
 			/* map integer */
 			case 'M':
 				assert(_map_s == NULL);
@@ -88,7 +87,7 @@ static void parse_params(int argc, char **argv)
 				_map_i = atoi(optarg);
 				_fieldmap |= 1;
 				break;
-			
+
 			/* key integer */
 			case 'K':
 				assert(_key_s == NULL);
@@ -96,14 +95,19 @@ static void parse_params(int argc, char **argv)
 				_key_i = atoi(optarg);
 				_fieldmap |= 2;
 				break;
-				
+
 			default:
 				fprintf(stderr, "Unexpected argument '\"%c\"''\n", c);
-				return;
-		}	
+				exit(1);
+		}
+	}
+
+	if (_conninfo == NULL) {
+		fprintf(stderr, "Connection info for a cluster node must be supplied (-c).\n");
+		exit(1);
 	}
-	
-	// we dont care about the map, but we must have key and value (4 + 2)
+
+	// we dont care about the map, but we must have the key.
 	if (_fieldmap < 2) {
 		fprintf(stderr, "Insufficient parameters.\n");
 		exit(1);
@@ -113,62 +117,47 @@ static void parse_params(int argc, char **argv)
 
 int main(int argc, char **argv)
 {
-	cluster_t *cluster;
+	OPENCLUSTER cluster;
+	conninfo_t *conninfo;
+	hash_t map_hash;
+	hash_t key_hash;
 	int result;
 	int nodes;
-	char *str;
-	int str_len;
-	int data;
 
 	// parse the command-line parameters.
 	parse_params(argc, argv);
-	
+
+	conninfo = conninfo_load(_conninfo);
+	if (conninfo == NULL) {
+		fprintf(stderr, "Unable to load connection info from '%s'.\n", _conninfo);
+		exit(1);
+	}
+
 	// Initialising the cluster library
 	cluster = cluster_init();
-	
-	// Adding node to the server list
-	assert(_node);
-	cluster_addserver(cluster, _node);
-	
+	cluster_addserver(cluster, conninfo);
+
 	nodes = cluster_connect(cluster);
 	if (nodes <= 0) {
-		fprintf(stderr, "Unable to connect to %s.", _node);
+		fprintf(stderr, "Unable to connect to the cluster.\n");
 		cluster_free(cluster);
 		exit(1);
 	}
-	else {
-	
-		// set an item in the cluster with some data.
-
-		if (_key_s && _integer > 0) {
-			// string key, integer value;
 
-			data = 0;
- 			result = cluster_getint(cluster, _key_s, &data);
- 			assert(result == 0);
-			printf ("%d\n", data);
-		}
-		else if (_key_s && _integer == 0) {
-			result = cluster_getstr(cluster, _key_s, &str, &str_len);
-			assert(result == 0);
-			assert(str);
-			assert(str_len > 0);
-			printf("%s\n", str);
-			free(str);
-			str = NULL;
-		}
-		else {
-			// we need to code in the other options.
-			assert(0);
-		}
+	map_hash = _map_s ? cluster_hash_str(_map_s) : cluster_hash_int(_map_i);
+	key_hash = _key_s ? cluster_hash_str(_key_s) : cluster_hash_int(_key_i);
 
-		// Disconnecting from the cluster
-		cluster_disconnect(cluster);		
+	result = cluster_delete(cluster, map_hash, key_hash);
+	if (result > 0) {
+		fprintf(stderr, "Not found\n");
+	}
+	else if (result < 0) {
+		fprintf(stderr, "Delete failed\n");
 	}
-	
-	// Shutting down
+
+	// Disconnecting from the cluster
+	cluster_disconnect(cluster);
 	cluster_free(cluster);
-	
-	return(0);
-}
 
+	return(result == 0 ? 0 : 1);
+}
@@ -0,0 +1,354 @@
+/*
+	Command-line tool to replay transaction logs (written by a logger node) into a cluster.
+*/
+
+
+#include <assert.h>
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <opencluster.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// The log format is owned by the server (server/translog.h).  It is duplicated here, the same as the
+// client library does with the protocol, so that the tool can be built without the server source.
+#define TRANSLOG_MAGIC "OCTLOG01"
+
+#define TRANSLOG_RECORD_INT     1
+#define TRANSLOG_RECORD_STRING  2
+#define TRANSLOG_RECORD_DELETE  3
+
+#pragma pack(push,1)
+typedef struct {
+	char magic[8];
+	uint32_t segment;
+	uint32_t reserved;
+} translog_header_t;
+
+typedef struct {
+	uint32_t length;
+	uint16_t type;
+	uint16_t reserved;
+	uint64_t map_hash;
+	uint64_t key_hash;
+	int64_t expires;
+} translog_record_t;
+#pragma pack(pop)
+
+
+static char *_conninfo = NULL;
+static char *_dir = NULL;
+static int _verbose = 0;
+
+static long long _replayed = 0;
+static long long _expired = 0;
+static long long _deleted = 0;
+static long long _failed = 0;
+
+// the records are sent without waiting for each reply.  Up to REPLAY_WINDOW can be in flight, after 
+// which the oldest is collected before another one is sent.
+#define REPLAY_WINDOW 4096
+static OC_REQUEST _window[REPLAY_WINDOW];
+static long long _sent = 0;
+static long long _collected = 0;
+
+
+//-----------------------------------------------------------------------------
+// print some info to the user, so that they can know what the parameters do.
+static void usage(void) {
+	printf(
+		"Usage:\n"
+		"  oc_replay <options> [segment files]\n\n"
+		"  -c <file>    Connection info file for a node in the cluster.\n"
+		"  -d <dir>     Replay all the segments in the directory (in order).\n"
+		"  -v           Verbose.\n"
+		"  -h           print this help and exit\n\n"
+		"Items that have already expired are skipped.\n"
+	);
+	return;
+}
+
+static void parse_params(int argc, char **argv)
+{
+	int c;
+
+	assert(argc >= 0);
+	assert(argv);
+
+	while ((c = getopt(argc, argv,
+		"h"     /* help */
+		"c:"    /* connection info for a cluster node */
+		"d:"    /* log directory */
+		"v"     /* verbose */
+		)) != -1) {
+		switch (c) {
+
+			/* help */
+			case 'h':
+				usage();
+				exit(EXIT_SUCCESS);
+				break;
+
+			case 'c':
+				_conninfo = optarg;
+				break;
+
+			case 'd':
+				_dir = optarg;
+				break;
+
+			case 'v':
+				_verbose ++;
+				break;
+
+			default:
+				fprintf(stderr, "Unexpected argument '\"%c\"''\n", c);
+				exit(1);
+		}
+	}
+
+	if (_conninfo == NULL) {
+		fprintf(stderr, "Connection info for a cluster node must be supplied (-c).\n");
+		exit(1);
+	}
+}
+
+
+static void collect_oldest(OPENCLUSTER cluster)
+{
+	OC_REQUEST request;
+
+	assert(_collected < _sent);
+
+	request = _window[_collected % REPLAY_WINDOW];
+	if (request == 0 || cluster_result(cluster, request) != 0) {
+		_failed ++;
+	}
+	_collected ++;
+}
+
+
+static void send_record(OPENCLUSTER cluster, OC_REQUEST request)
+{
+	if (_sent - _collected >= REPLAY_WINDOW) {
+		collect_oldest(cluster);
+	}
+
+	_window[_sent % REPLAY_WINDOW] = request;
+	_sent ++;
+}
+
+
+// replay all the records in a segment.  Returns 0 if the segment was valid.
+static int replay_segment(OPENCLUSTER cluster, const char *path)
+{
+	int fd;
+	struct stat st;
+	char *data;
+	const translog_header_t *header;
+	const translog_record_t *record;
+	long long pos;
+	int length;
+	int data_len;
+	int expires;
+	time_t now;
+	long long count = 0;
+
+	assert(cluster);
+	assert(path);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open '%s'.\n", path);
+		return(-1);
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(translog_header_t)) {
+		fprintf(stderr, "'%s' is not a transaction log.\n", path);
+		close(fd);
+		return(-1);
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Unable to read '%s'.\n", path);
+		return(-1);
+	}
+
+	header = (const translog_header_t *) data;
+	if (memcmp(header->magic, TRANSLOG_MAGIC, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "'%s' is not a transaction log.\n", path);
+		munmap(data, st.st_size);
+		return(-1);
+	}
+
+	now = time(NULL);
+	pos = sizeof(translog_header_t);
+
+	// the segments are pre-allocated, so a zero length marks the end of the records.
+	while (pos + sizeof(translog_record_t) <= st.st_size) {
+		record = (const translog_record_t *) (data + pos);
+		length = be32toh(record->length);
+		if (length == 0) {
+			break;
+		}
+
+		if (length < sizeof(translog_record_t) || pos + length > st.st_size) {
+			fprintf(stderr, "'%s' has a damaged record at %lld.\n", path, pos);
+			break;
+		}
+		data_len = length - sizeof(translog_record_t);
+
+		// deletes are replayed in order with the sets, so an item that was removed (and not set again 
+		// later in the log) ends up removed.  They have no expiry.
+		if (be16toh(record->type) == TRANSLOG_RECORD_DELETE) {
+			assert(data_len == 0);
+			send_record(cluster, cluster_delete_async(cluster, be64toh(record->map_hash), be64toh(record->key_hash)));
+			_deleted ++;
+			count ++;
+			pos += length;
+			continue;
+		}
+
+		expires = 0;
+		if (record->expires != 0) {
+			long long absolute = (long long) be64toh(record->expires);
+			if (absolute <= now) {
+				_expired ++;
+				pos += length;
+				continue;
+			}
+			expires = absolute - now;
+		}
+
+		if (be16toh(record->type) == TRANSLOG_RECORD_INT) {
+			int64_t value;
+			assert(data_len == sizeof(value));
+			memcpy(&value, data + pos + sizeof(translog_record_t), sizeof(value));
+			send_record(cluster, cluster_setlong_async(cluster, be64toh(record->map_hash), be64toh(record->key_hash), be64toh(value), expires));
+		}
+		else {
+			assert(be16toh(record->type) == TRANSLOG_RECORD_STRING);
+			send_record(cluster, cluster_setbin_async(cluster, be64toh(record->map_hash), be64toh(record->key_hash), data + pos + sizeof(translog_record_t), data_len, expires));
+		}
+
+		_replayed ++;
+		count ++;
+		pos += length;
+	}
+
+	munmap(data, st.st_size);
+
+	if (_verbose) {
+		printf("%s: %lld records.\n", path, count);
+	}
+
+	return(0);
+}
+
+
+static int compare_names(const void *a, const void *b)
+{
+	return(strcmp(*(char * const *) a, *(char * const *) b));
+}
+
+
+// replay all the segments in the directory.  They are named by their sequence number (with leading
+// zeros) so sorting by name puts them in order.
+static void replay_dir(OPENCLUSTER cluster, const char *dir)
+{
+	DIR *dp;
+	struct dirent *entry;
+	char **names = NULL;
+	int count = 0;
+	int i;
+	char path[4096];
+	int len;
+
+	assert(cluster);
+	assert(dir);
+
+	dp = opendir(dir);
+	if (dp == NULL) {
+		fprintf(stderr, "Unable to open directory '%s'.\n", dir);
+		return;
+	}
+
+	while ((entry = readdir(dp)) != NULL) {
+		len = strlen(entry->d_name);
+		if (len > 7 && strcmp(entry->d_name + len - 7, ".octlog") == 0) {
+			names = realloc(names, sizeof(char *) * (count + 1));
+			assert(names);
+			names[count] = strdup(entry->d_name);
+			count ++;
+		}
+	}
+	closedir(dp);
+
+	if (count > 0) {
+		qsort(names, count, sizeof(char *), compare_names);
+	}
+
+	for (i=0; i<count; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		replay_segment(cluster, path);
+		free(names[i]);
+	}
+	free(names);
+}
+
+
+int main(int argc, char **argv)
+{
+	OPENCLUSTER cluster;
+	conninfo_t *conninfo;
+	int nodes;
+	int i;
+
+	// parse the command-line parameters.
+	parse_params(argc, argv);
+
+	conninfo = conninfo_load(_conninfo);
+	if (conninfo == NULL) {
+		fprintf(stderr, "Unable to load connection info from '%s'.\n", _conninfo);
+		exit(1);
+	}
+
+	cluster = cluster_init();
+	cluster_addserver(cluster, conninfo);
+
+	nodes = cluster_connect(cluster);
+	if (nodes <= 0) {
+		fprintf(stderr, "Unable to connect to the cluster.\n");
+		cluster_free(cluster);
+		exit(1);
+	}
+
+	if (_dir) {
+		replay_dir(cluster, _dir);
+	}
+	for (i=optind; i<argc; i++) {
+		replay_segment(cluster, argv[i]);
+	}
+
+	// wait for the rest of the replies.
+	while (_collected < _sent) {
+		collect_oldest(cluster);
+	}
+
+	printf("Replayed %lld items and %lld deletes (%lld already expired, %lld failed).\n", _replayed, _deleted, _expired, _failed);
+
+	cluster_disconnect(cluster);
+	cluster_free(cluster);
+
+	return(0);
+}